@@ -1,17 +1,24 @@
 from __future__ import annotations
 
+import asyncio
 import json
+import mmap
 import os
+import re
+import signal
+import socket
+import struct
 import subprocess
 import threading
+import time
 import uuid
 from datetime import datetime
 from pathlib import Path
-from typing import Any, Dict, List, Optional
+from typing import Any, Dict, List, Optional, Tuple
 
-from fastapi import FastAPI, HTTPException
+from fastapi import FastAPI, HTTPException, Request
 from fastapi.middleware.cors import CORSMiddleware
-from fastapi.responses import RedirectResponse
+from fastapi.responses import RedirectResponse, Response
 from fastapi.staticfiles import StaticFiles
 from pydantic import BaseModel, Field
 
@@ -19,23 +26,69 @@ APP_DIR = Path(__file__).resolve().parent
 DATA_DIR = APP_DIR / "data"
 STREAMS_DIR = APP_DIR / "streams"
 DB_PATH = DATA_DIR / "cameras.json"
+MANIFEST_PATH = DATA_DIR / "cameras.manifest"
+STREAMER_LOG = DATA_DIR / "streamer.log"
+CONTROL_SOCKET = DATA_DIR / "streamer.sock"
+METRICS_FILE = DATA_DIR / "streamer.metrics"
+# Written by the streamer once SIGHUP reloads the manifest instead of killing it.
+STREAMER_READY = DATA_DIR / "streamer.ready"
 
 STREAMER_BIN = os.environ.get("STREAMER_BIN", str(APP_DIR.parent / "build" / "streamer"))
 DEFAULT_COPY_HLS_TIME = int(os.environ.get("COPY_HLS_TIME", "0"))
 DEFAULT_ENCODE_HLS_TIME = int(os.environ.get("ENCODE_HLS_TIME", "4"))
 DEFAULT_COPY_KEEP_MIN = int(os.environ.get("COPY_KEEP_MIN", "0"))
 DEFAULT_ENCODE_KEEP_MIN = int(os.environ.get("ENCODE_KEEP_MIN", "1"))
+STREAMER_WORKERS = int(os.environ.get("STREAMER_WORKERS", "0"))
+STREAMER_ASYNC_IO = int(os.environ.get("STREAMER_ASYNC_IO", "0"))
+ON_DEMAND_RENDITIONS = os.environ.get("ON_DEMAND_RENDITIONS", "1") == "1"
+RENDITION_IDLE_SEC = int(os.environ.get("RENDITION_IDLE_SEC", "60"))
+RENDITION_START_WAIT_SEC = float(os.environ.get("RENDITION_START_WAIT_SEC", "10"))
+LADDER_FILE = os.environ.get("LADDER_FILE", "")
+LADDER_AUTO = os.environ.get("LADDER_AUTO", "0") == "1"
+REDUCED_DECODE = os.environ.get("REDUCED_DECODE", "0") == "1"
+LL_HLS_PART_MS = int(os.environ.get("LL_HLS_PART_MS", "0"))
+SEGMENT_FORMAT = os.environ.get("SEGMENT_FORMAT", "ts")
+RING_STORE_MB = int(os.environ.get("RING_STORE_MB", "0"))
+# Rendition remuxed from a camera's sub-stream (sub_stream_url) instead of encoded.
+SUB_STREAM_RENDITION = os.environ.get("SUB_STREAM_RENDITION", "low")
+GLOBAL_QUOTA_MB = int(os.environ.get("GLOBAL_QUOTA_MB", "0"))
+DISK_MAX_PERCENT = int(os.environ.get("DISK_MAX_PERCENT", "0"))
+# Address the streamer's HTTP servers bind to; empty for loopback only.
+STREAMER_HTTP_ADDR = os.environ.get("STREAMER_HTTP_ADDR", "")
+# Live windows served from streamer memory; LIVE_HTTP_URL is how players reach it.
+# That server does not hold LL-HLS part requests, so LL-HLS stays on /streams.
+LIVE_HTTP_PORT = 0 if LL_HLS_PART_MS > 0 else int(os.environ.get("LIVE_HTTP_PORT", "0"))
+LIVE_HTTP_URL = os.environ.get("LIVE_HTTP_URL", f"http://localhost:{LIVE_HTTP_PORT}").rstrip("/")
+LIVE_CACHE_SEGMENTS = int(os.environ.get("LIVE_CACHE_SEGMENTS", "6"))
+# Recordings served by the streamer with sendfile; SEGMENT_HTTP_URL is how players reach it.
+SEGMENT_HTTP_PORT = int(os.environ.get("SEGMENT_HTTP_PORT", "0"))
+SEGMENT_HTTP_URL = os.environ.get("SEGMENT_HTTP_URL", f"http://localhost:{SEGMENT_HTTP_PORT}").rstrip("/")
+LL_HLS_PART_WAIT_SEC = 3.0
+
+# Segment catalog written by the streamer next to each playlist (src/catalog.hpp).
+CATALOG_MAGIC = 0x47544356
+CATALOG_VERSION = 2
+CATALOG_HEADER = struct.Struct("<IIII")
+CATALOG_ENTRY = struct.Struct("<qIIQQII8I8I56s")
+CATALOG_BYTE_RANGE = 1
+CATALOG_UNKNOWN_MS = 0xFFFFFFFF
+CATALOG_GAP_MS = 1000
 
 DATA_DIR.mkdir(parents=True, exist_ok=True)
 STREAMS_DIR.mkdir(parents=True, exist_ok=True)
 
 DB_LOCK = threading.Lock()
+STREAMER_LOCK = threading.Lock()
+_streamer_proc: Optional[subprocess.Popen] = None
 
 
 class CameraCreate(BaseModel):
     name: str = Field(..., min_length=1)
-    rtsp_url: str = Field(..., min_length=1)
+    # Manifest lines are split on whitespace.
+    rtsp_url: str = Field(..., min_length=1, pattern=r"^\S+$")
     max_playback_minutes: Optional[int] = Field(default=None, ge=1)
+    max_storage_mb: Optional[int] = Field(default=None, ge=1)
+    sub_stream_url: Optional[str] = Field(default=None, min_length=1, pattern=r"^\S+$")
 
 
 class CameraRecord(BaseModel):
@@ -43,6 +96,8 @@ class CameraRecord(BaseModel):
     name: str
     rtsp_url: str
     max_playback_minutes: Optional[int] = None
+    max_storage_mb: Optional[int] = None
+    sub_stream_url: Optional[str] = None
     created_at: str
     stream_dir: str
     copy_playlist: str
@@ -90,34 +145,328 @@ def _make_stream_paths(cam_id: str) -> Dict[str, str]:
     }
 
 
-def _start_streamer(rtsp_url: str, output_path: str, max_playback_minutes: Optional[int]) -> Optional[int]:
+def _manifest_url(url: str) -> str:
+    """Percent-encode whitespace, which would split the manifest line."""
+    return re.sub(r"\s", lambda m: f"%{ord(m.group()):02X}", url)
+
+
+def _write_manifest(records: List[Dict[str, Any]]) -> None:
+    lines = ["# Generated by the backend; one camera per line: <id> <input_url> <output_path> [flags]"]
+    for rec in records:
+        line = [rec["id"], _manifest_url(rec["rtsp_url"]), rec["copy_playlist"]]
+        if rec.get("max_playback_minutes"):
+            line.extend(["--encode-max-keep-minutes", str(rec["max_playback_minutes"])])
+        if rec.get("max_storage_mb"):
+            line.extend(["--quota-mb", str(rec["max_storage_mb"])])
+        if rec.get("sub_stream_url"):
+            line.extend(["--sub-input", f"{SUB_STREAM_RENDITION}={_manifest_url(rec['sub_stream_url'])}"])
+        lines.append(" ".join(line))
+    tmp_path = MANIFEST_PATH.with_suffix(".tmp")
+    tmp_path.write_text("\n".join(lines) + "\n", encoding="utf-8")
+    tmp_path.replace(MANIFEST_PATH)
+
+
+def _http_listen(port: int) -> str:
+    return f"{STREAMER_HTTP_ADDR}:{port}" if STREAMER_HTTP_ADDR else str(port)
+
+
+def _sync_streamer(records: List[Dict[str, Any]]) -> Optional[int]:
+    """Publish the camera manifest to the shared streamer process.
+
+    All cameras run inside one streamer that reloads the manifest on SIGHUP,
+    so adding a camera never restarts the others.
+    """
+    global _streamer_proc
+
     if not Path(STREAMER_BIN).exists():
         return None
 
-    cmd = [
-        STREAMER_BIN,
-        rtsp_url,
-        output_path,
-        "--encode-hls-time",
-        str(DEFAULT_ENCODE_HLS_TIME),
-        "--copy-hls-time",
-        str(DEFAULT_COPY_HLS_TIME),
-        "--encode-max-keep-minutes",
-        str(DEFAULT_ENCODE_KEEP_MIN),
-        "--copy-max-keep-minutes",
-        str(DEFAULT_COPY_KEEP_MIN),
+    with STREAMER_LOCK:
+        _write_manifest(records)
+
+        if _streamer_proc is not None and _streamer_proc.poll() is None:
+            # Until the ready file exists the streamer has not read the manifest
+            # yet and will pick up this one; before its handler SIGHUP kills it.
+            if STREAMER_READY.exists():
+                _streamer_proc.send_signal(signal.SIGHUP)
+            return _streamer_proc.pid
+
+        cmd = [
+            STREAMER_BIN,
+            "--manifest",
+            str(MANIFEST_PATH),
+            "--log-file",
+            str(STREAMER_LOG),
+            "--metrics-file",
+            str(METRICS_FILE),
+            "--ready-file",
+            str(STREAMER_READY),
+            "--encode-hls-time",
+            str(DEFAULT_ENCODE_HLS_TIME),
+            "--copy-hls-time",
+            str(DEFAULT_COPY_HLS_TIME),
+            "--encode-max-keep-minutes",
+            str(DEFAULT_ENCODE_KEEP_MIN),
+            "--copy-max-keep-minutes",
+            str(DEFAULT_COPY_KEEP_MIN),
+        ]
+
+        if STREAMER_WORKERS > 0:
+            cmd.extend(["--workers", str(STREAMER_WORKERS)])
+        if STREAMER_ASYNC_IO > 0:
+            cmd.extend(["--async-io", str(STREAMER_ASYNC_IO)])
+
+        if LADDER_FILE:
+            cmd.extend(["--ladder", LADDER_FILE])
+        if LADDER_AUTO:
+            cmd.append("--ladder-auto")
+        if REDUCED_DECODE:
+            cmd.append("--reduced-decode")
+        if LL_HLS_PART_MS > 0:
+            cmd.extend(["--ll-hls-part-ms", str(LL_HLS_PART_MS)])
+        elif SEGMENT_FORMAT != "ts":
+            cmd.extend(["--segment-format", SEGMENT_FORMAT])
+        if RING_STORE_MB > 0:
+            cmd.extend(["--ring-store-mb", str(RING_STORE_MB)])
+        if GLOBAL_QUOTA_MB > 0:
+            cmd.extend(["--global-quota-mb", str(GLOBAL_QUOTA_MB)])
+        if DISK_MAX_PERCENT > 0:
+            cmd.extend(["--disk-max-percent", str(DISK_MAX_PERCENT)])
+        if LIVE_HTTP_PORT > 0:
+            cmd.extend(
+                [
+                    "--live-http",
+                    _http_listen(LIVE_HTTP_PORT),
+                    "--live-cache-segments",
+                    str(LIVE_CACHE_SEGMENTS),
+                ]
+            )
+        if SEGMENT_HTTP_PORT > 0:
+            cmd.extend(["--segment-http", _http_listen(SEGMENT_HTTP_PORT)])
+        if LIVE_HTTP_PORT > 0 or SEGMENT_HTTP_PORT > 0:
+            cmd.extend(["--live-root", str(STREAMS_DIR)])
+
+        if ON_DEMAND_RENDITIONS:
+            cmd.extend(
+                [
+                    "--control-socket",
+                    str(CONTROL_SOCKET),
+                    "--on-demand",
+                    "--rendition-idle-sec",
+                    str(RENDITION_IDLE_SEC),
+                ]
+            )
+
+        STREAMER_READY.unlink(missing_ok=True)
+        _streamer_proc = subprocess.Popen(
+            cmd,
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            cwd=str(APP_DIR.parent),
+        )
+        return _streamer_proc.pid
+
+
+def _send_demand(cam_id: str, quality: str) -> None:
+    """Ask the streamer to keep a rendition running for the idle timeout."""
+    if not ON_DEMAND_RENDITIONS or quality == "copy":
+        return
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM) as sock:
+            sock.sendto(f"demand {cam_id} {quality}\n".encode("utf-8"), str(CONTROL_SOCKET))
+    except OSError:
+        # Streamer not running yet; the next playlist request retries.
+        pass
+
+
+def _wait_for_playlist(target: Path) -> bool:
+    """Wait for a just-requested rendition to publish its first playlist."""
+    deadline = time.monotonic() + RENDITION_START_WAIT_SEC
+    while not target.exists():
+        if time.monotonic() >= deadline:
+            return False
+        time.sleep(0.25)
+    return True
+
+
+def _ll_playlist_state(target: Path, msn: int, part: Optional[int]) -> Tuple[bool, int]:
+    """Whether an LL-HLS playlist lists segment msn (or its part), and its target duration."""
+    try:
+        lines = target.read_text().splitlines()
+    except OSError:
+        return False, 0
+    media_sequence = 0
+    target_duration = 0
+    segments = 0
+    open_parts = 0
+    for line in lines:
+        if line.startswith("#EXT-X-MEDIA-SEQUENCE:"):
+            media_sequence = int(line.split(":", 1)[1])
+        elif line.startswith("#EXT-X-TARGETDURATION:"):
+            target_duration = int(line.split(":", 1)[1])
+        elif line.startswith("#EXTINF:"):
+            # Parts precede their segment's EXTINF; later ones belong to the open segment.
+            segments += 1
+            open_parts = 0
+        elif line.startswith("#EXT-X-PART:"):
+            open_parts += 1
+        elif line == "#EXT-X-ENDLIST":
+            return True, target_duration
+    open_msn = media_sequence + segments
+    ready = msn < open_msn or (part is not None and msn == open_msn and open_parts > part)
+    return ready, target_duration
+
+
+async def _block_playlist_reload(target: Path, msn: int, part: Optional[int]) -> None:
+    """Hold an LL-HLS blocking reload until the playlist has the requested update."""
+    ready, target_duration = _ll_playlist_state(target, msn, part)
+    deadline = time.monotonic() + 3 * max(target_duration, 1)
+    while not ready and time.monotonic() < deadline:
+        await asyncio.sleep(0.02)
+        ready, _ = _ll_playlist_state(target, msn, part)
+
+
+async def _wait_for_part(target: Path) -> None:
+    """Hold a request for a preload-hinted part until the streamer publishes it."""
+    deadline = time.monotonic() + LL_HLS_PART_WAIT_SEC
+    while not target.exists() and time.monotonic() < deadline:
+        await asyncio.sleep(0.02)
+
+
+def _parse_time_ms(value: str) -> int:
+    """Unix seconds or an ISO 8601 timestamp, in Unix milliseconds."""
+    try:
+        return int(float(value) * 1000)
+    except ValueError:
+        pass
+    try:
+        return int(datetime.fromisoformat(value.replace("Z", "+00:00")).timestamp() * 1000)
+    except ValueError:
+        raise HTTPException(status_code=400, detail=f"Bad time {value}")
+
+
+def _catalog_range(catalog: Path, start_ms: int, end_ms: int) -> List[Tuple[Any, ...]]:
+    """Catalog records overlapping [start_ms, end_ms), found by bisecting the mapped file."""
+    try:
+        with catalog.open("rb") as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+            if len(m) < CATALOG_HEADER.size:
+                return []
+            magic, version, header_size, entry_size = CATALOG_HEADER.unpack_from(m, 0)
+            if magic != CATALOG_MAGIC or version != CATALOG_VERSION or entry_size != CATALOG_ENTRY.size:
+                return []
+            count = (len(m) - header_size) // entry_size
+
+            def entry(i: int) -> Tuple[Any, ...]:
+                return CATALOG_ENTRY.unpack_from(m, header_size + i * entry_size)
+
+            # First segment ending after start_ms; records are in start order.
+            lo, hi = 0, count
+            while lo < hi:
+                mid = (lo + hi) // 2
+                rec = entry(mid)
+                if rec[0] + rec[1] <= start_ms:
+                    lo = mid + 1
+                else:
+                    hi = mid
+            records = []
+            for i in range(lo, count):
+                rec = entry(i)
+                if rec[0] >= end_ms:
+                    break
+                records.append(rec)
+            return records
+    except (OSError, ValueError):
+        return []
+
+
+def _recording_playlist(target: Path, start_ms: int, end_ms: int) -> Optional[str]:
+    """VOD playlist of the recorded segments of a playlist between two instants."""
+    target = target.resolve()
+    base = target.with_suffix("")
+    url_dir = "/streams/" + target.parent.relative_to(STREAMS_DIR.resolve()).as_posix()
+    if SEGMENT_HTTP_PORT > 0:
+        url_dir = SEGMENT_HTTP_URL + url_dir
+    records = []
+    for rec in _catalog_range(base.with_suffix(".catalog"), start_ms, end_ms):
+        name = rec[23].rstrip(b"\0").decode("utf-8", "replace")
+        # The catalog keeps a record until the next sweep after its segment is deleted.
+        if (target.parent / name).exists():
+            records.append((rec, name))
+    if not records:
+        return None
+
+    fmp4 = records[0][1].endswith(".m4s")
+    target_duration = max(1, max((rec[1] + 999) // 1000 for rec, _ in records))
+    lines = [
+        "#EXTM3U",
+        f"#EXT-X-VERSION:{7 if fmp4 else 4}",
+        f"#EXT-X-TARGETDURATION:{target_duration}",
+        "#EXT-X-PLAYLIST-TYPE:VOD",
+        "#EXT-X-MEDIA-SEQUENCE:0",
     ]
+    if fmp4:
+        lines.append(f'#EXT-X-MAP:URI="{url_dir}/{base.name}_init.mp4"')
+
+    # Start at the last keyframe at or before the requested instant.
+    first = records[0][0]
+    if first[0] < start_ms:
+        offset_ms = 0
+        for k in range(first[2]):
+            ms = first[15 + k]
+            if ms != CATALOG_UNKNOWN_MS and first[0] + ms <= start_ms:
+                offset_ms = max(offset_ms, ms)
+        if offset_ms > 0:
+            lines.append(f"#EXT-X-START:TIME-OFFSET={offset_ms / 1000:.3f},PRECISE=YES")
+
+    prev_end = None
+    for rec, name in records:
+        if prev_end is not None and rec[0] - prev_end > CATALOG_GAP_MS:
+            lines.append("#EXT-X-DISCONTINUITY")
+        if prev_end is None or rec[0] - prev_end > CATALOG_GAP_MS:
+            stamp = datetime.utcfromtimestamp(rec[0] / 1000).isoformat(timespec="milliseconds")
+            lines.append(f"#EXT-X-PROGRAM-DATE-TIME:{stamp}Z")
+        lines.append(f"#EXTINF:{rec[1] / 1000:.3f},")
+        if rec[5] & CATALOG_BYTE_RANGE:
+            lines.append(f"#EXT-X-BYTERANGE:{rec[3]}@{rec[4]}")
+        lines.append(f"{url_dir}/{name}")
+        prev_end = rec[0] + rec[1]
+    lines.append("#EXT-X-ENDLIST")
+    return "\n".join(lines) + "\n"
+
+
+@app.middleware("http")
+async def refresh_rendition_demand(request: Request, call_next):
+    # Players reload rendition playlists directly from /streams; each reload
+    # keeps the rendition alive in the streamer.
+    parts = request.url.path.strip("/").split("/")
+    if len(parts) == 3 and parts[0] == "streams" and parts[2].startswith("index_") and parts[2].endswith(".m3u8"):
+        _send_demand(parts[1], parts[2][len("index_") : -len(".m3u8")])
+
+    # LL-HLS: blocking playlist reloads and preload hints wait for the streamer.
+    if len(parts) == 3 and parts[0] == "streams" and ".." not in parts:
+        target = STREAMS_DIR / parts[1] / parts[2]
+        msn = request.query_params.get("_HLS_msn")
+        if parts[2].endswith(".m3u8") and msn is not None and msn.isdigit():
+            part = request.query_params.get("_HLS_part")
+            await _block_playlist_reload(target, int(msn), int(part) if part and part.isdigit() else None)
+        elif parts[2].endswith(".m4s"):
+            await _wait_for_part(target)
+    return await call_next(request)
+
+
+@app.on_event("startup")
+def start_streamer_on_boot() -> None:
+    with DB_LOCK:
+        records = _load_db()
+    if records:
+        _sync_streamer(records)
 
-    if max_playback_minutes:
-        cmd.extend(["--encode-max-keep-minutes", str(max_playback_minutes)])
 
-    proc = subprocess.Popen(
-        cmd,
-        stdout=subprocess.DEVNULL,
-        stderr=subprocess.DEVNULL,
-        cwd=str(APP_DIR.parent),
-    )
-    return proc.pid
+@app.on_event("shutdown")
+def stop_streamer() -> None:
+    with STREAMER_LOCK:
+        if _streamer_proc is not None and _streamer_proc.poll() is None:
+            _streamer_proc.terminate()
 
 
 @app.post("/api/cameras", response_model=CameraRecord)
@@ -126,29 +475,26 @@ def create_camera(payload: CameraCreate) -> CameraRecord:
     paths = _make_stream_paths(cam_id)
     now = datetime.utcnow().isoformat() + "Z"
 
-    pid = _start_streamer(
-        payload.rtsp_url,
-        paths["copy_playlist"],
-        payload.max_playback_minutes,
-    )
-
     record = CameraRecord(
         id=cam_id,
         name=payload.name,
         rtsp_url=payload.rtsp_url,
         max_playback_minutes=payload.max_playback_minutes,
+        max_storage_mb=payload.max_storage_mb,
+        sub_stream_url=payload.sub_stream_url,
         created_at=now,
         stream_dir=paths["stream_dir"],
         copy_playlist=paths["copy_playlist"],
         low_playlist=paths["low_playlist"],
         mid_playlist=paths["mid_playlist"],
         high_playlist=paths["high_playlist"],
-        process_pid=pid,
     )
 
     with DB_LOCK:
         records = _load_db()
         records.append(record.model_dump())
+        record.process_pid = _sync_streamer(records)
+        records[-1]["process_pid"] = record.process_pid
         _save_db(records)
 
     return record
@@ -190,10 +536,21 @@ def get_live_playlist(camera_id: str, quality: Optional[str] = None):
 
     # Live uses the copy playlist (index.m3u8). Allow quality param for compatibility.
     target = Path(camera.copy_playlist)
+
+    # The streamer serves live windows from memory and waits for new playlists itself.
+    if LIVE_HTTP_PORT > 0:
+        if q != "copy":
+            target = Path(getattr(camera, f"{q}_playlist", camera.copy_playlist))
+            _send_demand(camera.id, q)
+        rel_path = target.relative_to(STREAMS_DIR)
+        return RedirectResponse(url=f"{LIVE_HTTP_URL}/streams/{rel_path.as_posix()}")
+
     if q != "copy":
         # If caller asks for specific rendition, prefer corresponding playlist if present.
         attr = f"{q}_playlist"
         target = Path(getattr(camera, attr, camera.copy_playlist))
+        _send_demand(camera.id, q)
+        _wait_for_playlist(target)
 
     if not target.exists():
         raise HTTPException(status_code=404, detail="Playlist not available")
@@ -203,7 +560,12 @@ def get_live_playlist(camera_id: str, quality: Optional[str] = None):
 
 
 @app.get("/api/cameras/{camera_id}/playback.m3u8")
-def get_playback_playlist(camera_id: str, quality: Optional[str] = None):
+def get_playback_playlist(
+    camera_id: str,
+    quality: Optional[str] = None,
+    start: Optional[str] = None,
+    end: Optional[str] = None,
+):
     camera = _find_camera(camera_id)
     if not camera:
         raise HTTPException(status_code=404, detail="Camera not found")
@@ -211,9 +573,28 @@ def get_playback_playlist(camera_id: str, quality: Optional[str] = None):
     q = _validate_quality(quality or "high")
     target = Path(getattr(camera, f"{q}_playlist", camera.high_playlist))
 
+    # Renditions are kept in streamer memory only with the live HTTP server, and
+    # only exist while watched on demand; the copy recording always exists.
+    memory_only = LIVE_HTTP_PORT > 0 and q != "copy"
+    if memory_only or (not target.exists() and ON_DEMAND_RENDITIONS):
+        target = Path(camera.copy_playlist)
+
     if not target.exists():
         raise HTTPException(status_code=404, detail="Playlist not available")
 
+    # A time range is served from the segment catalog instead of the rolling playlist.
+    if start is not None:
+        start_ms = _parse_time_ms(start)
+        end_ms = _parse_time_ms(end) if end is not None else int(time.time() * 1000)
+        if end_ms <= start_ms:
+            raise HTTPException(status_code=400, detail="end must be after start")
+        playlist = _recording_playlist(target, start_ms, end_ms)
+        if playlist is None:
+            raise HTTPException(status_code=404, detail="No recording in range")
+        return Response(content=playlist, media_type="application/vnd.apple.mpegurl")
+
     rel_path = target.relative_to(STREAMS_DIR)
+    if SEGMENT_HTTP_PORT > 0:
+        return RedirectResponse(url=f"{SEGMENT_HTTP_URL}/streams/{rel_path.as_posix()}")
     return RedirectResponse(url=f"/streams/{rel_path.as_posix()}")
 
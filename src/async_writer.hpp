@@ -0,0 +1,645 @@
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.hpp"
+
+/**
+ * Asynchronous file writer shared by every camera. Muxer output is
+ * copied into pooled aligned buffers and handed to an io_uring
+ * submission queue; one thread reaps completions for all files. When
+ * io_uring is not available (old kernel, seccomp) a single thread
+ * doing pwrite() takes its place with the same behaviour. Writers
+ * block only when the in-flight limit is reached.
+ */
+
+/** Size and alignment of the pooled write buffers */
+static constexpr size_t kAsyncBufferSize = 256 * 1024;
+static constexpr size_t kAsyncBufferAlign = 4096;
+
+/** Requests in flight across all files unless configured */
+static constexpr int kAsyncDefaultInflight = 64;
+
+/** Request kinds */
+static constexpr int kAsyncWrite = 0;
+static constexpr int kAsyncSync = 1;
+static constexpr int kAsyncSyncClose = 2;
+
+class AsyncWriter;
+
+/**
+ * @brief File written through the AsyncWriter. Fields other than
+ * pos and end are guarded by the writer's mutex.
+ */
+struct AsyncFile {
+  int fd = -1;
+  bool owns_fd = true;
+
+  /** Requests not yet completed */
+  int pending = 0;
+
+  /** First failure as an AVERROR code, 0 if none */
+  int error = 0;
+
+  /** Write position and size, used by the AVIO glue */
+  int64_t pos = 0;
+  int64_t end = 0;
+  AsyncWriter *writer = nullptr;
+};
+
+/**
+ * @brief One queued write or sync
+ */
+struct AsyncRequest {
+  int op = kAsyncWrite;
+  AsyncFile *file = nullptr;
+  uint8_t *buf = nullptr;
+  size_t size = 0;
+  size_t done = 0;
+  int64_t offset = 0;
+};
+
+class AsyncWriter {
+ public:
+  AsyncWriter() = default;
+  AsyncWriter(const AsyncWriter &) = delete;
+  AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+  ~AsyncWriter() {
+    stop();
+  }
+
+  /**
+   * @brief Set up io_uring, or the pwrite thread without it, and
+   * start the completion thread
+   *
+   * @param max_inflight requests in flight before writers block
+   * @return true on success
+   */
+  bool start(
+      int max_inflight
+  ) {
+    max_inflight_ = std::max(max_inflight, 1);
+    stopping_ = false;
+    uring_ = setup_uring(static_cast<unsigned>(max_inflight_));
+    thread_ = std::thread([this]() {
+      if (uring_) {
+        run_uring();
+      } else {
+        run_fallback();
+      }
+    });
+    return true;
+  }
+
+  /**
+   * @brief Complete everything in flight and stop the thread
+   */
+  void stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cv_.wait(lock, [this]() { return inflight_ == 0; });
+      stopping_ = true;
+      if (uring_) {
+        /** A NOP without a request wakes the reaper */
+        io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = 0;
+        submit_sqe();
+      }
+    }
+    queue_cv_.notify_all();
+    thread_.join();
+    teardown_uring();
+    for (uint8_t *buf : pool_) {
+      free(buf);
+    }
+    pool_.clear();
+  }
+
+  /**
+   * @brief Name of the backend in use
+   */
+  const char *backend() const {
+    return uring_ ? "io_uring" : "pwrite thread";
+  }
+
+  /**
+   * @brief Create or truncate a file for writing
+   *
+   * @param path
+   * @param err AVERROR code on failure
+   * @return AsyncFile* owned by the writer once closed with sync()
+   */
+  AsyncFile *open_file(
+      const std::string &path,
+      int &err
+  ) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      err = AVERROR(errno);
+      return nullptr;
+    }
+    AsyncFile *file = new AsyncFile();
+    file->fd = fd;
+    file->writer = this;
+    return file;
+  }
+
+  /**
+   * @brief Write through the writer to a descriptor the caller keeps
+   *
+   * @param fd
+   * @return AsyncFile* freed by the caller after drain()
+   */
+  AsyncFile *attach(
+      int fd
+  ) {
+    AsyncFile *file = new AsyncFile();
+    file->fd = fd;
+    file->owns_fd = false;
+    file->writer = this;
+    return file;
+  }
+
+  /**
+   * @brief Queue a positional write, copying the data into pooled
+   * buffers. Blocks only while the in-flight limit is reached.
+   *
+   * @param file
+   * @param data
+   * @param size
+   * @param offset
+   * @return int 0, or the first earlier failure of the file
+   */
+  int write(
+      AsyncFile *file,
+      const uint8_t *data,
+      size_t size,
+      int64_t offset
+  ) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (size > 0) {
+      if (file->error < 0) {
+        return file->error;
+      }
+      done_cv_.wait(lock, [this]() { return inflight_ < max_inflight_; });
+
+      AsyncRequest *req = new AsyncRequest();
+      req->op = kAsyncWrite;
+      req->file = file;
+      req->size = std::min(size, kAsyncBufferSize);
+      req->offset = offset;
+      req->buf = acquire_buffer();
+      if (!req->buf) {
+        delete req;
+        return AVERROR(ENOMEM);
+      }
+      std::memcpy(req->buf, data, req->size);
+      enqueue(req);
+
+      data += req->size;
+      offset += req->size;
+      size -= req->size;
+    }
+    return file->error;
+  }
+
+  /**
+   * @brief Queue a data sync of the file once its writes completed.
+   * With close, the descriptor is closed and the file freed afterwards.
+   *
+   * @param file
+   * @param close
+   */
+  void sync(
+      AsyncFile *file,
+      bool close
+  ) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [&]() { return file->pending == 0 && inflight_ < max_inflight_; });
+    AsyncRequest *req = new AsyncRequest();
+    req->op = close ? kAsyncSyncClose : kAsyncSync;
+    req->file = file;
+    enqueue(req);
+  }
+
+  /**
+   * @brief Wait until every request of a file completed
+   *
+   * @param file
+   * @return int the first failure of the file, 0 if none
+   */
+  int drain(
+      AsyncFile *file
+  ) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [&]() { return file->pending == 0; });
+    return file->error;
+  }
+
+ private:
+  /**
+   * @brief Mapped io_uring queues
+   */
+  struct Uring {
+    int fd = -1;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    void *sq_map = nullptr;
+    void *cq_map = nullptr;
+    size_t sq_map_size = 0;
+    size_t cq_map_size = 0;
+    size_t sqes_size = 0;
+  };
+
+  /**
+   * @brief Create and map an io_uring, without liburing
+   *
+   * @param entries submission queue size
+   * @return true if io_uring is usable
+   */
+  bool setup_uring(
+      unsigned entries
+  ) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      log_message("WARN", "io_uring unavailable (%s), writing from a thread",
+                  std::strerror(errno));
+      return false;
+    }
+
+    ring_.fd = fd;
+    ring_.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring_.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      ring_.sq_map_size = ring_.cq_map_size = std::max(ring_.sq_map_size, ring_.cq_map_size);
+    }
+    ring_.sq_map = mmap(nullptr, ring_.sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring_.cq_map = (params.features & IORING_FEAT_SINGLE_MMAP)
+                       ? ring_.sq_map
+                       : mmap(nullptr, ring_.cq_map_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring_.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, ring_.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring_.sq_map == MAP_FAILED || ring_.cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+      log_message("WARN", "io_uring mmap failed, writing from a thread");
+      if (sqes != MAP_FAILED) {
+        munmap(sqes, ring_.sqes_size);
+      }
+      ring_.sqes = nullptr;
+      teardown_uring();
+      return false;
+    }
+
+    char *sq = static_cast<char *>(ring_.sq_map);
+    char *cq = static_cast<char *>(ring_.cq_map);
+    ring_.sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring_.sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring_.sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring_.sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring_.cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring_.cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring_.cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring_.cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    ring_.sqes = static_cast<io_uring_sqe *>(sqes);
+
+    /** The in-flight limit keeps the queues from overflowing */
+    max_inflight_ = std::min(max_inflight_, static_cast<int>(params.sq_entries));
+    return true;
+  }
+
+  void teardown_uring() {
+    if (ring_.sqes) {
+      munmap(ring_.sqes, ring_.sqes_size);
+    }
+    if (ring_.cq_map && ring_.cq_map != MAP_FAILED && ring_.cq_map != ring_.sq_map) {
+      munmap(ring_.cq_map, ring_.cq_map_size);
+    }
+    if (ring_.sq_map && ring_.sq_map != MAP_FAILED) {
+      munmap(ring_.sq_map, ring_.sq_map_size);
+    }
+    if (ring_.fd >= 0) {
+      ::close(ring_.fd);
+    }
+    ring_ = Uring();
+  }
+
+  /** Caller holds mutex_ */
+  io_uring_sqe *next_sqe() {
+    unsigned tail = *ring_.sq_tail;
+    unsigned index = tail & *ring_.sq_mask;
+    io_uring_sqe *sqe = &ring_.sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ring_.sq_array[index] = index;
+    return sqe;
+  }
+
+  /** Caller holds mutex_ */
+  void submit_sqe() {
+    __atomic_store_n(ring_.sq_tail, *ring_.sq_tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring_.fd, 1, 0, 0, nullptr, 0) < 0 &&
+           errno == EINTR) {
+    }
+  }
+
+  /**
+   * @brief Hand a request to the backend. Caller holds mutex_.
+   *
+   * @param req
+   */
+  void enqueue(
+      AsyncRequest *req
+  ) {
+    if (!req->done) {
+      ++req->file->pending;
+      ++inflight_;
+    }
+    if (!uring_) {
+      queue_.push_back(req);
+      queue_cv_.notify_one();
+      return;
+    }
+
+    io_uring_sqe *sqe = next_sqe();
+    sqe->fd = req->file->fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(req);
+    if (req->op == kAsyncWrite) {
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->addr = reinterpret_cast<uint64_t>(req->buf + req->done);
+      sqe->len = static_cast<unsigned>(req->size - req->done);
+      sqe->off = static_cast<uint64_t>(req->offset + req->done);
+    } else {
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    submit_sqe();
+  }
+
+  /**
+   * @brief Account a finished operation
+   *
+   * @param req
+   * @param res bytes written or negative errno
+   */
+  void complete(
+      AsyncRequest *req,
+      int res
+  ) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    AsyncFile *file = req->file;
+    if (req->op == kAsyncWrite && res > 0 &&
+        req->done + static_cast<size_t>(res) < req->size) {
+      /** Short write: queue the rest */
+      req->done += res;
+      enqueue(req);
+      return;
+    }
+    if (res < 0 && file->error == 0) {
+      file->error = AVERROR(-res);
+      log_message("ERROR", "Async write failed: %s", std::strerror(-res));
+    } else if (req->op == kAsyncWrite && res == 0 && file->error == 0) {
+      file->error = AVERROR(EIO);
+    }
+
+    if (req->buf) {
+      pool_.push_back(req->buf);
+    }
+    --file->pending;
+    --inflight_;
+    if (req->op == kAsyncSyncClose) {
+      if (file->owns_fd) {
+        ::close(file->fd);
+      }
+      delete file;
+    }
+    delete req;
+    done_cv_.notify_all();
+  }
+
+  /**
+   * @brief Reap completions until stopped
+   */
+  void run_uring() {
+    while (true) {
+      unsigned head = *ring_.cq_head;
+      unsigned tail = __atomic_load_n(ring_.cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        if (syscall(__NR_io_uring_enter, ring_.fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    nullptr, 0) < 0 && errno != EINTR) {
+          log_message("ERROR", "io_uring_enter failed: %s", std::strerror(errno));
+          return;
+        }
+        continue;
+      }
+
+      bool stop = false;
+      for (; head != tail; ++head) {
+        io_uring_cqe *cqe = &ring_.cqes[head & *ring_.cq_mask];
+        AsyncRequest *req = reinterpret_cast<AsyncRequest *>(cqe->user_data);
+        if (req) {
+          complete(req, cqe->res);
+        } else {
+          stop = true;
+        }
+      }
+      __atomic_store_n(ring_.cq_head, head, __ATOMIC_RELEASE);
+      if (stop) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Run queued requests with blocking calls until stopped
+   */
+  void run_fallback() {
+    while (true) {
+      AsyncRequest *req = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        req = queue_.front();
+        queue_.pop_front();
+      }
+
+      int res = 0;
+      if (req->op == kAsyncWrite) {
+        ssize_t n = pwrite(req->file->fd, req->buf + req->done, req->size - req->done,
+                           req->offset + req->done);
+        res = n < 0 ? -errno : static_cast<int>(n);
+      } else {
+        res = fdatasync(req->file->fd) < 0 ? -errno : 0;
+      }
+      if (res == -EINTR) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_.push_front(req);
+        continue;
+      }
+      complete(req, res);
+    }
+  }
+
+  /** Caller holds mutex_ */
+  uint8_t *acquire_buffer() {
+    if (!pool_.empty()) {
+      uint8_t *buf = pool_.back();
+      pool_.pop_back();
+      return buf;
+    }
+    void *buf = nullptr;
+    if (posix_memalign(&buf, kAsyncBufferAlign, kAsyncBufferSize) != 0) {
+      return nullptr;
+    }
+    return static_cast<uint8_t *>(buf);
+  }
+
+  bool uring_ = false;
+  Uring ring_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  std::condition_variable queue_cv_;
+  std::deque<AsyncRequest *> queue_;
+  std::vector<uint8_t *> pool_;
+  int inflight_ = 0;
+  int max_inflight_ = kAsyncDefaultInflight;
+  bool stopping_ = false;
+};
+
+namespace utils {
+
+/**
+ * @brief AVIO write callback of async files
+ */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int async_avio_write(void *opaque, const uint8_t *buf, int size) {
+#else
+static int async_avio_write(void *opaque, uint8_t *buf, int size) {
+#endif
+  AsyncFile *file = static_cast<AsyncFile *>(opaque);
+  int ret = file->writer->write(file, buf, size, file->pos);
+  if (ret < 0) {
+    return ret;
+  }
+  file->pos += size;
+  file->end = std::max(file->end, file->pos);
+  return size;
+}
+
+/**
+ * @brief AVIO seek callback of async files. Going back waits for the
+ * writes in flight so the rewrite lands after them.
+ */
+static int64_t async_avio_seek(void *opaque, int64_t offset, int whence) {
+  AsyncFile *file = static_cast<AsyncFile *>(opaque);
+  if (whence == AVSEEK_SIZE) {
+    return file->end;
+  }
+  int64_t pos = offset;
+  if ((whence & ~AVSEEK_FORCE) == SEEK_CUR) {
+    pos = file->pos + offset;
+  } else if ((whence & ~AVSEEK_FORCE) == SEEK_END) {
+    pos = file->end + offset;
+  }
+  if (pos < 0) {
+    return AVERROR(EINVAL);
+  }
+  if (pos < file->end) {
+    file->writer->drain(file);
+  }
+  file->pos = pos;
+  return pos;
+}
+
+/**
+ * @brief Open a file for a muxer with writes going through the
+ * async writer
+ *
+ * @param writer
+ * @param url local path
+ * @param pb
+ * @return int AVERROR code, 0 on success
+ */
+static inline int open_async_avio(
+    AsyncWriter *writer,
+    const char *url,
+    AVIOContext **pb
+) {
+  int err = 0;
+  AsyncFile *file = writer->open_file(url, err);
+  if (!file) {
+    return err;
+  }
+  uint8_t *buffer = static_cast<uint8_t *>(av_malloc(kAsyncBufferSize));
+  if (buffer) {
+    *pb = avio_alloc_context(buffer, kAsyncBufferSize, 1, file, nullptr,
+                             &async_avio_write, &async_avio_seek);
+  }
+  if (!buffer || !*pb) {
+    av_free(buffer);
+    writer->sync(file, true);
+    return AVERROR(ENOMEM);
+  }
+  return 0;
+}
+
+/**
+ * @brief Finish an async file: wait for its writes, so it is complete
+ * for readers, then sync and close it in the background
+ *
+ * @param pb
+ * @return int first write failure, 0 on success
+ */
+static inline int close_async_avio(
+    AVIOContext **pb
+) {
+  AsyncFile *file = static_cast<AsyncFile *>((*pb)->opaque);
+  avio_flush(*pb);
+  int ret = file->writer->drain(file);
+  file->writer->sync(file, true);
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  return ret;
+}
+
+}  // namespace utils
@@ -0,0 +1,466 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+/** Bitrate of the shared AAC encoder */
+static constexpr int64_t kAudioAacBitrate = 64000;
+
+/** Channels the shared AAC encoder keeps at most */
+static constexpr int kAudioAacMaxChannels = 2;
+
+/** Input timestamps ahead of the encoded samples by more than this
+ * (in samples) move the output timeline forward */
+static constexpr int64_t kAudioResyncSamples = 4800;
+
+namespace utils {
+
+/**
+ * @brief Check if HLS players can play an audio codec as it is
+ *
+ * @param id
+ * @return true for AAC and MP3
+ */
+static inline bool hls_audio_codec(
+    AVCodecID id
+) {
+  return id == AV_CODEC_ID_AAC || id == AV_CODEC_ID_MP3;
+}
+
+}  // namespace utils
+
+/**
+ * @brief Decodes a camera's audio, resamples it and encodes it to AAC
+ * once per camera. The encoded packets are shared by the copy output
+ * and every rendition, so G.711/PCM cameras cost one audio encode
+ * whatever the ladder. Output timestamps count encoded samples and
+ * follow the input only when it runs ahead, e.g. over a gap, so they
+ * never go backwards.
+ */
+class AudioTranscoder {
+ public:
+  AudioTranscoder() = default;
+  AudioTranscoder(const AudioTranscoder &) = delete;
+  AudioTranscoder &operator=(const AudioTranscoder &) = delete;
+
+  ~AudioTranscoder() {
+    reset();
+  }
+
+  /**
+   * @brief Open the decoder for an input audio stream and the AAC
+   * encoder fed from it
+   *
+   * @param in
+   * @return AVERROR code, 0 on success
+   */
+  int open(
+      const AVStream *in
+  ) {
+    reset();
+    source_index_ = in->index;
+    in_time_base_ = in->time_base;
+
+    /** Decoder */
+    const AVCodec *decoder = avcodec_find_decoder(in->codecpar->codec_id);
+    if (!decoder) {
+      return AVERROR_DECODER_NOT_FOUND;
+    }
+    dec_ = avcodec_alloc_context3(decoder);
+    if (!dec_) {
+      return AVERROR(ENOMEM);
+    }
+    int ret = avcodec_parameters_to_context(dec_, in->codecpar);
+    if (ret < 0) {
+      return ret;
+    }
+    dec_->pkt_timebase = in->time_base;
+    ret = avcodec_open2(dec_, decoder, nullptr);
+    if (ret < 0) {
+      return ret;
+    }
+    int in_channels = decoder_channels();
+    if (dec_->sample_rate <= 0 || in_channels <= 0) {
+      return AVERROR(EINVAL);
+    }
+
+    /** Encoder */
+    const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!encoder) {
+      return AVERROR_ENCODER_NOT_FOUND;
+    }
+    enc_ = avcodec_alloc_context3(encoder);
+    if (!enc_) {
+      return AVERROR(ENOMEM);
+    }
+    int channels = std::min(in_channels, kAudioAacMaxChannels);
+    int rate = encoder_sample_rate(encoder, dec_->sample_rate);
+    enc_->sample_fmt = encoder->sample_fmts ? encoder->sample_fmts[0]
+                                            : AV_SAMPLE_FMT_FLTP;
+    enc_->sample_rate = rate;
+    enc_->bit_rate = kAudioAacBitrate;
+    enc_->time_base = AVRational{1, rate};
+    enc_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    av_channel_layout_default(&enc_->ch_layout, channels);
+#else
+    enc_->channels = channels;
+    enc_->channel_layout = av_get_default_channel_layout(channels);
+#endif
+    ret = avcodec_open2(enc_, encoder, nullptr);
+    if (ret < 0) {
+      return ret;
+    }
+    par_ = avcodec_parameters_alloc();
+    if (!par_) {
+      return AVERROR(ENOMEM);
+    }
+    ret = avcodec_parameters_from_context(par_, enc_);
+    if (ret < 0) {
+      return ret;
+    }
+
+    /** Resampler between them */
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    AVChannelLayout in_layout;
+    av_channel_layout_default(&in_layout, in_channels);
+    ret = swr_alloc_set_opts2(&swr_, &enc_->ch_layout, enc_->sample_fmt, rate,
+                              &in_layout, dec_->sample_fmt, dec_->sample_rate,
+                              0, nullptr);
+    av_channel_layout_uninit(&in_layout);
+    if (ret < 0) {
+      return ret;
+    }
+#else
+    swr_ = swr_alloc_set_opts(nullptr, enc_->channel_layout, enc_->sample_fmt,
+                              rate, av_get_default_channel_layout(in_channels),
+                              dec_->sample_fmt, dec_->sample_rate, 0, nullptr);
+    if (!swr_) {
+      return AVERROR(ENOMEM);
+    }
+#endif
+    ret = swr_init(swr_);
+    if (ret < 0) {
+      return ret;
+    }
+
+    /** Samples wait here for a full encoder frame */
+    frame_size_ = enc_->frame_size > 0 ? enc_->frame_size : 1024;
+    fifo_ = av_audio_fifo_alloc(enc_->sample_fmt, channels, frame_size_);
+    decoded_ = av_frame_alloc();
+    frame_ = av_frame_alloc();
+    if (!fifo_ || !decoded_ || !frame_) {
+      return AVERROR(ENOMEM);
+    }
+    frame_->format = enc_->sample_fmt;
+    frame_->sample_rate = rate;
+    frame_->nb_samples = frame_size_;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    ret = av_channel_layout_copy(&frame_->ch_layout, &enc_->ch_layout);
+    if (ret < 0) {
+      return ret;
+    }
+#else
+    frame_->channels = channels;
+    frame_->channel_layout = enc_->channel_layout;
+#endif
+    ret = av_frame_get_buffer(frame_, 0);
+    if (ret < 0) {
+      return ret;
+    }
+    channels_ = channels;
+    return 0;
+  }
+
+  /**
+   * @brief Transcode one input packet
+   *
+   * @param pkt packet of the source stream, null to drain at the end
+   * of the session
+   * @param out encoded packets in time_base(), owned by the caller
+   * @return AVERROR code, 0 on success
+   */
+  int transcode(
+      const AVPacket *pkt,
+      std::vector<AVPacket *> &out
+  ) {
+    int ret = avcodec_send_packet(dec_, pkt);
+    if (ret < 0 && ret != AVERROR_EOF) {
+      return ret;
+    }
+
+    while (true) {
+      ret = avcodec_receive_frame(dec_, decoded_);
+      if (ret == AVERROR(EAGAIN)) {
+        return 0;
+      }
+      if (ret == AVERROR_EOF) {
+        return drain(out);
+      }
+      if (ret < 0) {
+        return ret;
+      }
+      ret = resample(decoded_);
+      av_frame_unref(decoded_);
+      if (ret < 0) {
+        return ret;
+      }
+      ret = encode_fifo(false, out);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+  }
+
+  /**
+   * @brief Continue with a reconnected input of the same format: drop
+   * the decoder's state and keep the encoder and its timeline
+   *
+   * @param in
+   */
+  void reset_input(
+      const AVStream *in
+  ) {
+    avcodec_flush_buffers(dec_);
+    in_time_base_ = in->time_base;
+    dec_->pkt_timebase = in->time_base;
+  }
+
+  /**
+   * @brief Parameters of the encoded stream, for output streams
+   */
+  const AVCodecParameters *codecpar() const {
+    return par_;
+  }
+
+  /**
+   * @brief Timebase of the encoded packets
+   */
+  AVRational time_base() const {
+    return enc_->time_base;
+  }
+
+  /**
+   * @brief Input stream index the transcoder was opened for
+   */
+  int source_index() const {
+    return source_index_;
+  }
+
+ private:
+  int decoder_channels() const {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    return dec_->ch_layout.nb_channels;
+#else
+    return dec_->channels;
+#endif
+  }
+
+  /** Smallest supported rate not below the source's */
+  static int encoder_sample_rate(
+      const AVCodec *encoder,
+      int source_rate
+  ) {
+    if (!encoder->supported_samplerates) {
+      return source_rate;
+    }
+    int best = 0;
+    int highest = 0;
+    for (const int *rate = encoder->supported_samplerates; *rate; ++rate) {
+      highest = std::max(highest, *rate);
+      if (*rate >= source_rate && (best == 0 || *rate < best)) {
+        best = *rate;
+      }
+    }
+    return best > 0 ? best : highest;
+  }
+
+  /** Convert a decoded frame into the FIFO */
+  int resample(
+      const AVFrame *frame
+  ) {
+    int64_t pts = frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE) {
+      /** Where the FIFO would start if the input clock were exact */
+      int64_t start = av_rescale_q(pts, in_time_base_, enc_->time_base) -
+                      swr_get_delay(swr_, enc_->sample_rate) -
+                      av_audio_fifo_size(fifo_);
+      if (next_pts_ == AV_NOPTS_VALUE || start > next_pts_ + kAudioResyncSamples) {
+        next_pts_ = start;
+      }
+    } else if (next_pts_ == AV_NOPTS_VALUE) {
+      next_pts_ = 0;
+    }
+
+    int capacity = swr_get_out_samples(swr_, frame->nb_samples);
+    if (capacity < 0) {
+      return capacity;
+    }
+    int ret = reserve(capacity);
+    if (ret < 0) {
+      return ret;
+    }
+    int samples = swr_convert(swr_, convert_, capacity,
+                              const_cast<const uint8_t **>(frame->extended_data),
+                              frame->nb_samples);
+    if (samples < 0) {
+      return samples;
+    }
+    return write_fifo(samples);
+  }
+
+  /** Grow the conversion buffer to hold samples */
+  int reserve(
+      int samples
+  ) {
+    if (samples <= convert_capacity_) {
+      return 0;
+    }
+    av_freep(&convert_[0]);
+    int linesize = 0;
+    int ret = av_samples_alloc(convert_, &linesize, channels_, samples,
+                               enc_->sample_fmt, 0);
+    if (ret < 0) {
+      convert_capacity_ = 0;
+      return ret;
+    }
+    convert_capacity_ = samples;
+    return 0;
+  }
+
+  int write_fifo(
+      int samples
+  ) {
+    if (samples <= 0) {
+      return 0;
+    }
+    int ret = av_audio_fifo_write(fifo_, reinterpret_cast<void **>(convert_), samples);
+    return ret < 0 ? ret : 0;
+  }
+
+  /** Encode every full frame in the FIFO, and the rest when flushing */
+  int encode_fifo(
+      bool flush,
+      std::vector<AVPacket *> &out
+  ) {
+    while (av_audio_fifo_size(fifo_) >= frame_size_ ||
+           (flush && av_audio_fifo_size(fifo_) > 0)) {
+      frame_->nb_samples = frame_size_;
+      int ret = av_frame_make_writable(frame_);
+      if (ret < 0) {
+        return ret;
+      }
+      int samples = std::min(frame_size_, av_audio_fifo_size(fifo_));
+      ret = av_audio_fifo_read(fifo_, reinterpret_cast<void **>(frame_->data), samples);
+      if (ret < 0) {
+        return ret;
+      }
+      frame_->nb_samples = samples;
+      frame_->pts = next_pts_;
+      next_pts_ += samples;
+      ret = avcodec_send_frame(enc_, frame_);
+      if (ret < 0) {
+        return ret;
+      }
+      ret = receive_packets(out);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+    return 0;
+  }
+
+  int receive_packets(
+      std::vector<AVPacket *> &out
+  ) {
+    while (true) {
+      AVPacket *pkt = av_packet_alloc();
+      if (!pkt) {
+        return AVERROR(ENOMEM);
+      }
+      int ret = avcodec_receive_packet(enc_, pkt);
+      if (ret < 0) {
+        av_packet_free(&pkt);
+        return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+      }
+      out.push_back(pkt);
+    }
+  }
+
+  /** Decoder drained: flush the resampler, the FIFO and the encoder */
+  int drain(
+      std::vector<AVPacket *> &out
+  ) {
+    int pending = swr_get_out_samples(swr_, 0);
+    if (pending > 0) {
+      int ret = reserve(pending);
+      if (ret < 0) {
+        return ret;
+      }
+      int samples = swr_convert(swr_, convert_, pending, nullptr, 0);
+      if (samples < 0) {
+        return samples;
+      }
+      ret = write_fifo(samples);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+    if (next_pts_ == AV_NOPTS_VALUE) {
+      return 0;
+    }
+    int ret = encode_fifo(true, out);
+    if (ret < 0) {
+      return ret;
+    }
+    ret = avcodec_send_frame(enc_, nullptr);
+    if (ret < 0) {
+      return ret;
+    }
+    return receive_packets(out);
+  }
+
+  void reset() {
+    avcodec_free_context(&dec_);
+    avcodec_free_context(&enc_);
+    avcodec_parameters_free(&par_);
+    swr_free(&swr_);
+    if (fifo_) {
+      av_audio_fifo_free(fifo_);
+      fifo_ = nullptr;
+    }
+    av_frame_free(&decoded_);
+    av_frame_free(&frame_);
+    av_freep(&convert_[0]);
+    convert_capacity_ = 0;
+    next_pts_ = AV_NOPTS_VALUE;
+  }
+
+  AVCodecContext *dec_ = nullptr;
+  AVCodecContext *enc_ = nullptr;
+  AVCodecParameters *par_ = nullptr;
+  SwrContext *swr_ = nullptr;
+  AVAudioFifo *fifo_ = nullptr;
+  AVFrame *decoded_ = nullptr;
+  AVFrame *frame_ = nullptr;
+  uint8_t *convert_[AV_NUM_DATA_POINTERS] = {nullptr};
+  int convert_capacity_ = 0;
+  int frame_size_ = 1024;
+  int channels_ = 0;
+  int source_index_ = -1;
+  AVRational in_time_base_ = {1, 1};
+
+  /** PTS of the first sample in the FIFO, in the encoder timebase */
+  int64_t next_pts_ = AV_NOPTS_VALUE;
+};
@@ -7,8 +7,39 @@ extern "C" {
 
 #include <string>
 
+/**
+ * @brief Convert AVERROR to string
+ * 
+ * @param errnum 
+ * @return std::string 
+ */
+static inline std::string av_err2str_cpp(int errnum) {
+  /** Format FFmpeg error code */
+  char buf[AV_ERROR_MAX_STRING_SIZE];
+  av_strerror(errnum, buf, sizeof(buf));
+  return std::string(buf);
+}
+
 namespace utils {
 
+/**
+ * @brief Number of segments covering the keep window
+ * 
+ * @param max_keep_minutes 0 for unlimited
+ * @param hls_time_sec size of one segment
+ * @return int segments to keep, 0 for unlimited
+ */
+static inline int hls_list_size(
+    int max_keep_minutes,
+    int hls_time_sec
+) {
+  if (hls_time_sec <= 0 || max_keep_minutes <= 0) {
+    return 0;
+  }
+  int list_size = (max_keep_minutes * 60) / hls_time_sec;
+  return list_size < 2 ? 2 : list_size;
+}
+
 /**
  * @brief Set the hls output options
  * 
@@ -16,13 +47,15 @@ namespace utils {
  * @param max_keep_minutes maximum minutes to keep in HLS playlist, 0 for unlimited
  * @param hls_time_sec size of one segment
  * @param segment_pattern name of segments with pattern, e.g. "segment_%03d.ts"
+ * @param init_filename fMP4 init segment name, empty for MPEG-TS segments
  * @return AVERROR code, 0 on success
  */
 static inline int set_hls_output_options(
     AVDictionary **opts,
     int max_keep_minutes,
     int hls_time_sec,
-    const std::string &segment_pattern
+    const std::string &segment_pattern,
+    const std::string &init_filename
 ) {
   if (hls_time_sec > 0) {
     av_dict_set_int(
@@ -33,11 +66,11 @@ static inline int set_hls_output_options(
     );
   }
 
-  if (hls_time_sec > 0 && max_keep_minutes > 0) {
-    int list_size = (max_keep_minutes * 60) / hls_time_sec;
-    if (list_size < 2) {
-      list_size = 2;
-    }
+  int list_size = hls_list_size(
+      max_keep_minutes,
+      hls_time_sec
+  );
+  if (list_size > 0) {
     av_dict_set_int(
         opts,
         "hls_list_size",
@@ -53,6 +86,14 @@ static inline int set_hls_output_options(
       0
   );
 
+  /** Numbered from the epoch so a restart never reuses segment names */
+  av_dict_set(
+      opts,
+      "hls_start_number_source",
+      "epoch",
+      0
+  );
+
   av_dict_set(
       opts,
       "hls_segment_filename",
@@ -60,6 +101,22 @@ static inline int set_hls_output_options(
       0
   );
 
+  /** One init segment per playlist; media segments carry only fragments */
+  if (!init_filename.empty()) {
+    av_dict_set(
+        opts,
+        "hls_segment_type",
+        "fmp4",
+        0
+    );
+    av_dict_set(
+        opts,
+        "hls_fmp4_init_filename",
+        init_filename.c_str(),
+        0
+    );
+  }
+
   return 0;
 }
 
@@ -67,14 +124,16 @@ static inline int set_hls_output_options(
  * @brief Set the h264 encoder options for low latency streaming
  * 
  * @param priv_data 
+ * @param preset x264 preset, empty for veryfast
  */
 static inline void set_h264_encoder_options(
-    void *priv_data
+    void *priv_data,
+    const std::string &preset
 ) {
   av_opt_set(
       priv_data,
       "preset",
-      "veryfast",
+      preset.empty() ? "veryfast" : preset.c_str(),
       0
   );
   av_opt_set(
@@ -83,6 +142,13 @@ static inline void set_h264_encoder_options(
       "zerolatency",
       0
   );
+  /** Frames forced to I after dropped packets start a new GOP */
+  av_opt_set(
+      priv_data,
+      "forced-idr",
+      "1",
+      0
+  );
 }
 
 }  // namespace utils
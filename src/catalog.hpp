@@ -0,0 +1,1004 @@
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "logger.hpp"
+#include "reclaimer.hpp"
+#include "utils.hpp"
+
+/**
+ * Wall-clock segment catalog. Every finished segment of an output is
+ * appended as one fixed-size record to "<playlist base>.catalog", so
+ * the file stays sorted by start time and a reader can mmap it and
+ * bisect to any instant. The backend builds recording playlists for
+ * arbitrary time ranges from it.
+ *
+ * Layout, little-endian: a CatalogHeader, then CatalogEntry records.
+ * A trailing partial record left by a crash is ignored by readers and
+ * cut off when the catalog is reopened.
+ */
+
+static constexpr uint32_t kCatalogMagic = 0x47544356;  // "VCTG"
+static constexpr uint32_t kCatalogVersion = 2;
+
+/** Keyframes recorded per segment, the rest are dropped */
+static constexpr int kCatalogKeyframes = 8;
+
+/** Keyframe time not known, e.g. later fragments of an fMP4 segment */
+static constexpr uint32_t kCatalogUnknownMs = 0xffffffffu;
+
+/** Entry flag: the segment is a byte range of a shared file */
+static constexpr uint32_t kCatalogByteRange = 1;
+
+/** Appends between checks for records whose segment was deleted */
+static constexpr int kCatalogCompactEvery = 256;
+
+/** MPEG-TS packet size and the mpegts muxer's first elementary PID */
+static constexpr size_t kTsPacketSize = 188;
+static constexpr int kTsFirstPid = 0x100;
+
+#pragma pack(push, 1)
+
+struct CatalogHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t entry_size;
+};
+
+struct CatalogEntry {
+  int64_t start_unix_ms;
+  uint32_t duration_ms;
+  uint32_t keyframe_count;
+  uint64_t bytes;
+
+  /** Offset of the segment within its file, 0 unless kCatalogByteRange */
+  uint64_t offset;
+  uint32_t flags;
+  uint32_t reserved;
+
+  /** Byte offset and time of each keyframe from the segment start */
+  uint32_t keyframe_offset[kCatalogKeyframes];
+  uint32_t keyframe_ms[kCatalogKeyframes];
+
+  /** File name relative to the playlist, NUL padded */
+  char name[56];
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(CatalogHeader) == 16, "catalog header layout");
+static_assert(sizeof(CatalogEntry) == 160, "catalog entry layout");
+
+/**
+ * @brief Finds the keyframes of a segment in its bytes as they are
+ * written, in any chunking. MPEG-TS keyframes are PES starts on the
+ * video PID carrying the random access indicator; fMP4 fragments start
+ * on keyframes, and only the first one's time is known without the
+ * init section.
+ */
+class KeyframeScanner {
+ public:
+  /**
+   * @param video_pid MPEG-TS PID of the video stream, -1 for fMP4
+   */
+  explicit KeyframeScanner(
+      int video_pid
+  ) : video_pid_(video_pid) {}
+
+  /**
+   * @brief Scan the next bytes of the segment
+   *
+   * @param data
+   * @param size
+   * @param entry keyframe fields to fill
+   */
+  void feed(
+      const uint8_t *data,
+      size_t size,
+      CatalogEntry &entry
+  ) {
+    if (video_pid_ >= 0) {
+      feed_ts(data, size, entry);
+    } else {
+      feed_fmp4(data, size, entry);
+    }
+    offset_ += size;
+  }
+
+ private:
+  void feed_ts(
+      const uint8_t *data,
+      size_t size,
+      CatalogEntry &entry
+  ) {
+    uint64_t at = offset_;
+    while (size > 0 && !stopped_) {
+      /** Packets split across writes are put together first */
+      if (!carry_.empty() || size < kTsPacketSize) {
+        size_t take = std::min(kTsPacketSize - carry_.size(), size);
+        carry_.insert(carry_.end(), data, data + take);
+        data += take;
+        size -= take;
+        at += take;
+        if (carry_.size() == kTsPacketSize) {
+          ts_packet(carry_.data(), at - kTsPacketSize, entry);
+          carry_.clear();
+        }
+        continue;
+      }
+      ts_packet(data, at, entry);
+      data += kTsPacketSize;
+      size -= kTsPacketSize;
+      at += kTsPacketSize;
+    }
+  }
+
+  void ts_packet(
+      const uint8_t *p,
+      uint64_t off,
+      CatalogEntry &entry
+  ) {
+    if (p[0] != 0x47) {
+      stopped_ = true;
+      return;
+    }
+    int pid = ((p[1] & 0x1f) << 8) | p[2];
+    bool unit_start = (p[1] & 0x40) != 0;
+    if (pid != video_pid_ || !unit_start) {
+      return;
+    }
+
+    int afc = (p[3] >> 4) & 3;
+    size_t payload = 4;
+    bool random_access = false;
+    if (afc & 2) {
+      if (p[4] > 0) {
+        random_access = (p[5] & 0x40) != 0;
+      }
+      payload = 5 + p[4];
+    }
+    if (!(afc & 1) || payload + 14 > kTsPacketSize) {
+      return;
+    }
+
+    const uint8_t *pes = p + payload;
+    if (pes[0] != 0 || pes[1] != 0 || pes[2] != 1 || !(pes[7] & 0x80)) {
+      return;
+    }
+    int64_t pts = (static_cast<int64_t>((pes[9] >> 1) & 7) << 30) |
+                  (static_cast<int64_t>(pes[10]) << 22) |
+                  (static_cast<int64_t>(pes[11] >> 1) << 15) |
+                  (static_cast<int64_t>(pes[12]) << 7) |
+                  (pes[13] >> 1);
+    if (first_pts_ < 0) {
+      first_pts_ = pts;
+    }
+
+    if (random_access && entry.keyframe_count < kCatalogKeyframes) {
+      /** 33-bit PTS in 90 kHz units, may wrap inside the segment */
+      int64_t delta = (pts - first_pts_) & ((INT64_C(1) << 33) - 1);
+      entry.keyframe_offset[entry.keyframe_count] = static_cast<uint32_t>(off);
+      entry.keyframe_ms[entry.keyframe_count] = static_cast<uint32_t>(delta / 90);
+      ++entry.keyframe_count;
+    }
+  }
+
+  void feed_fmp4(
+      const uint8_t *data,
+      size_t size,
+      CatalogEntry &entry
+  ) {
+    uint64_t end = offset_ + size;
+    while (!stopped_ && entry.keyframe_count < kCatalogKeyframes) {
+      /** Collect the box header, 16 bytes for a 64-bit size */
+      uint64_t at = next_box_ + carry_.size();
+      while (at < end && carry_.size() < box_header_size()) {
+        carry_.push_back(data[at - offset_]);
+        ++at;
+      }
+      if (carry_.size() < box_header_size()) {
+        return;
+      }
+
+      uint64_t box = read_be(carry_.data(), 4);
+      if (box == 1) {
+        box = read_be(carry_.data() + 8, 8);
+      }
+      if (box < 8) {
+        stopped_ = true;
+        return;
+      }
+      if (std::memcmp(carry_.data() + 4, "moof", 4) == 0) {
+        entry.keyframe_offset[entry.keyframe_count] = static_cast<uint32_t>(next_box_);
+        entry.keyframe_ms[entry.keyframe_count] =
+            entry.keyframe_count == 0 ? 0 : kCatalogUnknownMs;
+        ++entry.keyframe_count;
+      }
+      next_box_ += box;
+      carry_.clear();
+    }
+  }
+
+  size_t box_header_size() const {
+    return carry_.size() >= 4 && read_be(carry_.data(), 4) == 1 ? 16 : 8;
+  }
+
+  static uint64_t read_be(
+      const uint8_t *p,
+      int bytes
+  ) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+      value = (value << 8) | p[i];
+    }
+    return value;
+  }
+
+  int video_pid_;
+  /** Bytes scanned so far */
+  uint64_t offset_ = 0;
+  /** Partial TS packet or box header from the previous write */
+  std::vector<uint8_t> carry_;
+  int64_t first_pts_ = -1;
+  uint64_t next_box_ = 0;
+  /** Lost sync; keyframes found so far are kept */
+  bool stopped_ = false;
+};
+
+namespace utils {
+
+/**
+ * @brief Current wall-clock time
+ *
+ * @return int64_t milliseconds since the Unix epoch
+ */
+static inline int64_t unix_time_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * @brief Check if a path names a media segment rather than a
+ * playlist or init section
+ *
+ * @param path
+ */
+static inline bool is_segment_file(
+    const std::string &path
+) {
+  return ends_with(path, ".ts") || ends_with(path, ".m4s");
+}
+
+/**
+ * @brief MPEG-TS PID the hls muxer gives the video stream of an output
+ *
+ * @param ctx output with its streams set up
+ * @param fmp4 fMP4 segments, which have no PIDs
+ * @return int PID, -1 if none
+ */
+static inline int segment_video_pid(
+    AVFormatContext *ctx,
+    bool fmp4
+) {
+  if (fmp4) {
+    return -1;
+  }
+  for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+    if (ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      return kTsFirstPid + static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+}  // namespace utils
+
+/**
+ * @brief Append-only writer of one output's catalog
+ */
+class SegmentCatalog {
+ public:
+  SegmentCatalog() = default;
+  SegmentCatalog(const SegmentCatalog &) = delete;
+  SegmentCatalog &operator=(const SegmentCatalog &) = delete;
+
+  ~SegmentCatalog() {
+    close();
+  }
+
+  /**
+   * @brief Catalog file of a playlist
+   *
+   * @param playlist_path
+   */
+  static std::string path_of(
+      const std::string &playlist_path
+  ) {
+    return utils::base_without_ext(playlist_path) + ".catalog";
+  }
+
+  /**
+   * @brief Open or create the catalog of a playlist and drop records
+   * of segments deleted since it was last written
+   *
+   * @param playlist_path
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool open(
+      const std::string &playlist_path,
+      std::string &error
+  ) {
+    close();
+    path_ = path_of(playlist_path);
+    size_t slash = path_.find_last_of('/');
+    dir_ = slash == std::string::npos ? "" : path_.substr(0, slash + 1);
+
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      error = "cannot open " + path_ + ": " + std::strerror(errno);
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      error = "cannot stat " + path_;
+      close();
+      return false;
+    }
+
+    CatalogHeader header;
+    bool valid = static_cast<size_t>(st.st_size) >= sizeof(header) &&
+                 pread(fd_, &header, sizeof(header), 0) ==
+                     static_cast<ssize_t>(sizeof(header)) &&
+                 header.magic == kCatalogMagic &&
+                 header.version == kCatalogVersion &&
+                 header.header_size == sizeof(CatalogHeader) &&
+                 header.entry_size == sizeof(CatalogEntry);
+    if (!valid) {
+      if (st.st_size > 0) {
+        log_message("WARN", "Replacing unreadable catalog %s", path_.c_str());
+      }
+      if (!rewrite({})) {
+        error = "cannot write " + path_;
+        return false;
+      }
+      report_all();
+      return true;
+    }
+
+    /** Cut a record torn by a crash so appends stay aligned */
+    off_t whole = sizeof(CatalogHeader) +
+                  (st.st_size - sizeof(CatalogHeader)) / sizeof(CatalogEntry) *
+                      sizeof(CatalogEntry);
+    if (whole != st.st_size && ftruncate(fd_, whole) != 0) {
+      error = "cannot truncate " + path_;
+      close();
+      return false;
+    }
+
+    compact();
+    report_all();
+    return fd_ >= 0;
+  }
+
+  /**
+   * @brief Append a finished segment
+   *
+   * @param entry
+   * @return true on success
+   */
+  bool append(
+      const CatalogEntry &entry
+  ) {
+    if (fd_ < 0) {
+      return false;
+    }
+    /** O_APPEND: one write per record keeps it whole for readers */
+    if (write(fd_, &entry, sizeof(entry)) != static_cast<ssize_t>(sizeof(entry))) {
+      log_message("ERROR", "Failed to append to %s: %s", path_.c_str(),
+                  std::strerror(errno));
+      return false;
+    }
+    if (g_reclaimer && !(entry.flags & kCatalogByteRange)) {
+      g_reclaimer->track(path_, reclaim_segment(entry));
+    }
+    if (++appends_ % kCatalogCompactEvery == 0) {
+      compact();
+    }
+    return true;
+  }
+
+  /**
+   * @brief Fill in the keyframes of a record from the segment bytes
+   *
+   * @param data
+   * @param size
+   * @param video_pid MPEG-TS PID of the video stream, -1 for fMP4
+   * @param entry
+   */
+  static void scan_keyframes(
+      const uint8_t *data,
+      size_t size,
+      int video_pid,
+      CatalogEntry &entry
+  ) {
+    KeyframeScanner(video_pid).feed(data, size, entry);
+  }
+
+  /**
+   * @brief Drop leading records of a file about to be overwritten,
+   * and any before them whose file is gone
+   *
+   * @param name file name as recorded
+   */
+  void drop_file(
+      const std::string &name
+  ) {
+    drop_leading([&](const CatalogEntry &entry) {
+      return name == entry.name || !exists(entry);
+    });
+  }
+
+  /**
+   * @brief Drop every record
+   */
+  void clear() {
+    drop_leading([](const CatalogEntry &) { return true; });
+  }
+
+  /**
+   * @brief Last record appended
+   *
+   * @param entry
+   * @return true if the catalog has one
+   */
+  bool last(
+      CatalogEntry &entry
+  ) const {
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(CatalogHeader) + sizeof(entry)) {
+      return false;
+    }
+    off_t at = st.st_size - sizeof(entry);
+    if (pread(fd_, &entry, sizeof(entry), at) != static_cast<ssize_t>(sizeof(entry))) {
+      return false;
+    }
+    entry.name[sizeof(entry.name) - 1] = '\0';
+    return true;
+  }
+
+  /**
+   * @brief Record with the common fields set and no keyframes
+   *
+   * @param name segment file name
+   * @param start_unix_ms
+   * @param duration_ms
+   * @param bytes
+   * @return CatalogEntry
+   */
+  static CatalogEntry make_entry(
+      const std::string &name,
+      int64_t start_unix_ms,
+      int64_t duration_ms,
+      uint64_t bytes
+  ) {
+    CatalogEntry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.start_unix_ms = start_unix_ms;
+    entry.duration_ms = static_cast<uint32_t>(duration_ms > 0 ? duration_ms : 0);
+    entry.bytes = bytes;
+    std::strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+    return entry;
+  }
+
+  void close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  /**
+   * @brief Drop leading records whose segment has been deleted, once
+   * they make up half the catalog so each record is rewritten only a
+   * few times. Segments are deleted oldest first, so the check resumes
+   * where the last one stopped and ends at the first one on disk.
+   */
+  void compact() {
+    size_t count = record_count();
+    CatalogEntry entry;
+    while (dead_ < count && read_entry(dead_, entry) && !exists(entry)) {
+      ++dead_;
+    }
+    if (dead_ > 0 && dead_ * 2 >= count) {
+      drop_first(dead_, count);
+    }
+  }
+
+  /** Number of whole records in the file */
+  size_t record_count() const {
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(CatalogHeader)) {
+      return 0;
+    }
+    return (st.st_size - sizeof(CatalogHeader)) / sizeof(CatalogEntry);
+  }
+
+  bool read_entry(
+      size_t index,
+      CatalogEntry &entry
+  ) const {
+    off_t at = sizeof(CatalogHeader) + index * sizeof(CatalogEntry);
+    if (pread(fd_, &entry, sizeof(entry), at) != static_cast<ssize_t>(sizeof(entry))) {
+      return false;
+    }
+    entry.name[sizeof(entry.name) - 1] = '\0';
+    return true;
+  }
+
+  static ReclaimSegment reclaim_segment(
+      const CatalogEntry &entry
+  ) {
+    ReclaimSegment segment;
+    segment.start_ms = entry.start_unix_ms;
+    segment.bytes = entry.bytes;
+    segment.name.assign(entry.name, strnlen(entry.name, sizeof(entry.name)));
+    return segment;
+  }
+
+  /**
+   * @brief Hand the segment files on record to the reclaimer. Ring
+   * store records share preallocated files and are left out.
+   */
+  void report_all() {
+    struct stat st;
+    if (!g_reclaimer || fd_ < 0 || fstat(fd_, &st) != 0) {
+      return;
+    }
+    size_t count = (st.st_size - sizeof(CatalogHeader)) / sizeof(CatalogEntry);
+    std::vector<CatalogEntry> entries(count);
+    size_t bytes = count * sizeof(CatalogEntry);
+    if (bytes > 0 &&
+        pread(fd_, entries.data(), bytes, sizeof(CatalogHeader)) != static_cast<ssize_t>(bytes)) {
+      return;
+    }
+    std::vector<ReclaimSegment> segments;
+    segments.reserve(count);
+    for (const auto &entry : entries) {
+      if (!(entry.flags & kCatalogByteRange)) {
+        segments.push_back(reclaim_segment(entry));
+      }
+    }
+    g_reclaimer->reset_output(path_, segments);
+  }
+
+  bool exists(
+      const CatalogEntry &entry
+  ) const {
+    return access((dir_ + entry.name).c_str(), F_OK) == 0;
+  }
+
+  /**
+   * @brief Drop records from the front while pred holds
+   *
+   * @param pred
+   */
+  template <typename Pred>
+  void drop_leading(
+      Pred pred
+  ) {
+    size_t count = record_count();
+    size_t first = 0;
+    CatalogEntry entry;
+    while (first < count) {
+      if (!read_entry(first, entry)) {
+        return;
+      }
+      if (!pred(entry)) {
+        break;
+      }
+      ++first;
+    }
+    if (first > 0) {
+      drop_first(first, count);
+    }
+  }
+
+  /**
+   * @brief Rewrite the catalog without its first records
+   *
+   * @param first records to drop
+   * @param count records in the file
+   */
+  void drop_first(
+      size_t first,
+      size_t count
+  ) {
+    std::vector<CatalogEntry> kept(count - first);
+    off_t at = sizeof(CatalogHeader) + first * sizeof(CatalogEntry);
+    size_t bytes = kept.size() * sizeof(CatalogEntry);
+    if (bytes > 0 && pread(fd_, kept.data(), bytes, at) != static_cast<ssize_t>(bytes)) {
+      return;
+    }
+    if (!rewrite(kept)) {
+      log_message("WARN", "Failed to compact %s", path_.c_str());
+    }
+  }
+
+  /**
+   * @brief Replace the catalog by renaming a new file over it, so a
+   * reader's existing mapping stays valid
+   *
+   * @param entries records to keep
+   * @return true on success
+   */
+  bool rewrite(
+      const std::vector<CatalogEntry> &entries
+  ) {
+    CatalogHeader header = {kCatalogMagic, kCatalogVersion,
+                            sizeof(CatalogHeader), sizeof(CatalogEntry)};
+    std::vector<uint8_t> data(sizeof(header) + entries.size() * sizeof(CatalogEntry));
+    std::memcpy(data.data(), &header, sizeof(header));
+    if (!entries.empty()) {
+      std::memcpy(data.data() + sizeof(header), entries.data(),
+                  entries.size() * sizeof(CatalogEntry));
+    }
+
+    close();
+    dead_ = 0;
+    if (!utils::write_file_atomic(path_, data.data(), data.size())) {
+      return false;
+    }
+    fd_ = ::open(path_.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    return fd_ >= 0;
+  }
+
+  int fd_ = -1;
+  std::string path_;
+  std::string dir_;
+  int64_t appends_ = 0;
+  /** Leading records known to have no segment left */
+  size_t dead_ = 0;
+};
+
+/**
+ * @brief Pass-through in front of a segment file that finds its
+ * keyframes in the bytes on their way to the file
+ */
+struct CatalogTee {
+  explicit CatalogTee(
+      int video_pid
+  ) : scanner(video_pid) {
+    std::memset(&entry, 0, sizeof(entry));
+  }
+
+  AVIOContext *inner = nullptr;
+  std::string path;
+  KeyframeScanner scanner;
+  CatalogEntry entry;
+  int64_t pos = 0;
+  int64_t size = 0;
+  /** A write went elsewhere than the end, scanning stopped */
+  bool rewritten = false;
+};
+
+/** AVIO buffer of catalog tees */
+static constexpr int kCatalogTeeBufferSize = 32 * 1024;
+
+namespace utils {
+
+/**
+ * @brief AVIO write callback of catalog tees
+ */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int catalog_tee_write(void *opaque, const uint8_t *buf, int size) {
+#else
+static int catalog_tee_write(void *opaque, uint8_t *buf, int size) {
+#endif
+  CatalogTee *tee = static_cast<CatalogTee *>(opaque);
+  if (tee->pos != tee->size) {
+    tee->rewritten = true;
+  }
+  if (!tee->rewritten) {
+    tee->scanner.feed(buf, size, tee->entry);
+  }
+  tee->pos += size;
+  tee->size = std::max(tee->size, tee->pos);
+  avio_write(tee->inner, buf, size);
+  return tee->inner->error < 0 ? tee->inner->error : size;
+}
+
+/**
+ * @brief AVIO seek callback of catalog tees
+ */
+static int64_t catalog_tee_seek(void *opaque, int64_t offset, int whence) {
+  CatalogTee *tee = static_cast<CatalogTee *>(opaque);
+  if (whence == AVSEEK_SIZE) {
+    return tee->size;
+  }
+  int64_t pos = offset;
+  if ((whence & ~AVSEEK_FORCE) == SEEK_CUR) {
+    pos = tee->pos + offset;
+  } else if ((whence & ~AVSEEK_FORCE) == SEEK_END) {
+    pos = tee->size + offset;
+  }
+  int64_t ret = avio_seek(tee->inner, pos, SEEK_SET);
+  if (ret < 0) {
+    return ret;
+  }
+  tee->pos = pos;
+  return pos;
+}
+
+}  // namespace utils
+
+/**
+ * @brief Times the segments of an hls muxer output by the packets
+ * written to it. A segment runs from the keyframe that opened it to
+ * the keyframe the muxer split at, and starts at the wall-clock time
+ * its first packet was written.
+ */
+class SegmentClock {
+ public:
+  /**
+   * @brief Start timing an output
+   *
+   * @param ctx output with its streams set up
+   */
+  void open(
+      const AVFormatContext *ctx
+  ) {
+    has_video_ = false;
+    for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+      if (ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        has_video_ = true;
+      }
+    }
+  }
+
+  /**
+   * @brief Note a packet about to be written to the output. The muxer
+   * splits segments on video keyframes, so the latest one noted is
+   * where the segment being closed ends.
+   *
+   * @param ctx
+   * @param pkt timestamps in the output stream timebase
+   */
+  void packet(
+      const AVFormatContext *ctx,
+      const AVPacket *pkt
+  ) {
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ts == AV_NOPTS_VALUE) {
+      return;
+    }
+    const AVStream *st = ctx->streams[pkt->stream_index];
+    AVRational ms = {1, 1000};
+    int64_t at_ms = av_rescale_q(ts, st->time_base, ms);
+    int64_t now = utils::unix_time_ms();
+
+    if (segment_start_ms_ == AV_NOPTS_VALUE) {
+      segment_start_ms_ = at_ms;
+      segment_wall_ms_ = now;
+    }
+    bool split_point = !has_video_ || (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+                                       (pkt->flags & AV_PKT_FLAG_KEY));
+    if (split_point && at_ms > segment_start_ms_) {
+      split_ms_ = at_ms;
+      split_wall_ms_ = now;
+    }
+    int64_t end_ms = at_ms + (pkt->duration > 0
+                                  ? av_rescale_q(pkt->duration, st->time_base, ms)
+                                  : 0);
+    end_ms_ = std::max(end_ms_, end_ms);
+  }
+
+  /**
+   * @brief The trailer is about to be written: the last segment ends
+   * with its last packet rather than at a keyframe
+   */
+  void finishing() {
+    split_ms_ = AV_NOPTS_VALUE;
+  }
+
+  /**
+   * @brief Time the segment the muxer closed and start the next one
+   * at the keyframe it split at
+   *
+   * @param start_ms wall-clock start of the closed segment
+   * @param duration_ms
+   */
+  void closed(
+      int64_t &start_ms,
+      int64_t &duration_ms
+  ) {
+    int64_t end_ms = split_ms_ != AV_NOPTS_VALUE ? split_ms_ : end_ms_;
+    start_ms = segment_wall_ms_ != AV_NOPTS_VALUE ? segment_wall_ms_
+                                                  : utils::unix_time_ms();
+    duration_ms = segment_start_ms_ != AV_NOPTS_VALUE ? end_ms - segment_start_ms_ : 0;
+
+    segment_start_ms_ = split_ms_;
+    segment_wall_ms_ = split_wall_ms_;
+    split_ms_ = AV_NOPTS_VALUE;
+    split_wall_ms_ = AV_NOPTS_VALUE;
+  }
+
+ private:
+  bool has_video_ = false;
+
+  /** Output time of the open segment's first packet and of the latest
+   * split point after it, in ms, with the wall-clock time each was
+   * written at */
+  int64_t segment_start_ms_ = AV_NOPTS_VALUE;
+  int64_t segment_wall_ms_ = AV_NOPTS_VALUE;
+  int64_t split_ms_ = AV_NOPTS_VALUE;
+  int64_t split_wall_ms_ = AV_NOPTS_VALUE;
+  /** End of the latest packet noted */
+  int64_t end_ms_ = 0;
+};
+
+/**
+ * @brief Feeds the catalog from the hls muxer's IO callbacks and the
+ * packets written to it. Segment files are tee'd to find keyframes as
+ * they are written and timed by SegmentClock.
+ */
+class CatalogRecorder {
+ public:
+  CatalogRecorder() = default;
+  CatalogRecorder(const CatalogRecorder &) = delete;
+  CatalogRecorder &operator=(const CatalogRecorder &) = delete;
+
+  /**
+   * @brief Open the catalog of an hls muxer output
+   *
+   * @param ctx output with its streams set up
+   * @param playlist_path
+   * @param fmp4 fMP4 instead of MPEG-TS segments
+   * @return true on success
+   */
+  bool open(
+      AVFormatContext *ctx,
+      const std::string &playlist_path,
+      bool fmp4
+  ) {
+    std::string error;
+    if (!catalog_.open(playlist_path, error)) {
+      log_message("WARN", "Segment catalog disabled: %s", error.c_str());
+      return false;
+    }
+
+    video_pid_ = utils::segment_video_pid(ctx, fmp4);
+    clock_.open(ctx);
+    return true;
+  }
+
+  /**
+   * @brief Note a packet about to be written to the output
+   *
+   * @param ctx
+   * @param pkt timestamps in the output stream timebase
+   */
+  void packet(
+      const AVFormatContext *ctx,
+      const AVPacket *pkt
+  ) {
+    clock_.packet(ctx, pkt);
+  }
+
+  /**
+   * @brief The trailer is about to be written
+   */
+  void finishing() {
+    clock_.finishing();
+  }
+
+  /**
+   * @brief Put a tee in front of a file the muxer opened, if it is a
+   * segment
+   *
+   * @param pb the file, replaced by the tee; left as is, and the
+   *        segment uncatalogued, if the tee cannot be allocated
+   * @param url
+   */
+  void opened(
+      AVIOContext **pb,
+      const char *url
+  ) {
+    if (!*pb || !url || !utils::is_segment_file(url)) {
+      return;
+    }
+    CatalogTee *tee = new CatalogTee(video_pid_);
+    tee->inner = *pb;
+    tee->path = url;
+    uint8_t *buffer = static_cast<uint8_t *>(av_malloc(kCatalogTeeBufferSize));
+    AVIOContext *wrapped = nullptr;
+    if (buffer) {
+      wrapped = avio_alloc_context(buffer, kCatalogTeeBufferSize, 1, tee, nullptr,
+                                   &utils::catalog_tee_write, &utils::catalog_tee_seek);
+    }
+    if (!wrapped) {
+      log_message("WARN", "Cannot catalog %s: out of memory", url);
+      av_free(buffer);
+      delete tee;
+      return;
+    }
+    *pb = wrapped;
+    tees_[wrapped] = tee;
+  }
+
+  /**
+   * @brief Take the tee off a segment about to be closed
+   *
+   * @param pb tee or any other file, replaced by the file behind it
+   * @return CatalogTee* the tee's state, null for other files; pass it
+   *         to closed()
+   */
+  CatalogTee *closing(
+      AVIOContext **pb
+  ) {
+    auto it = tees_.find(*pb);
+    if (it == tees_.end()) {
+      return nullptr;
+    }
+    CatalogTee *tee = it->second;
+    tees_.erase(it);
+    avio_flush(*pb);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    *pb = tee->inner;
+    return tee;
+  }
+
+  /**
+   * @brief Catalog a segment once its file is closed
+   *
+   * @param tee from closing()
+   * @param ok the file was written completely
+   */
+  void closed(
+      CatalogTee *tee,
+      bool ok
+  ) {
+    int64_t start_ms = 0;
+    int64_t duration_ms = 0;
+    clock_.closed(start_ms, duration_ms);
+    if (ok) {
+      CatalogEntry entry = SegmentCatalog::make_entry(
+          utils::file_name(tee->path), start_ms, duration_ms,
+          static_cast<uint64_t>(tee->size));
+      entry.keyframe_count = tee->entry.keyframe_count;
+      std::memcpy(entry.keyframe_offset, tee->entry.keyframe_offset,
+                  sizeof(entry.keyframe_offset));
+      std::memcpy(entry.keyframe_ms, tee->entry.keyframe_ms, sizeof(entry.keyframe_ms));
+      catalog_.append(entry);
+    }
+    delete tee;
+  }
+
+ private:
+  SegmentCatalog catalog_;
+  SegmentClock clock_;
+  std::map<AVIOContext *, CatalogTee *> tees_;
+  int video_pid_ = -1;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+/**
+ * @brief Unix datagram socket the backend uses to send one-line
+ * commands to a running streamer, e.g. "demand <camera> <rendition>"
+ */
+class ControlSocket {
+ public:
+  ControlSocket() = default;
+  ControlSocket(const ControlSocket &) = delete;
+  ControlSocket &operator=(const ControlSocket &) = delete;
+
+  ~ControlSocket() {
+    close();
+  }
+
+  /**
+   * @brief Bind the socket, replacing a stale one left by a crash
+   *
+   * @param path filesystem path of the socket
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool open(
+      const std::string &path,
+      std::string &error
+  ) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) {
+      error = "socket path too long";
+      return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    fd_ = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) {
+      error = std::strerror(errno);
+      return false;
+    }
+
+    ::unlink(path.c_str());
+    if (::bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      error = std::strerror(errno);
+      close();
+      return false;
+    }
+
+    path_ = path;
+    return true;
+  }
+
+  /**
+   * @brief Wait for one command
+   *
+   * @param line received command without trailing newline
+   * @param timeout_ms how long to wait
+   * @return true if a command was received
+   */
+  bool receive(
+      std::string &line,
+      int timeout_ms
+  ) {
+    if (fd_ < 0) {
+      return false;
+    }
+
+    pollfd pfd = {fd_, POLLIN, 0};
+    if (::poll(&pfd, 1, timeout_ms) <= 0) {
+      return false;
+    }
+
+    char buf[512];
+    ssize_t n = ::recv(fd_, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+      return false;
+    }
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) {
+      --n;
+    }
+    line.assign(buf, static_cast<size_t>(n));
+    return true;
+  }
+
+  /**
+   * @brief Close and remove the socket
+   */
+  void close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+    if (!path_.empty()) {
+      ::unlink(path_.c_str());
+      path_.clear();
+    }
+  }
+
+ private:
+  int fd_ = -1;
+  std::string path_;
+};
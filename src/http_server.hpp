@@ -0,0 +1,786 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "live_cache.hpp"
+#include "logger.hpp"
+#include "utils.hpp"
+
+/** Largest request head accepted */
+static constexpr size_t kHttpMaxRequestHead = 8192;
+
+/** Pipelined request bytes read ahead of a response in flight; the
+ *  socket is not read beyond this until the response is sent */
+static constexpr size_t kHttpMaxReadAhead = 64 * 1024;
+
+/** Keep-alive connections idle this long are closed */
+static constexpr int64_t kHttpIdleTimeoutMs = 60000;
+
+/** How long a request for a playlist not yet published waits for it */
+static constexpr int64_t kLivePlaylistWaitMs = 10000;
+
+/** Open files kept for repeated requests */
+static constexpr size_t kHttpOpenFiles = 64;
+
+/**
+ * @brief Open file shared by the fd cache and the responses sending it
+ */
+struct HttpFile {
+  int fd = -1;
+  int64_t last_used = 0;
+
+  ~HttpFile() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+};
+
+/**
+ * @brief Small LRU of open files, so scrubbing through a recording
+ * does not open every segment again. A file unlinked since it was
+ * opened (retention, quotas) is reopened, which then fails.
+ */
+class HttpFileCache {
+ public:
+  /**
+   * @brief Open a regular file, or reuse it if it is cached
+   *
+   * @param path
+   * @param size set to its current size
+   * @param now for LRU ordering
+   * @return std::shared_ptr<HttpFile> null if it cannot be opened
+   */
+  std::shared_ptr<HttpFile> open(
+      const std::string &path,
+      int64_t &size,
+      int64_t now
+  ) {
+    struct stat st;
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+      if (fstat(it->second->fd, &st) == 0 && st.st_nlink > 0) {
+        it->second->last_used = now;
+        size = st.st_size;
+        return it->second;
+      }
+      files_.erase(it);
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return nullptr;
+    }
+    std::shared_ptr<HttpFile> file(new HttpFile());
+    file->fd = fd;
+    file->last_used = now;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      return nullptr;
+    }
+    size = st.st_size;
+
+    if (files_.size() >= kHttpOpenFiles) {
+      auto oldest = files_.begin();
+      for (auto cur = files_.begin(); cur != files_.end(); ++cur) {
+        if (cur->second->last_used < oldest->second->last_used) {
+          oldest = cur;
+        }
+      }
+      files_.erase(oldest);
+    }
+    files_[path] = file;
+    return file;
+  }
+
+ private:
+  std::map<std::string, std::shared_ptr<HttpFile>> files_;
+};
+
+/**
+ * @brief One client connection and its request in progress
+ */
+struct HttpConnection {
+  int fd = -1;
+  std::string in;
+  int64_t last_active_ms = 0;
+  /** epoll events currently watched */
+  uint32_t events = 0;
+  /** The socket was full on the last send */
+  bool blocked = false;
+
+  /** Parsed request */
+  std::string key;
+  bool head_only = false;
+  bool keep_alive = true;
+  int64_t msn = -1;
+  /** "a-b", "a-" or "-n" from a Range header, empty for the whole file */
+  std::string range;
+
+  /** Blocked until a playlist update or the deadline */
+  bool parked = false;
+  int64_t deadline_ms = 0;
+
+  /** Response in flight: head, then body straight from the cache or
+   *  file bytes sent by the kernel */
+  std::string head;
+  LiveBuffer body;
+  size_t sent = 0;
+  std::shared_ptr<HttpFile> file;
+  off_t file_offset = 0;
+  int64_t file_left = 0;
+};
+
+/**
+ * @brief Minimal HTTP/1.1 server for the live cache and recorded
+ * segments: GET and HEAD, keep-alive, single byte ranges and blocking
+ * playlist reloads (_HLS_msn=N waits until segment N is listed). One
+ * thread runs an epoll loop over every connection; cached responses
+ * are written with writev directly from the cached buffers, and files
+ * under the root that are not cached go out with sendfile.
+ */
+class HttpServer {
+ public:
+  /** Called with the key of every playlist request, e.g. to keep an
+   *  on-demand rendition running */
+  typedef std::function<void(const std::string &key)> PlaylistHook;
+
+  HttpServer() = default;
+  HttpServer(const HttpServer &) = delete;
+  HttpServer &operator=(const HttpServer &) = delete;
+
+  ~HttpServer() {
+    stop();
+    close();
+  }
+
+  /**
+   * @brief Listen for connections
+   *
+   * @param listen "port" (loopback only) or "address:port"
+   * @param cache live files to serve, null to serve files only
+   * @param root directory of the files served from disk
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool open(
+      const std::string &listen,
+      LiveCache *cache,
+      const std::string &root,
+      std::string &error
+  ) {
+    std::string host = "127.0.0.1";
+    std::string port = listen;
+    size_t colon = listen.rfind(':');
+    if (colon != std::string::npos) {
+      host = listen.substr(0, colon);
+      port = listen.substr(colon + 1);
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(std::atoi(port.c_str())));
+    if (addr.sin_port == 0 || inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+      error = "invalid listen address " + listen;
+      return false;
+    }
+
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listen_fd_ < 0 || epoll_fd_ < 0 || stop_fd_ < 0) {
+      error = std::strerror(errno);
+      close();
+      return false;
+    }
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (::bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd_, SOMAXCONN) != 0) {
+      error = std::strerror(errno);
+      close();
+      return false;
+    }
+
+    cache_ = cache;
+    root_ = root.empty() || root.back() == '/' ? root : root + "/";
+    watch(listen_fd_, EPOLLIN);
+    watch(stop_fd_, EPOLLIN);
+    if (cache_) {
+      watch(cache_->notify_fd(), EPOLLIN);
+    }
+    return true;
+  }
+
+  void set_playlist_hook(
+      PlaylistHook hook
+  ) {
+    playlist_hook_ = std::move(hook);
+  }
+
+  void start() {
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  void stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    uint64_t one = 1;
+    ssize_t n = ::write(stop_fd_, &one, sizeof(one));
+    (void)n;
+    thread_.join();
+  }
+
+ private:
+  static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void watch(
+      int fd,
+      uint32_t events
+  ) {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void rewatch(
+      int fd,
+      uint32_t events
+  ) {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  void close() {
+    for (auto &entry : conns_) {
+      ::close(entry.first);
+    }
+    conns_.clear();
+    for (int *fd : {&listen_fd_, &epoll_fd_, &stop_fd_}) {
+      if (*fd >= 0) {
+        ::close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+  void run() {
+    epoll_event events[64];
+    while (true) {
+      int timeout = parked_ > 0 ? 20 : 1000;
+      int n = epoll_wait(epoll_fd_, events, 64, timeout);
+      if (n < 0 && errno != EINTR) {
+        log_message("ERROR", "Live HTTP server stopped: %s", std::strerror(errno));
+        return;
+      }
+      bool wake = false;
+      for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == stop_fd_) {
+          return;
+        }
+        if (fd == listen_fd_) {
+          accept_all();
+          continue;
+        }
+        if (cache_ && fd == cache_->notify_fd()) {
+          uint64_t count;
+          ssize_t r = ::read(fd, &count, sizeof(count));
+          (void)r;
+          wake = true;
+          continue;
+        }
+        auto it = conns_.find(fd);
+        if (it == conns_.end()) {
+          continue;
+        }
+        HttpConnection &conn = *it->second;
+        conn.last_active_ms = now_ms();
+        bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+        if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+          ok = receive(conn);
+        }
+        if (ok) {
+          ok = serve(conn);
+        }
+        if (!ok) {
+          drop(fd);
+        }
+      }
+      sweep(wake);
+    }
+  }
+
+  void accept_all() {
+    while (true) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      std::unique_ptr<HttpConnection> conn(new HttpConnection());
+      conn->fd = fd;
+      conn->last_active_ms = now_ms();
+      conn->events = EPOLLIN | EPOLLRDHUP;
+      watch(fd, conn->events);
+      conns_[fd] = std::move(conn);
+    }
+  }
+
+  void drop(
+      int fd
+  ) {
+    auto it = conns_.find(fd);
+    if (it == conns_.end()) {
+      return;
+    }
+    if (it->second->parked) {
+      --parked_;
+    }
+    ::close(fd);
+    conns_.erase(it);
+  }
+
+  /**
+   * @brief Answer parked requests whose playlist changed or whose
+   * deadline passed, and close idle connections
+   */
+  void sweep(
+      bool wake
+  ) {
+    int64_t now = now_ms();
+    std::vector<int> dead;
+    for (auto &entry : conns_) {
+      HttpConnection &conn = *entry.second;
+      if (conn.parked) {
+        if (wake || now >= conn.deadline_ms) {
+          answer(conn, now);
+          if (!serve(conn)) {
+            dead.push_back(entry.first);
+          }
+        }
+      } else if (conn.head.empty() && now - conn.last_active_ms > kHttpIdleTimeoutMs) {
+        dead.push_back(entry.first);
+      }
+    }
+    for (int fd : dead) {
+      drop(fd);
+    }
+  }
+
+  /**
+   * @brief Read request bytes, up to the read-ahead limit
+   *
+   * @return false if the connection is finished
+   */
+  bool receive(
+      HttpConnection &conn
+  ) {
+    char buf[4096];
+    while (conn.in.size() < kHttpMaxReadAhead) {
+      ssize_t n = ::recv(conn.fd, buf, sizeof(buf), 0);
+      if (n > 0) {
+        conn.in.append(buf, static_cast<size_t>(n));
+        continue;
+      }
+      if (n == 0) {
+        return false;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Send the response in flight, then answer buffered requests
+   * one after another until one has to wait for the socket or a
+   * playlist, and watch the events that move the connection on. A
+   * loop rather than recursion, so a packet full of pipelined
+   * requests does not grow the stack.
+   *
+   * @return false if the connection is finished
+   */
+  bool serve(
+      HttpConnection &conn
+  ) {
+    while (true) {
+      if (!conn.head.empty() && !flush(conn)) {
+        return false;
+      }
+      if (!conn.head.empty() || conn.parked) {
+        break;
+      }
+      bool started = false;
+      if (!next_request(conn, started)) {
+        return false;
+      }
+      if (!started) {
+        break;
+      }
+    }
+
+    /** Stop reading while a response holds back a full read-ahead */
+    bool busy = !conn.head.empty() || conn.parked;
+    uint32_t events = 0;
+    if (conn.blocked) {
+      events |= EPOLLOUT;
+    }
+    if (!busy || conn.in.size() < kHttpMaxReadAhead) {
+      events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events != conn.events) {
+      conn.events = events;
+      rewatch(conn.fd, events);
+    }
+    return true;
+  }
+
+  /**
+   * @brief Start the next buffered request
+   *
+   * @param started set if a complete request was taken
+   * @return false if the connection is finished
+   */
+  bool next_request(
+      HttpConnection &conn,
+      bool &started
+  ) {
+    size_t end = conn.in.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      return conn.in.size() <= kHttpMaxRequestHead;
+    }
+    started = true;
+    std::string request = conn.in.substr(0, end);
+    conn.in.erase(0, end + 4);
+    if (!parse(request, conn)) {
+      conn.keep_alive = false;
+      respond(conn, "400 Bad Request", "text/plain", 0);
+      return true;
+    }
+    if (utils::ends_with(conn.key, ".m3u8") && playlist_hook_) {
+      playlist_hook_(conn.key);
+    }
+    answer(conn, now_ms());
+    return true;
+  }
+
+  /**
+   * @brief Parse a request head into conn
+   *
+   * @return false if it is malformed or not GET/HEAD
+   */
+  static bool parse(
+      const std::string &request,
+      HttpConnection &conn
+  ) {
+    size_t line_end = request.find("\r\n");
+    std::string line = request.substr(0, line_end);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.rfind(' ');
+    if (sp1 == std::string::npos || sp2 <= sp1) {
+      return false;
+    }
+    std::string method = line.substr(0, sp1);
+    std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string version = line.substr(sp2 + 1);
+    if ((method != "GET" && method != "HEAD") || target.empty() || target[0] != '/') {
+      return false;
+    }
+    conn.head_only = method == "HEAD";
+    conn.keep_alive = version == "HTTP/1.1";
+
+    std::string lower = request;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (lower.find("\r\nconnection: close") != std::string::npos) {
+      conn.keep_alive = false;
+    } else if (lower.find("\r\nconnection: keep-alive") != std::string::npos) {
+      conn.keep_alive = true;
+    }
+
+    std::string query;
+    size_t mark = target.find('?');
+    if (mark != std::string::npos) {
+      query = target.substr(mark + 1);
+      target.erase(mark);
+    }
+    conn.msn = -1;
+    size_t msn = query.find("_HLS_msn=");
+    if (msn != std::string::npos && (msn == 0 || query[msn - 1] == '&')) {
+      conn.msn = std::strtoll(query.c_str() + msn + 9, nullptr, 10);
+    }
+    conn.range.clear();
+    size_t range = lower.find("\r\nrange: bytes=");
+    if (range != std::string::npos) {
+      size_t begin = range + 15;
+      conn.range = lower.substr(begin, lower.find("\r\n", begin) - begin);
+    }
+
+    /** Same paths as the backend's /streams mount */
+    conn.key = utils::starts_with(target, "/streams/") ? target.substr(9) : target.substr(1);
+    return !conn.key.empty() && conn.key.find("..") == std::string::npos;
+  }
+
+  static const char *content_type(
+      const std::string &key
+  ) {
+    if (utils::ends_with(key, ".m3u8")) {
+      return "application/vnd.apple.mpegurl";
+    }
+    if (utils::ends_with(key, ".ts")) {
+      return "video/mp2t";
+    }
+    if (utils::ends_with(key, ".m4s")) {
+      return "video/iso.segment";
+    }
+    if (utils::ends_with(key, ".mp4")) {
+      return "video/mp4";
+    }
+    return "application/octet-stream";
+  }
+
+  /**
+   * @brief Answer the current request from the cache, or park it
+   */
+  void answer(
+      HttpConnection &conn,
+      int64_t now
+  ) {
+    bool was_parked = conn.parked;
+    bool playlist = utils::ends_with(conn.key, ".m3u8");
+    LivePlaylist state;
+    bool published = cache_ && playlist && cache_->playlist(conn.key, state);
+
+    int64_t deadline = 0;
+    if (cache_ && playlist && !published && access((root_ + conn.key).c_str(), F_OK) != 0) {
+      deadline = now + kLivePlaylistWaitMs;
+    } else if (published && conn.msn >= 0 && conn.msn >= state.next_msn && !state.ended) {
+      deadline = now + 3000 * std::max(state.target_duration, 1);
+    }
+    if (deadline > 0 && (!was_parked || now < conn.deadline_ms)) {
+      if (!was_parked) {
+        conn.parked = true;
+        conn.deadline_ms = deadline;
+        ++parked_;
+      }
+      return;
+    }
+    if (was_parked) {
+      conn.parked = false;
+      --parked_;
+    }
+
+    LiveBuffer body;
+    if (published) {
+      body = state.data;
+    } else if (cache_ && !playlist) {
+      cache_->get(conn.key, body);
+    }
+    if (body) {
+      respond(conn, "200 OK", content_type(conn.key), body->size());
+      conn.body = conn.head_only ? nullptr : std::move(body);
+      return;
+    }
+    answer_file(conn, now);
+  }
+
+  /**
+   * @brief Answer the current request from a file under the root
+   */
+  void answer_file(
+      HttpConnection &conn,
+      int64_t now
+  ) {
+    int64_t size = 0;
+    std::shared_ptr<HttpFile> file = files_.open(root_ + conn.key, size, now);
+    if (!file) {
+      respond(conn, "404 Not Found", "text/plain", 0);
+      return;
+    }
+
+    int64_t first = 0;
+    int64_t last = size - 1;
+    if (!conn.range.empty() && !parse_range(conn.range, size, first, last)) {
+      respond(conn, "416 Range Not Satisfiable", "text/plain", 0,
+              "Content-Range: bytes */" + std::to_string(size) + "\r\n");
+      return;
+    }
+    int64_t length = size > 0 ? last - first + 1 : 0;
+    if (conn.range.empty()) {
+      respond(conn, "200 OK", content_type(conn.key), length,
+              "Accept-Ranges: bytes\r\n");
+    } else {
+      respond(conn, "206 Partial Content", content_type(conn.key), length,
+              "Content-Range: bytes " + std::to_string(first) + "-" +
+                  std::to_string(last) + "/" + std::to_string(size) + "\r\n");
+    }
+    if (!conn.head_only && length > 0) {
+      conn.file = std::move(file);
+      conn.file_offset = first;
+      conn.file_left = length;
+    }
+  }
+
+  /**
+   * @brief Resolve a single byte range against a file size
+   *
+   * @return false if it is malformed or outside the file
+   */
+  static bool parse_range(
+      const std::string &range,
+      int64_t size,
+      int64_t &first,
+      int64_t &last
+  ) {
+    size_t dash = range.find('-');
+    if (dash == std::string::npos || range.find(',') != std::string::npos) {
+      return false;
+    }
+    std::string from = range.substr(0, dash);
+    std::string to = range.substr(dash + 1);
+    if (from.empty()) {
+      int64_t suffix = std::strtoll(to.c_str(), nullptr, 10);
+      if (suffix <= 0) {
+        return false;
+      }
+      first = std::max<int64_t>(size - suffix, 0);
+      last = size - 1;
+    } else {
+      first = std::strtoll(from.c_str(), nullptr, 10);
+      last = to.empty() ? size - 1
+                        : std::min<int64_t>(std::strtoll(to.c_str(), nullptr, 10), size - 1);
+    }
+    return first >= 0 && first < size && first <= last;
+  }
+
+  void respond(
+      HttpConnection &conn,
+      const char *status,
+      const char *type,
+      int64_t length,
+      const std::string &extra = ""
+  ) {
+    bool playlist = utils::ends_with(conn.key, ".m3u8");
+    conn.head = std::string("HTTP/1.1 ") + status + "\r\n" +
+                "Content-Type: " + type + "\r\n" +
+                "Content-Length: " + std::to_string(length) + "\r\n" + extra +
+                "Cache-Control: " + (playlist ? "no-cache" : "max-age=60") + "\r\n" +
+                "Access-Control-Allow-Origin: *\r\n" +
+                "Connection: " + (conn.keep_alive ? "keep-alive" : "close") + "\r\n\r\n";
+    conn.body.reset();
+    conn.sent = 0;
+  }
+
+  /**
+   * @brief Send as much of the response as the socket takes; blocked
+   * is set if it filled up
+   *
+   * @return false if the connection is finished
+   */
+  bool flush(
+      HttpConnection &conn
+  ) {
+    conn.blocked = false;
+    size_t body_size = conn.body ? conn.body->size() : 0;
+    size_t total = conn.head.size() + body_size;
+    while (conn.sent < total) {
+      iovec iov[2];
+      int count = 0;
+      if (conn.sent < conn.head.size()) {
+        iov[count].iov_base = &conn.head[conn.sent];
+        iov[count].iov_len = conn.head.size() - conn.sent;
+        ++count;
+      }
+      if (body_size > 0) {
+        size_t at = conn.sent > conn.head.size() ? conn.sent - conn.head.size() : 0;
+        iov[count].iov_base = const_cast<char *>(conn.body->data() + at);
+        iov[count].iov_len = body_size - at;
+        ++count;
+      }
+      ssize_t n = ::writev(conn.fd, iov, count);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        conn.blocked = true;
+        return true;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      conn.sent += static_cast<size_t>(n);
+    }
+
+    while (conn.file_left > 0) {
+      ssize_t n = ::sendfile(conn.fd, conn.file->fd, &conn.file_offset,
+                             static_cast<size_t>(conn.file_left));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        conn.blocked = true;
+        return true;
+      }
+      if (n <= 0) {
+        /** The file shrank or failed; the response cannot be completed */
+        return false;
+      }
+      conn.file_left -= n;
+    }
+    conn.file.reset();
+
+    conn.head.clear();
+    conn.body.reset();
+    conn.sent = 0;
+    return conn.keep_alive;
+  }
+
+  LiveCache *cache_ = nullptr;
+  std::string root_;
+  HttpFileCache files_;
+  PlaylistHook playlist_hook_;
+  std::thread thread_;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  int stop_fd_ = -1;
+  int parked_ = 0;
+  std::map<int, std::unique_ptr<HttpConnection>> conns_;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Wall-clock alignment of a camera's inputs. The main input publishes
+ * where its output timeline stood at a wall-clock instant; sub-stream
+ * inputs shift their timestamps so the same instant lands on the same
+ * output timestamp in every playlist. The camera's RTCP clock is used
+ * when both inputs report one, arrival time otherwise.
+ */
+
+/** A sub-stream whose alignment moves by more than this re-aligns (us) */
+static constexpr int64_t kInputAlignSlackUs = 100000;
+
+/**
+ * @brief A packet timestamp and the wall-clock instant it belongs to
+ */
+struct ClockSample {
+  /** Timestamp in AV_TIME_BASE units */
+  int64_t ts = AV_NOPTS_VALUE;
+  /** When the packet was read, microseconds since the epoch */
+  int64_t arrival_us = 0;
+  /** Capture time from the sender's clock (RTCP), AV_NOPTS_VALUE if unknown */
+  int64_t ntp_us = AV_NOPTS_VALUE;
+};
+
+/**
+ * @brief Latest clock sample of a camera's main input, read by its
+ * sub-stream inputs
+ */
+class TimelineAnchor {
+ public:
+  TimelineAnchor() = default;
+  TimelineAnchor(const TimelineAnchor &) = delete;
+  TimelineAnchor &operator=(const TimelineAnchor &) = delete;
+
+  /**
+   * @brief Replace the sample, e.g. after a reconnect moved the timeline
+   *
+   * @param sample
+   */
+  void publish(
+      const ClockSample &sample
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sample_ = sample;
+    ++generation_;
+  }
+
+  /**
+   * @brief Current sample
+   *
+   * @param sample
+   * @param generation bumped by every publish
+   * @return true once the main input has published
+   */
+  bool get(
+      ClockSample &sample,
+      uint64_t &generation
+  ) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sample = sample_;
+    generation = generation_;
+    return generation_ > 0;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  ClockSample sample_;
+  uint64_t generation_ = 0;
+};
+
+namespace utils {
+
+/**
+ * @brief Sample an input's clock at a packet
+ *
+ * @param ctx
+ * @param pkt
+ * @param ts_offset shift already applied to pkt, AV_TIME_BASE units
+ * @return ClockSample ts is AV_NOPTS_VALUE if the packet has none
+ */
+static inline ClockSample sample_input_clock(
+    const AVFormatContext *ctx,
+    const AVPacket *pkt,
+    int64_t ts_offset
+) {
+  ClockSample sample;
+  int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+  if (ts == AV_NOPTS_VALUE) {
+    return sample;
+  }
+  sample.ts = av_rescale_q(ts, ctx->streams[pkt->stream_index]->time_base,
+                           AV_TIME_BASE_Q);
+  sample.arrival_us = av_gettime();
+
+  /** start_time_realtime is the sender's wall clock at pts 0 */
+  if (ctx->start_time_realtime != AV_NOPTS_VALUE) {
+    sample.ntp_us = ctx->start_time_realtime + sample.ts - ts_offset;
+  }
+  return sample;
+}
+
+/**
+ * @brief Offset that puts an input's timestamps on the main input's
+ * output timeline
+ *
+ * @param main published sample of the main input
+ * @param input unshifted sample of the input to align
+ * @return int64_t offset to add, AV_TIME_BASE units
+ */
+static inline int64_t aligned_ts_offset(
+    const ClockSample &main,
+    const ClockSample &input
+) {
+  bool sender_clock = main.ntp_us != AV_NOPTS_VALUE &&
+                      input.ntp_us != AV_NOPTS_VALUE;
+  int64_t wall_delta = sender_clock ? input.ntp_us - main.ntp_us
+                                    : input.arrival_us - main.arrival_us;
+  return main.ts + wall_delta - input.ts;
+}
+
+}  // namespace utils
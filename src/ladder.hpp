@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+/** How a rendition's size relates to the source aspect ratio */
+static constexpr int kAspectStretch = 0;
+static constexpr int kAspectFit = 1;
+
+/**
+ * @brief Struct used for quality
+ * version of live stream
+ */
+struct Rendition {
+  std::string name;
+  int width = 0;
+  int height = 0;
+  int video_bitrate = 0;
+
+  /** Frame rate cap, 0 keeps the source rate */
+  int fps = 0;
+
+  /** x264 preset, empty for the default */
+  std::string preset;
+
+  /** kAspectStretch encodes width x height, kAspectFit fits the
+   * source aspect ratio inside it */
+  int aspect = kAspectStretch;
+};
+
+/**
+ * @brief Default low/mid/high ladder
+ *
+ * @return std::vector<Rendition>
+ */
+static inline std::vector<Rendition> default_renditions() {
+  return {
+      {"low", 426, 240, 400000, 0, "", kAspectStretch},
+      {"mid", 854, 480, 1200000, 0, "", kAspectStretch},
+      {"high", 1280, 720, 2500000, 0, "", kAspectStretch},
+  };
+}
+
+/**
+ * @brief Ladder resolved against one source: renditions to encode and
+ * names served by the copy output instead
+ */
+struct ResolvedLadder {
+  std::vector<Rendition> encoded;
+  std::vector<std::string> copy_aliases;
+};
+
+namespace utils {
+
+/**
+ * @brief Parse a bitrate such as 800000, 800k or 2.5M
+ *
+ * @param value
+ * @param bps parsed bits per second
+ * @return true if valid
+ */
+static inline bool parse_bitrate(
+    const std::string &value,
+    int &bps
+) {
+  char *end = nullptr;
+  double number = std::strtod(value.c_str(), &end);
+  if (end == value.c_str()) {
+    return false;
+  }
+  std::string suffix(end);
+  if (suffix == "k" || suffix == "K") {
+    number *= 1000.0;
+  } else if (suffix == "m" || suffix == "M") {
+    number *= 1000000.0;
+  } else if (!suffix.empty()) {
+    return false;
+  }
+  if (number <= 0.0 || number > 2e9) {
+    return false;
+  }
+  bps = static_cast<int>(number);
+  return true;
+}
+
+/**
+ * @brief Load a rendition ladder. Each non-empty line that does not
+ * start with '#' reads
+ * "<name> <width>x<height> <bitrate> [fps=N] [preset=NAME] [aspect=stretch|fit]".
+ *
+ * @param path ladder file
+ * @param ladder parsed renditions, in file order
+ * @param error description of the first bad line
+ * @return true on success
+ */
+static inline bool load_ladder(
+    const std::string &path,
+    std::vector<Rendition> &ladder,
+    std::string &error
+) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    error = "cannot open " + path;
+    return false;
+  }
+
+  ladder.clear();
+  std::string line;
+  int line_no = 0;
+  while (std::getline(in, line)) {
+    ++line_no;
+    std::istringstream tokens(line);
+    std::vector<std::string> args;
+    std::string token;
+    while (tokens >> token) {
+      args.push_back(token);
+    }
+    if (args.empty() || args[0][0] == '#') {
+      continue;
+    }
+
+    std::string where = "line " + std::to_string(line_no) + ": ";
+    if (args.size() < 3) {
+      error = where + "expected <name> <width>x<height> <bitrate>";
+      return false;
+    }
+
+    Rendition r;
+    r.name = args[0];
+    if (std::sscanf(args[1].c_str(), "%dx%d", &r.width, &r.height) != 2 ||
+        r.width < 16 || r.height < 16) {
+      error = where + "bad size " + args[1];
+      return false;
+    }
+    if (!parse_bitrate(args[2], r.video_bitrate)) {
+      error = where + "bad bitrate " + args[2];
+      return false;
+    }
+
+    for (size_t i = 3; i < args.size(); ++i) {
+      const std::string &opt = args[i];
+      if (starts_with(opt, "fps=")) {
+        r.fps = std::atoi(opt.c_str() + 4);
+        if (r.fps <= 0) {
+          error = where + "bad " + opt;
+          return false;
+        }
+      } else if (starts_with(opt, "preset=")) {
+        r.preset = opt.substr(7);
+      } else if (opt == "aspect=stretch") {
+        r.aspect = kAspectStretch;
+      } else if (opt == "aspect=fit") {
+        r.aspect = kAspectFit;
+      } else {
+        error = where + "unknown option " + opt;
+        return false;
+      }
+    }
+
+    for (const auto &existing : ladder) {
+      if (existing.name == r.name) {
+        error = where + "duplicate rendition " + r.name;
+        return false;
+      }
+    }
+    ladder.push_back(r);
+  }
+
+  if (ladder.empty()) {
+    error = path + " has no renditions";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Fit a ladder to a source: apply its aspect policy and,
+ * in auto mode, serve any rendition at or above the source height
+ * from the copy output and clamp the rest to the source width.
+ *
+ * @param ladder configured renditions
+ * @param src_width
+ * @param src_height
+ * @param auto_fit drop renditions the source cannot improve on
+ * @return ResolvedLadder
+ */
+static inline ResolvedLadder resolve_ladder(
+    const std::vector<Rendition> &ladder,
+    int src_width,
+    int src_height,
+    bool auto_fit
+) {
+  ResolvedLadder resolved;
+  for (Rendition r : ladder) {
+    if (r.aspect == kAspectFit && src_width > 0 && src_height > 0) {
+      double scale = std::min(static_cast<double>(r.width) / src_width,
+                              static_cast<double>(r.height) / src_height);
+      r.width = std::max(2, static_cast<int>(src_width * scale) & ~1);
+      r.height = std::max(2, static_cast<int>(src_height * scale) & ~1);
+    }
+
+    if (auto_fit && src_height > 0) {
+      if (r.height >= src_height) {
+        resolved.copy_aliases.push_back(r.name);
+        continue;
+      }
+      if (r.width > src_width) {
+        r.width = src_width & ~1;
+      }
+    }
+    resolved.encoded.push_back(r);
+  }
+  return resolved;
+}
+
+}  // namespace utils
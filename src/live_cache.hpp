@@ -0,0 +1,423 @@
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "catalog.hpp"
+#include "utils.hpp"
+
+/**
+ * Live window of the hls muxer outputs, kept in memory. Playlists,
+ * init segments and the last few media segments of every output are
+ * published here as immutable buffers when the muxer closes them, and
+ * the live HTTP server (http_server.hpp) sends those buffers as they
+ * are. Rendition outputs live only here; the copy output is also
+ * written to disk for recording.
+ */
+
+/** Media segments kept per output unless --live-cache-segments says otherwise */
+static constexpr int kLiveCacheDefaultSegments = 6;
+
+/** Buffer of the AVIO tee in front of cached files */
+static constexpr int kLiveTeeBufferSize = 64 * 1024;
+
+/** Immutable bytes of one published file, shared with responses in flight */
+typedef std::shared_ptr<const std::string> LiveBuffer;
+
+/**
+ * @brief Published playlist and what blocking reloads wait for
+ */
+struct LivePlaylist {
+  LiveBuffer data;
+  /** Media sequence number of the next segment to be listed */
+  int64_t next_msn = 0;
+  int target_duration = 0;
+  bool ended = false;
+};
+
+/**
+ * @brief Files an output has published
+ */
+struct LiveOutputFiles {
+  std::deque<std::string> segments;
+  std::set<std::string> others;
+};
+
+class LiveCache {
+ public:
+  LiveCache() = default;
+  LiveCache(const LiveCache &) = delete;
+  LiveCache &operator=(const LiveCache &) = delete;
+
+  ~LiveCache() {
+    if (notify_fd_ >= 0) {
+      ::close(notify_fd_);
+    }
+  }
+
+  /**
+   * @brief Set up the cache
+   *
+   * @param root directory the served paths are relative to
+   * @param max_segments media segments kept per output
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool open(
+      const std::string &root,
+      int max_segments,
+      std::string &error
+  ) {
+    notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd_ < 0) {
+      error = std::strerror(errno);
+      return false;
+    }
+    root_ = root;
+    if (root_ == ".") {
+      root_.clear();
+    } else if (!root_.empty() && root_.back() != '/') {
+      root_ += '/';
+    }
+    max_segments_ = max_segments > 0 ? static_cast<size_t>(max_segments) : 1;
+    return true;
+  }
+
+  /**
+   * @brief Media segments kept per output
+   */
+  size_t max_segments() const {
+    return max_segments_;
+  }
+
+  /**
+   * @brief Key a file is served under
+   *
+   * @param path file path as the muxer writes it
+   * @return std::string empty if the file is outside the root
+   */
+  std::string key_of(
+      const std::string &path
+  ) const {
+    if (path.empty() || path.find("..") != std::string::npos) {
+      return "";
+    }
+    if (root_.empty()) {
+      return path[0] == '/' ? "" : path;
+    }
+    if (path.compare(0, root_.size(), root_) != 0) {
+      return "";
+    }
+    return path.substr(root_.size());
+  }
+
+  /**
+   * @brief Publish a file closed by an output's muxer
+   *
+   * @param output key of the output's playlist
+   * @param key
+   * @param data
+   */
+  void put(
+      const std::string &output,
+      const std::string &key,
+      LiveBuffer data
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LiveOutputFiles &files = outputs_[output];
+    if (utils::ends_with(key, ".m3u8")) {
+      LivePlaylist &playlist = playlists_[key];
+      parse_playlist(*data, playlist);
+      playlist.data = std::move(data);
+      files.others.insert(key);
+
+      /** Wake blocked reloads */
+      uint64_t one = 1;
+      ssize_t n = ::write(notify_fd_, &one, sizeof(one));
+      (void)n;
+      return;
+    }
+
+    files_[key] = std::move(data);
+    if (!utils::is_segment_file(key)) {
+      files.others.insert(key);
+      return;
+    }
+    files.segments.push_back(key);
+    while (files.segments.size() > max_segments_) {
+      files_.erase(files.segments.front());
+      files.segments.pop_front();
+    }
+  }
+
+  /**
+   * @brief Serve a playlist under another name, like the on-disk
+   * symlink of a rendition served from the copy output
+   *
+   * @param alias_key
+   * @param target_key
+   */
+  void alias(
+      const std::string &alias_key,
+      const std::string &target_key
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    aliases_[alias_key] = target_key;
+  }
+
+  /**
+   * @brief Forget everything an output published
+   *
+   * @param output key of the output's playlist
+   */
+  void drop_output(
+      const std::string &output
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = outputs_.find(output);
+    if (it == outputs_.end()) {
+      return;
+    }
+    for (const auto &key : it->second.segments) {
+      files_.erase(key);
+    }
+    for (const auto &key : it->second.others) {
+      files_.erase(key);
+      playlists_.erase(key);
+    }
+    outputs_.erase(it);
+  }
+
+  /**
+   * @brief Look up a published file
+   *
+   * @param key
+   * @param data set on success
+   * @return true if the file is cached
+   */
+  bool get(
+      const std::string &key,
+      LiveBuffer &data
+  ) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::string &resolved = resolve(key);
+    auto playlist = playlists_.find(resolved);
+    if (playlist != playlists_.end()) {
+      data = playlist->second.data;
+      return true;
+    }
+    auto file = files_.find(resolved);
+    if (file == files_.end()) {
+      return false;
+    }
+    data = file->second;
+    return true;
+  }
+
+  /**
+   * @brief Current state of a playlist
+   *
+   * @param key
+   * @param state copy of the playlist on success
+   * @return true if the playlist is published
+   */
+  bool playlist(
+      const std::string &key,
+      LivePlaylist &state
+  ) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = playlists_.find(resolve(key));
+    if (it == playlists_.end()) {
+      return false;
+    }
+    state = it->second;
+    return true;
+  }
+
+  /**
+   * @brief Readable whenever a playlist is published
+   */
+  int notify_fd() const {
+    return notify_fd_;
+  }
+
+ private:
+  /** Caller holds mutex_ */
+  const std::string &resolve(
+      const std::string &key
+  ) const {
+    auto it = aliases_.find(key);
+    return it == aliases_.end() ? key : it->second;
+  }
+
+  static void parse_playlist(
+      const std::string &text,
+      LivePlaylist &playlist
+  ) {
+    int64_t media_sequence = 0;
+    int64_t segments = 0;
+    playlist.ended = false;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+      if (utils::starts_with(line, "#EXT-X-MEDIA-SEQUENCE:")) {
+        media_sequence = std::strtoll(line.c_str() + 22, nullptr, 10);
+      } else if (utils::starts_with(line, "#EXT-X-TARGETDURATION:")) {
+        playlist.target_duration = std::atoi(line.c_str() + 22);
+      } else if (utils::starts_with(line, "#EXTINF:")) {
+        ++segments;
+      } else if (utils::starts_with(line, "#EXT-X-ENDLIST")) {
+        playlist.ended = true;
+      }
+    }
+    playlist.next_msn = media_sequence + segments;
+  }
+
+  mutable std::mutex mutex_;
+  std::string root_;
+  size_t max_segments_ = kLiveCacheDefaultSegments;
+  int notify_fd_ = -1;
+  std::map<std::string, LiveBuffer> files_;
+  std::map<std::string, LivePlaylist> playlists_;
+  std::map<std::string, LiveOutputFiles> outputs_;
+  std::map<std::string, std::string> aliases_;
+};
+
+/** Live cache of the process, null when live views are served from disk */
+static LiveCache *g_live_cache = nullptr;
+
+/**
+ * @brief A file being written by a muxer, collected for the cache and
+ * optionally passed on to its file
+ */
+struct LiveTee {
+  AVIOContext *inner = nullptr;
+  std::string key;
+  std::string data;
+  int64_t pos = 0;
+};
+
+namespace utils {
+
+/**
+ * @brief AVIO write callback of live tees
+ */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int live_tee_write(void *opaque, const uint8_t *buf, int size) {
+#else
+static int live_tee_write(void *opaque, uint8_t *buf, int size) {
+#endif
+  LiveTee *tee = static_cast<LiveTee *>(opaque);
+  size_t end = static_cast<size_t>(tee->pos) + size;
+  if (end > tee->data.size()) {
+    tee->data.resize(end);
+  }
+  std::memcpy(&tee->data[tee->pos], buf, size);
+  tee->pos += size;
+  if (tee->inner) {
+    avio_write(tee->inner, buf, size);
+    if (tee->inner->error < 0) {
+      return tee->inner->error;
+    }
+  }
+  return size;
+}
+
+/**
+ * @brief AVIO seek callback of live tees
+ */
+static int64_t live_tee_seek(void *opaque, int64_t offset, int whence) {
+  LiveTee *tee = static_cast<LiveTee *>(opaque);
+  int64_t size = static_cast<int64_t>(tee->data.size());
+  if (whence == AVSEEK_SIZE) {
+    return size;
+  }
+  int64_t pos = offset;
+  if ((whence & ~AVSEEK_FORCE) == SEEK_CUR) {
+    pos = tee->pos + offset;
+  } else if ((whence & ~AVSEEK_FORCE) == SEEK_END) {
+    pos = size + offset;
+  }
+  if (pos < 0) {
+    return AVERROR(EINVAL);
+  }
+  if (tee->inner) {
+    int64_t ret = avio_seek(tee->inner, pos, SEEK_SET);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  tee->pos = pos;
+  return pos;
+}
+
+/**
+ * @brief Put a tee in front of a file a muxer writes
+ *
+ * @param inner the file, null to keep it in memory only
+ * @param key cache key
+ * @param pb set to the tee
+ * @return int AVERROR code, 0 on success
+ */
+static inline int open_live_tee(
+    AVIOContext *inner,
+    const std::string &key,
+    AVIOContext **pb
+) {
+  LiveTee *tee = new LiveTee();
+  tee->inner = inner;
+  tee->key = key;
+  uint8_t *buffer = static_cast<uint8_t *>(av_malloc(kLiveTeeBufferSize));
+  if (buffer) {
+    *pb = avio_alloc_context(buffer, kLiveTeeBufferSize, 1, tee, nullptr,
+                             &live_tee_write, &live_tee_seek);
+  }
+  if (!buffer || !*pb) {
+    av_free(buffer);
+    delete tee;
+    return AVERROR(ENOMEM);
+  }
+  return 0;
+}
+
+/**
+ * @brief Flush and free a tee
+ *
+ * @param pb the tee
+ * @param key set to its cache key
+ * @param data set to everything written
+ * @return AVIOContext* the file behind it, null for memory only
+ */
+static inline AVIOContext *close_live_tee(
+    AVIOContext **pb,
+    std::string &key,
+    LiveBuffer &data
+) {
+  LiveTee *tee = static_cast<LiveTee *>((*pb)->opaque);
+  avio_flush(*pb);
+  AVIOContext *inner = tee->inner;
+  key = std::move(tee->key);
+  data = std::make_shared<const std::string>(std::move(tee->data));
+  delete tee;
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  return inner;
+}
+
+}  // namespace utils
@@ -0,0 +1,467 @@
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+}
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "avoptions.hpp"
+#include "catalog.hpp"
+#include "logger.hpp"
+#include "utils.hpp"
+
+/**
+ * Low-Latency HLS output. The mp4 muxer runs in custom fragment mode
+ * behind an in-memory AVIO; every fragment it flushes is one CMAF part,
+ * written as its own file and appended to the segment it belongs to.
+ * Segments start on video keyframes. The playlist lists the parts of
+ * the last few segments and a preload hint for the next one; blocking
+ * reloads are answered by the HTTP server from the playlist on disk.
+ */
+
+/** Segments whose parts stay listed in the playlist */
+static constexpr size_t kLlhlsPartSegments = 3;
+
+/** Segment target when none is configured, as for the hls muxer */
+static constexpr int kLlhlsSegmentSec = 2;
+
+/** Buffer of the in-memory AVIO */
+static constexpr int kLlhlsIoBufferSize = 64 * 1024;
+
+/**
+ * @brief Partial segment, one CMAF fragment
+ */
+struct LlhlsPart {
+  double duration = 0.0;
+  bool independent = false;
+  size_t bytes = 0;
+  std::string uri;
+};
+
+/**
+ * @brief Media segment and, while recent, its parts
+ */
+struct LlhlsSegment {
+  int64_t msn = 0;
+  double duration = 0.0;
+  /** Preceded by EXT-X-DISCONTINUITY */
+  bool discontinuity = false;
+  std::string uri;
+  std::vector<LlhlsPart> parts;
+};
+
+/**
+ * @brief Cuts an mp4 muxer's output into LL-HLS parts and segments.
+ * Owned through AVFormatContext::opaque of the output it writes.
+ */
+class LlhlsSegmenter {
+ public:
+  LlhlsSegmenter() = default;
+  LlhlsSegmenter(const LlhlsSegmenter &) = delete;
+  LlhlsSegmenter &operator=(const LlhlsSegmenter &) = delete;
+
+  ~LlhlsSegmenter() {
+    free_io();
+  }
+
+  /**
+   * @brief Attach to an mp4 output whose streams are set up, write
+   * the init section and an empty playlist
+   *
+   * @param ctx mp4 output context without IO
+   * @param playlist_path
+   * @param part_ms part target duration
+   * @param segment_sec segment target duration
+   * @param list_size segments kept, 0 keeps all
+   * @return int
+   */
+  int open(
+      AVFormatContext *ctx,
+      const std::string &playlist_path,
+      int part_ms,
+      int segment_sec,
+      int list_size
+  ) {
+    ctx_ = ctx;
+    playlist_path_ = playlist_path;
+    part_target_ = part_ms / 1000.0;
+    segment_target_ = segment_sec;
+    target_duration_ = segment_sec;
+    list_size_ = list_size;
+
+    std::string base = utils::base_without_ext(playlist_path);
+    size_t slash = base.find_last_of('/');
+    dir_ = slash == std::string::npos ? "" : base.substr(0, slash + 1);
+    name_ = slash == std::string::npos ? base : base.substr(slash + 1);
+
+    clock_index_ = 0;
+    for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+      if (ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        clock_index_ = static_cast<int>(i);
+        break;
+      }
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(av_malloc(kLlhlsIoBufferSize));
+    if (!buffer) {
+      return AVERROR(ENOMEM);
+    }
+    ctx->pb = avio_alloc_context(buffer, kLlhlsIoBufferSize, 1, this, nullptr,
+                                 &LlhlsSegmenter::write_packet, nullptr);
+    if (!ctx->pb) {
+      av_free(buffer);
+      return AVERROR(ENOMEM);
+    }
+    ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    AVDictionary *opts = nullptr;
+    av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    int ret = avformat_write_header(ctx, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+      log_message("ERROR", "Failed to write LL-HLS init section: %s",
+                  av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+    header_written_ = true;
+
+    /** ftyp and moov, before any fragment */
+    avio_flush(ctx->pb);
+    init_uri_ = name_ + "_init.mp4";
+    if (!utils::write_file_atomic(dir_ + init_uri_, pending_.data(),
+                                  pending_.size())) {
+      log_message("ERROR", "Failed to write %s", init_uri_.c_str());
+      return AVERROR(EIO);
+    }
+    pending_.clear();
+
+    std::string error;
+    if (!catalog_.open(playlist_path, error)) {
+      log_message("WARN", "Segment catalog disabled: %s", error.c_str());
+    }
+
+    /** Numbered from the epoch so a restart never reuses segment names */
+    current_.msn = static_cast<int64_t>(time(nullptr));
+    current_.uri = segment_uri(current_.msn);
+    write_playlist(false);
+    return 0;
+  }
+
+  /**
+   * @brief Write one packet, first closing the part or segment it
+   * does not belong to. Timestamps are in the output stream timebase.
+   *
+   * @param pkt
+   * @return int
+   */
+  int write(
+      AVPacket *pkt
+  ) {
+    if (pkt->stream_index == clock_index_) {
+      AVRational tb = ctx_->streams[clock_index_]->time_base;
+      int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+      double t = ts * av_q2d(tb);
+      if (pkt->duration > 0) {
+        frame_duration_ = pkt->duration * av_q2d(tb);
+      } else if (last_t_ >= 0.0 && t > last_t_) {
+        frame_duration_ = t - last_t_;
+      }
+
+      bool key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+      if (part_start_ < 0.0) {
+        part_start_ = t;
+        segment_start_ = t;
+        segment_wall_ms_ = utils::unix_time_ms();
+        part_independent_ = key;
+        cut_pending_ = false;
+      } else if (key && (cut_pending_ || t - segment_start_ >= segment_target_ - 1e-3)) {
+        int ret = flush_part(t);
+        if (ret >= 0) {
+          ret = finish_segment(t);
+        }
+        if (ret < 0) {
+          return ret;
+        }
+        current_.discontinuity = cut_pending_;
+        cut_pending_ = false;
+        part_independent_ = true;
+      } else if (t + frame_duration_ - part_start_ > part_target_ + 1e-3) {
+        /** Close the part before this frame would overrun the target */
+        int ret = flush_part(t);
+        if (ret < 0) {
+          return ret;
+        }
+        part_independent_ = key;
+      }
+      last_t_ = t;
+
+      /** The muxer times the last sample of a fragment by its duration */
+      if (pkt->duration <= 0 && frame_duration_ > 0.0) {
+        pkt->duration = std::llround(frame_duration_ / av_q2d(tb));
+      }
+    }
+
+    part_has_data_ = true;
+    return av_write_frame(ctx_, pkt);
+  }
+
+  /**
+   * @brief End the segment at the next keyframe and mark the one after
+   * it as a discontinuity, e.g. when the input reconnected
+   */
+  void discontinuity() {
+    cut_pending_ = true;
+  }
+
+  /**
+   * @brief Publish the last part and segment and end the playlist
+   */
+  void close() {
+    if (header_written_ && ctx_) {
+      double end = last_t_ >= 0.0 ? last_t_ + frame_duration_ : 0.0;
+      if (flush_part(end) >= 0 && !current_.parts.empty()) {
+        finish_segment(end);
+      }
+      write_playlist(true);
+      av_write_trailer(ctx_);
+      header_written_ = false;
+    }
+    free_io();
+  }
+
+ private:
+  /**
+   * @brief In-memory AVIO sink collecting the muxer output
+   */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+  static int write_packet(void *opaque, const uint8_t *buf, int size) {
+#else
+  static int write_packet(void *opaque, uint8_t *buf, int size) {
+#endif
+    LlhlsSegmenter *self = static_cast<LlhlsSegmenter *>(opaque);
+    self->pending_.insert(self->pending_.end(), buf, buf + size);
+    return size;
+  }
+
+  void free_io() {
+    if (ctx_ && ctx_->pb) {
+      av_freep(&ctx_->pb->buffer);
+      avio_context_free(&ctx_->pb);
+    }
+    ctx_ = nullptr;
+  }
+
+  std::string segment_uri(int64_t msn) const {
+    return name_ + "_seg_" + std::to_string(msn) + ".m4s";
+  }
+
+  std::string part_uri(int64_t msn, size_t part) const {
+    return name_ + "_seg_" + std::to_string(msn) + "." + std::to_string(part) +
+           ".m4s";
+  }
+
+  /**
+   * @brief Flush the muxer's fragment as the next part
+   *
+   * @param end time the part ends at
+   * @return int
+   */
+  int flush_part(double end) {
+    if (!part_has_data_) {
+      return 0;
+    }
+    int ret = av_write_frame(ctx_, nullptr);
+    if (ret < 0) {
+      log_message("ERROR", "LL-HLS fragment flush error: %s",
+                  av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+    avio_flush(ctx_->pb);
+
+    LlhlsPart part;
+    part.duration = end > part_start_ ? end - part_start_ : frame_duration_;
+    part.independent = part_independent_;
+    part.bytes = pending_.size();
+    part.uri = part_uri(current_.msn, current_.parts.size());
+    if (!utils::write_file_atomic(dir_ + part.uri, pending_.data(),
+                                  pending_.size())) {
+      log_message("ERROR", "Failed to write %s", part.uri.c_str());
+      return AVERROR(EIO);
+    }
+    segment_bytes_.insert(segment_bytes_.end(), pending_.begin(), pending_.end());
+    pending_.clear();
+
+    current_.parts.push_back(part);
+    part_start_ = end;
+    part_has_data_ = false;
+    write_playlist(false);
+    return 0;
+  }
+
+  /**
+   * @brief Write the finished segment and start the next one
+   *
+   * @param end time the segment ends at
+   * @return int
+   */
+  int finish_segment(double end) {
+    current_.duration = end - segment_start_;
+    if (!utils::write_file_atomic(dir_ + current_.uri, segment_bytes_.data(),
+                                  segment_bytes_.size())) {
+      log_message("ERROR", "Failed to write %s", current_.uri.c_str());
+      return AVERROR(EIO);
+    }
+    catalog_segment();
+    segment_bytes_.clear();
+    target_duration_ = std::max(target_duration_,
+                                static_cast<int>(std::ceil(current_.duration)));
+
+    int64_t next = current_.msn + 1;
+    segments_.push_back(current_);
+    current_ = LlhlsSegment();
+    current_.msn = next;
+    current_.uri = segment_uri(next);
+    segment_start_ = end;
+    segment_wall_ms_ = utils::unix_time_ms();
+
+    /** Parts are only listed for recent segments */
+    if (segments_.size() > kLlhlsPartSegments) {
+      LlhlsSegment &old = segments_[segments_.size() - kLlhlsPartSegments - 1];
+      for (const auto &part : old.parts) {
+        unlink((dir_ + part.uri).c_str());
+      }
+      old.parts.clear();
+    }
+    while (list_size_ > 0 && segments_.size() > static_cast<size_t>(list_size_)) {
+      unlink((dir_ + segments_.front().uri).c_str());
+      if (segments_.front().discontinuity) {
+        ++discontinuity_sequence_;
+      }
+      segments_.pop_front();
+    }
+    return 0;
+  }
+
+  /**
+   * @brief Catalog the segment being finished; it starts when its
+   * first packet was written, and its independent parts are its
+   * keyframes
+   */
+  void catalog_segment() {
+    int64_t duration_ms = std::llround(current_.duration * 1000.0);
+    CatalogEntry entry = SegmentCatalog::make_entry(
+        current_.uri, segment_wall_ms_, duration_ms, segment_bytes_.size());
+    size_t offset = 0;
+    double start = 0.0;
+    for (const auto &part : current_.parts) {
+      if (part.independent && entry.keyframe_count < kCatalogKeyframes) {
+        entry.keyframe_offset[entry.keyframe_count] = static_cast<uint32_t>(offset);
+        entry.keyframe_ms[entry.keyframe_count] =
+            static_cast<uint32_t>(std::llround(start * 1000.0));
+        ++entry.keyframe_count;
+      }
+      offset += part.bytes;
+      start += part.duration;
+    }
+    catalog_.append(entry);
+  }
+
+  /**
+   * @brief Rewrite the playlist
+   *
+   * @param final end the playlist instead of hinting the next part
+   */
+  void write_playlist(bool final) {
+    char line[256];
+    std::string m3u8 = "#EXTM3U\n#EXT-X-VERSION:6\n";
+    std::snprintf(line, sizeof(line),
+                  "#EXT-X-TARGETDURATION:%d\n"
+                  "#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+                  "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n"
+                  "#EXT-X-MEDIA-SEQUENCE:%lld\n",
+                  target_duration_, part_target_, 3.0 * part_target_,
+                  static_cast<long long>(segments_.empty() ? current_.msn
+                                                           : segments_.front().msn));
+    m3u8 += line;
+    if (discontinuity_sequence_ > 0) {
+      std::snprintf(line, sizeof(line), "#EXT-X-DISCONTINUITY-SEQUENCE:%lld\n",
+                    static_cast<long long>(discontinuity_sequence_));
+      m3u8 += line;
+    }
+    m3u8 += "#EXT-X-MAP:URI=\"" + init_uri_ + "\"\n";
+
+    auto add_parts = [&](const LlhlsSegment &seg) {
+      if (seg.discontinuity) {
+        m3u8 += "#EXT-X-DISCONTINUITY\n";
+      }
+      for (const auto &part : seg.parts) {
+        std::snprintf(line, sizeof(line), "#EXT-X-PART:DURATION=%.5f,URI=\"%s\"%s\n",
+                      part.duration, part.uri.c_str(),
+                      part.independent ? ",INDEPENDENT=YES" : "");
+        m3u8 += line;
+      }
+    };
+    for (const auto &seg : segments_) {
+      add_parts(seg);
+      std::snprintf(line, sizeof(line), "#EXTINF:%.5f,\n", seg.duration);
+      m3u8 += line;
+      m3u8 += seg.uri + "\n";
+    }
+
+    if (final) {
+      m3u8 += "#EXT-X-ENDLIST\n";
+    } else {
+      add_parts(current_);
+      m3u8 += "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" +
+              part_uri(current_.msn, current_.parts.size()) + "\"\n";
+    }
+
+    if (!utils::write_file_atomic(playlist_path_, m3u8.data(), m3u8.size())) {
+      log_message("ERROR", "Failed to write %s", playlist_path_.c_str());
+    }
+  }
+
+  AVFormatContext *ctx_ = nullptr;
+  bool header_written_ = false;
+  std::string playlist_path_;
+  std::string dir_;
+  std::string name_;
+  std::string init_uri_;
+  double part_target_ = 0.0;
+  double segment_target_ = 0.0;
+  int target_duration_ = 0;
+  int list_size_ = 0;
+  int clock_index_ = 0;
+
+  /** Muxer output not yet published, and the open segment so far */
+  std::vector<uint8_t> pending_;
+  std::vector<uint8_t> segment_bytes_;
+
+  SegmentCatalog catalog_;
+  std::deque<LlhlsSegment> segments_;
+  LlhlsSegment current_;
+  double part_start_ = -1.0;
+  double segment_start_ = -1.0;
+  /** Wall-clock time the open segment's first packet was written */
+  int64_t segment_wall_ms_ = 0;
+  double last_t_ = -1.0;
+  double frame_duration_ = 0.0;
+  bool part_has_data_ = false;
+  bool part_independent_ = false;
+  bool cut_pending_ = false;
+  int64_t discontinuity_sequence_ = 0;
+};
@@ -1,112 +1,557 @@
 #pragma once
 
+#include <sys/stat.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Asynchronous logger. log_message() renders the text into a slot of
+ * a per-thread single-producer ring and returns; no lock, allocation
+ * or syscall happens on the caller's side. One background thread
+ * drains every ring, formats timestamps, writes batches to the log
+ * file and stdout, and rotates the file. A full ring drops the
+ * message and counts it instead of blocking the packet path.
+ */
+
+/** Records per thread ring */
+static constexpr size_t kLogRingSlots = 64;
+/** Message text kept per record, longer messages are truncated */
+static constexpr size_t kLogTextSize = 448;
+/** Calls of one format string allowed per tag and window */
+static constexpr int kLogBurst = 10;
+/** Rate limiting entries, a power of two; a full table stops limiting */
+static constexpr size_t kLogLimitSlots = 2048;
+/** Rate limiting window */
+static constexpr int64_t kLogWindowNs = 10LL * 1000 * 1000 * 1000;
+/** Background drain interval */
+static constexpr int kLogDrainMs = 20;
+
+/**
+ * @brief One queued log line
+ */
+struct LogRecord {
+  int64_t time_ns;
+  char level[8];
+  char tag[40];
+  char text[kLogTextSize];
+};
+
+/**
+ * @brief Single-producer ring owned by one logging thread
+ */
+struct LogRing {
+  LogRecord slots[kLogRingSlots];
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  std::atomic<uint64_t> dropped{0};
+  /** Set when the owning thread exits; the writer frees it once empty */
+  std::atomic<bool> orphaned{false};
+};
+
+/** LogLimit::key of an entry being claimed */
+static constexpr uint64_t kLogLimitClaiming = 1;
+
+/**
+ * @brief Rate limiting counter of one format string and thread tag,
+ * shared by every thread logging for that tag. The key is published
+ * after fmt and tag, so a matching key makes them readable.
+ */
+struct LogLimit {
+  std::atomic<uint64_t> key{0};
+  const char *fmt = nullptr;
+  char tag[40];
+  std::atomic<int64_t> window_start_ns{0};
+  std::atomic<int> count{0};
+  std::atomic<int> suppressed{0};
+};
+
+/**
+ * @brief Logger shared state; intentionally never destroyed so late
+ * log calls during static destruction stay harmless
+ */
+struct LogState {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<LogRing>> rings;
+  std::ofstream stream;
+  std::string path;
+  uint64_t file_bytes = 0;
+  uint64_t max_bytes = 64ULL * 1024 * 1024;
+  int max_files = 5;
+  std::thread writer;
+  std::atomic<bool> running{false};
+  std::atomic<bool> stopping{false};
+  /** Open addressing table probed linearly from the key's hash */
+  LogLimit limits[kLogLimitSlots];
+};
 
 /**
- * @brief Get logger stream
- * 
- * @return std::ofstream& 
+ * @brief Get logger state
+ *
+ * @return LogState&
  */
-static inline std::ofstream &log_stream() {
-  static std::ofstream stream;
-  return stream;
+static inline LogState &log_state() {
+  static LogState *state = new LogState();
+  return *state;
 }
 
 /**
- * @brief Initialize logger by opening log file
- * 
- * @param path 
- * @return true 
- * @return false 
+ * @brief Get tag prefixed to messages logged by the calling thread
+ *
+ * @return std::string&
  */
-static inline bool log_init(
-    const std::string &path
+static inline std::string &log_thread_tag() {
+  static thread_local std::string tag;
+  return tag;
+}
+
+/**
+ * @brief Tag messages from the calling thread, e.g. with a camera id
+ *
+ * @param tag empty to log untagged
+ */
+static inline void log_set_thread_tag(
+    const std::string &tag
 ) {
-  std::ofstream &stream = log_stream();
-  if (stream.is_open()) {
-    return true;
+  log_thread_tag() = tag;
+}
+
+/**
+ * @brief Tag the calling thread for one scope, e.g. a pool task
+ * running on behalf of a camera, and restore the previous tag
+ */
+class LogTagScope {
+public:
+  explicit LogTagScope(const std::string &tag) : saved_(log_thread_tag()) {
+    log_thread_tag() = tag;
   }
 
-  stream.open(
-      path,
-      std::ios::out | std::ios::app
-  );
-  if (!stream.is_open()) {
-    std::fprintf(
-        stderr,
-        "Failed to open log file: %s\n",
-        path.c_str()
-    );
-    return false;
+  ~LogTagScope() {
+    log_thread_tag().swap(saved_);
   }
 
-  return true;
+  LogTagScope(const LogTagScope &) = delete;
+  LogTagScope &operator=(const LogTagScope &) = delete;
+
+private:
+  std::string saved_;
+};
+
+/**
+ * @brief Set size based rotation, applied by the writer thread
+ *
+ * @param max_bytes rotate once the file grows past this, 0 disables
+ * @param max_files rotated files kept as path.1 .. path.N
+ */
+static inline void log_set_rotation(
+    uint64_t max_bytes,
+    int max_files
+) {
+  LogState &state = log_state();
+  std::lock_guard<std::mutex> lock(state.mutex);
+  state.max_bytes = max_bytes;
+  state.max_files = max_files < 1 ? 1 : max_files;
 }
 
 /**
- * @brief Close logger stream
+ * @brief Owner of the calling thread's ring; marks it orphaned on
+ * thread exit so queued records are still written
  */
-static inline void log_close() {
-  std::ofstream &stream = log_stream();
-  if (stream.is_open()) {
-    stream.flush();
-    stream.close();
+struct LogRingHandle {
+  std::shared_ptr<LogRing> ring;
+
+  ~LogRingHandle() {
+    if (ring) {
+      ring->orphaned.store(true);
+    }
   }
+};
+
+/**
+ * @brief Get the calling thread's ring, registering it on first use
+ *
+ * @return LogRing&
+ */
+static inline LogRing &log_thread_ring() {
+  static thread_local LogRingHandle handle;
+  if (!handle.ring) {
+    handle.ring = std::make_shared<LogRing>();
+    LogState &state = log_state();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.rings.push_back(handle.ring);
+  }
+  return *handle.ring;
 }
 
 /**
- * @brief Log a message with a specific level
- * @example log_message("ERROR", "Failed to open file: %s", filename.c_str());
- * @param level 
- * @param fmt 
- * @param ... 
+ * @brief Find or claim the rate limiting entry of a format string
+ * logged under the calling thread's tag
+ *
+ * @param fmt
+ * @return LogLimit* nullptr once the table is full
  */
-static inline void log_message(
+static inline LogLimit *log_find_limit(
+    const char *fmt
+) {
+  const std::string &tag = log_thread_tag();
+  uint64_t key = 1469598103934665603ULL;
+  for (char c : tag) {
+    key = (key ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+  }
+  key ^= static_cast<uint64_t>(reinterpret_cast<uintptr_t>(fmt)) *
+         0x9E3779B97F4A7C15ULL;
+  if (key <= kLogLimitClaiming) {
+    key += 2;
+  }
+
+  LogLimit *limits = log_state().limits;
+  size_t start = static_cast<size_t>(key ^ (key >> 32));
+  for (size_t i = 0; i < kLogLimitSlots; ++i) {
+    LogLimit &limit = limits[(start + i) & (kLogLimitSlots - 1)];
+    uint64_t found = limit.key.load(std::memory_order_acquire);
+    if (found == key) {
+      return &limit;
+    }
+
+    /** A slot being claimed is skipped; at worst a key gets two */
+    if (found == 0 &&
+        limit.key.compare_exchange_strong(found, kLogLimitClaiming)) {
+      limit.fmt = fmt;
+      std::snprintf(limit.tag, sizeof(limit.tag), "%s", tag.c_str());
+      limit.key.store(key, std::memory_order_release);
+      return &limit;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Wall clock in nanoseconds, served from the vDSO
+ *
+ * @return int64_t
+ */
+static inline int64_t log_now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Render one line straight into the calling thread's ring
+ *
+ * @param level
+ * @param now_ns
+ * @param fmt
+ * @param args
+ */
+static inline void log_pushv(
     const char *level,
+    int64_t now_ns,
     const char *fmt,
-    ...
+    va_list args
 ) {
-  std::ofstream &stream = log_stream();
-  if (!stream.is_open()) {
+  LogRing &ring = log_thread_ring();
+  size_t tail = ring.tail.load(std::memory_order_relaxed);
+  if (tail - ring.head.load(std::memory_order_acquire) >= kLogRingSlots) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
     return;
   }
 
-  std::time_t now = std::time(nullptr);
-  std::tm tm_buf;
-  localtime_r(&now, &tm_buf);
-  char ts[32];
-  std::strftime(
-      ts,
-      sizeof(ts),
-      "%Y-%m-%d %H:%M:%S",
-      &tm_buf
-  );
+  LogRecord &rec = ring.slots[tail % kLogRingSlots];
+  rec.time_ns = now_ns;
+  std::snprintf(rec.level, sizeof(rec.level), "%s", level);
+  std::snprintf(rec.tag, sizeof(rec.tag), "%s", log_thread_tag().c_str());
+  std::vsnprintf(rec.text, sizeof(rec.text), fmt, args);
+  ring.tail.store(tail + 1, std::memory_order_release);
+}
 
-  char msg[2048];
+/**
+ * @brief Variadic form of log_pushv
+ */
+static inline void log_push(
+    const char *level,
+    int64_t now_ns,
+    const char *fmt,
+    ...
+) {
   va_list args;
   va_start(args, fmt);
-  std::vsnprintf(
-      msg,
-      sizeof(msg),
-      fmt,
-      args
-  );
+  log_pushv(level, now_ns, fmt, args);
   va_end(args);
+}
 
-  stream << "[" << level << "] " << ts << " " << msg << "\n";
-  stream.flush();
+/**
+ * @brief Rotate path -> path.1 -> ... -> path.N and reopen
+ *
+ * @param state locked logger state
+ */
+static inline void log_rotate(
+    LogState &state
+) {
+  state.stream.close();
+  for (int i = state.max_files - 1; i >= 1; --i) {
+    std::string from = state.path + "." + std::to_string(i);
+    std::string to = state.path + "." + std::to_string(i + 1);
+    std::rename(from.c_str(), to.c_str());
+  }
+  std::rename(state.path.c_str(), (state.path + ".1").c_str());
+  state.stream.open(state.path, std::ios::out | std::ios::app);
+  state.file_bytes = 0;
+}
+
+/**
+ * @brief Format a timestamp unless it falls in the cached second
+ *
+ * @param time_ns
+ * @param cached_sec second ts holds, updated
+ * @param ts
+ * @param size
+ */
+static inline void log_format_time(
+    int64_t time_ns,
+    time_t &cached_sec,
+    char *ts,
+    size_t size
+) {
+  time_t sec = static_cast<time_t>(time_ns / 1000000000LL);
+  if (sec != cached_sec) {
+    std::tm tm_buf;
+    localtime_r(&sec, &tm_buf);
+    std::strftime(ts, size, "%Y-%m-%d %H:%M:%S", &tm_buf);
+    cached_sec = sec;
+  }
+}
+
+/**
+ * @brief Drain every ring once and write the batch, reporting repeats
+ * suppressed in windows that have expired
+ *
+ * @param state
+ */
+static inline void log_drain(
+    LogState &state
+) {
+  std::string batch;
+  time_t cached_sec = -1;
+  char ts[32] = {0};
+
+  std::lock_guard<std::mutex> lock(state.mutex);
+  int64_t now = log_now_ns();
+  for (LogLimit &limit : state.limits) {
+    /** Report repeats of windows nobody has logged into since */
+    if (limit.key.load(std::memory_order_acquire) <= kLogLimitClaiming ||
+        now - limit.window_start_ns.load() < kLogWindowNs ||
+        limit.suppressed.load() == 0) {
+      continue;
+    }
+    int suppressed = limit.suppressed.exchange(0);
+    if (suppressed == 0) {
+      continue;
+    }
+    char line[kLogTextSize];
+    std::snprintf(line, sizeof(line), "Suppressed %d repeats of \"%s\"",
+                  suppressed, limit.fmt);
+    log_format_time(now, cached_sec, ts, sizeof(ts));
+    batch += "[WARN] ";
+    batch += ts;
+    batch += " ";
+    if (limit.tag[0]) {
+      batch += "[";
+      batch += limit.tag;
+      batch += "] ";
+    }
+    batch += line;
+    batch += "\n";
+  }
+
+  for (auto it = state.rings.begin(); it != state.rings.end();) {
+    LogRing &ring = **it;
+    bool orphaned = ring.orphaned.load();
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    size_t tail = ring.tail.load(std::memory_order_acquire);
 
-  std::fprintf(
-      stdout,
-      "[%s] %s %s\n",
-      level,
-      ts,
-      msg
-  );
+    for (; head != tail; ++head) {
+      const LogRecord &rec = ring.slots[head % kLogRingSlots];
+      log_format_time(rec.time_ns, cached_sec, ts, sizeof(ts));
+
+      batch += "[";
+      batch += rec.level;
+      batch += "] ";
+      batch += ts;
+      batch += " ";
+      if (rec.tag[0]) {
+        batch += "[";
+        batch += rec.tag;
+        batch += "] ";
+      }
+      batch += rec.text;
+      batch += "\n";
+    }
+    ring.head.store(head, std::memory_order_release);
+
+    uint64_t dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      log_format_time(now, cached_sec, ts, sizeof(ts));
+      batch += "[WARN] ";
+      batch += ts;
+      batch += " Logger ring full, dropped " + std::to_string(dropped) +
+               " messages\n";
+    }
+
+    if (orphaned) {
+      it = state.rings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  if (batch.empty() || !state.stream.is_open()) {
+    return;
+  }
+
+  state.stream.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+  state.stream.flush();
+  std::fwrite(batch.data(), 1, batch.size(), stdout);
   std::fflush(stdout);
+
+  state.file_bytes += batch.size();
+  if (state.max_bytes > 0 && state.file_bytes >= state.max_bytes) {
+    log_rotate(state);
+  }
+}
+
+/**
+ * @brief Close logger stream after writing everything queued
+ */
+static inline void log_close() {
+  LogState &state = log_state();
+  if (!state.running.exchange(false)) {
+    return;
+  }
+
+  state.stopping.store(true);
+  if (state.writer.joinable()) {
+    state.writer.join();
+  }
+  log_drain(state);
+
+  std::lock_guard<std::mutex> lock(state.mutex);
+  if (state.stream.is_open()) {
+    state.stream.flush();
+    state.stream.close();
+  }
 }
 
+/**
+ * @brief Initialize logger by opening log file and starting the
+ * writer thread
+ *
+ * @param path
+ * @return true
+ * @return false
+ */
+static inline bool log_init(
+    const std::string &path
+) {
+  LogState &state = log_state();
+  if (state.running.load()) {
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.stream.open(
+        path,
+        std::ios::out | std::ios::app
+    );
+    if (!state.stream.is_open()) {
+      std::fprintf(
+          stderr,
+          "Failed to open log file: %s\n",
+          path.c_str()
+      );
+      return false;
+    }
+
+    struct stat st;
+    state.path = path;
+    state.file_bytes = ::stat(path.c_str(), &st) == 0
+                           ? static_cast<uint64_t>(st.st_size)
+                           : 0;
+  }
+
+  state.stopping.store(false);
+  state.running.store(true);
+  state.writer = std::thread([&state]() {
+    while (!state.stopping.load()) {
+      log_drain(state);
+      std::this_thread::sleep_for(std::chrono::milliseconds(kLogDrainMs));
+    }
+  });
+
+  /** Still write queued lines when main returns early */
+  static bool exit_hook = false;
+  if (!exit_hook) {
+    exit_hook = true;
+    std::atexit([]() { log_close(); });
+  }
+  return true;
+}
+
+/**
+ * @brief Log a message with a specific level. Repeats of one format
+ * string under one thread tag beyond kLogBurst per window are folded
+ * into a single "suppressed" line, written when the window expires.
+ * @example log_message("ERROR", "Failed to open file: %s", filename.c_str());
+ * @param level
+ * @param fmt
+ * @param ...
+ */
+static inline void log_message(
+    const char *level,
+    const char *fmt,
+    ...
+) {
+  if (!log_state().running.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  int64_t now = log_now_ns();
+
+  /** Rate limit by format string and tag, e.g. per camera */
+  LogLimit *limit = log_find_limit(fmt);
+  if (limit) {
+    int64_t start = limit->window_start_ns.load();
+    if (now - start >= kLogWindowNs &&
+        limit->window_start_ns.compare_exchange_strong(start, now)) {
+      limit->count.store(0);
+      int suppressed = limit->suppressed.exchange(0);
+      if (suppressed > 0) {
+        log_push("WARN", now, "Suppressed %d repeats of \"%s\"",
+                 suppressed, fmt);
+      }
+    }
+    if (limit->count.fetch_add(1) >= kLogBurst) {
+      limit->suppressed.fetch_add(1);
+      return;
+    }
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  log_pushv(level, now, fmt, args);
+  va_end(args);
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Per-camera settings, filled from the CLI for a single
+ * camera or from one manifest line per camera
+ */
+struct CameraConfig {
+  std::string id;
+  std::string input_url;
+  std::string output_path;
+  bool rtsp_tcp = false;
+  int reconnect_sec = 0;
+  int copy_max_keep_minutes = 0;
+  int encode_max_keep_minutes = 5;
+  int copy_hls_time_sec = 0;
+  int encode_hls_time_sec = 4;
+  bool on_demand = false;
+  int rendition_idle_sec = 60;
+
+  /** Ladder file, empty for the default low/mid/high ladder */
+  std::string ladder_path;
+  bool ladder_auto = false;
+
+  /** LL-HLS part duration, 0 writes regular MPEG-TS HLS */
+  int ll_hls_part_ms = 0;
+
+  /** Segment container of HLS outputs, "ts" or "fmp4" */
+  std::string segment_format = "ts";
+
+  /** Copy output ring size in MB, 0 writes one file per segment */
+  int ring_store_mb = 0;
+
+  /** Decode at reduced cost where the encoded renditions allow it */
+  bool reduced_decode = false;
+
+  /** Bytes of segments this camera may keep in MB, 0 for no quota */
+  int quota_mb = 0;
+
+  /** Rendition name -> URL of a camera sub-stream remuxed as that
+   * rendition instead of encoding it */
+  std::map<std::string, std::string> sub_inputs;
+};
+
+namespace utils {
+
+/**
+ * @brief Parse one per-camera flag starting at args[i]
+ *
+ * @param args tokenized arguments
+ * @param i index of the flag, advanced past its value on success
+ * @param cfg config to update
+ * @return true if the flag was recognized
+ */
+static inline bool parse_camera_option(
+    const std::vector<std::string> &args,
+    size_t &i,
+    CameraConfig &cfg
+) {
+  const std::string &flag = args[i];
+  bool has_value = i + 1 < args.size();
+
+  if (flag == "--rtsp-tcp") {
+    cfg.rtsp_tcp = true;
+    return true;
+  }
+  if (flag == "--on-demand") {
+    cfg.on_demand = true;
+    return true;
+  }
+  if (flag == "--ladder-auto") {
+    cfg.ladder_auto = true;
+    return true;
+  }
+  if (flag == "--reduced-decode") {
+    cfg.reduced_decode = true;
+    return true;
+  }
+  if (flag == "--ladder" && has_value) {
+    cfg.ladder_path = args[++i];
+    return true;
+  }
+  if (flag == "--sub-input" && has_value) {
+    /** NAME=URL; the URL may contain '=' itself */
+    const std::string &value = args[i + 1];
+    size_t eq = value.find('=');
+    if (eq == 0 || eq == std::string::npos || eq + 1 == value.size()) {
+      return false;
+    }
+    cfg.sub_inputs[value.substr(0, eq)] = value.substr(eq + 1);
+    ++i;
+    return true;
+  }
+  if (flag == "--segment-format" && has_value &&
+      (args[i + 1] == "ts" || args[i + 1] == "fmp4")) {
+    cfg.segment_format = args[++i];
+    return true;
+  }
+
+  int *target = nullptr;
+  if (flag == "--reconnect-sec") {
+    target = &cfg.reconnect_sec;
+  } else if (flag == "--copy-max-keep-minutes") {
+    target = &cfg.copy_max_keep_minutes;
+  } else if (flag == "--encode-max-keep-minutes") {
+    target = &cfg.encode_max_keep_minutes;
+  } else if (flag == "--copy-hls-time") {
+    target = &cfg.copy_hls_time_sec;
+  } else if (flag == "--encode-hls-time") {
+    target = &cfg.encode_hls_time_sec;
+  } else if (flag == "--rendition-idle-sec") {
+    target = &cfg.rendition_idle_sec;
+  } else if (flag == "--ll-hls-part-ms") {
+    target = &cfg.ll_hls_part_ms;
+  } else if (flag == "--ring-store-mb") {
+    target = &cfg.ring_store_mb;
+  } else if (flag == "--quota-mb") {
+    target = &cfg.quota_mb;
+  }
+
+  if (!target || !has_value) {
+    return false;
+  }
+
+  *target = std::atoi(
+      args[i + 1].c_str()
+  );
+  ++i;
+  return true;
+}
+
+/**
+ * @brief Load a camera manifest. Each non-empty line that does not
+ * start with '#' reads "<id> <input_url> <output_path> [camera flags]";
+ * flags not given on the line keep the values from defaults. A bad
+ * line is skipped, so one camera cannot block the rest.
+ *
+ * @param path manifest file
+ * @param defaults per-camera settings taken from the command line
+ * @param cameras parsed cameras
+ * @param warnings one description per skipped line
+ * @param skipped_ids ids of skipped lines, e.g. to keep those cameras
+ *        running as they are
+ * @param error reason the file could not be read
+ * @return true if the file was read
+ */
+static inline bool load_manifest(
+    const std::string &path,
+    const CameraConfig &defaults,
+    std::vector<CameraConfig> &cameras,
+    std::vector<std::string> &warnings,
+    std::set<std::string> &skipped_ids,
+    std::string &error
+) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    error = "cannot open " + path;
+    return false;
+  }
+
+  cameras.clear();
+  warnings.clear();
+  skipped_ids.clear();
+  std::string line;
+  int line_no = 0;
+  while (std::getline(in, line)) {
+    ++line_no;
+    std::istringstream tokens(line);
+    std::vector<std::string> args;
+    std::string token;
+    while (tokens >> token) {
+      args.push_back(token);
+    }
+    if (args.empty() || args[0][0] == '#') {
+      continue;
+    }
+
+    std::string problem;
+    CameraConfig cfg = defaults;
+    if (args.size() < 3) {
+      problem = "expected <id> <input_url> <output_path>";
+    } else {
+      cfg.id = args[0];
+      cfg.input_url = args[1];
+      cfg.output_path = args[2];
+      for (size_t i = 3; i < args.size() && problem.empty(); ++i) {
+        if (!parse_camera_option(args, i, cfg)) {
+          problem = "unknown argument " + args[i];
+        }
+      }
+    }
+    for (const auto &existing : cameras) {
+      if (problem.empty() && existing.id == cfg.id) {
+        problem = "duplicate camera id " + cfg.id;
+      }
+    }
+
+    if (!problem.empty()) {
+      warnings.push_back("line " + std::to_string(line_no) + ": " + problem);
+      skipped_ids.insert(args[0]);
+      continue;
+    }
+    cameras.push_back(cfg);
+  }
+
+  return true;
+}
+
+/**
+ * @brief Compare the settings that require a camera restart
+ *
+ * @param a
+ * @param b
+ */
+static inline bool same_camera_config(
+    const CameraConfig &a,
+    const CameraConfig &b
+) {
+  return a.input_url == b.input_url &&
+         a.output_path == b.output_path &&
+         a.rtsp_tcp == b.rtsp_tcp &&
+         a.reconnect_sec == b.reconnect_sec &&
+         a.copy_max_keep_minutes == b.copy_max_keep_minutes &&
+         a.encode_max_keep_minutes == b.encode_max_keep_minutes &&
+         a.copy_hls_time_sec == b.copy_hls_time_sec &&
+         a.encode_hls_time_sec == b.encode_hls_time_sec &&
+         a.on_demand == b.on_demand &&
+         a.rendition_idle_sec == b.rendition_idle_sec &&
+         a.ladder_path == b.ladder_path &&
+         a.ladder_auto == b.ladder_auto &&
+         a.ll_hls_part_ms == b.ll_hls_part_ms &&
+         a.segment_format == b.segment_format &&
+         a.ring_store_mb == b.ring_store_mb &&
+         a.quota_mb == b.quota_mb &&
+         a.reduced_decode == b.reduced_decode &&
+         a.sub_inputs == b.sub_inputs;
+}
+
+}  // namespace utils
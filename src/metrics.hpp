@@ -0,0 +1,325 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+/** Identifies a metrics file written by the streamer */
+static constexpr uint64_t kMetricsMagic = 0x31534349525445ULL;
+static constexpr uint32_t kMetricsVersion = 3;
+static constexpr size_t kMetricsIdSize = 64;
+
+/** Histogram bucket upper bounds in microseconds; +Inf is the count */
+static constexpr uint64_t kMetricsBucketsUs[] = {
+    50,    100,   250,    500,    1000,   2500,   5000,    10000,
+    25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+};
+static constexpr size_t kMetricsBuckets =
+    sizeof(kMetricsBucketsUs) / sizeof(kMetricsBucketsUs[0]);
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "metrics need lock-free 64-bit atomics in shared memory");
+
+/**
+ * @brief Latency histogram of one pipeline stage. Bucket counts are
+ * per bucket, the exporter accumulates them.
+ */
+struct StageHistogram {
+  std::atomic<uint64_t> buckets[kMetricsBuckets];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum_ns;
+
+  /**
+   * @brief Record one duration
+   *
+   * @param ns
+   */
+  void observe(
+      int64_t ns
+  ) {
+    uint64_t us = ns > 0 ? static_cast<uint64_t>(ns) / 1000 : 0;
+    for (size_t i = 0; i < kMetricsBuckets; ++i) {
+      if (us <= kMetricsBucketsUs[i]) {
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+    }
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns > 0 ? static_cast<uint64_t>(ns) : 0,
+                     std::memory_order_relaxed);
+  }
+};
+
+/**
+ * @brief Live metrics of one camera. Writers use relaxed atomics; a
+ * reader may see fields from slightly different instants.
+ */
+struct CameraMetrics {
+  std::atomic<uint32_t> in_use;
+  uint32_t reserved;
+  char id[kMetricsIdSize];
+
+  /** Counters, monotonic for the lifetime of the camera */
+  std::atomic<uint64_t> packets_in;
+  std::atomic<uint64_t> bytes_in;
+  std::atomic<uint64_t> video_frames_in;
+  std::atomic<uint64_t> frames_decoded;
+  std::atomic<uint64_t> dropped_packets;
+  std::atomic<uint64_t> reconnects;
+  std::atomic<uint64_t> decode_errors;
+  std::atomic<uint64_t> corrupt_frames;
+  std::atomic<uint64_t> concealed_frames;
+  std::atomic<uint64_t> rendition_failures;
+
+  /** Gauges */
+  std::atomic<uint64_t> connected;
+  std::atomic<uint64_t> ingest_fps_milli;
+  std::atomic<uint64_t> ingest_bitrate_bps;
+  std::atomic<uint64_t> decode_queue_depth;
+  std::atomic<uint64_t> mux_queue_depth;
+  std::atomic<uint64_t> active_renditions;
+  std::atomic<uint64_t> last_keyframe_unix_ms;
+
+  /** Stage latencies */
+  StageHistogram decode;
+  StageHistogram scale;
+  StageHistogram encode;
+  StageHistogram mux;
+
+  /** Ingest of a video packet until all renditions encoded its frame */
+  StageHistogram frame_latency;
+};
+
+/**
+ * @brief File header, followed by slot_count CameraMetrics slots
+ */
+struct MetricsHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint32_t reserved;
+};
+
+namespace utils {
+
+/**
+ * @brief Monotonic clock for stage timings
+ *
+ * @return int64_t nanoseconds
+ */
+static inline int64_t metrics_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * @brief Wall clock for timestamps exported as gauges
+ *
+ * @return uint64_t milliseconds since the epoch
+ */
+static inline uint64_t metrics_unix_ms() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+
+/**
+ * @brief Zero a slot and label it with a camera id
+ *
+ * @param m
+ * @param id
+ */
+static inline void reset_camera_metrics(
+    CameraMetrics *m,
+    const std::string &id
+) {
+  uint32_t in_use = m->in_use.load();
+  std::memset(static_cast<void *>(m), 0, sizeof(*m));
+  std::strncpy(m->id, id.c_str(), kMetricsIdSize - 1);
+  m->in_use.store(in_use);
+}
+
+}  // namespace utils
+
+/**
+ * @brief Memory-mapped file holding one metrics slot per camera. The
+ * streamer creates it; the exporter maps it read-only.
+ */
+class MetricsRegion {
+ public:
+  MetricsRegion() = default;
+  MetricsRegion(const MetricsRegion &) = delete;
+  MetricsRegion &operator=(const MetricsRegion &) = delete;
+
+  ~MetricsRegion() {
+    close();
+  }
+
+  /**
+   * @brief Create or replace the metrics file
+   *
+   * @param path
+   * @param slots maximum number of cameras
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool create(
+      const std::string &path,
+      uint32_t slots,
+      std::string &error
+  ) {
+    size_t size = sizeof(MetricsHeader) + slots * sizeof(CameraMetrics);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      error = std::strerror(errno);
+      return false;
+    }
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      error = std::strerror(errno);
+      ::close(fd);
+      return false;
+    }
+
+    void *base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+      error = std::strerror(errno);
+      return false;
+    }
+
+    base_ = static_cast<uint8_t *>(base);
+    size_ = size;
+    for (uint32_t i = 0; i < slots; ++i) {
+      new (base_ + sizeof(MetricsHeader) + i * sizeof(CameraMetrics))
+          CameraMetrics();
+    }
+
+    MetricsHeader *header = reinterpret_cast<MetricsHeader *>(base_);
+    header->version = kMetricsVersion;
+    header->slot_count = slots;
+    header->slot_size = sizeof(CameraMetrics);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = kMetricsMagic;
+    return true;
+  }
+
+  /**
+   * @brief Map an existing metrics file read-only
+   *
+   * @param path
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool attach(
+      const std::string &path,
+      std::string &error
+  ) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      error = std::strerror(errno);
+      return false;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(MetricsHeader)) {
+      error = "metrics file too small";
+      ::close(fd);
+      return false;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void *base = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+      error = std::strerror(errno);
+      return false;
+    }
+
+    base_ = static_cast<uint8_t *>(base);
+    size_ = size;
+    const MetricsHeader *header = reinterpret_cast<const MetricsHeader *>(base_);
+    if (header->magic != kMetricsMagic || header->version != kMetricsVersion ||
+        header->slot_size != sizeof(CameraMetrics) ||
+        sizeof(MetricsHeader) + header->slot_count * sizeof(CameraMetrics) >
+            size_) {
+      error = "not a metrics file of this version";
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Claim a free slot for a camera
+   *
+   * @param id camera id
+   * @return slot, nullptr when all slots are taken
+   */
+  CameraMetrics *acquire(
+      const std::string &id
+  ) {
+    for (uint32_t i = 0; i < slot_count(); ++i) {
+      CameraMetrics *m = slot(i);
+      uint32_t expected = 0;
+      if (m->in_use.compare_exchange_strong(expected, 1)) {
+        utils::reset_camera_metrics(m, id);
+        return m;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Return a slot claimed by acquire()
+   *
+   * @param m
+   */
+  void release(
+      CameraMetrics *m
+  ) {
+    if (m) {
+      m->in_use.store(0);
+    }
+  }
+
+  uint32_t slot_count() const {
+    return base_ ? reinterpret_cast<const MetricsHeader *>(base_)->slot_count
+                 : 0;
+  }
+
+  CameraMetrics *slot(
+      uint32_t i
+  ) const {
+    return reinterpret_cast<CameraMetrics *>(
+        base_ + sizeof(MetricsHeader) + i * sizeof(CameraMetrics));
+  }
+
+  /**
+   * @brief Unmap the file
+   */
+  void close() {
+    if (base_) {
+      ::munmap(base_, size_);
+      base_ = nullptr;
+      size_ = 0;
+    }
+  }
+
+ private:
+  uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+};
@@ -0,0 +1,383 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+/**
+ * Prometheus exporter for the streamer metrics file. Every scrape maps
+ * the file afresh, so a restarted streamer is picked up without
+ * restarting the exporter.
+ */
+
+static std::atomic<bool> g_stop_requested(false);
+
+/**
+ * @brief Handle termination signals
+ *
+ * @param signum
+ */
+static void handle_signal(int signum) {
+  (void)signum;
+  g_stop_requested.store(true);
+}
+
+/**
+ * @brief Print usage
+ *
+ * @param argv0
+ */
+static void print_usage(const char *argv0) {
+  std::fprintf(
+      stderr,
+      "Usage: %s --metrics-file PATH [--listen ADDR:PORT]\n"
+      "Serves the streamer's per-camera metrics at /metrics in Prometheus "
+      "text format (default listen 0.0.0.0:9464).\n",
+      argv0);
+}
+
+/**
+ * @brief Escape a label value
+ *
+ * @param value
+ * @return std::string
+ */
+static std::string escape_label(const char *value) {
+  std::string out;
+  for (const char *p = value; *p; ++p) {
+    if (*p == '\\' || *p == '"') {
+      out += '\\';
+      out += *p;
+    } else if (*p == '\n') {
+      out += "\\n";
+    } else {
+      out += *p;
+    }
+  }
+  return out;
+}
+
+/**
+ * @brief Describe one metric family
+ *
+ * @param out
+ * @param name
+ * @param type counter, gauge or histogram
+ * @param help
+ */
+static void add_family(std::string &out, const char *name, const char *type,
+                       const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += " ";
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += " ";
+  out += type;
+  out += "\n";
+}
+
+/**
+ * @brief Append one sample
+ *
+ * @param out
+ * @param name
+ * @param labels already formatted labels without braces
+ * @param value
+ */
+static void add_sample(std::string &out, const std::string &name,
+                       const std::string &labels, double value) {
+  char buf[64];
+  std::snprintf(buf, sizeof(buf), "%.9g", value);
+  out += name;
+  out += "{";
+  out += labels;
+  out += "} ";
+  out += buf;
+  out += "\n";
+}
+
+/**
+ * @brief Scalar field of CameraMetrics exported as one family
+ */
+struct ScalarField {
+  const char *name;
+  const char *type;
+  const char *help;
+  std::atomic<uint64_t> CameraMetrics::*field;
+  double scale;
+};
+
+/**
+ * @brief Histogram field of CameraMetrics exported as one family
+ */
+struct HistogramField {
+  const char *name;
+  const char *help;
+  StageHistogram CameraMetrics::*field;
+};
+
+static const ScalarField kScalars[] = {
+    {"streamer_packets_total", "counter", "Packets read from the input",
+     &CameraMetrics::packets_in, 1.0},
+    {"streamer_ingest_bytes_total", "counter", "Bytes read from the input",
+     &CameraMetrics::bytes_in, 1.0},
+    {"streamer_video_frames_total", "counter", "Video packets read",
+     &CameraMetrics::video_frames_in, 1.0},
+    {"streamer_decoded_frames_total", "counter", "Frames decoded for renditions",
+     &CameraMetrics::frames_decoded, 1.0},
+    {"streamer_dropped_packets_total", "counter",
+     "Packets dropped because a stage queue was full",
+     &CameraMetrics::dropped_packets, 1.0},
+    {"streamer_reconnects_total", "counter", "Input reconnect attempts",
+     &CameraMetrics::reconnects, 1.0},
+    {"streamer_decode_errors_total", "counter",
+     "Decoder errors, each resynced at the next keyframe",
+     &CameraMetrics::decode_errors, 1.0},
+    {"streamer_corrupt_frames_total", "counter",
+     "Decoded frames skipped for missing references",
+     &CameraMetrics::corrupt_frames, 1.0},
+    {"streamer_concealed_frames_total", "counter",
+     "Decoded frames encoded with concealed errors",
+     &CameraMetrics::concealed_frames, 1.0},
+    {"streamer_rendition_failures_total", "counter",
+     "Renditions stopped by an encoder or output error",
+     &CameraMetrics::rendition_failures, 1.0},
+    {"streamer_connected", "gauge", "1 while the input is being read",
+     &CameraMetrics::connected, 1.0},
+    {"streamer_ingest_fps", "gauge", "Video packets per second",
+     &CameraMetrics::ingest_fps_milli, 0.001},
+    {"streamer_ingest_bitrate_bps", "gauge", "Input bitrate in bits per second",
+     &CameraMetrics::ingest_bitrate_bps, 1.0},
+    {"streamer_decode_queue_depth", "gauge", "Packets waiting for the decoder",
+     &CameraMetrics::decode_queue_depth, 1.0},
+    {"streamer_mux_queue_depth", "gauge", "Packets waiting for the muxers",
+     &CameraMetrics::mux_queue_depth, 1.0},
+    {"streamer_active_renditions", "gauge", "Renditions currently encoded",
+     &CameraMetrics::active_renditions, 1.0},
+    {"streamer_last_keyframe_timestamp_seconds", "gauge",
+     "Wall clock time of the last input keyframe",
+     &CameraMetrics::last_keyframe_unix_ms, 0.001},
+};
+
+static const HistogramField kHistograms[] = {
+    {"streamer_decode_seconds", "Time to decode one packet",
+     &CameraMetrics::decode},
+    {"streamer_scale_seconds", "Time to scale one rendition picture",
+     &CameraMetrics::scale},
+    {"streamer_encode_seconds", "Time to encode one rendition frame",
+     &CameraMetrics::encode},
+    {"streamer_mux_seconds", "Time to write one packet to an output",
+     &CameraMetrics::mux},
+    {"streamer_frame_latency_seconds",
+     "Time from reading a video packet until every rendition encoded it",
+     &CameraMetrics::frame_latency},
+};
+
+/**
+ * @brief Render every camera slot in use
+ *
+ * @param path metrics file
+ * @param body rendered exposition
+ * @return true if the file could be read
+ */
+static bool render_metrics(const std::string &path, std::string &body) {
+  MetricsRegion region;
+  std::string error;
+  if (!region.attach(path, error)) {
+    std::fprintf(stderr, "Cannot read %s: %s\n", path.c_str(), error.c_str());
+    return false;
+  }
+
+  std::vector<const CameraMetrics *> cameras;
+  std::vector<std::string> labels;
+  for (uint32_t i = 0; i < region.slot_count(); ++i) {
+    const CameraMetrics *m = region.slot(i);
+    if (m->in_use.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+    char id[kMetricsIdSize];
+    std::memcpy(id, m->id, sizeof(id));
+    id[kMetricsIdSize - 1] = '\0';
+    cameras.push_back(m);
+    labels.push_back("camera=\"" + escape_label(id) + "\"");
+  }
+
+  body.clear();
+  add_family(body, "streamer_cameras", "gauge", "Cameras hosted by the streamer");
+  body += "streamer_cameras " + std::to_string(cameras.size()) + "\n";
+
+  for (const auto &scalar : kScalars) {
+    add_family(body, scalar.name, scalar.type, scalar.help);
+    for (size_t c = 0; c < cameras.size(); ++c) {
+      uint64_t value =
+          (cameras[c]->*scalar.field).load(std::memory_order_relaxed);
+      add_sample(body, scalar.name, labels[c],
+                 static_cast<double>(value) * scalar.scale);
+    }
+  }
+
+  for (const auto &hist : kHistograms) {
+    add_family(body, hist.name, "histogram", hist.help);
+    std::string bucket_name = std::string(hist.name) + "_bucket";
+    for (size_t c = 0; c < cameras.size(); ++c) {
+      const StageHistogram &h = cameras[c]->*hist.field;
+      uint64_t count = h.count.load(std::memory_order_relaxed);
+      uint64_t cumulative = 0;
+      for (size_t b = 0; b < kMetricsBuckets; ++b) {
+        cumulative += h.buckets[b].load(std::memory_order_relaxed);
+        char le[32];
+        std::snprintf(le, sizeof(le), "%g", kMetricsBucketsUs[b] / 1e6);
+        add_sample(body, bucket_name, labels[c] + ",le=\"" + le + "\"",
+                   static_cast<double>(cumulative));
+      }
+      add_sample(body, bucket_name, labels[c] + ",le=\"+Inf\"",
+                 static_cast<double>(count < cumulative ? cumulative : count));
+      add_sample(body, std::string(hist.name) + "_sum", labels[c],
+                 static_cast<double>(h.sum_ns.load(std::memory_order_relaxed)) /
+                     1e9);
+      add_sample(body, std::string(hist.name) + "_count", labels[c],
+                 static_cast<double>(count));
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Send the whole buffer
+ *
+ * @param fd
+ * @param data
+ */
+static void send_all(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return;
+    }
+    sent += static_cast<size_t>(n);
+  }
+}
+
+/**
+ * @brief Answer one HTTP request
+ *
+ * @param fd connected client
+ * @param metrics_path
+ */
+static void serve_client(int fd, const std::string &metrics_path) {
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (::poll(&pfd, 1, 2000) <= 0) {
+      return;
+    }
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      return;
+    }
+    request.append(buf, static_cast<size_t>(n));
+  }
+
+  std::string status = "200 OK";
+  std::string content_type = "text/plain; version=0.0.4";
+  std::string body;
+  if (request.compare(0, 13, "GET /metrics ") != 0 &&
+      request.compare(0, 13, "GET /metrics?") != 0) {
+    status = "404 Not Found";
+    content_type = "text/plain";
+    body = "not found\n";
+  } else if (!render_metrics(metrics_path, body)) {
+    status = "503 Service Unavailable";
+    content_type = "text/plain";
+    body = "metrics file unavailable\n";
+  }
+
+  std::string response = "HTTP/1.1 " + status +
+                         "\r\nContent-Type: " + content_type +
+                         "\r\nContent-Length: " + std::to_string(body.size()) +
+                         "\r\nConnection: close\r\n\r\n" + body;
+  send_all(fd, response);
+}
+
+int main(int argc, char **argv) {
+  std::string metrics_path;
+  std::string listen_addr = "0.0.0.0:9464";
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--metrics-file" && i + 1 < argc) {
+      metrics_path = argv[++i];
+    } else if (arg == "--listen" && i + 1 < argc) {
+      listen_addr = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (metrics_path.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  size_t colon = listen_addr.rfind(':');
+  if (colon == std::string::npos) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(
+      std::atoi(listen_addr.substr(colon + 1).c_str())));
+  if (::inet_pton(AF_INET, listen_addr.substr(0, colon).c_str(),
+                  &addr.sin_addr) != 1) {
+    std::fprintf(stderr, "Invalid listen address: %s\n", listen_addr.c_str());
+    return 1;
+  }
+
+  int server = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int one = 1;
+  if (server < 0 ||
+      ::setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      ::bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      ::listen(server, 16) != 0) {
+    std::fprintf(stderr, "Cannot listen on %s: %s\n", listen_addr.c_str(),
+                 std::strerror(errno));
+    return 1;
+  }
+
+  std::signal(SIGINT, handle_signal);
+  std::signal(SIGTERM, handle_signal);
+  std::fprintf(stderr, "Serving %s on http://%s/metrics\n",
+               metrics_path.c_str(), listen_addr.c_str());
+
+  /** Scrapes are rare and cheap: serve them one at a time */
+  while (!g_stop_requested.load()) {
+    pollfd pfd = {server, POLLIN, 0};
+    if (::poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+    int client = ::accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      continue;
+    }
+    serve_client(client, metrics_path);
+    ::close(client);
+  }
+
+  ::close(server);
+  return 0;
+}
@@ -0,0 +1,2352 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.hpp"
+#include "utils.hpp"
+#include "async_writer.hpp"
+#include "audio_transcoder.hpp"
+#include "avoptions.hpp"
+#include "bounded_queue.hpp"
+#include "ladder.hpp"
+#include "catalog.hpp"
+#include "live_cache.hpp"
+#include "llhls.hpp"
+#include "metrics.hpp"
+#include "probe_cache.hpp"
+#include "ring_store.hpp"
+#include "scale_graph.hpp"
+#include "worker_pool.hpp"
+
+/**
+ * Per-camera media pipeline shared by the streamer and its benchmark
+ * tools: output setup, the decode/scale/encode and mux stages and the
+ * ingest-side distribution of packets between them. Session handling
+ * (inputs, reconnects, demand, manifests) stays in streamer.cpp.
+ */
+
+/** Threads per libav codec context, 0 lets libav decide */
+static int g_codec_threads = 0;
+
+/** Shared writer for segment files, null to write them synchronously */
+static AsyncWriter *g_async_writer = nullptr;
+
+/** Queue depths between pipeline stages */
+static constexpr size_t kDecodeQueueDepth = 256;
+static constexpr size_t kAudioQueueDepth = 256;
+static constexpr size_t kMuxQueueDepth = 1024;
+
+/** Items a stage handles before yielding its worker */
+static constexpr int kStageBatch = 32;
+
+/** Ingest times remembered for frame latency, per camera */
+static constexpr size_t kLatencySlots = 64;
+
+/** A rendition stopped by an encoder or output error restarts after this */
+static constexpr int64_t kRenditionRetryMs = 10000;
+
+/** Mux queue targets that are not a rendition index */
+static constexpr int kMuxCopy = -1;
+static constexpr int kMuxAudio = -2;
+
+/**
+ * @brief Rendition output lifecycle. The decode stage opens an idle
+ * output and hands its format context to the mux stage (open), later
+ * flushes the encoder and marks it closing; the mux stage closes the
+ * format context once the output's queued packets are written and
+ * returns it to idle.
+ */
+static constexpr int kOutputIdle = 0;
+static constexpr int kOutputOpen = 1;
+static constexpr int kOutputClosing = 2;
+
+/**
+ * @brief Ingest time of a video packet queued for decoding, matched
+ * by PTS when its frame has been encoded
+ */
+struct IngestStamp {
+  std::atomic<int64_t> pts{AV_NOPTS_VALUE};
+  std::atomic<int64_t> ns{0};
+};
+
+/**
+ * @brief Packet bound for the mux stage. The target is a rendition
+ * index, kMuxCopy or kMuxAudio (fanned out to every rendition and the
+ * copy output).
+ */
+struct MuxItem {
+  int target = kMuxCopy;
+  AVPacket *pkt = nullptr;
+};
+
+/**
+ * @brief Struct to abstract libav
+ * contexts for codec, format and packet.
+ * Scaling is shared across renditions in StreamState::scaler
+ */
+struct EncodeOutput {
+  int index = 0;
+  Rendition rendition;
+  std::string path;
+  std::atomic<int> status{kOutputIdle};
+
+  /** Set by ingest from viewer demand, acted on by the decode stage */
+  std::atomic<bool> wanted{true};
+
+  AVFormatContext *fmt = nullptr;
+  bool header_written = false;
+  AVStream *vstream = nullptr;
+  AVStream *astream = nullptr;
+  AVCodecContext *venc = nullptr;
+  AVPacket *enc_pkt = nullptr;
+
+  /** Reference to the scaled picture with this output's timestamps;
+   * the picture itself may be shared with passthrough renditions */
+  AVFrame *enc_frame = nullptr;
+
+  /** Last encoded PTS; frames mapping onto it are skipped, which
+   * decimates renditions with a lower frame rate than the source */
+  int64_t last_pts = AV_NOPTS_VALUE;
+
+  /** Mux backlog dropped packets; restart the GOP on the next frame */
+  bool force_keyframe = false;
+  bool mux_wait_keyframe = false;
+
+  /** Packets of this output in the mux queue; a closing output is
+   * closed by the mux stage once they are written */
+  std::atomic<int> queued{0};
+
+  /** Set by the encode task or the mux stage on an error; the decode
+   * stage then stops the rendition until retry_ns */
+  std::atomic<bool> failed{false};
+  int64_t retry_ns = 0;
+};
+
+/**
+ * @brief Where an input stream's packets have got to on the output
+ * timeline, in AV_TIME_BASE units
+ */
+struct StreamClock {
+  int64_t dts = AV_NOPTS_VALUE;
+  int64_t end = AV_NOPTS_VALUE;
+  /** Input reconnected; packets not past dts are dropped */
+  bool resuming = false;
+};
+
+/**
+ * @brief Aggregated runtime state for a streaming session
+ *
+ * The ingest thread owns in_ctx and the copy timestamp tracking, the
+ * decode stage owns vdec, decoded and the scaler, the audio stage the
+ * shared audio encoder, the rendition tasks forked for each frame own
+ * their EncodeOutput encoder, and the mux stage owns every open output
+ * format context.
+ */
+struct StreamState {
+  AVFormatContext *in_ctx = nullptr;
+  AVFormatContext *copy_ctx = nullptr;
+  AVCodecContext *vdec = nullptr;
+  AVStream *video_stream = nullptr;
+  int video_index = -1;
+  int audio_index = -1;
+  int64_t fallback_pts = 0;
+  int64_t packet_count = 0;
+  std::vector<int64_t> copy_next_pts;
+  std::vector<EncodeOutput> outputs;
+
+  /** Parameters of the input the outputs were opened for */
+  std::vector<ProbedStream> input_streams;
+
+  /** Read timestamps are shifted by ts_offset (AV_TIME_BASE units) so
+   * the outputs see one timeline across input reconnects */
+  int64_t ts_offset = 0;
+  bool rebase_pending = false;
+  std::vector<StreamClock> clocks;
+  ScaleGraph scaler;
+  std::vector<size_t> scaled_outputs;
+  AVFrame *decoded = nullptr;
+  AVPacket *audio_pkt = nullptr;
+
+  /** Shared AAC encoder when the source audio is not HLS-playable */
+  std::unique_ptr<AudioTranscoder> audio_encoder;
+
+  /** Settings for renditions opened on demand */
+  AVRational fps = {30, 1};
+  int encode_max_keep_minutes = 0;
+  int encode_hls_time_sec = 0;
+
+  /** LL-HLS part duration for every output, 0 for the stock hls muxer */
+  int ll_part_ms = 0;
+
+  /** fMP4 instead of MPEG-TS segments for the hls muxer */
+  bool fmp4_segments = false;
+
+  /** Copy output ring size in MB, 0 writes one file per segment */
+  int ring_store_mb = 0;
+
+  /** The copy output is a rendition, like that of a sub-stream input,
+   * kept in the live cache only when there is one */
+  bool live_only = false;
+
+  /** Outputs not idle; audio and decoding are skipped while zero */
+  std::atomic<int> active_outputs{0};
+  bool decoding = false;
+  int64_t next_demand_poll_ms = 0;
+
+  /** Stage queues; ingest never blocks on them */
+  WorkerPool *pool = nullptr;
+  BoundedQueue<AVPacket *> decode_queue{kDecodeQueueDepth};
+  BoundedQueue<AVPacket *> audio_queue{kAudioQueueDepth};
+  BoundedQueue<MuxItem> mux_queue{kMuxQueueDepth};
+  std::unique_ptr<Stage> decode_stage;
+  std::unique_ptr<Stage> audio_stage;
+  std::unique_ptr<Stage> mux_stage;
+
+  /** Ingest drop policy: after an overflow skip video to the next keyframe */
+  bool decode_wait_keyframe = false;
+  bool copy_wait_keyframe = false;
+
+  /** Decode stage: after a decoder error skip video to the next keyframe */
+  bool decode_resync = false;
+
+  /** First stage error, stops ingest */
+  std::atomic<int> pipeline_error{0};
+  std::atomic<int64_t> dropped_packets{0};
+
+  /** Log tag of the camera, set around every stage body and task */
+  std::string log_tag;
+
+  /** Live metrics of the camera, never null */
+  CameraMetrics *metrics = nullptr;
+  IngestStamp ingest_stamps[kLatencySlots];
+  size_t next_stamp = 0;
+  int64_t next_metrics_ms = 0;
+  uint64_t metrics_frames = 0;
+  uint64_t metrics_bytes = 0;
+  int64_t metrics_dropped = 0;
+};
+
+/**
+ * @brief Per-output state reachable from AVFormatContext::opaque. The
+ * hls muxer passes opaque and the IO callbacks on to the muxer of each
+ * segment, so both see the same hooks.
+ */
+struct OutputHooks {
+  /** Set for LL-HLS outputs, which catalog their own segments */
+  std::unique_ptr<LlhlsSegmenter> llhls;
+  std::unique_ptr<CatalogRecorder> catalog;
+
+  /** Set for outputs recording into a ring, which catalogs its segments */
+  std::unique_ptr<RingStore> ring;
+
+  /** Segment files open through g_async_writer */
+  std::set<AVIOContext *> async_files;
+
+  /** Playlist key in g_live_cache, empty if the output is not cached */
+  std::string live_output;
+  /** Cached outputs kept in memory only, without files */
+  bool live_only = false;
+  /** Tees in front of files being written for the cache */
+  std::set<AVIOContext *> live_files;
+
+  /** The next segment opened follows an input reconnect */
+  bool discontinuity_pending = false;
+  /** Segments to list after EXT-X-DISCONTINUITY, and whether a
+   * playlist has listed them yet */
+  std::map<std::string, bool> discontinuities;
+  /** Discontinuities that left the playlist window */
+  int64_t discontinuity_sequence = 0;
+  /** Playlists collected in memory to add the tags, with their url */
+  std::map<AVIOContext *, std::string> playlists;
+
+  int (*io_open)(AVFormatContext *, AVIOContext **, const char *, int,
+                 AVDictionary **) = nullptr;
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+  int (*io_close2)(AVFormatContext *, AVIOContext *) = nullptr;
+#else
+  void (*io_close)(AVFormatContext *, AVIOContext *) = nullptr;
+#endif
+};
+
+/**
+ * @brief Hooks of an output
+ *
+ * @param ctx
+ * @return OutputHooks* null if none were attached
+ */
+static inline OutputHooks *hooks_of(AVFormatContext *ctx) {
+  return static_cast<OutputHooks *>(ctx->opaque);
+}
+
+/**
+ * @brief LL-HLS segmenter of an output
+ *
+ * @param ctx
+ * @return LlhlsSegmenter* null for the stock hls muxer
+ */
+static inline LlhlsSegmenter *llhls_of(AVFormatContext *ctx) {
+  OutputHooks *hooks = hooks_of(ctx);
+  return hooks ? hooks->llhls.get() : nullptr;
+}
+
+/**
+ * @brief Free the hooks of an output once its muxer is done with IO
+ *
+ * @param ctx
+ */
+static inline void free_output_hooks(AVFormatContext *ctx) {
+  OutputHooks *hooks = hooks_of(ctx);
+  if (hooks && !hooks->live_output.empty() && g_live_cache) {
+    g_live_cache->drop_output(hooks->live_output);
+  }
+  delete hooks;
+  ctx->opaque = nullptr;
+}
+
+/**
+ * @brief Open a file of an hls muxer output: hand segments and
+ * playlists to the ring, or note segment files for the catalog
+ */
+static int open_output_file(AVFormatContext *s, AVIOContext **pb, const char *url,
+                            int flags, AVDictionary **options) {
+  OutputHooks *hooks = hooks_of(s);
+  if (hooks->ring && (flags & AVIO_FLAG_WRITE) && hooks->ring->intercepts(url)) {
+    return hooks->ring->opened(pb, url);
+  }
+  if (g_async_writer && (flags & AVIO_FLAG_WRITE) && utils::is_segment_file(url)) {
+    int ret = utils::open_async_avio(g_async_writer, url, pb);
+    if (ret >= 0) {
+      hooks->async_files.insert(*pb);
+      if (hooks->catalog) {
+        hooks->catalog->opened(pb, url);
+      }
+    }
+    return ret;
+  }
+  int ret = hooks->io_open(s, pb, url, flags, options);
+  if (ret >= 0 && (flags & AVIO_FLAG_WRITE) && hooks->catalog) {
+    hooks->catalog->opened(pb, url);
+  }
+  return ret;
+}
+
+/**
+ * @brief Open a file of an hls muxer output behind a live cache tee
+ * if it is cached, which for memory-only outputs is all there is
+ */
+static int open_cached_file(AVFormatContext *s, AVIOContext **pb, const char *url,
+                            int flags, AVDictionary **options) {
+  OutputHooks *hooks = hooks_of(s);
+  std::string key;
+  if ((flags & AVIO_FLAG_WRITE) && !hooks->live_output.empty()) {
+    key = g_live_cache->key_of(url);
+  }
+  if (key.empty() && hooks->live_only) {
+    return AVERROR(EPERM);
+  }
+
+  AVIOContext *inner = nullptr;
+  if (!hooks->live_only) {
+    int ret = open_output_file(s, &inner, url, flags, options);
+    if (ret < 0 || key.empty()) {
+      *pb = inner;
+      return ret;
+    }
+  }
+  int ret = utils::open_live_tee(inner, key, pb);
+  if (ret < 0) {
+    if (hooks->live_only) {
+      return ret;
+    }
+    *pb = inner;
+    return 0;
+  }
+  hooks->live_files.insert(*pb);
+  return 0;
+}
+
+/**
+ * @brief Close a file of an hls muxer output: store or catalog each
+ * finished segment
+ */
+static int close_output_file(AVFormatContext *s, AVIOContext *pb) {
+  OutputHooks *hooks = hooks_of(s);
+  if (hooks->ring && hooks->ring->owns(pb)) {
+    hooks->ring->closed(pb);
+    return 0;
+  }
+  CatalogTee *segment = hooks->catalog ? hooks->catalog->closing(&pb) : nullptr;
+  int ret = 0;
+  if (hooks->async_files.erase(pb)) {
+    ret = utils::close_async_avio(&pb);
+  } else {
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+    ret = hooks->io_close2(s, pb);
+#else
+    hooks->io_close(s, pb);
+#endif
+  }
+  if (segment) {
+    hooks->catalog->closed(segment, ret >= 0);
+  }
+  return ret;
+}
+
+/**
+ * @brief Close a file opened by open_cached_file: publish it to the
+ * cache, then close the file behind it
+ */
+static int close_cached_file(AVFormatContext *s, AVIOContext *pb) {
+  OutputHooks *hooks = hooks_of(s);
+  if (hooks->live_files.erase(pb)) {
+    std::string key;
+    LiveBuffer data;
+    AVIOContext *inner = utils::close_live_tee(&pb, key, data);
+    g_live_cache->put(hooks->live_output, key, std::move(data));
+    if (!inner) {
+      return 0;
+    }
+    pb = inner;
+  }
+  return close_output_file(s, pb);
+}
+
+/**
+ * @brief Add EXT-X-DISCONTINUITY before the segments that follow an
+ * input reconnect, and EXT-X-DISCONTINUITY-SEQUENCE once one of them
+ * has left the window
+ *
+ * @param hooks
+ * @param text playlist as the muxer wrote it
+ * @return std::string
+ */
+static inline std::string tag_discontinuities(OutputHooks *hooks, const std::string &text) {
+  std::set<std::string> listed;
+  std::string body;
+  size_t extinf = std::string::npos;
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (utils::starts_with(line, "#EXTINF:")) {
+      extinf = body.size();
+    } else if (!line.empty() && line[0] != '#') {
+      std::string name = utils::file_name(line);
+      if (hooks->discontinuities.count(name) && extinf != std::string::npos) {
+        body.insert(extinf, "#EXT-X-DISCONTINUITY\n");
+        listed.insert(name);
+      }
+      extinf = std::string::npos;
+    }
+    body += line + "\n";
+  }
+
+  /** Forget tagged segments the muxer no longer lists */
+  for (auto it = hooks->discontinuities.begin(); it != hooks->discontinuities.end();) {
+    if (listed.count(it->first)) {
+      it->second = true;
+      ++it;
+    } else if (it->second) {
+      ++hooks->discontinuity_sequence;
+      it = hooks->discontinuities.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (hooks->discontinuity_sequence == 0) {
+    return body;
+  }
+
+  std::string tag = "#EXT-X-DISCONTINUITY-SEQUENCE:" +
+                    std::to_string(hooks->discontinuity_sequence) + "\n";
+  size_t pos = body.find("#EXT-X-MEDIA-SEQUENCE:");
+  pos = pos == std::string::npos ? body.find('\n') : body.find('\n', pos);
+  body.insert(pos == std::string::npos ? body.size() : pos + 1, tag);
+  return body;
+}
+
+/**
+ * @brief Write a playlist collected in memory, with its discontinuity
+ * tags, to the file it was meant for
+ *
+ * @param s
+ * @param buf dynamic buffer the muxer wrote the playlist into; freed
+ * @param url
+ * @return int
+ */
+static int write_collected_playlist(AVFormatContext *s, AVIOContext *buf,
+                                    const std::string &url) {
+  OutputHooks *hooks = hooks_of(s);
+  uint8_t *data = nullptr;
+  int size = avio_close_dyn_buf(buf, &data);
+  std::string text = tag_discontinuities(
+      hooks, std::string(reinterpret_cast<const char *>(data), size > 0 ? size : 0));
+  av_free(data);
+
+  AVIOContext *pb = nullptr;
+  int ret = open_cached_file(s, &pb, url.c_str(), AVIO_FLAG_WRITE, nullptr);
+  if (ret < 0) {
+    return ret;
+  }
+  avio_write(pb, reinterpret_cast<const uint8_t *>(text.data()),
+             static_cast<int>(text.size()));
+  return close_cached_file(s, pb);
+}
+
+/**
+ * @brief io_open of hls muxer outputs: note the first segment after an
+ * input reconnect, and collect playlists that have to be tagged
+ */
+static int output_io_open(AVFormatContext *s, AVIOContext **pb, const char *url,
+                          int flags, AVDictionary **options) {
+  OutputHooks *hooks = hooks_of(s);
+  if ((flags & AVIO_FLAG_WRITE) && hooks->discontinuity_pending &&
+      utils::is_segment_file(url)) {
+    hooks->discontinuities[utils::file_name(url)] = false;
+    hooks->discontinuity_pending = false;
+  }
+  if ((flags & AVIO_FLAG_WRITE) && std::strstr(url, ".m3u8") &&
+      (!hooks->discontinuities.empty() || hooks->discontinuity_sequence > 0)) {
+    int ret = avio_open_dyn_buf(pb);
+    if (ret < 0) {
+      return ret;
+    }
+    hooks->playlists[*pb] = url;
+    return 0;
+  }
+  return open_cached_file(s, pb, url, flags, options);
+}
+
+/**
+ * @brief io_close of hls muxer outputs
+ */
+static int close_output_io(AVFormatContext *s, AVIOContext *pb) {
+  OutputHooks *hooks = hooks_of(s);
+  auto playlist = hooks->playlists.find(pb);
+  if (playlist != hooks->playlists.end()) {
+    std::string url = std::move(playlist->second);
+    hooks->playlists.erase(playlist);
+    return write_collected_playlist(s, pb, url);
+  }
+  return close_cached_file(s, pb);
+}
+
+/**
+ * @brief Mark an input reconnect in an output's playlist: the stock
+ * hls muxer tags the next segment it starts, LL-HLS cuts a segment at
+ * the next keyframe and tags the one after it
+ *
+ * @param ctx
+ */
+static inline void mark_discontinuity(AVFormatContext *ctx) {
+  OutputHooks *hooks = ctx ? hooks_of(ctx) : nullptr;
+  if (!hooks) {
+    return;
+  }
+  if (hooks->llhls) {
+    hooks->llhls->discontinuity();
+  } else {
+    hooks->discontinuity_pending = true;
+  }
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+static int output_io_close(AVFormatContext *s, AVIOContext *pb) {
+  return close_output_io(s, pb);
+}
+#else
+static void output_io_close(AVFormatContext *s, AVIOContext *pb) {
+  close_output_io(s, pb);
+}
+#endif
+
+/**
+ * @brief Check if an output is kept in the live cache only
+ *
+ * @param output_path playlist path
+ * @param live_only whether the output is for live viewing only
+ * @return true if no files are written for it
+ */
+static inline bool memory_only_output(const std::string &output_path, bool live_only) {
+  return live_only && g_live_cache && !g_live_cache->key_of(output_path).empty();
+}
+
+/**
+ * @brief Route an hls muxer output's segment IO through the live
+ * cache and a ring store or, without one, the catalog
+ *
+ * @param ctx output with its streams set up, before its header
+ * @param output_path playlist path
+ * @param fmp4
+ * @param ring_store_mb ring size, 0 for one file per segment
+ * @param live_only keep the output in the live cache only, if enabled
+ */
+static inline void attach_output_hooks(AVFormatContext *ctx, const std::string &output_path,
+                                       bool fmp4, int ring_store_mb, bool live_only) {
+  OutputHooks *hooks = new OutputHooks();
+  if (g_live_cache) {
+    hooks->live_output = g_live_cache->key_of(output_path);
+    hooks->live_only = memory_only_output(output_path, live_only);
+  }
+  if (hooks->live_only) {
+    /** Nothing on disk to ring, catalog or write asynchronously */
+  } else if (ring_store_mb > 0) {
+    std::string error;
+    hooks->ring.reset(new RingStore());
+    if (!hooks->ring->open(ctx, output_path, static_cast<int64_t>(ring_store_mb) << 20,
+                           fmp4, g_async_writer, error)) {
+      log_message("WARN", "Ring store disabled, writing segment files: %s",
+                  error.c_str());
+      hooks->ring.reset();
+    }
+  }
+  if (!hooks->ring && !hooks->live_only) {
+    hooks->catalog.reset(new CatalogRecorder());
+    if (!hooks->catalog->open(ctx, output_path, fmp4)) {
+      hooks->catalog.reset();
+    }
+  }
+
+  hooks->io_open = ctx->io_open;
+  ctx->io_open = output_io_open;
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+  hooks->io_close2 = ctx->io_close2;
+  ctx->io_close2 = output_io_close;
+#else
+  hooks->io_close = ctx->io_close;
+  ctx->io_close = output_io_close;
+#endif
+  ctx->opaque = hooks;
+}
+
+/**
+ * @brief Write a packet to an HLS or LL-HLS output. Like
+ * av_interleaved_write_frame the packet is consumed.
+ *
+ * @param ctx
+ * @param pkt timestamps in the output stream timebase
+ * @return int
+ */
+static inline int write_output_packet(AVFormatContext *ctx, AVPacket *pkt) {
+  LlhlsSegmenter *seg = llhls_of(ctx);
+  if (!seg) {
+    OutputHooks *hooks = hooks_of(ctx);
+    if (hooks && hooks->catalog) {
+      hooks->catalog->packet(ctx, pkt);
+    } else if (hooks && hooks->ring) {
+      hooks->ring->packet(ctx, pkt);
+    }
+    return av_interleaved_write_frame(ctx, pkt);
+  }
+  int ret = seg->write(pkt);
+  av_packet_unref(pkt);
+  return ret;
+}
+
+/**
+ * @brief Tell what times an output's segments that the trailer is
+ * about to close the last one
+ *
+ * @param ctx
+ */
+static inline void note_output_finishing(AVFormatContext *ctx) {
+  OutputHooks *hooks = hooks_of(ctx);
+  if (hooks && hooks->catalog) {
+    hooks->catalog->finishing();
+  } else if (hooks && hooks->ring) {
+    hooks->ring->finishing();
+  }
+}
+
+/**
+ * @brief Close copy outputs by writing trailer, closing IO and freeing context
+ * 
+ * @param out_ctx 
+ */
+static inline void close_copy_output(AVFormatContext *out_ctx) {
+  /** Close copy output */
+  if (!out_ctx) {
+    return;
+  }
+
+  if (llhls_of(out_ctx)) {
+    llhls_of(out_ctx)->close();
+  } else {
+    note_output_finishing(out_ctx);
+    av_write_trailer(out_ctx);
+    if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&out_ctx->pb);
+    }
+  }
+  free_output_hooks(out_ctx);
+  avformat_free_context(out_ctx);
+}
+
+/**
+ * @brief Close a rendition's format context by writing trailer and closing IO
+ * 
+ * @param out 
+ */
+static inline void close_reencode_format(EncodeOutput &out) {
+  if (out.fmt && llhls_of(out.fmt)) {
+    llhls_of(out.fmt)->close();
+  } else if (out.fmt) {
+    if (out.header_written) {
+      note_output_finishing(out.fmt);
+      av_write_trailer(out.fmt);
+    }
+    if (!(out.fmt->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&out.fmt->pb);
+    }
+  }
+  if (out.fmt) {
+    free_output_hooks(out.fmt);
+    avformat_free_context(out.fmt);
+    out.fmt = nullptr;
+  }
+  out.header_written = false;
+  out.vstream = nullptr;
+  out.astream = nullptr;
+}
+
+/**
+ * @brief Free a rendition's encoder and packet
+ * 
+ * @param out 
+ */
+static inline void close_reencode_encoder(EncodeOutput &out) {
+  if (out.venc) {
+    avcodec_free_context(&out.venc);
+  }
+
+  if (out.enc_pkt) {
+    av_packet_free(&out.enc_pkt);
+  }
+
+  if (out.enc_frame) {
+    av_frame_free(&out.enc_frame);
+  }
+}
+
+/**
+ * @brief Close reencode outputs by writing trailer, closing IO and freeing contexts
+ * 
+ * @param outputs 
+ */
+static inline void close_reencode_outputs(std::vector<EncodeOutput> &outputs) {
+  /** Close reencoded outputs */
+  for (auto &out : outputs) {
+    close_reencode_format(out);
+    close_reencode_encoder(out);
+    out.status.store(kOutputIdle);
+  }
+}
+
+/**
+ * @brief Write the header of an hls muxer output
+ *
+ * @param ctx
+ * @param output_path playlist path
+ * @param max_keep_minutes
+ * @param hls_time_sec
+ * @param fmp4 fMP4 segments with a shared init segment instead of MPEG-TS
+ * @param ring_store_mb record into a ring of this size, 0 for segment files
+ * @param live_only keep the output in the live cache only, if enabled
+ * @return int
+ */
+static inline int write_hls_header(AVFormatContext *ctx, const std::string &output_path,
+                                   int max_keep_minutes, int hls_time_sec, bool fmp4,
+                                   int ring_store_mb, bool live_only) {
+  AVDictionary *hls_opts = nullptr;
+  std::string base = utils::base_without_ext(
+      output_path
+  );
+  std::string seg_pattern = base + (fmp4 ? "_seg_%d.m4s" : "_seg_%d.ts");
+  std::string init_filename = fmp4 ? utils::file_name(base) + "_init.mp4" : "";
+  utils::set_hls_output_options(
+      &hls_opts,
+      max_keep_minutes,
+      hls_time_sec,
+      seg_pattern,
+      init_filename
+  );
+  if (ring_store_mb > 0 || memory_only_output(output_path, live_only)) {
+    /** The ring reuses its files and the cache evicts on its own; there
+     *  are no segment files to delete */
+    av_dict_set(&hls_opts, "hls_flags", nullptr, 0);
+  }
+  if (memory_only_output(output_path, live_only)) {
+    /** List no more segments than the cache still holds */
+    av_dict_set_int(&hls_opts, "hls_list_size",
+                    static_cast<int64_t>(g_live_cache->max_segments()), 0);
+  } else if (g_reclaimer) {
+    /** Unset, the muxer lists its default number of segments */
+    int list_size = utils::hls_list_size(max_keep_minutes, hls_time_sec);
+    g_reclaimer->set_list_size(SegmentCatalog::path_of(output_path),
+                               list_size > 0 ? static_cast<size_t>(list_size)
+                                             : kReclaimDefaultListSize);
+  }
+  attach_output_hooks(ctx, output_path, fmp4, ring_store_mb, live_only);
+  int ret = avformat_write_header(ctx, &hls_opts);
+  av_dict_free(&hls_opts);
+  if (ret < 0) {
+    log_message("ERROR", "Failed to write header: %s",
+                av_err2str_cpp(ret).c_str());
+  }
+  return ret;
+}
+
+/**
+ * @brief Hand an mp4 output with its streams set up to a new LL-HLS
+ * segmenter
+ *
+ * @param ctx
+ * @param output_path playlist path
+ * @param max_keep_minutes
+ * @param hls_time_sec segment target, 0 for the default
+ * @param part_ms
+ * @return int
+ */
+static inline int open_llhls(AVFormatContext *ctx, const std::string &output_path,
+                             int max_keep_minutes, int hls_time_sec, int part_ms) {
+  int segment_sec = hls_time_sec > 0 ? hls_time_sec : kLlhlsSegmentSec;
+  int list_size = utils::hls_list_size(max_keep_minutes, segment_sec);
+  if (g_reclaimer) {
+    g_reclaimer->set_list_size(SegmentCatalog::path_of(output_path),
+                               static_cast<size_t>(list_size));
+  }
+  OutputHooks *hooks = new OutputHooks();
+  hooks->llhls.reset(new LlhlsSegmenter());
+  ctx->opaque = hooks;
+  return hooks->llhls->open(ctx, output_path, part_ms, segment_sec, list_size);
+}
+
+/**
+ * @brief Open codec copy output context for HLS with appropriate options
+ * 
+ * @param output_path 
+ * @param in_ctx 
+ * @param out_ctx 
+ * @param max_keep_minutes 
+ * @param hls_time_sec 
+ * @param ll_part_ms LL-HLS part duration, 0 for the stock hls muxer
+ * @param fmp4 fMP4 instead of MPEG-TS segments for the hls muxer
+ * @param ring_store_mb record into a ring of this size, 0 for segment files
+ * @param audio_encoder shared AAC encoder replacing the input audio, or null
+ * @param live_only keep the output in the live cache only, if enabled
+ * @return int 
+ */
+static inline int open_copy_output(const std::string &output_path,
+                                   AVFormatContext *in_ctx,
+                                   AVFormatContext **out_ctx, int max_keep_minutes,
+                                   int copy_hls_time_sec, int ll_part_ms,
+                                   bool fmp4, int ring_store_mb,
+                                   const AudioTranscoder *audio_encoder,
+                                   bool live_only) {
+  /** Create output context (HLS, or fragmented MP4 for LL-HLS) */
+  int ret = avformat_alloc_output_context2(out_ctx, nullptr,
+                                           ll_part_ms > 0 ? "mp4" : "hls",
+                                           output_path.c_str());
+  if (ret < 0 || !*out_ctx) {
+    log_message("ERROR", "Failed to create output context: %s",
+                av_err2str_cpp(ret).c_str());
+    return ret < 0 ? ret : AVERROR_UNKNOWN;
+  }
+
+  /** Copy input streams */
+  for (unsigned int i = 0; i < in_ctx->nb_streams; ++i) {
+    AVStream *in_stream = in_ctx->streams[i];
+    AVStream *out_stream = avformat_new_stream(*out_ctx, nullptr);
+    if (!out_stream) {
+      log_message("ERROR", "Failed to allocate output stream");
+      return AVERROR(ENOMEM);
+    }
+
+    /** The audio stream carries the shared encoder's packets instead */
+    bool encoded = audio_encoder && static_cast<int>(i) == audio_encoder->source_index();
+    ret = avcodec_parameters_copy(out_stream->codecpar,
+                                  encoded ? audio_encoder->codecpar() : in_stream->codecpar);
+    if (ret < 0) {
+      log_message("ERROR", "Failed to copy codec parameters: %s",
+                  av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base = encoded ? audio_encoder->time_base() : in_stream->time_base;
+  }
+
+  if (ll_part_ms > 0) {
+    return open_llhls(*out_ctx, output_path, max_keep_minutes,
+                      copy_hls_time_sec, ll_part_ms);
+  }
+
+  /** Open output IO */
+  if (!((*out_ctx)->oformat->flags & AVFMT_NOFILE)) {
+    ret = avio_open(&(*out_ctx)->pb, output_path.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0) {
+      log_message("ERROR", "Failed to open output file: %s",
+                  av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+  }
+
+  /** Write header with HLS options */
+  ret = write_hls_header(*out_ctx, output_path, max_keep_minutes,
+                         copy_hls_time_sec, fmp4, ring_store_mb, live_only);
+  if (ret < 0) {
+    return ret;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Add the audio stream to output context: a copy of the
+ * input's, or the shared AAC encoder's
+ * 
+ * @param in_ctx 
+ * @param out_ctx 
+ * @param audio_index 
+ * @param audio_encoder shared AAC encoder, or null to copy
+ * @return int 
+ */
+static inline int add_audio_stream(AVFormatContext *in_ctx,
+                                   AVFormatContext *out_ctx,
+                                   int audio_index,
+                                   const AudioTranscoder *audio_encoder) {
+  /** Create audio stream */
+  AVStream *in_stream = in_ctx->streams[audio_index];
+  AVStream *out_stream = avformat_new_stream(out_ctx, nullptr);
+  if (!out_stream) {
+    log_message("ERROR", "Failed to allocate audio stream");
+    return AVERROR(ENOMEM);
+  }
+
+  int ret = avcodec_parameters_copy(out_stream->codecpar,
+                                    audio_encoder ? audio_encoder->codecpar()
+                                                  : in_stream->codecpar);
+  if (ret < 0) {
+    log_message("ERROR", "Failed to copy audio codec parameters: %s",
+                av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+
+  out_stream->codecpar->codec_tag = 0;
+  out_stream->time_base = audio_encoder ? audio_encoder->time_base()
+                                        : in_stream->time_base;
+  return 0;
+}
+
+/**
+ * @brief Initialize encoder context for a given rendition and output format
+ * 
+ * @param out The EncodeOutput structure to initialize
+ * @param rendition The rendition settings
+ * @param fps The frame rate
+ * @param global_header Whether to use a global header
+
+ * @return int 
+ */
+static inline int init_video_encoder(EncodeOutput &out, const Rendition &rendition,
+                                     AVRational fps, bool global_header) {
+  /** Find H.264 encoder */
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec) {
+    log_message("ERROR", "H.264 encoder not found");
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+
+  /** Create encoder context */
+  out.venc = avcodec_alloc_context3(codec);
+  if (!out.venc) {
+    log_message("ERROR", "Failed to allocate encoder context");
+    return AVERROR(ENOMEM);
+  }
+
+  out.venc->codec_id = AV_CODEC_ID_H264;
+  out.venc->width = rendition.width;
+  out.venc->height = rendition.height;
+  out.venc->pix_fmt = AV_PIX_FMT_YUV420P;
+  out.venc->time_base = av_inv_q(fps);
+  out.venc->framerate = fps;
+  out.venc->bit_rate = rendition.video_bitrate;
+  out.venc->gop_size = fps.num > 0 ? fps.num * 2 / fps.den : 60;
+  out.venc->max_b_frames = 0;
+  out.venc->thread_count = g_codec_threads;
+
+  /** Honor global header requirement */
+  if (global_header) {
+    out.venc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  /** Apply low-latency-ish tune */
+  utils::set_h264_encoder_options(
+      out.venc->priv_data,
+      rendition.preset
+  );
+
+  /** Open encoder */
+  int ret = avcodec_open2(out.venc, codec, nullptr);
+  if (ret < 0) {
+    log_message("ERROR", "Failed to open H.264 encoder: %s",
+                av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Initialize reencode output context with video encoder and HLS options
+ * 
+ * @param output_path The path to the output file
+ * @param in_ctx The input format context
+ * @param audio_index The index of the input audio stream
+ * @param audio_encoder shared AAC encoder replacing it, or null to copy
+ * @param rendition The rendition settings
+ * @param max_keep_minutes 
+ * @param hls_time_sec 
+ * @param ll_part_ms LL-HLS part duration, 0 for the stock hls muxer
+ * @param fmp4 fMP4 instead of MPEG-TS segments for the hls muxer
+ * @param fps 
+ * @param out 
+ * @return int 
+ */
+static inline int init_reencode_output(const std::string &output_path,
+                                       AVFormatContext *in_ctx,
+                                       int audio_index,
+                                       const AudioTranscoder *audio_encoder,
+                                       const Rendition &rendition,
+                                       int max_keep_minutes, int encode_hls_time_sec,
+                                       int ll_part_ms, bool fmp4, AVRational fps,
+                                       EncodeOutput &out) {
+  /** Create output context (HLS, or fragmented MP4 for LL-HLS) */
+  int ret = avformat_alloc_output_context2(&out.fmt, nullptr,
+                                           ll_part_ms > 0 ? "mp4" : "hls",
+                                           output_path.c_str());
+  if (ret < 0 || !out.fmt) {
+    log_message("ERROR", "Failed to create output context: %s",
+                av_err2str_cpp(ret).c_str());
+    return ret < 0 ? ret : AVERROR_UNKNOWN;
+  }
+
+  /** Initialize video encoder */
+  ret = init_video_encoder(out, rendition, fps,
+                           (out.fmt->oformat->flags & AVFMT_GLOBALHEADER) != 0);
+  if (ret < 0) {
+    return ret;
+  }
+
+  /** Allocate reusable packet and frame */
+  out.enc_pkt = av_packet_alloc();
+  out.enc_frame = av_frame_alloc();
+  if (!out.enc_pkt || !out.enc_frame) {
+    log_message("ERROR", "Failed to allocate encoder packet");
+    return AVERROR(ENOMEM);
+  }
+
+  /** Add video stream */
+  out.vstream = avformat_new_stream(out.fmt, nullptr);
+  if (!out.vstream) {
+    log_message("ERROR", "Failed to allocate video stream");
+    return AVERROR(ENOMEM);
+  }
+
+  ret = avcodec_parameters_from_context(out.vstream->codecpar, out.venc);
+  if (ret < 0) {
+    log_message("ERROR", "Failed to set video stream params: %s",
+                av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+
+  out.vstream->time_base = out.venc->time_base;
+
+  /** Add audio stream */
+  if (audio_index >= 0) {
+    ret = add_audio_stream(in_ctx, out.fmt, audio_index, audio_encoder);
+    if (ret < 0) {
+      return ret;
+    }
+    out.astream = out.fmt->streams[out.fmt->nb_streams - 1];
+  }
+
+  if (ll_part_ms > 0) {
+    ret = open_llhls(out.fmt, output_path, max_keep_minutes,
+                     encode_hls_time_sec, ll_part_ms);
+    out.header_written = ret >= 0;
+    return ret;
+  }
+
+  /** Open output IO */
+  if (!(out.fmt->oformat->flags & AVFMT_NOFILE)) {
+    ret = avio_open(&out.fmt->pb, output_path.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0) {
+      log_message("ERROR", "Failed to open output file: %s",
+                  av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+  }
+
+  /** Write header with HLS options; renditions are only for live viewing */
+  ret = write_hls_header(out.fmt, output_path, max_keep_minutes,
+                         encode_hls_time_sec, fmp4, 0, true);
+  if (ret < 0) {
+    return ret;
+  }
+  out.header_written = true;
+
+  return 0;
+}
+
+/**
+ * @brief Write copy packet to copy output with rescaled timestamps
+ * 
+ * @param in_ctx 
+ * @param out_ctx 
+ * @param pkt 
+ * @return int 
+ */
+static inline int write_copy_packet(AVFormatContext *in_ctx, AVFormatContext *out_ctx,
+                                    AVPacket *pkt) {
+  /** Rescale timestamps and write */
+  AVStream *in_stream = in_ctx->streams[pkt->stream_index];
+  AVStream *out_stream = out_ctx->streams[pkt->stream_index];
+
+  pkt->pts = av_rescale_q_rnd(pkt->pts, in_stream->time_base,
+                              out_stream->time_base,
+                              static_cast<AVRounding>(
+                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+  pkt->dts = av_rescale_q_rnd(pkt->dts, in_stream->time_base,
+                              out_stream->time_base,
+                              static_cast<AVRounding>(
+                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+  pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base,
+                                out_stream->time_base);
+  pkt->pos = -1;
+
+  int ret = write_output_packet(out_ctx, pkt);
+  if (ret < 0) {
+    log_message("ERROR", "Write error: %s", av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Record the first pipeline error; later errors are dropped
+ *
+ * @param state
+ * @param err
+ */
+static inline void fail_pipeline(StreamState &state, int err) {
+  int expected = 0;
+  state.pipeline_error.compare_exchange_strong(expected, err);
+}
+
+/**
+ * @brief Hand an encoded packet to the mux stage. When the mux stage
+ * is backed up the packet is dropped and the rendition skips to its
+ * next keyframe, which the encoder is asked to produce right away.
+ *
+ * @param state
+ * @param out
+ * @param pkt packet to reference; left untouched
+ * @return int
+ */
+static inline int queue_encoded_packet(StreamState &state, EncodeOutput &out,
+                                       AVPacket *pkt) {
+  if (out.mux_wait_keyframe) {
+    if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+      state.dropped_packets++;
+      return 0;
+    }
+    out.mux_wait_keyframe = false;
+  }
+
+  MuxItem item;
+  item.target = out.index;
+  item.pkt = av_packet_clone(pkt);
+  if (!item.pkt) {
+    return AVERROR(ENOMEM);
+  }
+
+  out.queued.fetch_add(1);
+  if (!state.mux_queue.try_push(item)) {
+    out.queued.fetch_sub(1);
+    av_packet_free(&item.pkt);
+    state.dropped_packets++;
+    out.mux_wait_keyframe = true;
+    out.force_keyframe = true;
+    return 0;
+  }
+
+  state.mux_stage->schedule();
+  return 0;
+}
+
+/**
+ * @brief Encode a scaled frame and hand the packets to the mux stage
+ * 
+ * @param state
+ * @param out 
+ * @param frame picture scaled for this rendition, read only
+ * @param pts 
+ * @return int 
+ */
+static inline int encode_and_write_frame(StreamState &state, EncodeOutput &out,
+                                         const AVFrame *frame, int64_t pts) {
+  /** Passthrough renditions share the picture, so stamp a reference */
+  int ret = av_frame_ref(out.enc_frame, frame);
+  if (ret < 0) {
+    log_message("ERROR", "Frame ref error: %s", av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+  out.enc_frame->pts = pts;
+
+  /** Restart the GOP after the mux stage dropped packets */
+  out.enc_frame->pict_type = out.force_keyframe ? AV_PICTURE_TYPE_I
+                                                : AV_PICTURE_TYPE_NONE;
+  out.force_keyframe = false;
+
+  /** Send to encoder */
+  ret = avcodec_send_frame(out.venc, out.enc_frame);
+  av_frame_unref(out.enc_frame);
+  if (ret < 0) {
+    log_message("ERROR", "Encode send error: %s", av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+
+  /** Drain encoder packets */
+  av_packet_unref(out.enc_pkt);
+  while (true) {
+    ret = avcodec_receive_packet(out.venc, out.enc_pkt);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      break;
+    }
+    if (ret < 0) {
+      log_message("ERROR", "Encode receive error: %s",
+                  av_err2str_cpp(ret).c_str());
+      av_packet_unref(out.enc_pkt);
+      return ret;
+    }
+
+    out.enc_pkt->stream_index = out.vstream->index;
+    av_packet_rescale_ts(out.enc_pkt, out.venc->time_base,
+                         out.vstream->time_base);
+
+    ret = queue_encoded_packet(state, out, out.enc_pkt);
+    av_packet_unref(out.enc_pkt);
+    if (ret < 0) {
+      log_message("ERROR", "Queue error: %s", av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Normalize packet timestamps for copy output
+ *
+ * @param state
+ * @param pkt
+ */
+static inline void normalize_copy_timestamps(StreamState &state, AVPacket *pkt) {
+  /** Skip if no stream state */
+  if (pkt->stream_index < 0 ||
+      pkt->stream_index >= static_cast<int>(state.copy_next_pts.size())) {
+    return;
+  }
+
+  /** Fill missing timestamps */
+  if (pkt->pts == AV_NOPTS_VALUE && pkt->dts == AV_NOPTS_VALUE) {
+    int64_t next = state.copy_next_pts[pkt->stream_index];
+    pkt->pts = next;
+    pkt->dts = next;
+  } else if (pkt->pts == AV_NOPTS_VALUE) {
+    pkt->pts = pkt->dts;
+  } else if (pkt->dts == AV_NOPTS_VALUE) {
+    pkt->dts = pkt->pts;
+  }
+
+  /** Enforce monotonic DTS */
+  int64_t next = state.copy_next_pts[pkt->stream_index];
+  if (pkt->dts < next) {
+    pkt->dts = next;
+  }
+  if (pkt->pts < pkt->dts) {
+    pkt->pts = pkt->dts;
+  }
+
+  /** Advance next PTS */
+  int64_t inc = pkt->duration > 0 ? pkt->duration : 1;
+  state.copy_next_pts[pkt->stream_index] = pkt->dts + inc;
+}
+
+/**
+ * @brief Timestamps of a packet rescaled into one output timebase,
+ * computed once and shared by every output using that timebase
+ */
+struct PacketTimes {
+  AVRational time_base = {0, 0};
+  int64_t pts = AV_NOPTS_VALUE;
+  int64_t dts = AV_NOPTS_VALUE;
+  int64_t duration = 0;
+};
+
+/**
+ * @brief Rescale a packet's timestamps unless times already holds
+ * them for this timebase
+ *
+ * @param pkt
+ * @param from input stream timebase
+ * @param to output stream timebase
+ * @param times
+ */
+static inline void rescale_packet_times(const AVPacket *pkt, AVRational from,
+                                        AVRational to, PacketTimes &times) {
+  if (times.time_base.den != 0 && av_cmp_q(times.time_base, to) == 0) {
+    return;
+  }
+  AVRounding rnd = static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+  times.time_base = to;
+  times.pts = av_rescale_q_rnd(pkt->pts, from, to, rnd);
+  times.dts = av_rescale_q_rnd(pkt->dts, from, to, rnd);
+  times.duration = av_rescale_q(pkt->duration, from, to);
+}
+
+/**
+ * @brief Write a fanned-out packet to one output with precomputed
+ * timestamps
+ *
+ * @param ctx
+ * @param stream_index output stream
+ * @param pkt consumed
+ * @param times
+ * @return int
+ */
+static inline int write_fanout_packet(AVFormatContext *ctx, int stream_index,
+                                      AVPacket *pkt, const PacketTimes &times) {
+  pkt->pts = times.pts;
+  pkt->dts = times.dts;
+  pkt->duration = times.duration;
+  pkt->pos = -1;
+  pkt->stream_index = stream_index;
+  return write_output_packet(ctx, pkt);
+}
+
+/**
+ * @brief Open a rendition output on first demand
+ *
+ * @param state
+ * @param out idle output
+ * @return int
+ */
+static inline int open_rendition(StreamState &state, EncodeOutput &out) {
+  /** A rendition frame rate only ever lowers the source rate */
+  AVRational fps = state.fps;
+  if (out.rendition.fps > 0 && av_cmp_q(AVRational{out.rendition.fps, 1}, fps) < 0) {
+    fps = AVRational{out.rendition.fps, 1};
+  }
+
+  /** The path may still alias the copy playlist from an earlier source */
+  utils::remove_symlink(out.path);
+
+  int ret = init_reencode_output(out.path, state.in_ctx, state.audio_index,
+                                 state.audio_encoder.get(), out.rendition,
+                                 state.encode_max_keep_minutes,
+                                 state.encode_hls_time_sec, state.ll_part_ms,
+                                 state.fmp4_segments, fps, out);
+  if (ret < 0) {
+    close_reencode_format(out);
+    close_reencode_encoder(out);
+    return ret;
+  }
+
+  out.last_pts = AV_NOPTS_VALUE;
+  state.active_outputs.fetch_add(1);
+  out.status.store(kOutputOpen);
+  log_message("INFO", "Rendition %s started", out.rendition.name.c_str());
+  return 0;
+}
+
+/**
+ * @brief Open copy and reencode outputs. On-demand renditions are
+ * only prepared here and opened once a viewer asks for them.
+ *
+ * @param state
+ * @param output_path
+ * @param renditions
+ * @param max_keep_minutes
+ * @param hls_time_sec
+ * @param on_demand
+ * @return int
+ */
+static inline int open_outputs(StreamState &state, const std::string &output_path,
+                               const std::vector<Rendition> &renditions,
+                               int copy_max_keep_minutes, int copy_hls_time_sec,
+                               int encode_max_keep_minutes, int encode_hls_time_sec,
+                               bool on_demand) {
+  /** Audio HLS players cannot play is encoded to AAC once for all outputs */
+  if (state.audio_index >= 0) {
+    const AVStream *audio = state.in_ctx->streams[state.audio_index];
+    const char *codec = avcodec_get_name(audio->codecpar->codec_id);
+    if (!utils::hls_audio_codec(audio->codecpar->codec_id)) {
+      std::unique_ptr<AudioTranscoder> encoder(new AudioTranscoder());
+      int ret = encoder->open(audio);
+      if (ret < 0) {
+        log_message("WARN", "Failed to set up AAC encoding of %s audio, copying it: %s",
+                    codec, av_err2str_cpp(ret).c_str());
+      } else {
+        log_message("INFO", "Encoding %s audio to AAC for all outputs", codec);
+        state.audio_encoder = std::move(encoder);
+      }
+    }
+  }
+
+  /** Open copy output */
+  int ret = open_copy_output(output_path, state.in_ctx, &state.copy_ctx,
+                             copy_max_keep_minutes, copy_hls_time_sec,
+                             state.ll_part_ms, state.fmp4_segments,
+                             state.ring_store_mb, state.audio_encoder.get(),
+                             state.live_only);
+  if (ret < 0) {
+    return ret;
+  }
+
+  /** Initialize renditions */
+  AVRational fps = av_guess_frame_rate(state.in_ctx, state.video_stream, nullptr);
+  if (fps.num <= 0 || fps.den <= 0) {
+    fps = {30, 1};
+  }
+
+  state.fps = fps;
+  state.encode_max_keep_minutes = encode_max_keep_minutes;
+  state.encode_hls_time_sec = encode_hls_time_sec;
+  state.outputs = std::vector<EncodeOutput>(renditions.size());
+
+  std::string base = utils::base_without_ext(
+      output_path
+  );
+  for (size_t i = 0; i < renditions.size(); ++i) {
+    EncodeOutput &out = state.outputs[i];
+    out.index = static_cast<int>(i);
+    out.rendition = renditions[i];
+    out.path = base + "_" + renditions[i].name + ".m3u8";
+    out.wanted.store(!on_demand);
+    if (on_demand) {
+      continue;
+    }
+
+    ret = open_rendition(state, out);
+    if (ret < 0) {
+      close_copy_output(state.copy_ctx);
+      state.copy_ctx = nullptr;
+      close_reencode_outputs(state.outputs);
+      return ret;
+    }
+  }
+
+  /** Initialize copy timestamp tracking */
+  state.copy_next_pts.assign(state.in_ctx->nb_streams, 0);
+  state.clocks.assign(state.in_ctx->nb_streams, StreamClock());
+  state.input_streams = utils::probed_streams(state.in_ctx);
+
+  return 0;
+}
+
+/**
+ * @brief Check if a reconnected input can feed the open outputs: the
+ * same streams, codecs, picture size, audio format and extradata
+ *
+ * @param state
+ * @param in_ctx
+ * @param video_index
+ * @param audio_index
+ * @return true if the outputs can be kept
+ */
+static inline bool input_matches_outputs(const StreamState &state, const AVFormatContext *in_ctx,
+                                         int video_index, int audio_index) {
+  return video_index == state.video_index && audio_index == state.audio_index &&
+         utils::probe_cache_consistent(in_ctx, state.input_streams);
+}
+
+/**
+ * @brief Feed the open outputs and encoders from a reconnected input.
+ * Its timestamps continue where the last input ended, video restarts
+ * at its first keyframe with a new GOP in every rendition, and the
+ * copy output, whose bitstream is cut, marks a discontinuity.
+ *
+ * @param state session whose pipeline is stopped
+ * @param in_ctx
+ * @param vdec decoder opened for in_ctx
+ */
+static inline void resume_outputs(StreamState &state, AVFormatContext *in_ctx,
+                                  AVCodecContext *vdec) {
+  state.in_ctx = in_ctx;
+  state.vdec = vdec;
+  state.video_stream = in_ctx->streams[state.video_index];
+  state.rebase_pending = true;
+  for (size_t i = 0; i < state.clocks.size(); ++i) {
+    StreamClock &clock = state.clocks[i];
+    clock.resuming = true;
+    if (clock.end != AV_NOPTS_VALUE) {
+      state.copy_next_pts[i] = av_rescale_q(clock.end, AV_TIME_BASE_Q,
+                                            in_ctx->streams[i]->time_base);
+    }
+  }
+
+  if (state.audio_encoder) {
+    state.audio_encoder->reset_input(in_ctx->streams[state.audio_index]);
+  }
+
+  state.decode_wait_keyframe = true;
+  state.copy_wait_keyframe = true;
+  for (auto &out : state.outputs) {
+    out.force_keyframe = true;
+  }
+  mark_discontinuity(state.copy_ctx);
+}
+
+/**
+ * @brief Shift a read packet onto the output timeline. The first
+ * timestamp after a reconnect continues where the previous input
+ * ended; packets of a stream that would still land before its last
+ * one are dropped.
+ *
+ * @param state
+ * @param pkt
+ * @return true to distribute the packet, false to drop it
+ */
+static inline bool rebase_timestamps(StreamState &state, AVPacket *pkt) {
+  if (pkt->stream_index < 0 ||
+      pkt->stream_index >= static_cast<int>(state.clocks.size())) {
+    return true;
+  }
+  int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+  if (ts == AV_NOPTS_VALUE) {
+    return true;
+  }
+
+  AVRational tb = state.in_ctx->streams[pkt->stream_index]->time_base;
+  if (state.rebase_pending) {
+    int64_t resume = AV_NOPTS_VALUE;
+    for (const auto &clock : state.clocks) {
+      if (clock.dts != AV_NOPTS_VALUE) {
+        resume = std::max(resume, std::max(clock.end, clock.dts + 1));
+      }
+    }
+    state.ts_offset = resume == AV_NOPTS_VALUE
+                          ? 0
+                          : resume - av_rescale_q(ts, tb, AV_TIME_BASE_Q);
+    state.rebase_pending = false;
+  }
+
+  int64_t offset = av_rescale_q(state.ts_offset, AV_TIME_BASE_Q, tb);
+  StreamClock &clock = state.clocks[pkt->stream_index];
+  int64_t dts = av_rescale_q(ts + offset, tb, AV_TIME_BASE_Q);
+  if (clock.resuming && clock.dts != AV_NOPTS_VALUE && dts <= clock.dts) {
+    return false;
+  }
+  clock.resuming = false;
+
+  if (pkt->pts != AV_NOPTS_VALUE) {
+    pkt->pts += offset;
+  }
+  if (pkt->dts != AV_NOPTS_VALUE) {
+    pkt->dts += offset;
+  }
+  clock.dts = dts;
+  clock.end = std::max(clock.end,
+                       dts + av_rescale_q(std::max<int64_t>(pkt->duration, 0), tb,
+                                          AV_TIME_BASE_Q));
+  return true;
+}
+
+/**
+ * @brief Encode one rendition of a decoded frame
+ *
+ * @param state
+ * @param out
+ * @param frame picture scaled for this rendition
+ * @param in_pts source PTS in the input stream timebase
+ * @return int
+ */
+static inline int encode_rendition(StreamState &state, EncodeOutput &out,
+                                   const AVFrame *frame, int64_t in_pts) {
+  int64_t enc_pts = av_rescale_q(in_pts, state.video_stream->time_base,
+                                 out.venc->time_base);
+  if (out.last_pts != AV_NOPTS_VALUE && enc_pts <= out.last_pts) {
+    return 0;
+  }
+  out.last_pts = enc_pts;
+
+  int64_t start = utils::metrics_now_ns();
+  int ret = encode_and_write_frame(state, out, frame, enc_pts);
+  state.metrics->encode.observe(utils::metrics_now_ns() - start);
+  if (ret < 0) {
+    log_message("ERROR", "Encode/write error: %s", av_err2str_cpp(ret).c_str());
+  }
+  return ret;
+}
+
+/**
+ * @brief Set up a video decoder before it is opened. At full cost it
+ * decodes every frame at full quality on g_codec_threads. At reduced
+ * cost it runs frame and slice threads sized to the camera's CPU
+ * budget and takes the shortcuts the encoded renditions cannot show:
+ * lowres decoding down to the largest rendition where the codec
+ * supports it, no loop filter on non-reference frames when every
+ * rendition is downscaled, and no non-reference frames when every
+ * rendition runs at most half the source frame rate. Reference frames
+ * keep their loop filter, so no prediction drift builds up over a
+ * long GOP.
+ *
+ * @param vdec decoder context with the stream parameters applied
+ * @param decoder
+ * @param fps source frame rate
+ * @param encoded renditions decoded frames are scaled for
+ * @param reduced reduced decode cost
+ * @param threads decoder threads at reduced cost, 0 lets libav decide
+ */
+static inline void configure_decoder(AVCodecContext *vdec, const AVCodec *decoder,
+                                     AVRational fps, const std::vector<Rendition> &encoded,
+                                     bool reduced, int threads) {
+  vdec->thread_count = g_codec_threads;
+  if (!reduced) {
+    return;
+  }
+  vdec->thread_count = threads;
+  vdec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (encoded.empty() || vdec->width <= 0 || vdec->height <= 0) {
+    return;
+  }
+
+  int max_width = 0;
+  int max_height = 0;
+  bool decimated = fps.num > 0 && fps.den > 0;
+  for (const auto &r : encoded) {
+    max_width = std::max(max_width, r.width);
+    max_height = std::max(max_height, r.height);
+    decimated = decimated && r.fps > 0 && r.fps * 2 <= av_q2d(fps);
+  }
+
+  /** Largest shift that still covers every rendition */
+  for (int lowres = std::min(decoder->max_lowres, 3); lowres > 0; --lowres) {
+    int step = 1 << lowres;
+    if ((vdec->width + step - 1) / step >= max_width &&
+        (vdec->height + step - 1) / step >= max_height) {
+      vdec->lowres = lowres;
+      break;
+    }
+  }
+
+  /** Downscaling hides what the loop filter would smooth on frames
+   *  nothing predicts from */
+  if (max_height < vdec->height) {
+    vdec->skip_loop_filter = AVDISCARD_NONREF;
+  }
+
+  /** Nothing references them, and the renditions decimate anyway */
+  if (decimated) {
+    vdec->skip_frame = AVDISCARD_NONREF;
+  }
+
+  log_message("INFO", "Reduced decode: %d threads, lowres %d, loop filter %s%s",
+              threads, vdec->lowres,
+              vdec->skip_loop_filter == AVDISCARD_NONREF ? "skipped on non-reference frames"
+                                                         : "kept",
+              decimated ? ", non-reference frames skipped" : "");
+}
+
+/**
+ * @brief Recover from a decoder error: count it, drop the decoder's
+ * references and skip video until the next keyframe. Renditions keep
+ * their last picture meanwhile; only running out of memory stops the
+ * pipeline.
+ *
+ * @param state
+ * @param err
+ * @return int err if it is fatal, 0 otherwise
+ */
+static inline int resync_decoder(StreamState &state, int err) {
+  if (err == AVERROR(ENOMEM)) {
+    return err;
+  }
+  state.metrics->decode_errors.fetch_add(1, std::memory_order_relaxed);
+  log_message("WARN", "Decode error, resyncing at the next keyframe: %s",
+              av_err2str_cpp(err).c_str());
+  avcodec_flush_buffers(state.vdec);
+  state.decode_resync = true;
+  return 0;
+}
+
+/**
+ * @brief Plan the cascaded scaler for the renditions of a source
+ *
+ * @param state
+ * @param src first decoded frame of this geometry
+ * @return int
+ */
+static inline int build_scaler(StreamState &state, const AVFrame *src) {
+  std::vector<ScaleTarget> targets;
+  state.scaled_outputs.clear();
+  for (const auto &out : state.outputs) {
+    if (out.status.load() != kOutputOpen) {
+      continue;
+    }
+    targets.push_back({out.venc->width, out.venc->height, out.venc->pix_fmt});
+    state.scaled_outputs.push_back(static_cast<size_t>(out.index));
+  }
+
+  int ret = state.scaler.build(src->width, src->height,
+                               static_cast<AVPixelFormat>(src->format), targets);
+  if (ret < 0) {
+    log_message("ERROR", "Failed to build scaler: %s",
+                av_err2str_cpp(ret).c_str());
+    return ret;
+  }
+
+  for (size_t idx : state.scaler.order()) {
+    int parent = state.scaler.parent(idx);
+    const EncodeOutput &out = state.outputs[state.scaled_outputs[idx]];
+    std::string from = "source";
+    if (parent != ScaleGraph::kSource) {
+      const EncodeOutput &up = state.outputs[state.scaled_outputs[parent]];
+      from = std::to_string(up.venc->width) + "x" +
+             std::to_string(up.venc->height);
+    }
+    log_message("INFO", "Scale %dx%d from %s", out.venc->width,
+                out.venc->height, from.c_str());
+  }
+  return 0;
+}
+
+/**
+ * @brief Stop a rendition nobody watches: drain its encoder into the
+ * mux stage, free it and leave closing the output to the mux stage
+ *
+ * @param state
+ * @param out open output
+ */
+static inline void close_rendition(StreamState &state, EncodeOutput &out) {
+  int ret = avcodec_send_frame(out.venc, nullptr);
+  while (ret >= 0) {
+    ret = avcodec_receive_packet(out.venc, out.enc_pkt);
+    if (ret < 0) {
+      break;
+    }
+    out.enc_pkt->stream_index = out.vstream->index;
+    av_packet_rescale_ts(out.enc_pkt, out.venc->time_base,
+                         out.vstream->time_base);
+    ret = queue_encoded_packet(state, out, out.enc_pkt);
+    av_packet_unref(out.enc_pkt);
+  }
+
+  close_reencode_encoder(out);
+  out.force_keyframe = false;
+  out.mux_wait_keyframe = false;
+  out.status.store(kOutputClosing);
+  state.mux_stage->schedule();
+}
+
+/**
+ * @brief Start wanted renditions and stop unwanted or failed ones
+ * between frames. A rendition that fails to open or fails later is
+ * retried after kRenditionRetryMs while the others keep running.
+ *
+ * @param state
+ * @return int
+ */
+static inline int update_renditions(StreamState &state) {
+  bool changed = false;
+  int64_t now = utils::metrics_now_ns();
+  for (auto &out : state.outputs) {
+    int status = out.status.load();
+    bool wanted = out.wanted.load();
+    if (status == kOutputOpen && out.failed.load()) {
+      log_message("WARN", "Rendition %s failed, retrying in %d s",
+                  out.rendition.name.c_str(), static_cast<int>(kRenditionRetryMs / 1000));
+      state.metrics->rendition_failures.fetch_add(1, std::memory_order_relaxed);
+      close_rendition(state, out);
+      out.retry_ns = now + kRenditionRetryMs * 1000000;
+      changed = true;
+    } else if (wanted && status == kOutputIdle && now >= out.retry_ns) {
+      out.failed.store(false);
+      if (open_rendition(state, out) < 0) {
+        log_message("WARN", "Rendition %s failed to start, retrying in %d s",
+                    out.rendition.name.c_str(), static_cast<int>(kRenditionRetryMs / 1000));
+        state.metrics->rendition_failures.fetch_add(1, std::memory_order_relaxed);
+        out.retry_ns = now + kRenditionRetryMs * 1000000;
+        continue;
+      }
+      changed = true;
+    } else if (!wanted && status == kOutputOpen) {
+      close_rendition(state, out);
+      log_message("INFO", "Rendition %s idle, stopping", out.rendition.name.c_str());
+      changed = true;
+    }
+  }
+
+  /** Replan the cascade for the new set of renditions */
+  if (changed) {
+    state.scaler.reset();
+  }
+  return 0;
+}
+
+/**
+ * @brief Record ingest-to-encoded latency of a frame whose packet
+ * ingest stamped
+ *
+ * @param state
+ * @param pts frame PTS in the input stream timebase
+ */
+static inline void observe_frame_latency(StreamState &state, int64_t pts) {
+  for (auto &stamp : state.ingest_stamps) {
+    if (stamp.pts.load(std::memory_order_acquire) == pts) {
+      int64_t ns = stamp.ns.load(std::memory_order_relaxed);
+      state.metrics->frame_latency.observe(utils::metrics_now_ns() - ns);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Decode one packet and encode every rendition of each frame
+ * in parallel. Renditions are scaled down the cascade on the decode
+ * stage and each encode is forked as soon as its picture is ready;
+ * all of them are joined before the next frame is decoded, so frame
+ * latency is the slowest rendition rather than the sum.
+ *
+ * @param state
+ * @param pkt
+ * @return int
+ */
+static inline int decode_packet(StreamState &state, AVPacket *pkt) {
+  int ret = update_renditions(state);
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (state.decode_resync) {
+    if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+      return 0;
+    }
+    state.decode_resync = false;
+  }
+
+  int64_t start = utils::metrics_now_ns();
+  ret = avcodec_send_packet(state.vdec, pkt);
+  if (ret < 0) {
+    return resync_decoder(state, ret);
+  }
+
+  while (true) {
+    ret = avcodec_receive_frame(state.vdec, state.decoded);
+    state.metrics->decode.observe(utils::metrics_now_ns() - start);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      break;
+    }
+    if (ret < 0) {
+      return resync_decoder(state, ret);
+    }
+    state.metrics->frames_decoded.fetch_add(1, std::memory_order_relaxed);
+
+    /** Pictures built on missing references are skipped until the
+     * decoder recovers; concealed slice errors are kept */
+    if (state.decoded->flags & AV_FRAME_FLAG_CORRUPT) {
+      state.metrics->corrupt_frames.fetch_add(1, std::memory_order_relaxed);
+      av_frame_unref(state.decoded);
+      start = utils::metrics_now_ns();
+      continue;
+    }
+    if (state.decoded->decode_error_flags & FF_DECODE_ERROR_CONCEALMENT_ACTIVE) {
+      state.metrics->concealed_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /** Derive PTS in the input stream timebase */
+    int64_t in_pts = state.decoded->best_effort_timestamp;
+    if (in_pts == AV_NOPTS_VALUE) {
+      in_pts = state.fallback_pts++;
+    }
+
+    /** (Re)plan the cascade when the source geometry changes */
+    if (!state.scaler.matches(state.decoded)) {
+      ret = build_scaler(state, state.decoded);
+      if (ret < 0) {
+        av_frame_unref(state.decoded);
+        return ret;
+      }
+    }
+
+    {
+      TaskGroup group(*state.pool);
+      for (size_t idx : state.scaler.order()) {
+        int64_t scale_start = utils::metrics_now_ns();
+        ret = state.scaler.scale(idx, state.decoded);
+        state.metrics->scale.observe(utils::metrics_now_ns() - scale_start);
+        if (ret < 0) {
+          log_message("ERROR", "Scale error: %s", av_err2str_cpp(ret).c_str());
+          fail_pipeline(state, ret);
+          break;
+        }
+
+        EncodeOutput *out = &state.outputs[state.scaled_outputs[idx]];
+        const AVFrame *frame = state.scaler.output(idx);
+        if (out->failed.load()) {
+          continue;
+        }
+        group.run([&state, out, frame, in_pts]() {
+          LogTagScope tag(state.log_tag);
+          if (encode_rendition(state, *out, frame, in_pts) < 0) {
+            out->failed.store(true);
+          }
+        });
+      }
+      group.wait();
+    }
+    av_frame_unref(state.decoded);
+
+    ret = state.pipeline_error.load();
+    if (ret < 0) {
+      return ret;
+    }
+    observe_frame_latency(state, in_pts);
+    start = utils::metrics_now_ns();
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Decode stage body: drain a batch of queued video packets
+ *
+ * @param state
+ */
+static inline void run_decode_stage(StreamState &state) {
+  for (int n = 0; n < kStageBatch; ++n) {
+    AVPacket *pkt = nullptr;
+    if (!state.decode_queue.try_pop(pkt)) {
+      return;
+    }
+
+    /** Decoding resumes after an idle period: drop stale references */
+    if (!pkt) {
+      avcodec_flush_buffers(state.vdec);
+      continue;
+    }
+
+    if (state.pipeline_error.load() == 0) {
+      int ret = decode_packet(state, pkt);
+      if (ret < 0) {
+        fail_pipeline(state, ret);
+      }
+    }
+    av_packet_free(&pkt);
+  }
+  state.decode_stage->schedule();
+}
+
+/**
+ * @brief Transcode one input audio packet and queue what the shared
+ * encoder returns for the mux stage. Like video decode errors, audio
+ * errors are counted and skipped unless memory ran out; like ingest,
+ * a full mux queue drops the packets and counts them.
+ *
+ * @param state
+ * @param pkt
+ * @return int
+ */
+static inline int transcode_audio_packet(StreamState &state, const AVPacket *pkt) {
+  std::vector<AVPacket *> encoded;
+  int ret = state.audio_encoder->transcode(pkt, encoded);
+  for (AVPacket *out : encoded) {
+    MuxItem item;
+    item.target = kMuxAudio;
+    item.pkt = out;
+    if (!state.mux_queue.try_push(item)) {
+      av_packet_free(&item.pkt);
+      state.dropped_packets++;
+    }
+  }
+  if (!encoded.empty()) {
+    state.mux_stage->schedule();
+  }
+  if (ret < 0 && ret != AVERROR(ENOMEM)) {
+    state.metrics->decode_errors.fetch_add(1, std::memory_order_relaxed);
+    log_message("WARN", "Audio transcode error: %s", av_err2str_cpp(ret).c_str());
+    return 0;
+  }
+  return ret;
+}
+
+/**
+ * @brief Audio stage body: transcode a batch of queued audio packets
+ *
+ * @param state
+ */
+static inline void run_audio_stage(StreamState &state) {
+  for (int n = 0; n < kStageBatch; ++n) {
+    AVPacket *pkt = nullptr;
+    if (!state.audio_queue.try_pop(pkt)) {
+      return;
+    }
+    if (state.pipeline_error.load() == 0) {
+      int ret = transcode_audio_packet(state, pkt);
+      if (ret < 0) {
+        fail_pipeline(state, ret);
+      }
+    }
+    av_packet_free(&pkt);
+  }
+  state.audio_stage->schedule();
+}
+
+/**
+ * @brief Fan an audio packet out: renditions share timestamps
+ * rescaled once per timebase and references to one buffer; the copy
+ * output, written last, takes the packet itself
+ *
+ * @param state
+ * @param pkt input audio, or shared encoder output; consumed
+ * @return int
+ */
+static inline int fan_out_audio(StreamState &state, AVPacket *pkt) {
+  AVRational from = state.audio_encoder
+                        ? state.audio_encoder->time_base()
+                        : state.in_ctx->streams[state.audio_index]->time_base;
+  PacketTimes times;
+  for (auto &out : state.outputs) {
+    if (out.status.load() == kOutputIdle || !out.astream || out.failed.load()) {
+      continue;
+    }
+    int ret = av_packet_ref(state.audio_pkt, pkt);
+    if (ret < 0) {
+      log_message("ERROR", "Audio packet ref error: %s",
+                  av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+    rescale_packet_times(pkt, from, out.astream->time_base, times);
+    ret = write_fanout_packet(out.fmt, out.astream->index, state.audio_pkt, times);
+    if (ret < 0) {
+      log_message("ERROR", "Audio write error: %s",
+                  av_err2str_cpp(ret).c_str());
+      out.failed.store(true);
+    }
+  }
+
+  AVStream *copy_stream = state.copy_ctx->streams[state.audio_index];
+  rescale_packet_times(pkt, from, copy_stream->time_base, times);
+  int ret = write_fanout_packet(state.copy_ctx, state.audio_index, pkt, times);
+  if (ret < 0) {
+    log_message("ERROR", "Copy write error: %s", av_err2str_cpp(ret).c_str());
+  }
+  return ret;
+}
+
+/**
+ * @brief Write one mux item to its output
+ *
+ * @param state
+ * @param item
+ * @return int
+ */
+static inline int write_mux_item(StreamState &state, MuxItem &item) {
+  /** Write copy output */
+  if (item.target == kMuxCopy) {
+    int ret = write_copy_packet(state.in_ctx, state.copy_ctx, item.pkt);
+    if (ret < 0) {
+      log_message("ERROR", "Copy write error: %s", av_err2str_cpp(ret).c_str());
+    }
+    return ret;
+  }
+
+  if (item.target == kMuxAudio) {
+    return fan_out_audio(state, item.pkt);
+  }
+
+  /** Write encoded rendition packet; a failed output only stops itself */
+  EncodeOutput &out = state.outputs[item.target];
+  if (out.failed.load()) {
+    return 0;
+  }
+  int ret = write_output_packet(out.fmt, item.pkt);
+  if (ret < 0) {
+    log_message("ERROR", "Write error: %s", av_err2str_cpp(ret).c_str());
+    out.failed.store(true);
+  }
+  return 0;
+}
+
+/**
+ * @brief Close renditions stopped by the decode stage whose queued
+ * packets have all been written
+ *
+ * @param state
+ */
+static inline void close_stopped_renditions(StreamState &state) {
+  for (auto &out : state.outputs) {
+    if (out.status.load() == kOutputClosing && out.queued.load() == 0) {
+      close_reencode_format(out);
+      out.status.store(kOutputIdle);
+      state.active_outputs.fetch_sub(1);
+    }
+  }
+}
+
+/**
+ * @brief Mux stage body: write a batch of packets to the outputs
+ *
+ * @param state
+ */
+static inline void run_mux_stage(StreamState &state) {
+  int n = 0;
+  for (; n < kStageBatch; ++n) {
+    MuxItem item;
+    if (!state.mux_queue.try_pop(item)) {
+      break;
+    }
+    if (state.pipeline_error.load() == 0) {
+      int64_t start = utils::metrics_now_ns();
+      int ret = write_mux_item(state, item);
+      state.metrics->mux.observe(utils::metrics_now_ns() - start);
+      if (ret < 0) {
+        fail_pipeline(state, ret);
+      }
+    }
+    av_packet_free(&item.pkt);
+    if (item.target >= 0) {
+      state.outputs[item.target].queued.fetch_sub(1);
+    }
+  }
+
+  close_stopped_renditions(state);
+  if (n == kStageBatch) {
+    state.mux_stage->schedule();
+  }
+}
+
+/**
+ * @brief Create the decode, audio and mux stages for an opened session
+ *
+ * @param state
+ * @param pool
+ */
+static inline void start_pipeline(StreamState &state, WorkerPool &pool) {
+  state.pool = &pool;
+  state.pipeline_error.store(0);
+  state.decode_stage.reset(new Stage(pool, [&state]() {
+    LogTagScope tag(state.log_tag);
+    run_decode_stage(state);
+  }));
+  if (state.audio_encoder) {
+    state.audio_stage.reset(new Stage(pool, [&state]() {
+      LogTagScope tag(state.log_tag);
+      run_audio_stage(state);
+    }));
+  }
+  state.mux_stage.reset(new Stage(pool, [&state]() {
+    LogTagScope tag(state.log_tag);
+    run_mux_stage(state);
+  }));
+}
+
+/**
+ * @brief Let queued work finish, then release the stages. Stages keep
+ * draining after an error, so this always terminates.
+ *
+ * @param state
+ */
+static inline void stop_pipeline(StreamState &state) {
+  while (true) {
+    /** Check upstream first: work only flows towards the muxer */
+    bool idle = state.decode_queue.empty() &&
+                (!state.decode_stage || state.decode_stage->idle());
+    idle = idle && state.audio_queue.empty() &&
+           (!state.audio_stage || state.audio_stage->idle());
+    idle = idle && state.mux_queue.empty() &&
+           (!state.mux_stage || state.mux_stage->idle());
+    if (idle) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  state.decode_stage.reset();
+  state.audio_stage.reset();
+  state.mux_stage.reset();
+}
+
+/**
+ * @brief Distribute packet to the pipeline stages without blocking.
+ * Video goes to the decoder and every packet to the copy output, the
+ * audio stream's as one item the mux stage fans out to the renditions,
+ * or through the audio stage when it is transcoded. A full queue drops
+ * the packet and, for video, everything up to the next keyframe so
+ * outputs stay decodable.
+ *
+ * @param state
+ * @param pkt consumed
+ * @return int
+ */
+static inline int distribute_outputs(StreamState &state, AVPacket *pkt) {
+  bool is_video = pkt->stream_index == state.video_index;
+  bool is_key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+
+  /** Queue video for renditions */
+  if (is_video && state.decoding) {
+    if (state.decode_wait_keyframe && is_key) {
+      state.decode_wait_keyframe = false;
+    }
+    if (state.decode_wait_keyframe) {
+      state.dropped_packets++;
+    } else {
+      AVPacket *ref = av_packet_clone(pkt);
+      if (!ref) {
+        return AVERROR(ENOMEM);
+      }
+      int64_t pts = ref->pts;
+      if (state.decode_queue.try_push(ref)) {
+        IngestStamp &stamp = state.ingest_stamps[state.next_stamp++ % kLatencySlots];
+        stamp.pts.store(AV_NOPTS_VALUE, std::memory_order_relaxed);
+        stamp.ns.store(utils::metrics_now_ns(), std::memory_order_relaxed);
+        stamp.pts.store(pts, std::memory_order_release);
+        state.decode_stage->schedule();
+      } else {
+        av_packet_free(&ref);
+        state.dropped_packets++;
+        state.decode_wait_keyframe = true;
+      }
+    }
+  }
+
+  /** Queue copy output; audio is fanned out to the renditions from there */
+  bool is_audio = state.audio_index >= 0 && pkt->stream_index == state.audio_index;
+  normalize_copy_timestamps(state, pkt);
+  if (is_video && state.copy_wait_keyframe && is_key) {
+    state.copy_wait_keyframe = false;
+  }
+  if (is_video && state.copy_wait_keyframe) {
+    state.dropped_packets++;
+  } else if (is_audio && state.audio_encoder) {
+    AVPacket *ref = av_packet_alloc();
+    if (!ref) {
+      return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(ref, pkt);
+    if (state.audio_queue.try_push(ref)) {
+      state.audio_stage->schedule();
+    } else {
+      av_packet_free(&ref);
+      state.dropped_packets++;
+    }
+  } else {
+    MuxItem item;
+    item.target = is_audio ? kMuxAudio : kMuxCopy;
+    item.pkt = av_packet_alloc();
+    if (!item.pkt) {
+      return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(item.pkt, pkt);
+    if (!state.mux_queue.try_push(item)) {
+      av_packet_free(&item.pkt);
+      state.dropped_packets++;
+      state.copy_wait_keyframe = state.copy_wait_keyframe || is_video;
+    }
+  }
+
+  state.mux_stage->schedule();
+  return 0;
+}
+
+/**
+ * @brief Drain the shared audio encoder into the outputs at the end of
+ * the session, once the stages have stopped
+ *
+ * @param state
+ * @return int
+ */
+static inline int flush_audio(StreamState &state) {
+  if (!state.audio_encoder || !state.copy_ctx) {
+    return 0;
+  }
+  std::vector<AVPacket *> encoded;
+  int ret = state.audio_encoder->transcode(nullptr, encoded);
+  for (AVPacket *pkt : encoded) {
+    if (ret >= 0) {
+      ret = fan_out_audio(state, pkt);
+    }
+    av_packet_free(&pkt);
+  }
+  return ret;
+}
+
+/**
+ * @brief Flush encoders at the end of stream to ensure all packets are written
+ * 
+ * @param outputs The list of encode outputs
+ * @return int 0 on success, negative error code on failure
+ */
+static inline int flush_encoders(std::vector<EncodeOutput> &outputs) {
+  /** Flush each open encoder */
+  for (auto &out : outputs) {
+    if (out.status.load() != kOutputOpen || !out.venc || out.failed.load()) {
+      continue;
+    }
+
+    int ret = avcodec_send_frame(out.venc, nullptr);
+    if (ret < 0) {
+      log_message("ERROR", "Flush send error: %s", av_err2str_cpp(ret).c_str());
+      return ret;
+    }
+
+    while (true) {
+      ret = avcodec_receive_packet(out.venc, out.enc_pkt);
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        break;
+      }
+      if (ret < 0) {
+        log_message("ERROR", "Flush receive error: %s",
+                    av_err2str_cpp(ret).c_str());
+        av_packet_unref(out.enc_pkt);
+        return ret;
+      }
+
+      out.enc_pkt->stream_index = out.vstream->index;
+      av_packet_rescale_ts(out.enc_pkt, out.venc->time_base,
+                           out.vstream->time_base);
+
+      ret = write_output_packet(out.fmt, out.enc_pkt);
+      av_packet_unref(out.enc_pkt);
+      if (ret < 0) {
+        log_message("ERROR", "Flush write error: %s",
+                    av_err2str_cpp(ret).c_str());
+        return ret;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+/**
+ * Stream parameters of a camera's last full probe, kept in
+ * "<playlist base>.probe". The next open fills them in before a short
+ * avformat_find_stream_info instead of probing for seconds, and falls
+ * back to a full probe when what the short probe sees disagrees.
+ */
+
+/** Format version of .probe files */
+static constexpr int kProbeCacheVersion = 1;
+
+/** Probe limits when the cached parameters are used */
+static constexpr int64_t kProbeCacheProbesize = 32 * 1024;
+static constexpr int64_t kProbeCacheAnalyzeUs = 200000;
+
+/**
+ * @brief Codec parameters of one probed stream
+ */
+struct ProbedStream {
+  int codec_type = AVMEDIA_TYPE_UNKNOWN;
+  int codec_id = AV_CODEC_ID_NONE;
+  int format = -1;
+  int64_t bit_rate = 0;
+  int profile = 0;
+  int level = 0;
+  int width = 0;
+  int height = 0;
+  AVRational sample_aspect_ratio = {0, 1};
+  int sample_rate = 0;
+  int channels = 0;
+  int frame_size = 0;
+  AVRational avg_frame_rate = {0, 1};
+  AVRational r_frame_rate = {0, 1};
+  std::vector<uint8_t> extradata;
+};
+
+namespace utils {
+
+/**
+ * @brief Channel count of codec parameters
+ *
+ * @param par
+ * @return int
+ */
+static inline int codecpar_channels(
+    const AVCodecParameters *par
+) {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+  return par->ch_layout.nb_channels;
+#else
+  return par->channels;
+#endif
+}
+
+/**
+ * @brief Read a camera's cached stream parameters
+ *
+ * @param path
+ * @param streams
+ * @return true if the file exists and was written by this libavcodec
+ */
+static inline bool load_probe_cache(
+    const std::string &path,
+    std::vector<ProbedStream> &streams
+) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  std::string tag;
+  int version = 0;
+  int lavc_major = 0;
+  if (!(in >> tag >> version >> lavc_major) || tag != "probe" ||
+      version != kProbeCacheVersion || lavc_major != LIBAVCODEC_VERSION_MAJOR) {
+    return false;
+  }
+
+  streams.clear();
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    ProbedStream st;
+    std::string extradata;
+    if (!(fields >> tag) || tag != "stream") {
+      continue;
+    }
+    if (!(fields >> st.codec_type >> st.codec_id >> st.format >> st.bit_rate >>
+          st.profile >> st.level >> st.width >> st.height >>
+          st.sample_aspect_ratio.num >> st.sample_aspect_ratio.den >>
+          st.sample_rate >> st.channels >> st.frame_size >>
+          st.avg_frame_rate.num >> st.avg_frame_rate.den >>
+          st.r_frame_rate.num >> st.r_frame_rate.den >> extradata)) {
+      return false;
+    }
+    if (extradata != "-") {
+      for (size_t i = 0; i + 1 < extradata.size(); i += 2) {
+        st.extradata.push_back(static_cast<uint8_t>(
+            std::strtoul(extradata.substr(i, 2).c_str(), nullptr, 16)));
+      }
+    }
+    streams.push_back(st);
+  }
+  return !streams.empty();
+}
+
+/**
+ * @brief Parameters of an input's streams
+ *
+ * @param ctx
+ * @return std::vector<ProbedStream>
+ */
+static inline std::vector<ProbedStream> probed_streams(
+    const AVFormatContext *ctx
+) {
+  std::vector<ProbedStream> streams(ctx->nb_streams);
+  for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+    const AVStream *st = ctx->streams[i];
+    const AVCodecParameters *par = st->codecpar;
+    ProbedStream &out = streams[i];
+    out.codec_type = par->codec_type;
+    out.codec_id = par->codec_id;
+    out.format = par->format;
+    out.bit_rate = par->bit_rate;
+    out.profile = par->profile;
+    out.level = par->level;
+    out.width = par->width;
+    out.height = par->height;
+    out.sample_aspect_ratio = par->sample_aspect_ratio;
+    out.sample_rate = par->sample_rate;
+    out.channels = codecpar_channels(par);
+    out.frame_size = par->frame_size;
+    out.avg_frame_rate = st->avg_frame_rate;
+    out.r_frame_rate = st->r_frame_rate;
+    out.extradata.assign(par->extradata, par->extradata + par->extradata_size);
+  }
+  return streams;
+}
+
+/**
+ * @brief Persist the parameters of a fully probed input
+ *
+ * @param path
+ * @param ctx
+ * @return true on success
+ */
+static inline bool save_probe_cache(
+    const std::string &path,
+    const AVFormatContext *ctx
+) {
+  std::ostringstream out;
+  out << "probe " << kProbeCacheVersion << " " << LIBAVCODEC_VERSION_MAJOR << "\n";
+  for (const ProbedStream &st : probed_streams(ctx)) {
+    out << "stream " << st.codec_type << " " << st.codec_id << " "
+        << st.format << " " << st.bit_rate << " " << st.profile << " "
+        << st.level << " " << st.width << " " << st.height << " "
+        << st.sample_aspect_ratio.num << " " << st.sample_aspect_ratio.den << " "
+        << st.sample_rate << " " << st.channels << " "
+        << st.frame_size << " " << st.avg_frame_rate.num << " "
+        << st.avg_frame_rate.den << " " << st.r_frame_rate.num << " "
+        << st.r_frame_rate.den << " ";
+    if (!st.extradata.empty()) {
+      char hex[3];
+      for (uint8_t b : st.extradata) {
+        std::snprintf(hex, sizeof(hex), "%02x", b);
+        out << hex;
+      }
+    } else {
+      out << "-";
+    }
+    out << "\n";
+  }
+  std::string text = out.str();
+  return write_file_atomic(path, text.data(), text.size());
+}
+
+/**
+ * @brief Check the streams an input opened with against the cache,
+ * before any probing: same layout and codecs, and the same extradata
+ * where the demuxer already has some (e.g. from an RTSP SDP)
+ *
+ * @param ctx
+ * @param streams
+ * @return true if the cache can be applied
+ */
+static inline bool probe_cache_matches_layout(
+    const AVFormatContext *ctx,
+    const std::vector<ProbedStream> &streams
+) {
+  if (ctx->nb_streams != streams.size()) {
+    return false;
+  }
+  for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+    const AVCodecParameters *par = ctx->streams[i]->codecpar;
+    const ProbedStream &cached = streams[i];
+    if (par->codec_type != cached.codec_type || par->codec_id != cached.codec_id) {
+      return false;
+    }
+    if (par->extradata_size > 0 && !cached.extradata.empty() &&
+        (static_cast<size_t>(par->extradata_size) != cached.extradata.size() ||
+         std::memcmp(par->extradata, cached.extradata.data(), cached.extradata.size()) != 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Fill in parameters the demuxer does not know yet from the
+ * cache
+ *
+ * @param ctx input whose layout matches the cache
+ * @param streams
+ */
+static inline void apply_probe_cache(
+    AVFormatContext *ctx,
+    const std::vector<ProbedStream> &streams
+) {
+  for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+    AVStream *st = ctx->streams[i];
+    AVCodecParameters *par = st->codecpar;
+    const ProbedStream &cached = streams[i];
+
+    if (par->format < 0) {
+      par->format = cached.format;
+    }
+    if (par->bit_rate <= 0) {
+      par->bit_rate = cached.bit_rate;
+    }
+    if (par->profile < 0) {
+      par->profile = cached.profile;
+    }
+    if (par->level < 0) {
+      par->level = cached.level;
+    }
+    if (par->width <= 0 || par->height <= 0) {
+      par->width = cached.width;
+      par->height = cached.height;
+    }
+    if (par->sample_aspect_ratio.num == 0) {
+      par->sample_aspect_ratio = cached.sample_aspect_ratio;
+    }
+    if (par->sample_rate <= 0) {
+      par->sample_rate = cached.sample_rate;
+    }
+    if (codecpar_channels(par) <= 0 && cached.channels > 0) {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+      av_channel_layout_default(&par->ch_layout, cached.channels);
+#else
+      par->channels = cached.channels;
+      par->channel_layout = av_get_default_channel_layout(cached.channels);
+#endif
+    }
+    if (par->frame_size <= 0) {
+      par->frame_size = cached.frame_size;
+    }
+    if (st->avg_frame_rate.num == 0) {
+      st->avg_frame_rate = cached.avg_frame_rate;
+    }
+    if (st->r_frame_rate.num == 0) {
+      st->r_frame_rate = cached.r_frame_rate;
+    }
+    if (par->extradata_size == 0 && !cached.extradata.empty()) {
+      par->extradata = static_cast<uint8_t *>(
+          av_mallocz(cached.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+      if (par->extradata) {
+        std::memcpy(par->extradata, cached.extradata.data(), cached.extradata.size());
+        par->extradata_size = static_cast<int>(cached.extradata.size());
+      }
+    }
+  }
+}
+
+/**
+ * @brief Check what a short probe found against the cache: the same
+ * codecs, picture size, audio format and extradata
+ *
+ * @param ctx
+ * @param streams
+ * @return true if the cached parameters still describe the input
+ */
+static inline bool probe_cache_consistent(
+    const AVFormatContext *ctx,
+    const std::vector<ProbedStream> &streams
+) {
+  if (!probe_cache_matches_layout(ctx, streams)) {
+    return false;
+  }
+  for (unsigned int i = 0; i < ctx->nb_streams; ++i) {
+    const AVCodecParameters *par = ctx->streams[i]->codecpar;
+    const ProbedStream &cached = streams[i];
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (par->width != cached.width || par->height != cached.height ||
+         par->format != cached.format)) {
+      return false;
+    }
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (par->sample_rate != cached.sample_rate ||
+         codecpar_channels(par) != cached.channels)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace utils
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.hpp"
+
+/**
+ * Byte-based retention. Every catalogued segment file is reported
+ * here; a background thread evicts the oldest ones, across outputs
+ * and cameras, whenever a camera exceeds its quota, all cameras
+ * together exceed the global quota, or the disk is fuller than
+ * allowed. Eviction runs down to a low-water mark so files are
+ * deleted in batches, away from the write path. The newest segments
+ * of each output, those its live playlist lists, are never evicted.
+ */
+
+/** Seconds between reclaimer passes */
+static constexpr int kReclaimIntervalSec = 5;
+
+/** Fraction of a limit a pass evicts down to */
+static constexpr double kReclaimLowWater = 0.95;
+
+/** Live playlist length of the hls muxer when hls_list_size is unset */
+static constexpr size_t kReclaimDefaultListSize = 5;
+
+/**
+ * @brief Segment file known to the reclaimer
+ */
+struct ReclaimSegment {
+  int64_t start_ms = 0;
+  uint64_t bytes = 0;
+  std::string name;
+};
+
+/**
+ * @brief Segments of one output, oldest first
+ */
+struct ReclaimOutput {
+  std::string dir;
+  std::deque<ReclaimSegment> segments;
+  uint64_t bytes = 0;
+};
+
+class Reclaimer {
+ public:
+  Reclaimer() = default;
+  Reclaimer(const Reclaimer &) = delete;
+  Reclaimer &operator=(const Reclaimer &) = delete;
+
+  ~Reclaimer() {
+    stop();
+  }
+
+  /**
+   * @brief Start the reclaimer thread
+   *
+   * @param global_quota bytes for all cameras together, 0 for none
+   * @param disk_max_percent highest disk usage allowed, 0 for no limit
+   */
+  void start(
+      uint64_t global_quota,
+      int disk_max_percent
+  ) {
+    global_quota_ = global_quota;
+    disk_max_percent_ = disk_max_percent;
+    stopping_ = false;
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  void stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  /**
+   * @brief Set the quota of the camera writing into a directory
+   *
+   * @param dir camera output directory, with a trailing slash
+   * @param bytes 0 removes the quota
+   */
+  void set_quota(
+      const std::string &dir,
+      uint64_t bytes
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (bytes > 0) {
+      quotas_[dir] = bytes;
+      return;
+    }
+    quotas_.erase(dir);
+    if (tracked(dir)) {
+      return;
+    }
+    for (auto it = outputs_.begin(); it != outputs_.end();) {
+      it = it->second.dir == dir ? outputs_.erase(it) : std::next(it);
+    }
+  }
+
+  /**
+   * @brief Set how many of an output's newest segments its live
+   * playlist lists; those are never evicted
+   *
+   * @param catalog_path
+   * @param count 0 protects every segment
+   */
+  void set_list_size(
+      const std::string &catalog_path,
+      size_t count
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    list_sizes_[catalog_path] = count;
+  }
+
+  /**
+   * @brief Replace what is known about an output, e.g. from its
+   * catalog when it is reopened
+   *
+   * @param catalog_path
+   * @param segments oldest first
+   */
+  void reset_output(
+      const std::string &catalog_path,
+      const std::vector<ReclaimSegment> &segments
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string dir = dir_of(catalog_path);
+    if (!tracked(dir)) {
+      outputs_.erase(catalog_path);
+      return;
+    }
+    ReclaimOutput &out = outputs_[catalog_path];
+    out.dir = dir;
+    out.segments.assign(segments.begin(), segments.end());
+    out.bytes = 0;
+    for (const auto &seg : segments) {
+      out.bytes += seg.bytes;
+    }
+  }
+
+  /**
+   * @brief Report a segment an output finished
+   *
+   * @param catalog_path
+   * @param segment
+   */
+  void track(
+      const std::string &catalog_path,
+      const ReclaimSegment &segment
+  ) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string dir = dir_of(catalog_path);
+    if (!tracked(dir)) {
+      return;
+    }
+    ReclaimOutput &out = outputs_[catalog_path];
+    out.dir = dir;
+    out.segments.push_back(segment);
+    out.bytes += segment.bytes;
+  }
+
+ private:
+  static std::string dir_of(
+      const std::string &path
+  ) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  }
+
+  /** Caller holds mutex_ */
+  bool tracked(
+      const std::string &dir
+  ) const {
+    return global_quota_ > 0 || disk_max_percent_ > 0 || quotas_.count(dir) > 0;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      cv_.wait_for(lock, std::chrono::seconds(kReclaimIntervalSec));
+      if (stopping_) {
+        break;
+      }
+      std::vector<std::string> victims;
+      uint64_t freed = plan(victims);
+      if (victims.empty()) {
+        continue;
+      }
+
+      /** Unlink without blocking writers reporting new segments */
+      lock.unlock();
+      size_t removed = 0;
+      for (const auto &path : victims) {
+        if (unlink(path.c_str()) == 0) {
+          ++removed;
+        }
+      }
+      log_message("INFO", "Reclaimed %zu segments, %.1f MB", removed,
+                  freed / (1024.0 * 1024.0));
+      lock.lock();
+    }
+  }
+
+  /**
+   * @brief Drop records of files deleted elsewhere (the hls muxer's
+   * own retention) from the front of each output. Caller holds mutex_.
+   */
+  void prune() {
+    for (auto &entry : outputs_) {
+      ReclaimOutput &out = entry.second;
+      while (!out.segments.empty() &&
+             access((out.dir + out.segments.front().name).c_str(), F_OK) != 0) {
+        out.bytes -= out.segments.front().bytes;
+        out.segments.pop_front();
+      }
+    }
+  }
+
+  /**
+   * @brief Segments of an output its live playlist may still list.
+   * Caller holds mutex_.
+   *
+   * @param catalog_path
+   */
+  size_t listed(
+      const std::string &catalog_path
+  ) const {
+    auto it = list_sizes_.find(catalog_path);
+    if (it == list_sizes_.end()) {
+      return kReclaimDefaultListSize;
+    }
+    return it->second > 0 ? it->second : SIZE_MAX;
+  }
+
+  /**
+   * @brief Pop the oldest segments of the outputs in dir (all outputs
+   * if empty) until at least amount bytes are released, sparing those
+   * in live playlists. Logs once when a limit cannot be met and once
+   * it is met again. Caller holds mutex_.
+   *
+   * @param limit name of the limit, for the log
+   * @param dir
+   * @param amount
+   * @param victims paths to unlink
+   * @return uint64_t bytes released
+   */
+  uint64_t evict(
+      const std::string &limit,
+      const std::string &dir,
+      uint64_t amount,
+      std::vector<std::string> &victims
+  ) {
+    uint64_t freed = 0;
+    while (freed < amount) {
+      ReclaimOutput *oldest = nullptr;
+      for (auto &entry : outputs_) {
+        ReclaimOutput &out = entry.second;
+        if (out.segments.size() <= listed(entry.first) ||
+            (!dir.empty() && out.dir != dir)) {
+          continue;
+        }
+        if (!oldest || out.segments.front().start_ms < oldest->segments.front().start_ms) {
+          oldest = &out;
+        }
+      }
+      if (!oldest) {
+        break;
+      }
+      const ReclaimSegment &seg = oldest->segments.front();
+      victims.push_back(oldest->dir + seg.name);
+      freed += seg.bytes;
+      oldest->bytes -= seg.bytes;
+      oldest->segments.pop_front();
+    }
+
+    if (freed < amount && unmet_.insert(limit).second) {
+      log_message("WARN", "Cannot meet %s: %.1f MB over, the remaining segments "
+                  "are in live playlists", limit.c_str(),
+                  (amount - freed) / (1024.0 * 1024.0));
+    } else if (freed >= amount && unmet_.erase(limit) > 0) {
+      log_message("INFO", "Met %s again", limit.c_str());
+    }
+    return freed;
+  }
+
+  /**
+   * @brief Choose the segments to evict this pass. Caller holds mutex_.
+   *
+   * @param victims paths to unlink
+   * @return uint64_t bytes released
+   */
+  uint64_t plan(
+      std::vector<std::string> &victims
+  ) {
+    prune();
+    uint64_t freed = 0;
+
+    /** Per-camera quotas */
+    for (const auto &quota : quotas_) {
+      uint64_t used = 0;
+      for (const auto &entry : outputs_) {
+        if (entry.second.dir == quota.first) {
+          used += entry.second.bytes;
+        }
+      }
+      if (used > quota.second) {
+        uint64_t target = static_cast<uint64_t>(quota.second * kReclaimLowWater);
+        freed += evict("quota of " + quota.first, quota.first, used - target, victims);
+      } else {
+        unmet_.erase("quota of " + quota.first);
+      }
+    }
+
+    /** Global quota */
+    uint64_t total = 0;
+    for (const auto &entry : outputs_) {
+      total += entry.second.bytes;
+    }
+    if (global_quota_ > 0 && total > global_quota_) {
+      uint64_t target = static_cast<uint64_t>(global_quota_ * kReclaimLowWater);
+      freed += evict("global quota", "", total - target, victims);
+    } else {
+      unmet_.erase("global quota");
+    }
+
+    /** Disk usage, counting what this pass already releases */
+    if (disk_max_percent_ > 0 && !outputs_.empty()) {
+      struct statvfs fs;
+      if (statvfs(outputs_.begin()->second.dir.c_str(), &fs) == 0 && fs.f_blocks > 0) {
+        double size = static_cast<double>(fs.f_blocks) * fs.f_frsize;
+        double used = size - static_cast<double>(fs.f_bavail) * fs.f_frsize - freed;
+        double limit = size * disk_max_percent_ / 100.0;
+        if (used > limit) {
+          double target = limit * kReclaimLowWater;
+          freed += evict("disk usage limit", "", static_cast<uint64_t>(used - target),
+                         victims);
+        } else {
+          unmet_.erase("disk usage limit");
+        }
+      }
+    }
+    return freed;
+  }
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  uint64_t global_quota_ = 0;
+  int disk_max_percent_ = 0;
+  std::map<std::string, uint64_t> quotas_;
+  std::map<std::string, ReclaimOutput> outputs_;
+  /** Live playlist length by catalog path, 0 for unbounded */
+  std::map<std::string, size_t> list_sizes_;
+  /** Limits logged as not met */
+  std::set<std::string> unmet_;
+};
+
+/** Reclaimer of the process, null when retention is time-based only */
+static Reclaimer *g_reclaimer = nullptr;
@@ -0,0 +1,441 @@
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "async_writer.hpp"
+#include "catalog.hpp"
+#include "logger.hpp"
+#include "utils.hpp"
+
+/**
+ * Ring-buffer recording store. Instead of one file per segment, an hls
+ * muxer output writes its segments back to back into a few large
+ * preallocated files, reusing the oldest file once the last one is
+ * full. Segments are addressed by offset through the catalog and the
+ * playlist lists them as EXT-X-BYTERANGE ranges of the ring files, so
+ * recording never creates or unlinks files.
+ */
+
+/** Files a ring is split into; reusing one drops a quarter of the ring */
+static constexpr int kRingFiles = 4;
+
+/** Preallocation granularity of a ring file */
+static constexpr int64_t kRingAlign = 1 << 20;
+
+/**
+ * @brief Where a muxer segment landed in the ring
+ */
+struct RingLocation {
+  int file = 0;
+  int64_t offset = 0;
+  int64_t size = 0;
+};
+
+/**
+ * @brief Takes over segment and playlist IO of an hls muxer output
+ * through its io_open/io_close callbacks. Segments are collected in
+ * memory and written to the ring in one call when the muxer closes
+ * them; the muxer's playlists are rewritten to byte ranges.
+ */
+class RingStore {
+ public:
+  RingStore() = default;
+  RingStore(const RingStore &) = delete;
+  RingStore &operator=(const RingStore &) = delete;
+
+  ~RingStore() {
+    for (AsyncFile *file : async_) {
+      writer_->drain(file);
+      delete file;
+    }
+    for (int fd : fds_) {
+      ::close(fd);
+    }
+  }
+
+  /**
+   * @brief Open or create the ring files of an output and resume
+   * after the last segment the catalog holds
+   *
+   * @param ctx output with its streams set up
+   * @param playlist_path
+   * @param total_bytes ring size, split over kRingFiles files
+   * @param fmp4 fMP4 instead of MPEG-TS segments
+   * @param writer async writer for the ring files, null to write them
+   * synchronously
+   * @param error reason on failure
+   * @return true on success
+   */
+  bool open(
+      AVFormatContext *ctx,
+      const std::string &playlist_path,
+      int64_t total_bytes,
+      bool fmp4,
+      AsyncWriter *writer,
+      std::string &error
+  ) {
+    std::string base = utils::base_without_ext(playlist_path);
+    size_t slash = base.find_last_of('/');
+    dir_ = slash == std::string::npos ? "" : base.substr(0, slash + 1);
+    name_ = slash == std::string::npos ? base : base.substr(slash + 1);
+    ext_ = fmp4 ? ".m4s" : ".ts";
+    file_size_ = std::max(kRingAlign,
+                          total_bytes / kRingFiles / kRingAlign * kRingAlign);
+    video_pid_ = utils::segment_video_pid(ctx, fmp4);
+
+    bool resized = false;
+    for (int i = 0; i < kRingFiles; ++i) {
+      std::string path = dir_ + ring_name(i);
+      int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0) {
+        error = "cannot open " + path + ": " + std::strerror(errno);
+        return false;
+      }
+      fds_.push_back(fd);
+      if (writer) {
+        async_.push_back(writer->attach(fd));
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        error = "cannot stat " + path;
+        return false;
+      }
+      if (st.st_size == file_size_) {
+        continue;
+      }
+      resized = true;
+      /** Reserve the blocks now so recording writes never allocate */
+      if (ftruncate(fd, 0) != 0 || fallocate(fd, 0, 0, file_size_) != 0) {
+        log_message("WARN", "Cannot preallocate %s (%s), using a sparse file",
+                    path.c_str(), std::strerror(errno));
+        if (ftruncate(fd, file_size_) != 0) {
+          error = "cannot size " + path;
+          return false;
+        }
+      }
+    }
+
+    if (!catalog_.open(playlist_path, error)) {
+      return false;
+    }
+
+    /** Resume after the newest segment, unless the ring was re-sized */
+    CatalogEntry last;
+    current_ = 0;
+    offset_ = 0;
+    if (catalog_.last(last) && (last.flags & kCatalogByteRange) && resized) {
+      catalog_.clear();
+    } else if (catalog_.last(last) && (last.flags & kCatalogByteRange)) {
+      for (int i = 0; i < kRingFiles; ++i) {
+        if (ring_name(i) == last.name) {
+          current_ = i;
+          offset_ = static_cast<int64_t>(last.offset + last.bytes);
+        }
+      }
+    } else {
+      catalog_.drop_file(ring_name(0));
+    }
+
+    writer_ = writer;
+    clock_.open(ctx);
+    log_message("INFO", "Recording %s into %d ring files of %lld MB", name_.c_str(),
+                kRingFiles, static_cast<long long>(file_size_ >> 20));
+    return true;
+  }
+
+  /**
+   * @brief Note a packet about to be written to the output, which
+   * times the segments
+   *
+   * @param ctx
+   * @param pkt timestamps in the output stream timebase
+   */
+  void packet(
+      const AVFormatContext *ctx,
+      const AVPacket *pkt
+  ) {
+    clock_.packet(ctx, pkt);
+  }
+
+  /**
+   * @brief The trailer is about to be written
+   */
+  void finishing() {
+    clock_.finishing();
+  }
+
+  /**
+   * @brief Check if the store takes over a file the muxer opens
+   *
+   * @param url
+   */
+  bool intercepts(
+      const char *url
+  ) const {
+    return url && (utils::is_segment_file(url) || is_playlist(url));
+  }
+
+  /**
+   * @brief Hand the muxer a memory buffer for a segment or playlist
+   *
+   * @param pb
+   * @param url
+   * @return int
+   */
+  int opened(
+      AVIOContext **pb,
+      const char *url
+  ) {
+    int ret = avio_open_dyn_buf(pb);
+    if (ret >= 0) {
+      open_[*pb] = url;
+    }
+    return ret;
+  }
+
+  /**
+   * @brief Check if an IO context is one of the store's buffers
+   *
+   * @param pb
+   */
+  bool owns(
+      AVIOContext *pb
+  ) const {
+    return open_.count(pb) > 0;
+  }
+
+  /**
+   * @brief Store a finished segment or publish a playlist, freeing
+   * the buffer
+   *
+   * @param pb
+   */
+  void closed(
+      AVIOContext *pb
+  ) {
+    auto it = open_.find(pb);
+    std::string url = it->second;
+    open_.erase(it);
+
+    uint8_t *data = nullptr;
+    int size = avio_close_dyn_buf(pb, &data);
+    if (size >= 0 && utils::is_segment_file(url)) {
+      store_segment(url, data, size);
+    } else if (size >= 0) {
+      publish_playlist(url, data, size);
+    }
+    av_free(data);
+  }
+
+ private:
+  static bool is_playlist(
+      const std::string &url
+  ) {
+    return url.find(".m3u8") != std::string::npos;
+  }
+
+  std::string ring_name(int file) const {
+    return name_ + "_ring" + std::to_string(file) + ext_;
+  }
+
+  /**
+   * @brief Move to the next ring file, forgetting what it held
+   */
+  void advance() {
+    current_ = (current_ + 1) % kRingFiles;
+    offset_ = 0;
+    catalog_.drop_file(ring_name(current_));
+    for (auto it = locations_.begin(); it != locations_.end();) {
+      it = it->second.file == current_ ? locations_.erase(it) : std::next(it);
+    }
+  }
+
+  /**
+   * @brief Append a segment at the write head and catalog it
+   *
+   * @param url segment name the muxer chose
+   * @param data
+   * @param size
+   */
+  void store_segment(
+      const std::string &url,
+      const uint8_t *data,
+      int64_t size
+  ) {
+    int64_t start_ms = 0;
+    int64_t duration_ms = 0;
+    clock_.closed(start_ms, duration_ms);
+    if (size > file_size_) {
+      log_message("WARN", "Segment %s (%lld bytes) exceeds a ring file, dropped",
+                  url.c_str(), static_cast<long long>(size));
+      return;
+    }
+    if (offset_ + size > file_size_) {
+      advance();
+    }
+
+    int64_t done = writer_ ? size : 0;
+    if (writer_ && writer_->write(async_[current_], data, size, offset_) < 0) {
+      log_message("ERROR", "Failed to write %s", ring_name(current_).c_str());
+      return;
+    }
+    while (done < size) {
+      ssize_t n = pwrite(fds_[current_], data + done, size - done, offset_ + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        log_message("ERROR", "Failed to write %s: %s", ring_name(current_).c_str(),
+                    std::strerror(errno));
+        return;
+      }
+      done += n;
+    }
+
+    CatalogEntry entry = SegmentCatalog::make_entry(ring_name(current_), start_ms,
+                                                    duration_ms, size);
+    entry.offset = offset_;
+    entry.flags = kCatalogByteRange;
+    SegmentCatalog::scan_keyframes(data, size, video_pid_, entry);
+    catalog_.append(entry);
+
+    RingLocation loc;
+    loc.file = current_;
+    loc.offset = offset_;
+    loc.size = size;
+    locations_[utils::file_name(url)] = loc;
+    offset_ += size;
+  }
+
+  /**
+   * @brief Write the muxer's playlist with its segments replaced by
+   * ring byte ranges. Segments already overwritten are left out.
+   *
+   * @param url playlist path the muxer is writing
+   * @param data playlist text
+   * @param size
+   */
+  void publish_playlist(
+      const std::string &url,
+      const uint8_t *data,
+      int size
+  ) {
+    static const char *kGlobalTags[] = {
+        "#EXTM3U", "#EXT-X-TARGETDURATION", "#EXT-X-DISCONTINUITY-SEQUENCE",
+        "#EXT-X-PLAYLIST-TYPE", "#EXT-X-ALLOW-CACHE", "#EXT-X-INDEPENDENT-SEGMENTS",
+    };
+
+    std::istringstream in(std::string(reinterpret_cast<const char *>(data), size));
+    std::string header;
+    std::string body;
+    std::string block;
+    std::string carry;
+    int version = 4;
+    long long media_sequence = 0;
+    bool ended = false;
+    bool listed = false;
+    char range[64];
+
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      if (line[0] != '#') {
+        auto it = locations_.find(utils::file_name(line));
+        if (it == locations_.end()) {
+          /** Overwritten; keep its init section reference for the next */
+          if (!listed) {
+            ++media_sequence;
+          }
+          std::istringstream tags(block);
+          std::string tag;
+          while (std::getline(tags, tag)) {
+            if (utils::starts_with(tag, "#EXT-X-MAP")) {
+              carry = tag + "\n";
+            }
+          }
+          block.clear();
+          continue;
+        }
+        std::snprintf(range, sizeof(range), "#EXT-X-BYTERANGE:%lld@%lld\n",
+                      static_cast<long long>(it->second.size),
+                      static_cast<long long>(it->second.offset));
+        body += carry + block + range + ring_name(it->second.file) + "\n";
+        carry.clear();
+        block.clear();
+        listed = true;
+        continue;
+      }
+
+      if (utils::starts_with(line, "#EXT-X-VERSION:")) {
+        version = std::max(version, std::atoi(line.c_str() + 15));
+      } else if (utils::starts_with(line, "#EXT-X-MEDIA-SEQUENCE:")) {
+        media_sequence += std::atoll(line.c_str() + 22);
+      } else if (line == "#EXT-X-ENDLIST") {
+        ended = true;
+      } else if (std::any_of(std::begin(kGlobalTags), std::end(kGlobalTags),
+                             [&](const char *tag) { return utils::starts_with(line, tag); })) {
+        header += line + "\n";
+      } else {
+        block += line + "\n";
+      }
+    }
+
+    /** Segments are complete before a playlist lists them; their
+     * sync to disk is left to the writer, one per segment */
+    if (writer_) {
+      for (AsyncFile *file : async_) {
+        writer_->drain(file);
+      }
+      writer_->sync(async_[current_], false);
+    }
+
+    /** EXT-X-BYTERANGE needs version 4 */
+    std::string m3u8 = header + "#EXT-X-VERSION:" + std::to_string(version) + "\n" +
+                       "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(media_sequence) +
+                       "\n" + body + (ended ? "#EXT-X-ENDLIST\n" : "");
+    if (!utils::write_file_atomic(url, m3u8.data(), m3u8.size())) {
+      log_message("ERROR", "Failed to write %s", url.c_str());
+    }
+  }
+
+  SegmentCatalog catalog_;
+  SegmentClock clock_;
+  std::vector<int> fds_;
+  AsyncWriter *writer_ = nullptr;
+  std::vector<AsyncFile *> async_;
+  std::string dir_;
+  std::string name_;
+  std::string ext_;
+  int64_t file_size_ = 0;
+  int video_pid_ = -1;
+
+  /** Write head */
+  int current_ = 0;
+  int64_t offset_ = 0;
+
+  std::map<AVIOContext *, std::string> open_;
+  std::map<std::string, RingLocation> locations_;
+};
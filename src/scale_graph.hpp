@@ -0,0 +1,245 @@
+#pragma once
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Output size and format requested from the scale graph
+ */
+struct ScaleTarget {
+  int width;
+  int height;
+  AVPixelFormat format;
+};
+
+/**
+ * @brief Cascaded downscaler for a rendition ladder. Instead of
+ * scaling every rendition from the full source, each rendition is
+ * scaled from the smallest already-scaled picture that still covers
+ * it, e.g. source->720p->480p->240p, so only the first step reads the
+ * full-resolution frame. Scaler contexts and output buffers live for
+ * the whole session and are reused for every frame.
+ */
+class ScaleGraph {
+ public:
+  /** Parent index meaning "scale from the decoded source frame" */
+  static constexpr int kSource = -1;
+
+  ScaleGraph() = default;
+  ScaleGraph(const ScaleGraph &) = delete;
+  ScaleGraph &operator=(const ScaleGraph &) = delete;
+
+  ~ScaleGraph() {
+    reset();
+  }
+
+  /**
+   * @brief Plan the graph for a source geometry
+   *
+   * @param src_width
+   * @param src_height
+   * @param src_format
+   * @param targets one entry per rendition, outputs keep this indexing
+   * @return AVERROR code, 0 on success
+   */
+  int build(
+      int src_width,
+      int src_height,
+      AVPixelFormat src_format,
+      const std::vector<ScaleTarget> &targets
+  ) {
+    reset();
+    src_width_ = src_width;
+    src_height_ = src_height;
+    src_format_ = src_format;
+    nodes_.resize(targets.size());
+
+    /** Largest first, so every parent is scaled before its children */
+    order_.clear();
+    for (size_t i = 0; i < targets.size(); ++i) {
+      order_.push_back(i);
+    }
+    std::stable_sort(order_.begin(), order_.end(), [&](size_t a, size_t b) {
+      return area(targets[a].width, targets[a].height) >
+             area(targets[b].width, targets[b].height);
+    });
+
+    for (size_t pos = 0; pos < order_.size(); ++pos) {
+      size_t idx = order_[pos];
+      Node &node = nodes_[idx];
+      node.target = targets[idx];
+
+      /** Cheapest parent: the smallest planned picture covering this one */
+      node.parent = kSource;
+      int parent_w = src_width;
+      int parent_h = src_height;
+      AVPixelFormat parent_fmt = src_format;
+      for (size_t prev = 0; prev < pos; ++prev) {
+        const Node &cand = nodes_[order_[prev]];
+        if (cand.target.width < node.target.width ||
+            cand.target.height < node.target.height) {
+          continue;
+        }
+        if (area(cand.target.width, cand.target.height) <
+            area(parent_w, parent_h)) {
+          node.parent = static_cast<int>(order_[prev]);
+          parent_w = cand.target.width;
+          parent_h = cand.target.height;
+          parent_fmt = cand.target.format;
+        }
+      }
+
+      node.frame = av_frame_alloc();
+      if (!node.frame) {
+        return AVERROR(ENOMEM);
+      }
+
+      /** Same geometry as the parent: share its buffers */
+      node.passthrough = parent_w == node.target.width &&
+                         parent_h == node.target.height &&
+                         parent_fmt == node.target.format;
+      if (node.passthrough) {
+        continue;
+      }
+
+      node.sws = sws_getContext(parent_w, parent_h, parent_fmt,
+                                node.target.width, node.target.height,
+                                node.target.format, SWS_BILINEAR, nullptr,
+                                nullptr, nullptr);
+      if (!node.sws) {
+        return AVERROR(EINVAL);
+      }
+
+      node.frame->format = node.target.format;
+      node.frame->width = node.target.width;
+      node.frame->height = node.target.height;
+      int ret = av_frame_get_buffer(node.frame, 32);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+
+    built_ = true;
+    return 0;
+  }
+
+  /**
+   * @brief Check that the plan was built for this source geometry
+   *
+   * @param src
+   */
+  bool matches(
+      const AVFrame *src
+  ) const {
+    return built_ && src->width == src_width_ && src->height == src_height_ &&
+           src->format == src_format_;
+  }
+
+  /**
+   * @brief Node indexes in an order where parents precede children
+   */
+  const std::vector<size_t> &order() const {
+    return order_;
+  }
+
+  /**
+   * @brief Parent of a node, kSource for the decoded frame
+   *
+   * @param idx
+   */
+  int parent(
+      size_t idx
+  ) const {
+    return nodes_[idx].parent;
+  }
+
+  /**
+   * @brief Produce one node's picture; its parent must be done
+   *
+   * @param idx
+   * @param src decoded source frame, read only
+   * @return AVERROR code, 0 on success
+   */
+  int scale(
+      size_t idx,
+      const AVFrame *src
+  ) {
+    Node &node = nodes_[idx];
+    const AVFrame *in = node.parent == kSource ? src
+                                               : nodes_[node.parent].frame;
+
+    if (node.passthrough) {
+      av_frame_unref(node.frame);
+      return av_frame_ref(node.frame, in);
+    }
+
+    /** Reallocates only if the encoder still holds the last picture */
+    int ret = av_frame_make_writable(node.frame);
+    if (ret < 0) {
+      return ret;
+    }
+
+    sws_scale(node.sws, in->data, in->linesize, 0, in->height,
+              node.frame->data, node.frame->linesize);
+    return 0;
+  }
+
+  /**
+   * @brief Picture produced for a node by the last scale() call
+   *
+   * @param idx
+   */
+  AVFrame *output(
+      size_t idx
+  ) {
+    return nodes_[idx].frame;
+  }
+
+  /**
+   * @brief Release every scaler and buffer
+   */
+  void reset() {
+    for (auto &node : nodes_) {
+      if (node.sws) {
+        sws_freeContext(node.sws);
+        node.sws = nullptr;
+      }
+      if (node.frame) {
+        av_frame_free(&node.frame);
+      }
+    }
+    nodes_.clear();
+    order_.clear();
+    built_ = false;
+  }
+
+ private:
+  struct Node {
+    ScaleTarget target{0, 0, AV_PIX_FMT_NONE};
+    int parent = kSource;
+    bool passthrough = false;
+    SwsContext *sws = nullptr;
+    AVFrame *frame = nullptr;
+  };
+
+  static int64_t area(
+      int width,
+      int height
+  ) {
+    return static_cast<int64_t>(width) * height;
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<size_t> order_;
+  int src_width_ = 0;
+  int src_height_ = 0;
+  int src_format_ = AV_PIX_FMT_NONE;
+  bool built_ = false;
+};
@@ -7,6 +7,7 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
@@ -15,6 +16,12 @@ extern "C" {
 #include <inttypes.h>
 #include <csignal>
 #include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
@@ -22,52 +29,72 @@ extern "C" {
 #include "logger.hpp"
 #include "utils.hpp"
 #include "avoptions.hpp"
+#include "bounded_queue.hpp"
+#include "control_socket.hpp"
+#include "http_server.hpp"
+#include "input_clock.hpp"
+#include "live_cache.hpp"
+#include "manifest.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "probe_cache.hpp"
+#include "worker_pool.hpp"
+
+/** How often ingest re-evaluates viewer demand */
+static constexpr int64_t kDemandPollMs = 250;
+
+/** Interval of ingest rate and queue depth metrics */
+static constexpr int64_t kMetricsPublishMs = 1000;
 
 /**
- * @brief Struct used for quality
- * version of live stream 
+ * @brief A camera hosted by this process: its settings, the thread
+ * running its reconnect loop and the pool its pipeline stages run on
  */
-struct Rendition {
-  std::string name;
-  int width;
-  int height;
-  int video_bitrate;
-};
+struct CameraSession {
+  CameraConfig config;
+  std::atomic<bool> stop{false};
+  std::atomic<bool> finished{false};
+  int exit_code = 0;
+  WorkerPool *pool = nullptr;
+  std::thread thread;
 
-/**
- * @brief Struct to abstract libav
- * contexts for codec, format, scaler,
- * frame and packet
- */
-struct EncodeOutput {
-  AVFormatContext *fmt = nullptr;
-  AVStream *vstream = nullptr;
-  AVStream *astream = nullptr;
-  AVCodecContext *venc = nullptr;
-  SwsContext *sws = nullptr;
-  AVFrame *sws_frame = nullptr;
-  AVPacket *enc_pkt = nullptr;
-};
+  /** Rendition name -> steady clock ms until which a viewer wants it */
+  std::mutex demand_mutex;
+  std::map<std::string, int64_t> demand_until_ms;
 
-/**
- * @brief Aggregated runtime state for a streaming session
- */
-struct StreamState {
-  AVFormatContext *in_ctx = nullptr;
-  AVFormatContext *copy_ctx = nullptr;
-  AVCodecContext *vdec = nullptr;
-  AVStream *video_stream = nullptr;
-  int video_index = -1;
-  int audio_index = -1;
-  int64_t fallback_pts = 0;
-  int64_t packet_count = 0;
-  std::vector<int64_t> copy_next_pts;
-  std::vector<EncodeOutput> outputs;
-  AVFrame *decoded = nullptr;
-  AVPacket *audio_pkt = nullptr;
+  /** Decoder threads with --reduced-decode, 0 lets libav decide */
+  int decode_threads = 0;
+
+  /** Slot in the metrics file, or local_metrics when there is none */
+  CameraMetrics local_metrics{};
+  CameraMetrics *metrics = &local_metrics;
+
+  /** Output timeline of the main input, followed by sub-stream inputs */
+  TimelineAnchor timeline;
 };
 
 static std::atomic<bool> g_stop_requested(false);
+static std::atomic<bool> g_reload_requested(false);
+
+/** Guards the camera list against lookups from the control thread */
+static std::mutex g_cameras_mutex;
+
+
+/** Decoder threads per camera with --reduced-decode, -1 to split the
+ * worker pool between the cameras of the manifest */
+static int g_decode_threads = -1;
+
+/** Shared metrics file, enabled with --metrics-file */
+static MetricsRegion g_metrics;
+
+/**
+ * @brief Monotonic clock in milliseconds
+ */
+static int64_t steady_now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 
 /**
  * @brief Suppress libav logging
@@ -87,11 +114,46 @@ static void quiet_av_log_callback(void *ptr, int level, const char *fmt,
  * @param signum
  */
 static void handle_signal(int signum) {
-  /** Request stop */
-  (void)signum;
+  /** Request stop, or a manifest reload on SIGHUP */
+  if (signum == SIGHUP) {
+    g_reload_requested.store(true);
+    return;
+  }
   g_stop_requested.store(true);
 }
 
+/**
+ * @brief Check if the process or this camera is shutting down
+ *
+ * @param session
+ */
+static bool stop_requested(const CameraSession &session) {
+  return g_stop_requested.load() || session.stop.load();
+}
+
+/**
+ * @brief Interrupt callback aborting blocking libav IO on shutdown
+ *
+ * @param opaque CameraSession
+ * @return int non-zero to abort
+ */
+static int interrupt_on_stop(void *opaque) {
+  return stop_requested(*static_cast<const CameraSession *>(opaque)) ? 1 : 0;
+}
+
+/**
+ * @brief Sleep for the reconnect delay, waking early on shutdown
+ *
+ * @param session
+ * @param seconds
+ */
+static void sleep_unless_stopped(const CameraSession &session, int seconds) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  while (!stop_requested(session) && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
 /**
  * @brief Print CLI usage instructions
  * 
@@ -104,24 +166,52 @@ static void print_usage(const char *argv0) {
       "Usage: %s <input_url> <output_path> [--rtsp-tcp] [--reconnect-sec N] "
       "[--copy-max-keep-minutes M] [--encode-max-keep-minutes M] "
       "[--copy-hls-time S] [--encode-hls-time S] "
-      "[--log-file PATH]\n"
+      "[--on-demand] [--rendition-idle-sec S] [--ladder PATH] [--ladder-auto] "
+      "[--ll-hls-part-ms MS] [--segment-format ts|fmp4] [--ring-store-mb MB] "
+      "[--quota-mb MB] [--sub-input NAME=URL]... [--reduced-decode] "
+      "[--global-quota-mb MB] [--disk-max-percent P] [--log-file PATH] "
+      "[--workers N] [--codec-threads N] [--decode-threads N] [--async-io N] "
+      "[--live-http [ADDR:]PORT] [--live-root DIR] [--live-cache-segments N] "
+      "[--segment-http [ADDR:]PORT] [--control-socket PATH] [--metrics-file PATH] [--metrics-slots N] "
+      "[--ready-file PATH]\n"
+      "       %s --manifest PATH [camera defaults...] [--log-file PATH] "
+      "[--workers N] [--codec-threads N] [--decode-threads N] [--async-io N] "
+      "[--global-quota-mb MB] [--disk-max-percent P] "
+      "[--live-http [ADDR:]PORT] [--live-root DIR] "
+      "[--live-cache-segments N] [--segment-http [ADDR:]PORT] [--control-socket PATH] "
+      "[--metrics-file PATH] [--metrics-slots N] [--ready-file PATH]\n"
       "Note: If output_path is a directory, index.m3u8 is created inside.\n"
-      "Example: %s rtsp://cam/stream out.m3u8 --max-keep-minutes 5\n",
-      argv0, argv0);
+      "Manifest lines read \"<id> <input_url> <output_path> [camera flags]\"; "
+      "send SIGHUP to reload, once --ready-file exists. Bad lines are "
+      "skipped.\n"
+      "With --on-demand, renditions run only while \"demand <id> <rendition>\" "
+      "datagrams arrive on the control socket.\n"
+      "--metrics-file publishes live per-camera metrics for streamer_metrics.\n"
+      "Ladder lines read \"<name> <W>x<H> <bitrate> [fps=N] [preset=P] "
+      "[aspect=stretch|fit]\"; --ladder-auto serves renditions at or above "
+      "the source resolution from the copy output.\n"
+      "--ll-hls-part-ms writes Low-Latency HLS (fMP4 segments with parts of "
+      "that duration) instead of MPEG-TS segments.\n"
+      "--ring-store-mb records the copy output into preallocated ring files "
+      "of that total size, listed as byte ranges.\n"
+      "--async-io N writes segments through io_uring with N writes in flight "
+      "(0 writes them on the mux threads).\n"
+      "--quota-mb, --global-quota-mb and --disk-max-percent bound recorded "
+      "segments; a background thread deletes the oldest across cameras.\n"
+      "--live-http serves the live window of every output under --live-root "
+      "from memory; renditions are then not written to disk. A bare PORT "
+      "listens on loopback only. Not used together with --ll-hls-part-ms.\n"
+      "--segment-http serves recorded files under --live-root with sendfile, "
+      "including byte ranges.\n"
+      "--reduced-decode decodes on --decode-threads threads (default: the "
+      "camera's share of the workers) and skips detail the renditions cannot "
+      "show (lowres, loop filter, non-reference frames).\n"
+      "--sub-input NAME=URL remuxes a camera sub-stream as rendition NAME "
+      "instead of encoding it, aligned to the main input's timeline.\n"
+      "Example: %s rtsp://cam/stream out.m3u8 --encode-max-keep-minutes 5\n",
+      argv0, argv0, argv0);
 }
 
-/**
- * @brief Convert AVERROR to string
- * 
- * @param errnum 
- * @return std::string 
- */
-static std::string av_err2str_cpp(int errnum) {
-  /** Format FFmpeg error code */
-  char buf[AV_ERROR_MAX_STRING_SIZE];
-  av_strerror(errnum, buf, sizeof(buf));
-  return std::string(buf);
-}
 
 /** 
  * @brief Check if a string starts with a given prefix
@@ -149,68 +239,21 @@ static bool is_live_input(const std::string &url) {
 }
 
 
-/**
- * @brief Close copy outputs by writing trailer, closing IO and freeing context
- * 
- * @param out_ctx 
- */
-static void close_copy_output(AVFormatContext *out_ctx) {
-  /** Close copy output */
-  if (!out_ctx) {
-    return;
-  }
-
-  av_write_trailer(out_ctx);
-  if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
-    avio_closep(&out_ctx->pb);
-  }
-  avformat_free_context(out_ctx);
-}
-
-/**
- * @brief Close reencode outputs by flushing encoders, writing trailer, closing IO and freeing contexts
- * 
- * @param outputs 
- */
-static void close_reencode_outputs(std::vector<EncodeOutput> &outputs) {
-  /** Close reencoded outputs */
-  for (auto &out : outputs) {
-    if (out.fmt) {
-      av_write_trailer(out.fmt);
-      if (!(out.fmt->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&out.fmt->pb);
-      }
-      avformat_free_context(out.fmt);
-      out.fmt = nullptr;
-    }
-
-    if (out.venc) {
-      avcodec_free_context(&out.venc);
-    }
-
-    if (out.sws_frame) {
-      av_frame_free(&out.sws_frame);
-    }
-
-    if (out.sws) {
-      sws_freeContext(out.sws);
-    }
-
-    if (out.enc_pkt) {
-      av_packet_free(&out.enc_pkt);
-    }
-  }
-}
 
 /**
  * @brief Open input stream with appropriate options for RTSP and HLS
  * 
  * @param input_url 
  * @param rtsp_tcp 
+ * @param interrupt_cb callback aborting blocking reads on shutdown
+ * @param probe_path stream parameter cache, empty to always probe fully
+ * @param use_cache try the cached parameters with a short probe
  * @param in_ctx 
  * @return int 
  */
 static int open_input(const std::string &input_url, bool rtsp_tcp,
+                      const AVIOInterruptCB &interrupt_cb,
+                      const std::string &probe_path, bool use_cache,
                       AVFormatContext **in_ctx) {
   AVDictionary *opts = nullptr;
 
@@ -232,6 +275,14 @@ static int open_input(const std::string &input_url, bool rtsp_tcp,
   }
 
   /** Open input */
+  *in_ctx = avformat_alloc_context();
+  if (!*in_ctx) {
+    av_dict_free(&opts);
+    log_message("ERROR", "Failed to allocate input context");
+    return AVERROR(ENOMEM);
+  }
+  (*in_ctx)->interrupt_callback = interrupt_cb;
+
   int ret = avformat_open_input(in_ctx, input_url.c_str(), nullptr, &opts);
   av_dict_free(&opts);
   if (ret < 0) {
@@ -243,694 +294,380 @@ static int open_input(const std::string &input_url, bool rtsp_tcp,
   /** Generate missing PTS if needed */
   (*in_ctx)->flags |= AVFMT_FLAG_GENPTS;
 
+  /** Start from the last full probe when the input still looks the same */
+  std::vector<ProbedStream> cached;
+  bool cache_applied = use_cache && !probe_path.empty() &&
+                       utils::load_probe_cache(probe_path, cached) &&
+                       utils::probe_cache_matches_layout(*in_ctx, cached);
+  if (cache_applied) {
+    utils::apply_probe_cache(*in_ctx, cached);
+    (*in_ctx)->probesize = kProbeCacheProbesize;
+    (*in_ctx)->max_analyze_duration = kProbeCacheAnalyzeUs;
+  }
+
   /** Load stream info */
   ret = avformat_find_stream_info(*in_ctx, nullptr);
+  if (cache_applied && (ret < 0 || !utils::probe_cache_consistent(*in_ctx, cached))) {
+    log_message("WARN", "Cached stream parameters no longer match, probing fully");
+    avformat_close_input(in_ctx);
+    return open_input(input_url, rtsp_tcp, interrupt_cb, probe_path, false, in_ctx);
+  }
   if (ret < 0) {
     log_message("ERROR", "Failed to find stream info: %s",
                 av_err2str_cpp(ret).c_str());
     return ret;
   }
 
+  if (!cache_applied && !probe_path.empty() &&
+      !utils::save_probe_cache(probe_path, *in_ctx)) {
+    log_message("WARN", "Failed to write %s", probe_path.c_str());
+  }
+
   /** Log stream discovery */
-  log_message("INFO", "Opened input with %u streams", (*in_ctx)->nb_streams);
+  log_message("INFO", "Opened input with %u streams%s", (*in_ctx)->nb_streams,
+              cache_applied ? " (cached parameters)" : "");
 
   return 0;
 }
 
+
 /**
- * @brief Open codec copy output context for HLS with appropriate options
- * 
- * @param output_path 
- * @param in_ctx 
- * @param out_ctx 
- * @param max_keep_minutes 
- * @param hls_time_sec 
- * @return int 
+ * @brief Mark renditions wanted or idle from viewer demand and decide
+ * whether video has to be decoded at all. A camera nobody watches is
+ * only remuxed to the copy output.
+ *
+ * @param state
+ * @param session
  */
-static int open_copy_output(const std::string &output_path,
-                            AVFormatContext *in_ctx,
-                            AVFormatContext **out_ctx, int max_keep_minutes,
-                            int copy_hls_time_sec) {
-  /** Create output context (HLS) */
-  int ret = avformat_alloc_output_context2(out_ctx, nullptr, "hls",
-                                           output_path.c_str());
-  if (ret < 0 || !*out_ctx) {
-    log_message("ERROR", "Failed to create output context: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret < 0 ? ret : AVERROR_UNKNOWN;
-  }
-
-  /** Copy input streams */
-  for (unsigned int i = 0; i < in_ctx->nb_streams; ++i) {
-    AVStream *in_stream = in_ctx->streams[i];
-    AVStream *out_stream = avformat_new_stream(*out_ctx, nullptr);
-    if (!out_stream) {
-      log_message("ERROR", "Failed to allocate output stream");
-      return AVERROR(ENOMEM);
-    }
-
-    ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-    if (ret < 0) {
-      log_message("ERROR", "Failed to copy codec parameters: %s",
-                  av_err2str_cpp(ret).c_str());
-      return ret;
-    }
-
-    out_stream->codecpar->codec_tag = 0;
-    out_stream->time_base = in_stream->time_base;
+static void refresh_demand(StreamState &state, CameraSession &session) {
+  int64_t now = steady_now_ms();
+  if (now < state.next_demand_poll_ms) {
+    return;
   }
+  state.next_demand_poll_ms = now + kDemandPollMs;
 
-  /** Open output IO */
-  if (!((*out_ctx)->oformat->flags & AVFMT_NOFILE)) {
-    ret = avio_open(&(*out_ctx)->pb, output_path.c_str(), AVIO_FLAG_WRITE);
-    if (ret < 0) {
-      log_message("ERROR", "Failed to open output file: %s",
-                  av_err2str_cpp(ret).c_str());
-      return ret;
+  bool want_decode = false;
+  {
+    std::lock_guard<std::mutex> lock(session.demand_mutex);
+    for (auto &out : state.outputs) {
+      bool wanted = !session.config.on_demand;
+      auto it = session.demand_until_ms.find(out.rendition.name);
+      if (it != session.demand_until_ms.end() && it->second > now) {
+        wanted = true;
+      }
+      out.wanted.store(wanted);
+      want_decode = want_decode || wanted ||
+                    out.status.load() == kOutputOpen;
     }
   }
 
-  /** Write header with HLS options */
-  AVDictionary *hls_opts = nullptr;
-  std::string base = utils::base_without_ext(
-      output_path
-  );
-  std::string seg_pattern = base + "_seg_%d.ts";
-  utils::set_hls_output_options(
-      &hls_opts,
-      max_keep_minutes,
-      copy_hls_time_sec,
-      seg_pattern
-  );
-  ret = avformat_write_header(*out_ctx, &hls_opts);
-  av_dict_free(&hls_opts);
-  if (ret < 0) {
-    log_message("ERROR", "Failed to write header: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret;
-  }
-
-  return 0;
-}
-
-/**
- * @brief Add audio stream copy to output context
- * 
- * @param in_ctx 
- * @param out_ctx 
- * @param audio_index 
- * @return int 
- */
-static int add_audio_stream_copy(AVFormatContext *in_ctx,
-                                 AVFormatContext *out_ctx,
-                                 int audio_index) {
-  /** Create audio stream copy */
-  AVStream *in_stream = in_ctx->streams[audio_index];
-  AVStream *out_stream = avformat_new_stream(out_ctx, nullptr);
-  if (!out_stream) {
-    log_message("ERROR", "Failed to allocate audio stream");
-    return AVERROR(ENOMEM);
-  }
-
-  int ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-  if (ret < 0) {
-    log_message("ERROR", "Failed to copy audio codec parameters: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret;
+  if (want_decode && !state.decoding) {
+    /** Restart cleanly at the next keyframe */
+    AVPacket *flush = nullptr;
+    state.decode_queue.try_push(flush);
+    state.decode_wait_keyframe = true;
   }
-
-  out_stream->codecpar->codec_tag = 0;
-  out_stream->time_base = in_stream->time_base;
-  return 0;
+  state.decoding = want_decode;
 }
 
 /**
- * @brief Initialize encoder context for a given rendition and output format
- * 
- * @param out The EncodeOutput structure to initialize
- * @param rendition The rendition settings
- * @param fps The frame rate
- * @param global_header Whether to use a global header
-
- * @return int 
+ * @brief Count one ingested packet and, once per interval, publish
+ * ingest rates, queue depths and drops
+ *
+ * @param state
+ * @param pkt read packet, before it is distributed
  */
-static int init_video_encoder(EncodeOutput &out, const Rendition &rendition,
-                              AVRational fps, bool global_header) {
-  /** Find H.264 encoder */
-  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-  if (!codec) {
-    log_message("ERROR", "H.264 encoder not found");
-    return AVERROR_ENCODER_NOT_FOUND;
-  }
-
-  /** Create encoder context */
-  out.venc = avcodec_alloc_context3(codec);
-  if (!out.venc) {
-    log_message("ERROR", "Failed to allocate encoder context");
-    return AVERROR(ENOMEM);
+static void update_ingest_metrics(StreamState &state, const AVPacket *pkt) {
+  CameraMetrics *m = state.metrics;
+  m->packets_in.fetch_add(1, std::memory_order_relaxed);
+  m->bytes_in.fetch_add(static_cast<uint64_t>(pkt->size),
+                        std::memory_order_relaxed);
+  if (pkt->stream_index == state.video_index) {
+    m->video_frames_in.fetch_add(1, std::memory_order_relaxed);
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+      m->last_keyframe_unix_ms.store(utils::metrics_unix_ms(),
+                                     std::memory_order_relaxed);
+    }
   }
 
-  out.venc->codec_id = AV_CODEC_ID_H264;
-  out.venc->width = rendition.width;
-  out.venc->height = rendition.height;
-  out.venc->pix_fmt = AV_PIX_FMT_YUV420P;
-  out.venc->time_base = av_inv_q(fps);
-  out.venc->framerate = fps;
-  out.venc->bit_rate = rendition.video_bitrate;
-  out.venc->gop_size = fps.num > 0 ? fps.num * 2 / fps.den : 60;
-  out.venc->max_b_frames = 0;
-
-  /** Honor global header requirement */
-  if (global_header) {
-    out.venc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  int64_t now = steady_now_ms();
+  if (state.next_metrics_ms == 0) {
+    state.next_metrics_ms = now + kMetricsPublishMs;
+    state.metrics_frames = m->video_frames_in.load(std::memory_order_relaxed);
+    state.metrics_bytes = m->bytes_in.load(std::memory_order_relaxed);
+    return;
   }
-
-  /** Apply low-latency-ish tune */
-  utils::set_h264_encoder_options(
-      out.venc->priv_data
-  );
-
-  /** Open encoder */
-  int ret = avcodec_open2(out.venc, codec, nullptr);
-  if (ret < 0) {
-    log_message("ERROR", "Failed to open H.264 encoder: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret;
+  if (now < state.next_metrics_ms) {
+    return;
   }
 
-  return 0;
+  int64_t elapsed = now - state.next_metrics_ms + kMetricsPublishMs;
+  state.next_metrics_ms = now + kMetricsPublishMs;
+  uint64_t frames = m->video_frames_in.load(std::memory_order_relaxed);
+  uint64_t bytes = m->bytes_in.load(std::memory_order_relaxed);
+  m->ingest_fps_milli.store((frames - state.metrics_frames) * 1000000 /
+                                static_cast<uint64_t>(elapsed),
+                            std::memory_order_relaxed);
+  m->ingest_bitrate_bps.store((bytes - state.metrics_bytes) * 8000 /
+                                  static_cast<uint64_t>(elapsed),
+                              std::memory_order_relaxed);
+  state.metrics_frames = frames;
+  state.metrics_bytes = bytes;
+
+  int64_t dropped = state.dropped_packets.load();
+  m->dropped_packets.fetch_add(static_cast<uint64_t>(dropped - state.metrics_dropped),
+                               std::memory_order_relaxed);
+  state.metrics_dropped = dropped;
+
+  m->decode_queue_depth.store(state.decode_queue.size(), std::memory_order_relaxed);
+  m->mux_queue_depth.store(state.mux_queue.size(), std::memory_order_relaxed);
+  m->active_renditions.store(static_cast<uint64_t>(state.active_outputs.load()),
+                             std::memory_order_relaxed);
 }
 
 /**
- * @brief Initialize reencode output context with video encoder and HLS options
- * 
- * @param output_path The path to the output file
- * @param in_ctx The input format context
- * @param audio_index The index of the audio stream to copy
- * @param rendition The rendition settings
- * @param max_keep_minutes 
- * @param hls_time_sec 
- * @param fps 
- * @param out 
- * @return int 
+ * @brief Ingest loop: read packets and distribute them to the
+ * pipeline stages running on the shared worker pool
+ *
+ * @param state
+ * @param session
+ * @return int
  */
-static int init_reencode_output(const std::string &output_path,
-                                AVFormatContext *in_ctx,
-                                int audio_index, const Rendition &rendition,
-                                int max_keep_minutes, int encode_hls_time_sec,
-                                AVRational fps, EncodeOutput &out) {
-  /** Create output context (HLS) */
-  int ret = avformat_alloc_output_context2(&out.fmt, nullptr, "hls",
-                                           output_path.c_str());
-  if (ret < 0 || !out.fmt) {
-    log_message("ERROR", "Failed to create output context: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret < 0 ? ret : AVERROR_UNKNOWN;
-  }
-
-  /** Initialize video encoder */
-  ret = init_video_encoder(out, rendition, fps,
-                           (out.fmt->oformat->flags & AVFMT_GLOBALHEADER) != 0);
-  if (ret < 0) {
-    return ret;
-  }
-
-  /** Allocate reusable packet */
-  out.enc_pkt = av_packet_alloc();
-  if (!out.enc_pkt) {
-    log_message("ERROR", "Failed to allocate encoder packet");
+static int run_loop(StreamState &state, CameraSession &session) {
+  /** Allocate packet for reading */
+  AVPacket *pkt = av_packet_alloc();
+  if (!pkt) {
+    log_message("ERROR", "Failed to allocate packet");
     return AVERROR(ENOMEM);
   }
 
-  /** Add video stream */
-  out.vstream = avformat_new_stream(out.fmt, nullptr);
-  if (!out.vstream) {
-    log_message("ERROR", "Failed to allocate video stream");
-    return AVERROR(ENOMEM);
-  }
+  start_pipeline(state, *session.pool);
+  state.metrics->connected.store(1, std::memory_order_relaxed);
 
-  ret = avcodec_parameters_from_context(out.vstream->codecpar, out.venc);
-  if (ret < 0) {
-    log_message("ERROR", "Failed to set video stream params: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret;
-  }
+  /** Timeline published for sub-stream inputs on this connection */
+  bool anchored = false;
+  bool anchored_sender_clock = false;
 
-  out.vstream->time_base = out.venc->time_base;
+  int ret = 0;
+  while (true) {
+    if (stop_requested(session)) {
+      log_message("INFO", "Stop requested, ending loop");
+      ret = AVERROR_EXIT;
+      break;
+    }
 
-  /** Add audio stream (copy) */
-  if (audio_index >= 0) {
-    ret = add_audio_stream_copy(in_ctx, out.fmt, audio_index);
+    /** Stop reading once a stage has failed */
+    ret = state.pipeline_error.load();
     if (ret < 0) {
-      return ret;
+      break;
     }
-    out.astream = out.fmt->streams[out.fmt->nb_streams - 1];
-  }
 
-  /** Open output IO */
-  if (!(out.fmt->oformat->flags & AVFMT_NOFILE)) {
-    ret = avio_open(&out.fmt->pb, output_path.c_str(), AVIO_FLAG_WRITE);
+    ret = av_read_frame(state.in_ctx, pkt);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR(ETIMEDOUT)) {
+      log_message("WARN", "Read timeout, retrying...");
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      continue;
+    }
+    if (ret == AVERROR_EOF) {
+      log_message("WARN", "Input reached EOF");
+      break;
+    }
+    if (ret == AVERROR_EXIT && stop_requested(session)) {
+      continue;
+    }
     if (ret < 0) {
-      log_message("ERROR", "Failed to open output file: %s",
-                  av_err2str_cpp(ret).c_str());
-      return ret;
+      log_message("ERROR", "Read error: %s", av_err2str_cpp(ret).c_str());
+      break;
     }
-  }
 
-  /** Write header with HLS options */
-  AVDictionary *hls_opts = nullptr;
-  std::string base = utils::base_without_ext(
-      output_path
-  );
-  std::string seg_pattern = base + "_seg_%d.ts";
-  utils::set_hls_output_options(
-      &hls_opts,
-      max_keep_minutes,
-      encode_hls_time_sec,
-      seg_pattern
-  );
-  ret = avformat_write_header(out.fmt, &hls_opts);
-  av_dict_free(&hls_opts);
-  if (ret < 0) {
-    log_message("ERROR", "Failed to write header: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret;
-  }
+    update_ingest_metrics(state, pkt);
+    if (!rebase_timestamps(state, pkt)) {
+      state.dropped_packets++;
+      av_packet_unref(pkt);
+      continue;
+    }
 
-  return 0;
-}
+    /** Publish again once the sender's clock becomes known */
+    if (pkt->stream_index == state.video_index &&
+        (!anchored || (!anchored_sender_clock &&
+                       state.in_ctx->start_time_realtime != AV_NOPTS_VALUE))) {
+      ClockSample sample = utils::sample_input_clock(state.in_ctx, pkt, state.ts_offset);
+      if (sample.ts != AV_NOPTS_VALUE) {
+        session.timeline.publish(sample);
+        anchored = true;
+        anchored_sender_clock = sample.ntp_us != AV_NOPTS_VALUE;
+      }
+    }
+    refresh_demand(state, session);
+    ret = distribute_outputs(state, pkt);
+    av_packet_unref(pkt);
+    if (ret < 0) {
+      break;
+    }
 
-/**
- * @brief Init software scaler context and frame for reencode output based on input frame
- * 
- * @param out 
- * @param in_frame 
- * @return int 
- */
-static int init_sws_for_output(EncodeOutput &out, AVFrame *in_frame) {
-  /** Build swscale context */
-  out.sws = sws_getContext(in_frame->width, in_frame->height,
-                           static_cast<AVPixelFormat>(in_frame->format),
-                           out.venc->width, out.venc->height,
-                           out.venc->pix_fmt, SWS_BILINEAR, nullptr, nullptr,
-                           nullptr);
-  if (!out.sws) {
-    log_message("ERROR", "Failed to create swscale context");
-    return AVERROR(EINVAL);
-  }
-
-  /** Allocate scaled frame */
-  out.sws_frame = av_frame_alloc();
-  if (!out.sws_frame) {
-    log_message("ERROR", "Failed to allocate sws frame");
-    return AVERROR(ENOMEM);
+    state.packet_count++;
+    if (state.packet_count % 300 == 0) {
+      log_message("INFO", "Processed %" PRId64 " packets, dropped %" PRId64,
+                  state.packet_count, state.dropped_packets.load());
+    }
   }
 
-  out.sws_frame->format = out.venc->pix_fmt;
-  out.sws_frame->width = out.venc->width;
-  out.sws_frame->height = out.venc->height;
-
-  int ret = av_frame_get_buffer(out.sws_frame, 32);
-  if (ret < 0) {
-    log_message("ERROR", "Failed to allocate sws frame: %s",
-                av_err2str_cpp(ret).c_str());
-    return ret;
+  /** Let queued packets finish before outputs are flushed */
+  stop_pipeline(state);
+  state.metrics->connected.store(0, std::memory_order_relaxed);
+  state.metrics->dropped_packets.fetch_add(
+      static_cast<uint64_t>(state.dropped_packets.load() - state.metrics_dropped),
+      std::memory_order_relaxed);
+  state.metrics_dropped = state.dropped_packets.load();
+  state.next_metrics_ms = 0;
+  state.metrics->decode_queue_depth.store(0, std::memory_order_relaxed);
+  state.metrics->mux_queue_depth.store(0, std::memory_order_relaxed);
+  state.metrics->active_renditions.store(0, std::memory_order_relaxed);
+  if (ret >= 0 || ret == AVERROR_EOF) {
+    int err = state.pipeline_error.load();
+    if (err < 0) {
+      ret = err;
+    }
   }
 
-  return 0;
+  av_packet_free(&pkt);
+  return ret;
 }
 
+
 /**
- * @brief Write copy packet to copy output with rescaled timestamps
- * 
- * @param in_ctx 
- * @param out_ctx 
- * @param pkt 
- * @return int 
+ * @brief Flush the encoders and close every output of a session
+ *
+ * @param state
  */
-static int write_copy_packet(AVFormatContext *in_ctx, AVFormatContext *out_ctx,
-                             AVPacket *pkt) {
-  /** Rescale timestamps and write */
-  AVStream *in_stream = in_ctx->streams[pkt->stream_index];
-  AVStream *out_stream = out_ctx->streams[pkt->stream_index];
-
-  pkt->pts = av_rescale_q_rnd(pkt->pts, in_stream->time_base,
-                              out_stream->time_base,
-                              static_cast<AVRounding>(
-                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-  pkt->dts = av_rescale_q_rnd(pkt->dts, in_stream->time_base,
-                              out_stream->time_base,
-                              static_cast<AVRounding>(
-                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-  pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base,
-                                out_stream->time_base);
-  pkt->pos = -1;
-
-  int ret = av_interleaved_write_frame(out_ctx, pkt);
-  if (ret < 0) {
-    log_message("ERROR", "Write error: %s", av_err2str_cpp(ret).c_str());
-    return ret;
+static void close_outputs(StreamState &state) {
+  int audio_ret = flush_audio(state);
+  if (audio_ret < 0) {
+    log_message("ERROR", "Audio flush error: %s", av_err2str_cpp(audio_ret).c_str());
   }
+  av_packet_free(&state.audio_pkt);
+  av_frame_free(&state.decoded);
 
-  return 0;
+  /** Flush encoders */
+  int flush_ret = flush_encoders(state.outputs);
+  if (flush_ret < 0) {
+    log_message("ERROR", "Flush error: %s", av_err2str_cpp(flush_ret).c_str());
+  }
+
+  /** Cleanup outputs */
+  close_copy_output(state.copy_ctx);
+  state.copy_ctx = nullptr;
+  close_reencode_outputs(state.outputs);
 }
 
 /**
- * @brief Encode frame 
- * 
- * @param out 
- * @param in_frame 
- * @param pts 
- * @return int 
+ * @brief Read loop of a sub-stream input: shift its timestamps onto
+ * the main input's output timeline and remux it to its rendition on
+ * this thread. Packets read before the main input has published its
+ * timeline are dropped.
+ *
+ * @param state
+ * @param session
+ * @return int
  */
-static int encode_and_write_frame(EncodeOutput &out, AVFrame *in_frame,
-                                  int64_t pts) {
-  /** Prepare scaled frame */
-  int ret = av_frame_make_writable(out.sws_frame);
-  if (ret < 0) {
-    log_message("ERROR", "Frame not writable: %s", av_err2str_cpp(ret).c_str());
-    return ret;
-  }
-
-  sws_scale(out.sws, in_frame->data, in_frame->linesize, 0, in_frame->height,
-            out.sws_frame->data, out.sws_frame->linesize);
-
-  out.sws_frame->pts = pts;
-
-  /** Send to encoder */
-  ret = avcodec_send_frame(out.venc, out.sws_frame);
-  if (ret < 0) {
-    log_message("ERROR", "Encode send error: %s", av_err2str_cpp(ret).c_str());
-    return ret;
+static int run_sub_loop(StreamState &state, CameraSession &session) {
+  AVPacket *pkt = av_packet_alloc();
+  if (!pkt) {
+    log_message("ERROR", "Failed to allocate packet");
+    return AVERROR(ENOMEM);
   }
 
-  /** Drain encoder packets */
-  av_packet_unref(out.enc_pkt);
+  bool aligned = false;
+  uint64_t aligned_generation = 0;
+  int ret = 0;
   while (true) {
-    ret = avcodec_receive_packet(out.venc, out.enc_pkt);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+    if (stop_requested(session)) {
+      ret = AVERROR_EXIT;
       break;
     }
-    if (ret < 0) {
-      log_message("ERROR", "Encode receive error: %s",
-                  av_err2str_cpp(ret).c_str());
-      av_packet_unref(out.enc_pkt);
-      return ret;
-    }
 
-    out.enc_pkt->stream_index = out.vstream->index;
-    av_packet_rescale_ts(out.enc_pkt, out.venc->time_base,
-                         out.vstream->time_base);
-
-    ret = av_interleaved_write_frame(out.fmt, out.enc_pkt);
-    av_packet_unref(out.enc_pkt);
+    ret = av_read_frame(state.in_ctx, pkt);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR(ETIMEDOUT)) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      continue;
+    }
+    if (ret == AVERROR_EOF) {
+      log_message("WARN", "Sub-stream reached EOF");
+      break;
+    }
+    if (ret == AVERROR_EXIT && stop_requested(session)) {
+      continue;
+    }
     if (ret < 0) {
-      log_message("ERROR", "Write error: %s", av_err2str_cpp(ret).c_str());
-      return ret;
+      log_message("ERROR", "Sub-stream read error: %s", av_err2str_cpp(ret).c_str());
+      break;
     }
-  }
-
-  return 0;
-}
-
-/**
- * @brief Normalize packet timestamps for copy output
- *
- * @param state
- * @param pkt
- */
-static void normalize_copy_timestamps(StreamState &state, AVPacket *pkt) {
-  /** Skip if no stream state */
-  if (pkt->stream_index < 0 ||
-      pkt->stream_index >= static_cast<int>(state.copy_next_pts.size())) {
-    return;
-  }
-
-  /** Fill missing timestamps */
-  if (pkt->pts == AV_NOPTS_VALUE && pkt->dts == AV_NOPTS_VALUE) {
-    int64_t next = state.copy_next_pts[pkt->stream_index];
-    pkt->pts = next;
-    pkt->dts = next;
-  } else if (pkt->pts == AV_NOPTS_VALUE) {
-    pkt->pts = pkt->dts;
-  } else if (pkt->dts == AV_NOPTS_VALUE) {
-    pkt->dts = pkt->pts;
-  }
-
-  /** Enforce monotonic DTS */
-  int64_t next = state.copy_next_pts[pkt->stream_index];
-  if (pkt->dts < next) {
-    pkt->dts = next;
-  }
-  if (pkt->pts < pkt->dts) {
-    pkt->pts = pkt->dts;
-  }
-
-  /** Advance next PTS */
-  int64_t inc = pkt->duration > 0 ? pkt->duration : 1;
-  state.copy_next_pts[pkt->stream_index] = pkt->dts + inc;
-}
-
-/**
- * @brief Write audio packet to output context with rescaled timestamps
- * 
- * @param in_ctx The input format context
- * @param out_ctx The output format context
- * @param in_index The index of the input audio stream
- * @param out_index The index of the output audio stream
- * @param pkt 
- * @return int 
- */
-static int write_audio_packet_to_output(AVFormatContext *in_ctx,
-                                        AVFormatContext *out_ctx,
-                                        int in_index, int out_index,
-                                        AVPacket *pkt) {
-  /** Rescale timestamps and write audio packet */
-  AVStream *in_stream = in_ctx->streams[in_index];
-  AVStream *out_stream = out_ctx->streams[out_index];
-
-  pkt->pts = av_rescale_q_rnd(pkt->pts, in_stream->time_base,
-                              out_stream->time_base,
-                              static_cast<AVRounding>(
-                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-  pkt->dts = av_rescale_q_rnd(pkt->dts, in_stream->time_base,
-                              out_stream->time_base,
-                              static_cast<AVRounding>(
-                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-  pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base,
-                                out_stream->time_base);
-  pkt->pos = -1;
-  pkt->stream_index = out_index;
-
-  int ret = av_interleaved_write_frame(out_ctx, pkt);
-  if (ret < 0) {
-    log_message("ERROR", "Write audio error: %s", av_err2str_cpp(ret).c_str());
-    return ret;
-  }
-
-  return 0;
-}
-
-/**
- * @brief Open copy and reencode outputs
- *
- * @param state
- * @param output_path
- * @param renditions
- * @param max_keep_minutes
- * @param hls_time_sec
- * @return int
- */
-static int open_outputs(StreamState &state, const std::string &output_path,
-                        const std::vector<Rendition> &renditions,
-                        int copy_max_keep_minutes, int copy_hls_time_sec,
-                        int encode_max_keep_minutes, int encode_hls_time_sec) {
-  /** Open copy output */
-  int ret = open_copy_output(output_path, state.in_ctx, &state.copy_ctx,
-                             copy_max_keep_minutes, copy_hls_time_sec);
-  if (ret < 0) {
-    return ret;
-  }
-
-  /** Initialize renditions */
-  AVRational fps = av_guess_frame_rate(state.in_ctx, state.video_stream, nullptr);
-  if (fps.num <= 0 || fps.den <= 0) {
-    fps = {30, 1};
-  }
-
-  state.outputs.clear();
-  state.outputs.reserve(renditions.size());
-
-  std::string base = utils::base_without_ext(
-      output_path
-  );
-  for (const auto &rendition : renditions) {
-    EncodeOutput out;
-    std::string path = base + "_" + rendition.name + ".m3u8";
-
-    ret = init_reencode_output(path, state.in_ctx, state.audio_index, rendition,
-                               encode_max_keep_minutes, encode_hls_time_sec,
-                               fps, out);
-    if (ret < 0) {
-      close_copy_output(state.copy_ctx);
-      state.copy_ctx = nullptr;
-      close_reencode_outputs(state.outputs);
-      return ret;
-    }
-
-    state.outputs.push_back(out);
-  }
 
-  /** Initialize copy timestamp tracking */
-  state.copy_next_pts.assign(state.in_ctx->nb_streams, 0);
-
-  return 0;
-}
-
-/**
- * @brief Distribute packet to copy and reencode outputs
- *
- * @param state
- * @param pkt
- * @return int
- */
-static int distribute_outputs(StreamState &state, AVPacket *pkt) {
-  /** Decode video for renditions */
-  if (pkt->stream_index == state.video_index) {
-    int ret = avcodec_send_packet(state.vdec, pkt);
-    if (ret < 0) {
-      log_message("ERROR", "Decode send error: %s",
-                  av_err2str_cpp(ret).c_str());
-      return ret;
+    /** Align on connect and whenever the main timeline moves */
+    ClockSample main;
+    uint64_t generation = 0;
+    if (!session.timeline.get(main, generation)) {
+      av_packet_unref(pkt);
+      continue;
     }
-
-    while (true) {
-      ret = avcodec_receive_frame(state.vdec, state.decoded);
-      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-        break;
-      }
-      if (ret < 0) {
-        log_message("ERROR", "Decode receive error: %s",
-                    av_err2str_cpp(ret).c_str());
-        return ret;
-      }
-
-      /** Initialize sws once we have the first frame */
-      for (auto &out : state.outputs) {
-        if (!out.sws) {
-          ret = init_sws_for_output(out, state.decoded);
-          if (ret < 0) {
-            log_message("ERROR", "Init sws error: %s",
-                        av_err2str_cpp(ret).c_str());
-            return ret;
-          }
-        }
-      }
-
-      /** Derive PTS for encoder timebase */
-      int64_t in_pts = state.decoded->best_effort_timestamp;
-      if (in_pts == AV_NOPTS_VALUE) {
-        in_pts = state.fallback_pts++;
+    if (!aligned || generation != aligned_generation) {
+      ClockSample sample = utils::sample_input_clock(state.in_ctx, pkt, 0);
+      if (sample.ts == AV_NOPTS_VALUE) {
+        av_packet_unref(pkt);
+        continue;
       }
-
-      /** Encode all renditions */
-      for (auto &out : state.outputs) {
-        int64_t enc_pts = av_rescale_q(in_pts, state.video_stream->time_base,
-                                       out.venc->time_base);
-        ret = encode_and_write_frame(out, state.decoded, enc_pts);
-        if (ret < 0) {
-          log_message("ERROR", "Encode/write error: %s",
-                      av_err2str_cpp(ret).c_str());
-          return ret;
+      int64_t offset = utils::aligned_ts_offset(main, sample);
+      if (!aligned || std::llabs(offset - state.ts_offset) > kInputAlignSlackUs) {
+        /** Restart at a keyframe; nothing goes back in time */
+        log_message("INFO", "Sub-stream aligned to the main input, offset %" PRId64 " us",
+                    offset);
+        state.ts_offset = offset;
+        state.copy_wait_keyframe = true;
+        for (auto &clock : state.clocks) {
+          clock.resuming = true;
         }
       }
+      state.rebase_pending = false;
+      aligned = true;
+      aligned_generation = generation;
     }
-  }
-
-  /** Write audio packets to rendition outputs */
-  if (state.audio_index >= 0 && pkt->stream_index == state.audio_index) {
-    for (auto &out : state.outputs) {
-      if (!out.astream) {
-        continue;
-      }
-      av_packet_unref(state.audio_pkt);
-      int ret = av_packet_ref(state.audio_pkt, pkt);
-      if (ret < 0) {
-        log_message("ERROR", "Audio packet ref error: %s",
-                    av_err2str_cpp(ret).c_str());
-        return ret;
-      }
-
-      ret = write_audio_packet_to_output(state.in_ctx, out.fmt, state.audio_index,
-                                         out.astream->index, state.audio_pkt);
-      av_packet_unref(state.audio_pkt);
-      if (ret < 0) {
-        log_message("ERROR", "Audio write error: %s",
-                    av_err2str_cpp(ret).c_str());
-        return ret;
-      }
+    if (!rebase_timestamps(state, pkt)) {
+      av_packet_unref(pkt);
+      continue;
     }
-  }
-
-  /** Write copy output */
-  normalize_copy_timestamps(state, pkt);
-  int ret = write_copy_packet(state.in_ctx, state.copy_ctx, pkt);
-  if (ret < 0) {
-    log_message("ERROR", "Copy write error: %s", av_err2str_cpp(ret).c_str());
-    return ret;
-  }
-
-  return 0;
-}
 
-/**
- * @brief Read packets and distribute to outputs
- *
- * @param state
- * @return int
- */
-static int run_loop(StreamState &state) {
-  /** Allocate packet for reading */
-  AVPacket *pkt = av_packet_alloc();
-  if (!pkt) {
-    log_message("ERROR", "Failed to allocate packet");
-    return AVERROR(ENOMEM);
-  }
-
-  int ret = 0;
-  while (true) {
-    if (g_stop_requested.load()) {
-      log_message("INFO", "Stop requested, ending loop");
-      ret = AVERROR_EXIT;
-      break;
+    bool is_video = pkt->stream_index == state.video_index;
+    if (is_video && state.copy_wait_keyframe && (pkt->flags & AV_PKT_FLAG_KEY)) {
+      state.copy_wait_keyframe = false;
     }
-
-    ret = av_read_frame(state.in_ctx, pkt);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR(ETIMEDOUT)) {
-      log_message("WARN", "Read timeout, retrying...");
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+    if (is_video && state.copy_wait_keyframe) {
+      av_packet_unref(pkt);
       continue;
     }
-    if (ret == AVERROR_EOF) {
-      log_message("WARN", "Input reached EOF");
-      break;
-    }
-    if (ret < 0) {
-      log_message("ERROR", "Read error: %s", av_err2str_cpp(ret).c_str());
-      break;
-    }
 
-    ret = distribute_outputs(state, pkt);
+    /** Remux, encoding unplayable audio like the main input does */
+    normalize_copy_timestamps(state, pkt);
+    if (pkt->stream_index == state.audio_index && state.audio_encoder) {
+      std::vector<AVPacket *> encoded;
+      ret = state.audio_encoder->transcode(pkt, encoded);
+      if (ret < 0 && ret != AVERROR(ENOMEM)) {
+        log_message("WARN", "Audio transcode error: %s", av_err2str_cpp(ret).c_str());
+        ret = 0;
+      }
+      for (AVPacket *out : encoded) {
+        if (ret >= 0) {
+          ret = fan_out_audio(state, out);
+        }
+        av_packet_free(&out);
+      }
+    } else {
+      ret = write_copy_packet(state.in_ctx, state.copy_ctx, pkt);
+    }
     av_packet_unref(pkt);
     if (ret < 0) {
+      fail_pipeline(state, ret);
       break;
     }
-
-    state.packet_count++;
-    if (state.packet_count % 300 == 0) {
-      log_message("INFO", "Processed %" PRId64 " packets",
-                  state.packet_count);
-    }
   }
 
   av_packet_free(&pkt);
@@ -938,154 +675,217 @@ static int run_loop(StreamState &state) {
 }
 
 /**
- * @brief Flush encoders at the end of stream to ensure all packets are written
- * 
- * @param outputs The list of encode outputs
- * @return int 0 on success, negative error code on failure
+ * @brief Reconnect loop of a sub-stream input remuxed as one rendition
+ * instead of encoding it, running beside the camera's main input
+ * until the camera stops. Its output stays open across reconnects
+ * like the main input's.
+ *
+ * @param session
+ * @param rendition
+ * @param input_url
+ * @param output_path rendition playlist
  */
-static int flush_encoders(std::vector<EncodeOutput> &outputs) {
-  /** Flush each encoder */
-  for (auto &out : outputs) {
-    int ret = avcodec_send_frame(out.venc, nullptr);
-    if (ret < 0) {
-      log_message("ERROR", "Flush send error: %s", av_err2str_cpp(ret).c_str());
-      return ret;
-    }
+static void run_sub_input(CameraSession &session, const std::string &rendition,
+                          const std::string &input_url, const std::string &output_path) {
+  const CameraConfig &cfg = session.config;
+  log_set_thread_tag(cfg.id + "/" + rendition);
+  log_message("INFO", "Sub-stream URL: %s", input_url.c_str());
 
-    while (true) {
-      ret = avcodec_receive_packet(out.venc, out.enc_pkt);
-      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-        break;
-      }
-      if (ret < 0) {
-        log_message("ERROR", "Flush receive error: %s",
-                    av_err2str_cpp(ret).c_str());
-        av_packet_unref(out.enc_pkt);
-        return ret;
-      }
+  int reconnect_sec = cfg.reconnect_sec > 0 ? cfg.reconnect_sec : 5;
+  std::string probe_path = utils::base_without_ext(output_path) + ".probe";
+  AVIOInterruptCB interrupt_cb = {interrupt_on_stop, &session};
 
-      out.enc_pkt->stream_index = out.vstream->index;
-      av_packet_rescale_ts(out.enc_pkt, out.venc->time_base,
-                           out.vstream->time_base);
+  /** The path may still alias the copy playlist from an earlier ladder */
+  utils::remove_symlink(output_path);
 
-      ret = av_interleaved_write_frame(out.fmt, out.enc_pkt);
-      av_packet_unref(out.enc_pkt);
-      if (ret < 0) {
-        log_message("ERROR", "Flush write error: %s",
-                    av_err2str_cpp(ret).c_str());
-        return ret;
+  std::unique_ptr<StreamState> state;
+  while (!stop_requested(session)) {
+    AVFormatContext *in_ctx = nullptr;
+    int ret = open_input(input_url, cfg.rtsp_tcp, interrupt_cb, probe_path,
+                         true, &in_ctx);
+    int video_index = -1;
+    if (ret >= 0) {
+      video_index = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                        nullptr, 0);
+      if (video_index < 0) {
+        log_message("ERROR", "No video stream found in sub-stream");
       }
     }
-  }
 
-  return 0;
-}
+    if (video_index >= 0) {
+      int audio_index = av_find_best_stream(in_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                            nullptr, 0);
+      if (state && !input_matches_outputs(*state, in_ctx, video_index, audio_index)) {
+        log_message("INFO", "Sub-stream parameters changed, reopening output");
+        close_outputs(*state);
+        state.reset();
+      }
 
-int main(int argc, char **argv) {
-  if (argc < 3) {
-    print_usage(argv[0]);
-    return 1;
-  }
+      if (state) {
+        resume_outputs(*state, in_ctx, nullptr);
+      } else {
+        state.reset(new StreamState());
+        state->log_tag = log_thread_tag();
+        state->in_ctx = in_ctx;
+        state->video_stream = in_ctx->streams[video_index];
+        state->video_index = video_index;
+        state->audio_index = audio_index;
+        state->metrics = session.metrics;
+        state->ll_part_ms = cfg.ll_hls_part_ms;
+        state->fmp4_segments = cfg.segment_format == "fmp4";
+        state->live_only = true;
+        state->audio_pkt = av_packet_alloc();
+        ret = state->audio_pkt
+                  ? open_outputs(*state, output_path, {}, cfg.encode_max_keep_minutes,
+                                 cfg.encode_hls_time_sec, 0, 0, false)
+                  : AVERROR(ENOMEM);
+        if (ret < 0) {
+          log_message("ERROR", "Failed to open sub-stream output: %s",
+                      av_err2str_cpp(ret).c_str());
+          av_packet_free(&state->audio_pkt);
+          state.reset();
+        } else {
+          log_message("INFO", "Rendition %s remuxed from the sub-stream",
+                      rendition.c_str());
+        }
+      }
 
-  /** Capture CLI inputs */
-  std::string input_url = argv[1];
-  std::string output_path = argv[2];
-  std::string log_file = "streamer.log";
-  bool rtsp_tcp = false;
-  int reconnect_sec = 0;
-  int copy_max_keep_minutes = 0;
-  int encode_max_keep_minutes = 5;
-  int copy_hls_time_sec = 0;
-  int encode_hls_time_sec = 4;
-  bool live_input = is_live_input(input_url);
+      if (state) {
+        ret = run_sub_loop(*state, session);
+        state->in_ctx = nullptr;
+        state->video_stream = nullptr;
 
-  /** Parse CLI */
-  for (int i = 3; i < argc; ++i) {
-    if (std::strcmp(argv[i], "--rtsp-tcp") == 0) {
-      rtsp_tcp = true;
-    } else if (std::strcmp(argv[i], "--reconnect-sec") == 0 && i + 1 < argc) {
-      reconnect_sec = std::atoi(argv[i + 1]);
-      ++i;
-    } else if (std::strcmp(argv[i], "--copy-max-keep-minutes") == 0 && i + 1 < argc) {
-      copy_max_keep_minutes = std::atoi(argv[i + 1]);
-      ++i;
-    } else if (std::strcmp(argv[i], "--encode-max-keep-minutes") == 0 && i + 1 < argc) {
-      encode_max_keep_minutes = std::atoi(argv[i + 1]);
-      ++i;
-    } else if (std::strcmp(argv[i], "--copy-hls-time") == 0 && i + 1 < argc) {
-      copy_hls_time_sec = std::atoi(argv[i + 1]);
-      ++i;
-    } else if (std::strcmp(argv[i], "--encode-hls-time") == 0 && i + 1 < argc) {
-      encode_hls_time_sec = std::atoi(argv[i + 1]);
-      ++i;
-    } else if (std::strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
-      log_file = argv[i + 1];
-      ++i;
-    } else {
-      std::fprintf(stderr, "Unknown argument: %s\n", argv[i]);
-      print_usage(argv[0]);
-      return 1;
+        /** A failed write may have left the output unusable */
+        if (state->pipeline_error.load() < 0) {
+          close_outputs(*state);
+          state.reset();
+        }
+      }
+    }
+    avformat_close_input(&in_ctx);
+
+    if (stop_requested(session)) {
+      break;
     }
+    log_message("INFO", "Sub-stream retrying in %d seconds...", reconnect_sec);
+    sleep_unless_stopped(session, reconnect_sec);
   }
 
-  /** Initialize logger */
-  if (!log_init(log_file)) {
-    return 1;
+  if (state) {
+    close_outputs(*state);
   }
+  log_set_thread_tag("");
+}
+
+/**
+ * @brief Reconnect loop for one camera: open input and decoder, open
+ * outputs or resume those of the last connection, stream until
+ * failure and retry
+ *
+ * @param session
+ * @return int process exit code for this camera
+ */
+static int run_camera(CameraSession &session) {
+  const CameraConfig &cfg = session.config;
+  log_set_thread_tag(cfg.id);
 
-  /** Normalize output path */
-  output_path = utils::normalize_output_path(
-      output_path
+  std::string output_path = utils::normalize_output_path(
+      cfg.output_path
   );
 
   /** Auto-reconnect for live inputs unless disabled */
-  if (live_input && reconnect_sec <= 0) {
+  int reconnect_sec = cfg.reconnect_sec;
+  if (is_live_input(cfg.input_url) && reconnect_sec <= 0) {
     reconnect_sec = 5;
   }
 
   /** Log configuration */
-  log_message("INFO", "Input URL: %s", input_url.c_str());
+  log_message("INFO", "Input URL: %s", cfg.input_url.c_str());
   log_message("INFO", "Output HLS: %s", output_path.c_str());
-  log_message("INFO", "Log file: %s", log_file.c_str());
   log_message("INFO", "Reconnect seconds: %d", reconnect_sec);
-  log_message("INFO", "Copy max keep minutes: %d", copy_max_keep_minutes);
-  log_message("INFO", "Encode max keep minutes: %d", encode_max_keep_minutes);
-  log_message("INFO", "Copy HLS time: %d", copy_hls_time_sec);
-  log_message("INFO", "Encode HLS time: %d", encode_hls_time_sec);
-
-  /** Static ladder for low/mid/high */
-  std::vector<Rendition> renditions = {
-      {"low", 426, 240, 400000},
-      {"mid", 854, 480, 1200000},
-      {"high", 1280, 720, 2500000},
-  };
+  log_message("INFO", "Copy max keep minutes: %d", cfg.copy_max_keep_minutes);
+  log_message("INFO", "Encode max keep minutes: %d", cfg.encode_max_keep_minutes);
+  log_message("INFO", "Copy HLS time: %d", cfg.copy_hls_time_sec);
+  log_message("INFO", "Encode HLS time: %d", cfg.encode_hls_time_sec);
+  log_message("INFO", "Segment format: %s", cfg.segment_format.c_str());
+  if (cfg.ll_hls_part_ms > 0) {
+    log_message("INFO", "LL-HLS parts of %d ms", cfg.ll_hls_part_ms);
+  }
+  if (cfg.ring_store_mb > 0 && cfg.ll_hls_part_ms > 0) {
+    log_message("WARN", "Ring store ignored, LL-HLS writes its own parts");
+  } else if (cfg.ring_store_mb > 0) {
+    log_message("INFO", "Copy output ring store: %d MB", cfg.ring_store_mb);
+  }
+  if (cfg.quota_mb > 0) {
+    log_message("INFO", "Storage quota: %d MB", cfg.quota_mb);
+  }
+  if (cfg.on_demand) {
+    log_message("INFO", "On-demand renditions, idle after %d seconds",
+                cfg.rendition_idle_sec);
+  }
 
-  /** Initialize FFmpeg */
-  av_log_set_level(AV_LOG_QUIET);
-  av_log_set_callback(quiet_av_log_callback);
-  avformat_network_init();
+  /** Configured ladder, fitted to the source on every connect */
+  std::vector<Rendition> ladder = default_renditions();
+  if (!cfg.ladder_path.empty()) {
+    std::string error;
+    if (!utils::load_ladder(cfg.ladder_path, ladder, error)) {
+      log_message("ERROR", "Invalid ladder: %s", error.c_str());
+      return 1;
+    }
+    log_message("INFO", "Ladder: %s (%zu renditions)", cfg.ladder_path.c_str(),
+                ladder.size());
+  }
 
-  /** Install signal handlers */
-  std::signal(SIGINT, handle_signal);
-  std::signal(SIGTERM, handle_signal);
+  /** Stream parameters of the last full probe */
+  std::string probe_path = utils::base_without_ext(output_path) + ".probe";
+
+  /** Register the quota before any output reports its segments */
+  std::string output_dir = output_path.substr(0, output_path.find_last_of('/') + 1);
+  if (g_reclaimer) {
+    g_reclaimer->set_quota(output_dir, static_cast<uint64_t>(cfg.quota_mb) << 20);
+  }
+
+  AVIOInterruptCB interrupt_cb = {interrupt_on_stop, &session};
+
+  /** Sub-stream inputs replace the encoders of their renditions */
+  std::vector<std::thread> sub_inputs;
+  for (const auto &sub : cfg.sub_inputs) {
+    ladder.erase(std::remove_if(ladder.begin(), ladder.end(),
+                                [&sub](const Rendition &r) {
+                                  return r.name == sub.first;
+                                }),
+                 ladder.end());
+    std::string path = utils::base_without_ext(output_path) + "_" + sub.first + ".m3u8";
+    sub_inputs.emplace_back(run_sub_input, std::ref(session), sub.first, sub.second, path);
+  }
+
+  /** Outputs and encoders, kept across reconnects */
+  std::unique_ptr<StreamState> state;
 
   /** Reconnect loop */
   int exit_code = 0;
+  bool first_attempt = true;
   while (true) {
-    if (g_stop_requested.load()) {
+    if (stop_requested(session)) {
       log_message("INFO", "Stop requested, shutting down");
       exit_code = 0;
       break;
     }
+    if (!first_attempt) {
+      session.metrics->reconnects.fetch_add(1, std::memory_order_relaxed);
+    }
+    first_attempt = false;
 
     AVFormatContext *in_ctx = nullptr;
 
     /** Open input */
-    int ret = open_input(input_url, rtsp_tcp, &in_ctx);
+    int ret = open_input(cfg.input_url, cfg.rtsp_tcp, interrupt_cb, probe_path,
+                         true, &in_ctx);
     if (ret < 0) {
+      avformat_close_input(&in_ctx);
       if (reconnect_sec > 0) {
         log_message("INFO", "Retrying in %d seconds...", reconnect_sec);
-        std::this_thread::sleep_for(std::chrono::seconds(reconnect_sec));
+        sleep_unless_stopped(session, reconnect_sec);
         continue;
       }
       exit_code = 2;
@@ -1134,6 +934,12 @@ int main(int argc, char **argv) {
       break;
     }
 
+    /** Fit the ladder to this source; the decoder may skip what it cannot show */
+    ResolvedLadder resolved = utils::resolve_ladder(
+        ladder, video_stream->codecpar->width, video_stream->codecpar->height,
+        cfg.ladder_auto);
+    configure_decoder(vdec, decoder, av_guess_frame_rate(in_ctx, video_stream, nullptr),
+                      resolved.encoded, cfg.reduced_decode, session.decode_threads);
     ret = avcodec_open2(vdec, decoder, nullptr);
     if (ret < 0) {
       log_message("ERROR", "Failed to open decoder: %s",
@@ -1144,81 +950,116 @@ int main(int argc, char **argv) {
       break;
     }
 
-    /** Prepare stream state */
-    StreamState state;
-    state.in_ctx = in_ctx;
-    state.copy_ctx = nullptr;
-    state.vdec = vdec;
-    state.video_stream = video_stream;
-    state.video_index = video_index;
-    state.audio_index = audio_index;
-
-    /** Open outputs */
-    ret = open_outputs(state, output_path, renditions,
-                       copy_max_keep_minutes, copy_hls_time_sec,
-                       encode_max_keep_minutes, encode_hls_time_sec);
-    if (ret < 0) {
-      avcodec_free_context(&vdec);
-      avformat_close_input(&in_ctx);
-      exit_code = 4;
-      break;
+    /** Keep the outputs of the last connection while the input fits them */
+    if (state && !input_matches_outputs(*state, in_ctx, video_index, audio_index)) {
+      log_message("INFO", "Input parameters changed, reopening outputs");
+      close_outputs(*state);
+      state.reset();
     }
 
-    /** Allocate shared decode resources */
-    state.decoded = av_frame_alloc();
-    if (!state.decoded) {
-      log_message("ERROR", "Failed to allocate decode frame");
-      close_copy_output(state.copy_ctx);
-      close_reencode_outputs(state.outputs);
-      avcodec_free_context(&vdec);
-      avformat_close_input(&in_ctx);
-      exit_code = 5;
-      break;
-    }
+    if (state) {
+      resume_outputs(*state, in_ctx, vdec);
+      log_message("INFO", "Input reconnected, resuming outputs");
+    } else {
+      for (const auto &r : resolved.encoded) {
+        log_message("INFO", "Rendition %s: %dx%d %d bps%s%s", r.name.c_str(),
+                    r.width, r.height, r.video_bitrate,
+                    r.preset.empty() ? "" : " preset ", r.preset.c_str());
+      }
 
-    state.audio_pkt = av_packet_alloc();
-    if (!state.audio_pkt) {
-      log_message("ERROR", "Failed to allocate audio packet");
-      av_frame_free(&state.decoded);
-      close_copy_output(state.copy_ctx);
-      close_reencode_outputs(state.outputs);
-      avcodec_free_context(&vdec);
-      avformat_close_input(&in_ctx);
-      exit_code = 5;
-      break;
-    }
+      /** Prepare stream state */
+      state.reset(new StreamState());
+      state->log_tag = log_thread_tag();
+      state->in_ctx = in_ctx;
+      state->copy_ctx = nullptr;
+      state->vdec = vdec;
+      state->video_stream = video_stream;
+      state->video_index = video_index;
+      state->audio_index = audio_index;
+      state->metrics = session.metrics;
+      state->ll_part_ms = cfg.ll_hls_part_ms;
+      state->fmp4_segments = cfg.segment_format == "fmp4";
+      state->ring_store_mb = cfg.ring_store_mb;
+
+      /** Open outputs */
+      ret = open_outputs(*state, output_path, resolved.encoded,
+                         cfg.copy_max_keep_minutes, cfg.copy_hls_time_sec,
+                         cfg.encode_max_keep_minutes, cfg.encode_hls_time_sec,
+                         cfg.on_demand);
+      if (ret < 0) {
+        state.reset();
+        avcodec_free_context(&vdec);
+        avformat_close_input(&in_ctx);
+        exit_code = 4;
+        break;
+      }
 
-    /** Read and distribute packets */
-    ret = run_loop(state);
+      /** Renditions the source cannot improve on are its copy output */
+      std::string base = utils::base_without_ext(output_path);
+      for (const auto &name : resolved.copy_aliases) {
+        std::string alias_path = base + "_" + name + ".m3u8";
+        if (g_live_cache) {
+          g_live_cache->alias(g_live_cache->key_of(alias_path),
+                              g_live_cache->key_of(output_path));
+        }
+        if (utils::link_playlist_alias(output_path, alias_path)) {
+          log_message("INFO", "Rendition %s served from the copy output",
+                      name.c_str());
+        } else {
+          log_message("WARN", "Failed to alias rendition %s: %s",
+                      name.c_str(), std::strerror(errno));
+        }
+      }
 
-    av_packet_free(&state.audio_pkt);
-    av_frame_free(&state.decoded);
+      /** Allocate shared decode resources */
+      state->decoded = av_frame_alloc();
+      if (!state->decoded) {
+        log_message("ERROR", "Failed to allocate decode frame");
+        avcodec_free_context(&vdec);
+        avformat_close_input(&in_ctx);
+        exit_code = 5;
+        break;
+      }
 
-    /** Flush encoders */
-    ret = flush_encoders(state.outputs);
-    if (ret < 0) {
-      log_message("ERROR", "Flush error: %s", av_err2str_cpp(ret).c_str());
+      state->audio_pkt = av_packet_alloc();
+      if (!state->audio_pkt) {
+        log_message("ERROR", "Failed to allocate audio packet");
+        avcodec_free_context(&vdec);
+        avformat_close_input(&in_ctx);
+        exit_code = 5;
+        break;
+      }
     }
 
-    /** Cleanup outputs */
-    close_copy_output(state.copy_ctx);
-    close_reencode_outputs(state.outputs);
+    /** Read and distribute packets */
+    ret = run_loop(*state, session);
+
+    /** Only the input goes; the outputs wait for the reconnect */
+    state->in_ctx = nullptr;
+    state->vdec = nullptr;
+    state->video_stream = nullptr;
     avcodec_free_context(&vdec);
     avformat_close_input(&in_ctx);
 
+    /** A failed stage may have left its output unusable */
+    if (state->pipeline_error.load() < 0) {
+      close_outputs(*state);
+      state.reset();
+    }
+
     if (ret == AVERROR_EXIT) {
       exit_code = 0;
       break;
     }
     if (ret == AVERROR_EOF || ret == 0) {
       if (reconnect_sec > 0) {
-        if (g_stop_requested.load()) {
+        if (stop_requested(session)) {
           exit_code = 0;
           break;
         }
         log_message("INFO", "Restarting after EOF in %d seconds...",
                     reconnect_sec);
-        std::this_thread::sleep_for(std::chrono::seconds(reconnect_sec));
+        sleep_unless_stopped(session, reconnect_sec);
         continue;
       }
       exit_code = 0;
@@ -1227,13 +1068,13 @@ int main(int argc, char **argv) {
 
     if (ret < 0) {
       if (reconnect_sec > 0) {
-        if (g_stop_requested.load()) {
+        if (stop_requested(session)) {
           exit_code = 0;
           break;
         }
         log_message("INFO", "Stream error, reconnecting in %d seconds...",
                     reconnect_sec);
-        std::this_thread::sleep_for(std::chrono::seconds(reconnect_sec));
+        sleep_unless_stopped(session, reconnect_sec);
         continue;
       }
       exit_code = 4;
@@ -1245,6 +1086,497 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (state) {
+    close_outputs(*state);
+  }
+
+  /** Sub-stream inputs end with the camera */
+  session.stop.store(true);
+  for (auto &thread : sub_inputs) {
+    thread.join();
+  }
+  if (g_reclaimer) {
+    g_reclaimer->set_quota(output_dir, 0);
+  }
+  log_message("INFO", "Camera stopped with code %d", exit_code);
+  log_set_thread_tag("");
+  return exit_code;
+}
+
+/**
+ * @brief Start a camera thread whose pipeline runs on the shared pool
+ *
+ * @param cfg
+ * @param pool
+ * @param decode_threads decoder threads with --reduced-decode
+ * @return std::unique_ptr<CameraSession>
+ */
+static std::unique_ptr<CameraSession> start_camera(const CameraConfig &cfg,
+                                                   WorkerPool &pool,
+                                                   int decode_threads) {
+  std::unique_ptr<CameraSession> session(new CameraSession());
+  session->config = cfg;
+  session->pool = &pool;
+  session->decode_threads = decode_threads;
+  if (g_metrics.slot_count() > 0) {
+    CameraMetrics *slot = g_metrics.acquire(cfg.id);
+    if (slot) {
+      session->metrics = slot;
+    } else {
+      log_message("WARN", "No free metrics slot for camera %s", cfg.id.c_str());
+    }
+  }
+  CameraSession *raw = session.get();
+  session->thread = std::thread([raw]() {
+    raw->exit_code = run_camera(*raw);
+    raw->finished.store(true);
+  });
+  return session;
+}
+
+/**
+ * @brief Stop a camera thread and wait for its outputs to close
+ *
+ * @param session
+ */
+static void stop_camera(CameraSession &session) {
+  session.stop.store(true);
+  if (session.thread.joinable()) {
+    session.thread.join();
+  }
+  if (session.metrics != &session.local_metrics) {
+    g_metrics.release(session.metrics);
+    session.metrics = &session.local_metrics;
+  }
+}
+
+/**
+ * @brief Reconcile running cameras with the manifest: start new
+ * cameras, stop removed ones and restart cameras whose settings changed
+ *
+ * @param manifest_path
+ * @param defaults
+ * @param pool
+ * @param cameras
+ * @return true if the manifest was applied
+ */
+static bool apply_manifest(const std::string &manifest_path,
+                           const CameraConfig &defaults, WorkerPool &pool,
+                           std::list<std::unique_ptr<CameraSession>> &cameras) {
+  std::vector<CameraConfig> wanted;
+  std::vector<std::string> warnings;
+  std::set<std::string> skipped_ids;
+  std::string error;
+  if (!utils::load_manifest(manifest_path, defaults, wanted, warnings, skipped_ids,
+                            error)) {
+    log_message("ERROR", "Manifest %s rejected: %s", manifest_path.c_str(),
+                error.c_str());
+    return false;
+  }
+  for (const auto &warning : warnings) {
+    log_message("WARN", "Manifest %s: skipped %s", manifest_path.c_str(), warning.c_str());
+  }
+
+  /** Like on the command line, LL-HLS cannot go through the live server */
+  for (auto it = wanted.begin(); it != wanted.end();) {
+    if (g_live_cache && it->ll_hls_part_ms > 0) {
+      log_message("WARN", "Manifest %s: skipped camera %s, --ll-hls-part-ms is not "
+                  "served by --live-http", manifest_path.c_str(), it->id.c_str());
+      skipped_ids.insert(it->id);
+      it = wanted.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  /** Stop cameras that were removed, changed or have given up; a
+   * camera whose line was skipped keeps running as it is */
+  for (auto it = cameras.begin(); it != cameras.end();) {
+    bool listed = false;
+    bool keep = false;
+    for (const auto &cfg : wanted) {
+      if (cfg.id == (*it)->config.id) {
+        listed = true;
+        keep = !(*it)->finished.load() && utils::same_camera_config(cfg, (*it)->config);
+        break;
+      }
+    }
+    if (!listed && skipped_ids.count((*it)->config.id) && !(*it)->finished.load()) {
+      keep = true;
+    }
+    if (keep) {
+      ++it;
+      continue;
+    }
+    log_message("INFO", "Stopping camera %s", (*it)->config.id.c_str());
+    stop_camera(**it);
+    std::lock_guard<std::mutex> lock(g_cameras_mutex);
+    it = cameras.erase(it);
+  }
+
+  /** Start cameras that are not running yet, each with its share of
+   * the pool for decoder threads */
+  int decode_threads = g_decode_threads >= 0
+                           ? g_decode_threads
+                           : std::max(1, static_cast<int>(pool.size() /
+                                                          std::max<size_t>(1, wanted.size())));
+  for (const auto &cfg : wanted) {
+    bool running = false;
+    for (const auto &session : cameras) {
+      if (session->config.id == cfg.id) {
+        running = true;
+        break;
+      }
+    }
+    if (!running) {
+      log_message("INFO", "Starting camera %s", cfg.id.c_str());
+      std::unique_ptr<CameraSession> session = start_camera(cfg, pool, decode_threads);
+      std::lock_guard<std::mutex> lock(g_cameras_mutex);
+      cameras.push_back(std::move(session));
+    }
+  }
+
+  log_message("INFO", "Manifest applied: %zu cameras", cameras.size());
+  return true;
+}
+
+/**
+ * @brief Keep a camera's rendition running for its idle timeout
+ *
+ * @param session
+ * @param rendition
+ */
+static void note_demand(CameraSession &session, const std::string &rendition) {
+  std::lock_guard<std::mutex> demand_lock(session.demand_mutex);
+  session.demand_until_ms[rendition] =
+      steady_now_ms() + session.config.rendition_idle_sec * 1000LL;
+}
+
+/**
+ * @brief Apply one control command. Supported: "demand <camera>
+ * <rendition>", which keeps a rendition running for the camera's idle
+ * timeout.
+ *
+ * @param line
+ * @param cameras
+ */
+static void handle_control_command(
+    const std::string &line,
+    std::list<std::unique_ptr<CameraSession>> &cameras) {
+  std::istringstream tokens(line);
+  std::string command;
+  std::string camera_id;
+  std::string rendition;
+  tokens >> command >> camera_id >> rendition;
+
+  if (command != "demand" || camera_id.empty() || rendition.empty()) {
+    log_message("WARN", "Ignoring control command: %s", line.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(g_cameras_mutex);
+  for (auto &session : cameras) {
+    if (session->config.id == camera_id) {
+      note_demand(*session, rendition);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Treat a live playlist request like a demand command: a
+ * reload of "<base>_<rendition>.m3u8" keeps that rendition running
+ *
+ * @param key requested cache key
+ * @param cache
+ * @param cameras
+ */
+static void handle_live_request(
+    const std::string &key,
+    const LiveCache &cache,
+    std::list<std::unique_ptr<CameraSession>> &cameras) {
+  std::lock_guard<std::mutex> lock(g_cameras_mutex);
+  for (auto &session : cameras) {
+    std::string prefix = cache.key_of(utils::base_without_ext(
+        utils::normalize_output_path(session->config.output_path))) + "_";
+    if (prefix.size() > 1 && utils::starts_with(key, prefix.c_str()) &&
+        key.size() > prefix.size() + 5) {
+      note_demand(*session, key.substr(prefix.size(), key.size() - prefix.size() - 5));
+      return;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  /** Install signal handlers before anything else, so an early SIGHUP
+   * from the backend cannot kill the process */
+  std::signal(SIGINT, handle_signal);
+  std::signal(SIGTERM, handle_signal);
+  std::signal(SIGHUP, handle_signal);
+
+  if (argc < 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  /** Capture CLI inputs */
+  std::vector<std::string> args(argv + 1, argv + argc);
+  CameraConfig defaults;
+  std::string manifest_path;
+  std::string log_file = "streamer.log";
+  std::string control_path;
+  std::string metrics_path;
+  std::string ready_path;
+  int metrics_slots = 1024;
+  int workers = 0;
+  int codec_threads = -1;
+  int async_io = 0;
+  int global_quota_mb = 0;
+  int disk_max_percent = 0;
+  std::string live_http;
+  std::string live_root = ".";
+  std::string segment_http;
+  int live_cache_segments = kLiveCacheDefaultSegments;
+  size_t first_flag = 0;
+
+  if (!utils::starts_with(args[0], "--")) {
+    if (args.size() < 2) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    defaults.id = "camera";
+    defaults.input_url = args[0];
+    defaults.output_path = args[1];
+    first_flag = 2;
+  }
+
+  /** Parse CLI */
+  for (size_t i = first_flag; i < args.size(); ++i) {
+    if (args[i] == "--manifest" && i + 1 < args.size()) {
+      manifest_path = args[++i];
+    } else if (args[i] == "--log-file" && i + 1 < args.size()) {
+      log_file = args[++i];
+    } else if (args[i] == "--workers" && i + 1 < args.size()) {
+      workers = std::atoi(args[++i].c_str());
+    } else if (args[i] == "--codec-threads" && i + 1 < args.size()) {
+      codec_threads = std::atoi(args[++i].c_str());
+    } else if (args[i] == "--decode-threads" && i + 1 < args.size()) {
+      g_decode_threads = std::max(0, std::atoi(args[++i].c_str()));
+    } else if (args[i] == "--async-io" && i + 1 < args.size()) {
+      async_io = std::atoi(args[++i].c_str());
+    } else if (args[i] == "--global-quota-mb" && i + 1 < args.size()) {
+      global_quota_mb = std::atoi(args[++i].c_str());
+    } else if (args[i] == "--disk-max-percent" && i + 1 < args.size()) {
+      disk_max_percent = std::atoi(args[++i].c_str());
+    } else if (args[i] == "--live-http" && i + 1 < args.size()) {
+      live_http = args[++i];
+    } else if (args[i] == "--segment-http" && i + 1 < args.size()) {
+      segment_http = args[++i];
+    } else if (args[i] == "--live-root" && i + 1 < args.size()) {
+      live_root = args[++i];
+    } else if (args[i] == "--live-cache-segments" && i + 1 < args.size()) {
+      live_cache_segments = std::atoi(args[++i].c_str());
+    } else if (args[i] == "--control-socket" && i + 1 < args.size()) {
+      control_path = args[++i];
+    } else if (args[i] == "--metrics-file" && i + 1 < args.size()) {
+      metrics_path = args[++i];
+    } else if (args[i] == "--ready-file" && i + 1 < args.size()) {
+      ready_path = args[++i];
+    } else if (args[i] == "--metrics-slots" && i + 1 < args.size()) {
+      metrics_slots = std::atoi(args[++i].c_str());
+    } else if (!utils::parse_camera_option(args, i, defaults)) {
+      std::fprintf(stderr, "Unknown argument: %s\n", args[i].c_str());
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  bool manifest_mode = !manifest_path.empty();
+  if (manifest_mode == !defaults.input_url.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  /** The live server ignores _HLS_part and has no parts before they are written */
+  if (!live_http.empty() && defaults.ll_hls_part_ms > 0) {
+    std::fprintf(stderr, "--live-http cannot serve LL-HLS, drop --ll-hls-part-ms "
+                         "or --live-http\n");
+    return 1;
+  }
+
+  /** Many cameras share the pool, so keep codecs single-threaded by default */
+  if (codec_threads < 0) {
+    codec_threads = manifest_mode ? 1 : 0;
+  }
+  g_codec_threads = codec_threads;
+
+  /** Initialize logger */
+  if (!log_init(log_file)) {
+    return 1;
+  }
+
+  /** Initialize FFmpeg */
+  av_log_set_level(AV_LOG_QUIET);
+  av_log_set_callback(quiet_av_log_callback);
+  avformat_network_init();
+
+  WorkerPool pool(workers > 0 ? static_cast<size_t>(workers) : 0);
+  log_message("INFO", "Log file: %s", log_file.c_str());
+  log_message("INFO", "Worker threads: %zu", pool.size());
+  log_message("INFO", "Codec threads: %d", g_codec_threads);
+  if (g_decode_threads >= 0) {
+    log_message("INFO", "Decode threads: %d", g_decode_threads);
+  }
+
+  /** Segment writes leave the mux threads */
+  AsyncWriter async_writer;
+  if (async_io > 0) {
+    async_writer.start(async_io);
+    g_async_writer = &async_writer;
+    log_message("INFO", "Async segment writes: %s, %d in flight",
+                async_writer.backend(), async_io);
+  }
+
+  /** Byte quotas are enforced off the write path */
+  Reclaimer reclaimer;
+  reclaimer.start(static_cast<uint64_t>(std::max(global_quota_mb, 0)) << 20,
+                  std::min(std::max(disk_max_percent, 0), 100));
+  g_reclaimer = &reclaimer;
+  if (global_quota_mb > 0) {
+    log_message("INFO", "Global storage quota: %d MB", global_quota_mb);
+  }
+  if (disk_max_percent > 0) {
+    log_message("INFO", "Disk usage limit: %d%%", disk_max_percent);
+  }
+
+  /** Publish live metrics for the exporter */
+  if (!metrics_path.empty()) {
+    std::string error;
+    if (g_metrics.create(metrics_path,
+                         static_cast<uint32_t>(std::max(metrics_slots, 1)),
+                         error)) {
+      log_message("INFO", "Metrics file: %s", metrics_path.c_str());
+    } else {
+      log_message("ERROR", "Failed to create metrics file %s: %s",
+                  metrics_path.c_str(), error.c_str());
+    }
+  }
+
+  int exit_code = 0;
+  std::list<std::unique_ptr<CameraSession>> cameras;
+
+  /** Serve live windows from memory */
+  LiveCache live_cache;
+  HttpServer live_server;
+  if (!live_http.empty()) {
+    std::string error;
+    if (live_cache.open(live_root, live_cache_segments, error) &&
+        live_server.open(live_http, &live_cache, live_root, error)) {
+      g_live_cache = &live_cache;
+      live_server.set_playlist_hook([&live_cache, &cameras](const std::string &key) {
+        handle_live_request(key, live_cache, cameras);
+      });
+      live_server.start();
+      log_message("INFO", "Live HTTP on %s for %s, %d segments per output",
+                  live_http.c_str(), live_root.c_str(), live_cache_segments);
+    } else {
+      log_message("ERROR", "Failed to start live HTTP on %s: %s",
+                  live_http.c_str(), error.c_str());
+    }
+  }
+
+  /** Serve recordings without the backend copying them */
+  HttpServer segment_server;
+  if (!segment_http.empty()) {
+    std::string error;
+    if (segment_server.open(segment_http, nullptr, live_root, error)) {
+      segment_server.start();
+      log_message("INFO", "Segment HTTP on %s for %s", segment_http.c_str(),
+                  live_root.c_str());
+    } else {
+      log_message("ERROR", "Failed to start segment HTTP on %s: %s",
+                  segment_http.c_str(), error.c_str());
+    }
+  }
+
+  /** Serve control commands from the backend */
+  ControlSocket control;
+  std::thread control_thread;
+  if (!control_path.empty()) {
+    std::string error;
+    if (control.open(control_path, error)) {
+      log_message("INFO", "Control socket: %s", control_path.c_str());
+      control_thread = std::thread([&control, &cameras]() {
+        std::string line;
+        while (!g_stop_requested.load()) {
+          if (control.receive(line, 200)) {
+            handle_control_command(line, cameras);
+          }
+        }
+      });
+    } else {
+      log_message("ERROR", "Failed to open control socket %s: %s",
+                  control_path.c_str(), error.c_str());
+    }
+  }
+
+  /** SIGHUP is safe from here on, and the manifest is read after this,
+   * so a manifest written before the file appears needs no reload */
+  if (!ready_path.empty()) {
+    std::string pid = std::to_string(getpid()) + "\n";
+    if (!utils::write_file_atomic(ready_path, pid.data(), pid.size())) {
+      log_message("ERROR", "Failed to write ready file %s", ready_path.c_str());
+    }
+  }
+
+  if (manifest_mode) {
+    log_message("INFO", "Manifest: %s", manifest_path.c_str());
+    if (!apply_manifest(manifest_path, defaults, pool, cameras)) {
+      exit_code = 1;
+    }
+
+    /** Serve until signalled, reloading the manifest on SIGHUP */
+    while (exit_code == 0 && !g_stop_requested.load()) {
+      if (g_reload_requested.exchange(false)) {
+        log_message("INFO", "Reloading manifest");
+        apply_manifest(manifest_path, defaults, pool, cameras);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+  } else {
+    {
+      std::unique_ptr<CameraSession> session =
+          start_camera(defaults, pool, std::max(g_decode_threads, 0));
+      std::lock_guard<std::mutex> lock(g_cameras_mutex);
+      cameras.push_back(std::move(session));
+    }
+    while (!cameras.front()->finished.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    exit_code = cameras.front()->exit_code;
+  }
+
+  g_stop_requested.store(true);
+  if (control_thread.joinable()) {
+    control_thread.join();
+  }
+  control.close();
+
+  for (auto &session : cameras) {
+    stop_camera(*session);
+  }
+  cameras.clear();
+  live_server.stop();
+  segment_server.stop();
+  g_live_cache = nullptr;
+  async_writer.stop();
+  g_async_writer = nullptr;
+  reclaimer.stop();
+  g_reclaimer = nullptr;
+
+  if (!ready_path.empty()) {
+    unlink(ready_path.c_str());
+  }
   avformat_network_deinit();
   log_message("INFO", "Exiting with code %d", exit_code);
   log_close();
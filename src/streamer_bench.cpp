@@ -0,0 +1,638 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/opt.h>
+}
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "pipeline.hpp"
+#include "synthetic_source.hpp"
+
+/**
+ * Per-stage micro-benchmark. A synthetic H.264 source is generated in
+ * process and muxed to an in-memory MPEG-TS, then every pipeline stage
+ * runs on it in isolation with the same functions the streamer uses:
+ * demux, decode, each rendition's scale and encode, and the HLS muxers.
+ * Results are printed as JSON so runs can be diffed.
+ */
+
+/** Heap allocations made by the process, libav included */
+static std::atomic<uint64_t> g_alloc_count(0);
+
+/**
+ * The allocation functions below interpose on the C library's for the
+ * whole process and forward to the next definition, found with
+ * dlsym(RTLD_NEXT). dlsym may itself allocate, so calls made while the
+ * functions are being resolved are served from a static arena that is
+ * never freed.
+ */
+namespace bench_alloc {
+
+using MallocFn = void *(*)(size_t);
+using CallocFn = void *(*)(size_t, size_t);
+using ReallocFn = void *(*)(void *, size_t);
+using AlignFn = void *(*)(size_t, size_t);
+using PosixAlignFn = int (*)(void **, size_t, size_t);
+using FreeFn = void (*)(void *);
+
+/** Forwarding targets, null until resolved */
+struct Next {
+  MallocFn malloc = nullptr;
+  CallocFn calloc = nullptr;
+  ReallocFn realloc = nullptr;
+  AlignFn memalign = nullptr;
+  AlignFn aligned_alloc = nullptr;
+  PosixAlignFn posix_memalign = nullptr;
+  MallocFn valloc = nullptr;
+  MallocFn pvalloc = nullptr;
+  FreeFn free = nullptr;
+};
+
+static Next g_next;
+static std::atomic<bool> g_resolved(false);
+static std::atomic<bool> g_resolving(false);
+
+/** Arena for allocations made by dlsym during resolution */
+alignas(alignof(std::max_align_t)) static char g_arena[16384];
+static std::atomic<size_t> g_arena_used(0);
+
+/**
+ * @brief Check that a pointer came from the arena
+ */
+static inline bool in_arena(
+    const void *ptr
+) {
+  const char *p = static_cast<const char *>(ptr);
+  return p >= g_arena && p < g_arena + sizeof(g_arena);
+}
+
+/**
+ * @brief Bump allocate zeroed memory from the arena
+ *
+ * @return void* nullptr once the arena is exhausted
+ */
+static inline void *arena_alloc(
+    size_t size,
+    size_t alignment
+) {
+  if (alignment < alignof(std::max_align_t)) {
+    alignment = alignof(std::max_align_t);
+  }
+  size_t used = g_arena_used.load();
+  while (true) {
+    size_t offset = (used + alignment - 1) & ~(alignment - 1);
+    if (offset > sizeof(g_arena) || size > sizeof(g_arena) - offset) {
+      return nullptr;
+    }
+    if (g_arena_used.compare_exchange_weak(used, offset + size)) {
+      return g_arena + offset;
+    }
+  }
+}
+
+/**
+ * @brief Resolve the forwarding targets once; false while resolution
+ * is in progress, the caller then uses the arena
+ */
+static inline bool resolve() {
+  if (g_resolved.load(std::memory_order_acquire)) {
+    return true;
+  }
+  if (g_resolving.exchange(true)) {
+    return g_resolved.load(std::memory_order_acquire);
+  }
+
+  Next next;
+  next.malloc = reinterpret_cast<MallocFn>(dlsym(RTLD_NEXT, "malloc"));
+  next.calloc = reinterpret_cast<CallocFn>(dlsym(RTLD_NEXT, "calloc"));
+  next.realloc = reinterpret_cast<ReallocFn>(dlsym(RTLD_NEXT, "realloc"));
+  next.memalign = reinterpret_cast<AlignFn>(dlsym(RTLD_NEXT, "memalign"));
+  next.aligned_alloc = reinterpret_cast<AlignFn>(dlsym(RTLD_NEXT, "aligned_alloc"));
+  next.posix_memalign = reinterpret_cast<PosixAlignFn>(dlsym(RTLD_NEXT, "posix_memalign"));
+  next.valloc = reinterpret_cast<MallocFn>(dlsym(RTLD_NEXT, "valloc"));
+  next.pvalloc = reinterpret_cast<MallocFn>(dlsym(RTLD_NEXT, "pvalloc"));
+  next.free = reinterpret_cast<FreeFn>(dlsym(RTLD_NEXT, "free"));
+  if (!next.malloc || !next.calloc || !next.realloc || !next.posix_memalign ||
+      !next.free) {
+    std::fputs("streamer_bench: cannot resolve the C allocator\n", stderr);
+    std::abort();
+  }
+
+  g_next = next;
+  g_resolved.store(true, std::memory_order_release);
+  return true;
+}
+
+/**
+ * @brief Check an alignment the way posix_memalign requires
+ */
+static inline bool valid_alignment(
+    size_t alignment
+) {
+  return alignment >= sizeof(void *) && (alignment & (alignment - 1)) == 0;
+}
+
+/**
+ * @brief Aligned allocation through posix_memalign, for the variants
+ * the C library does not export
+ */
+static inline void *next_aligned(
+    size_t alignment,
+    size_t size
+) {
+  void *mem = nullptr;
+  int ret = g_next.posix_memalign(&mem, alignment, size);
+  if (ret != 0) {
+    errno = ret;
+    return nullptr;
+  }
+  return mem;
+}
+
+}  // namespace bench_alloc
+
+extern "C" {
+
+void *malloc(size_t size) {
+  if (!bench_alloc::resolve()) {
+    return bench_alloc::arena_alloc(size, 0);
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  return bench_alloc::g_next.malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (!bench_alloc::resolve()) {
+    if (size != 0 && n > SIZE_MAX / size) {
+      return nullptr;
+    }
+    return bench_alloc::arena_alloc(n * size, 0);
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  return bench_alloc::g_next.calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (!bench_alloc::resolve() || bench_alloc::in_arena(ptr)) {
+    /** Arena blocks keep no size; copy what the arena can hold */
+    void *mem = malloc(size);
+    if (mem && ptr) {
+      size_t avail = static_cast<size_t>(
+          bench_alloc::g_arena + sizeof(bench_alloc::g_arena) -
+          static_cast<char *>(ptr));
+      std::memcpy(mem, ptr, std::min(size, avail));
+    }
+    return mem;
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  return bench_alloc::g_next.realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  if (!bench_alloc::resolve()) {
+    return bench_alloc::arena_alloc(size, alignment);
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (!bench_alloc::g_next.memalign) {
+    return bench_alloc::next_aligned(alignment, size);
+  }
+  return bench_alloc::g_next.memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (!bench_alloc::resolve()) {
+    return bench_alloc::arena_alloc(size, alignment);
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (!bench_alloc::g_next.aligned_alloc) {
+    return bench_alloc::next_aligned(alignment, size);
+  }
+  return bench_alloc::g_next.aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  /** POSIX: *ptr is left untouched on failure */
+  if (!bench_alloc::valid_alignment(alignment)) {
+    return EINVAL;
+  }
+  if (!bench_alloc::resolve()) {
+    void *mem = bench_alloc::arena_alloc(size, alignment);
+    if (!mem) {
+      return ENOMEM;
+    }
+    *ptr = mem;
+    return 0;
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  return bench_alloc::g_next.posix_memalign(ptr, alignment, size);
+}
+
+void *valloc(size_t size) {
+  if (!bench_alloc::resolve()) {
+    return bench_alloc::arena_alloc(size, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (!bench_alloc::g_next.valloc) {
+    return bench_alloc::next_aligned(static_cast<size_t>(sysconf(_SC_PAGESIZE)), size);
+  }
+  return bench_alloc::g_next.valloc(size);
+}
+
+void *pvalloc(size_t size) {
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  size_t rounded = size == 0 ? page : (size + page - 1) & ~(page - 1);
+  if (!bench_alloc::resolve()) {
+    return bench_alloc::arena_alloc(rounded, page);
+  }
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (!bench_alloc::g_next.pvalloc) {
+    return bench_alloc::next_aligned(page, rounded);
+  }
+  return bench_alloc::g_next.pvalloc(size);
+}
+
+void free(void *ptr) {
+  /** Arena blocks are never reused */
+  if (!ptr || bench_alloc::in_arena(ptr) || !bench_alloc::resolve()) {
+    return;
+  }
+  bench_alloc::g_next.free(ptr);
+}
+}
+
+/**
+ * @brief Accumulated cost of one stage
+ */
+struct StageResult {
+  std::string name;
+  uint64_t items = 0;
+  int64_t ns = 0;
+  uint64_t allocs = 0;
+};
+
+/**
+ * @brief Times one stage step and counts its allocations
+ */
+class StageTimer {
+ public:
+  explicit StageTimer(
+      StageResult &result
+  ) : result_(result),
+      allocs_(g_alloc_count.load(std::memory_order_relaxed)),
+      start_(utils::metrics_now_ns()) {}
+
+  ~StageTimer() {
+    result_.ns += utils::metrics_now_ns() - start_;
+    result_.allocs += g_alloc_count.load(std::memory_order_relaxed) - allocs_;
+    result_.items++;
+  }
+
+ private:
+  StageResult &result_;
+  uint64_t allocs_;
+  int64_t start_;
+};
+
+/**
+ * @brief Benchmark settings
+ */
+struct BenchConfig {
+  int width = 1920;
+  int height = 1080;
+  int fps = 30;
+  int frames = 300;
+  int codec_threads = 1;
+  bool reduced_decode = false;
+  bool fmp4 = false;
+  std::string out_dir;
+};
+
+/**
+ * @brief Print one stage as a JSON object
+ *
+ * @param result
+ * @param last
+ */
+static void print_stage(const StageResult &result, bool last) {
+  double items = result.items > 0 ? static_cast<double>(result.items) : 1.0;
+  double ns_per_frame = static_cast<double>(result.ns) / items;
+  std::printf(
+      "    {\"stage\": \"%s\", \"frames\": %" PRIu64
+      ", \"ns_per_frame\": %.0f, \"frames_per_sec\": %.2f, "
+      "\"allocs_per_frame\": %.2f}%s\n",
+      result.name.c_str(), result.items, ns_per_frame,
+      ns_per_frame > 0 ? 1e9 / ns_per_frame : 0.0,
+      static_cast<double>(result.allocs) / items, last ? "" : ",");
+}
+
+/**
+ * @brief Print CLI usage instructions
+ *
+ * @param argv0
+ */
+static void print_usage(const char *argv0) {
+  std::fprintf(
+      stderr,
+      "Usage: %s [--width W] [--height H] [--fps F] [--frames N] "
+      "[--codec-threads N] [--reduced-decode] [--segment-format ts|fmp4] "
+      "[--out-dir DIR]\n"
+      "Runs each pipeline stage on a synthetic source and prints JSON with "
+      "ns/frame, frames/s and allocations/frame per stage and the bytes "
+      "written by the HLS outputs.\n",
+      argv0);
+}
+
+int main(int argc, char **argv) {
+  BenchConfig cfg;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--width" && has_value) {
+      cfg.width = std::atoi(argv[++i]);
+    } else if (arg == "--height" && has_value) {
+      cfg.height = std::atoi(argv[++i]);
+    } else if (arg == "--fps" && has_value) {
+      cfg.fps = std::atoi(argv[++i]);
+    } else if (arg == "--frames" && has_value) {
+      cfg.frames = std::atoi(argv[++i]);
+    } else if (arg == "--codec-threads" && has_value) {
+      cfg.codec_threads = std::atoi(argv[++i]);
+    } else if (arg == "--reduced-decode") {
+      cfg.reduced_decode = true;
+    } else if (arg == "--segment-format" && has_value) {
+      std::string format = argv[++i];
+      if (format != "ts" && format != "fmp4") {
+        print_usage(argv[0]);
+        return 1;
+      }
+      cfg.fmp4 = format == "fmp4";
+    } else if (arg == "--out-dir" && has_value) {
+      cfg.out_dir = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (cfg.width <= 0 || cfg.height <= 0 || cfg.fps <= 0 || cfg.frames <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  av_log_set_level(AV_LOG_QUIET);
+  g_codec_threads = cfg.codec_threads;
+
+  /** HLS outputs go to a scratch directory */
+  bool own_dir = cfg.out_dir.empty();
+  if (own_dir) {
+    char tmpl[] = "/tmp/streamer_bench_XXXXXX";
+    if (!mkdtemp(tmpl)) {
+      std::fprintf(stderr, "Cannot create scratch directory\n");
+      return 1;
+    }
+    cfg.out_dir = tmpl;
+  }
+
+  std::vector<uint8_t> ts;
+  int ret = utils::make_synthetic_source(cfg.width, cfg.height, cfg.fps,
+                                         cfg.frames, ts);
+  if (ret < 0) {
+    std::fprintf(stderr, "Synthetic source failed: %s\n",
+                 av_err2str_cpp(ret).c_str());
+    return 1;
+  }
+
+  /** Open the in-memory input like a camera */
+  utils::MemoryInput memory;
+  memory.data = ts.data();
+  memory.size = ts.size();
+  AVFormatContext *in_ctx = nullptr;
+  ret = utils::open_memory_input(memory, &in_ctx);
+  if (ret < 0) {
+    std::fprintf(stderr, "Cannot open synthetic input: %s\n",
+                 av_err2str_cpp(ret).c_str());
+    return 1;
+  }
+
+  std::vector<StageResult> results;
+  results.reserve(16);
+
+  /** Demux */
+  std::vector<AVPacket *> packets;
+  {
+    StageResult demux;
+    demux.name = "demux";
+    while (true) {
+      AVPacket *pkt = av_packet_alloc();
+      {
+        StageTimer timer(demux);
+        ret = av_read_frame(in_ctx, pkt);
+      }
+      if (ret < 0) {
+        demux.items--;
+        av_packet_free(&pkt);
+        break;
+      }
+      packets.push_back(pkt);
+    }
+    results.push_back(demux);
+  }
+
+  /** Pipeline state as the streamer builds it */
+  WorkerPool pool(1);
+  CameraMetrics metrics{};
+  StreamState state;
+  state.in_ctx = in_ctx;
+  state.video_index = 0;
+  state.video_stream = in_ctx->streams[0];
+  state.audio_index = -1;
+  state.metrics = &metrics;
+  state.pool = &pool;
+  state.mux_stage.reset(new Stage(pool, []() {}));
+
+  const AVCodec *decoder =
+      avcodec_find_decoder(state.video_stream->codecpar->codec_id);
+  state.vdec = avcodec_alloc_context3(decoder);
+  avcodec_parameters_to_context(state.vdec, state.video_stream->codecpar);
+  configure_decoder(state.vdec, decoder, AVRational{cfg.fps, 1}, default_renditions(),
+                    cfg.reduced_decode, g_codec_threads);
+  ret = avcodec_open2(state.vdec, decoder, nullptr);
+  state.fmp4_segments = cfg.fmp4;
+  if (ret >= 0) {
+    ret = open_outputs(state, cfg.out_dir + "/index.m3u8",
+                       default_renditions(), 0, 0, 1, 4, false);
+  }
+  if (ret < 0) {
+    std::fprintf(stderr, "Pipeline setup failed: %s\n",
+                 av_err2str_cpp(ret).c_str());
+    return 1;
+  }
+
+  /** Decode; keep a window of pictures for the scale and encode stages */
+  const size_t kPictureWindow = 16;
+  std::vector<AVFrame *> pictures;
+  {
+    StageResult decode;
+    decode.name = "decode";
+    AVFrame *frame = av_frame_alloc();
+    for (size_t i = 0; i <= packets.size(); ++i) {
+      StageTimer timer(decode);
+      ret = avcodec_send_packet(state.vdec, i < packets.size() ? packets[i]
+                                                               : nullptr);
+      while (ret >= 0) {
+        ret = avcodec_receive_frame(state.vdec, frame);
+        if (ret < 0) {
+          break;
+        }
+        if (pictures.size() < kPictureWindow) {
+          pictures.push_back(av_frame_clone(frame));
+        }
+        av_frame_unref(frame);
+      }
+    }
+    av_frame_free(&frame);
+    results.push_back(decode);
+  }
+  if (pictures.empty()) {
+    std::fprintf(stderr, "Synthetic source did not decode\n");
+    return 1;
+  }
+
+  /** Scale, encode and mux each rendition */
+  ret = build_scaler(state, pictures[0]);
+  if (ret < 0) {
+    std::fprintf(stderr, "Scaler setup failed: %s\n",
+                 av_err2str_cpp(ret).c_str());
+    return 1;
+  }
+
+  size_t count = state.scaled_outputs.size();
+  std::vector<StageResult> scale(count);
+  std::vector<StageResult> encode(count);
+  std::vector<StageResult> mux(count);
+  for (size_t idx = 0; idx < count; ++idx) {
+    const std::string &name = state.outputs[state.scaled_outputs[idx]].rendition.name;
+    scale[idx].name = "scale_" + name;
+    encode[idx].name = "encode_" + name;
+    mux[idx].name = "mux_" + name;
+  }
+
+  for (int n = 0; n < cfg.frames && state.pipeline_error.load() == 0; ++n) {
+    const AVFrame *src = pictures[static_cast<size_t>(n) % pictures.size()];
+    for (size_t idx : state.scaler.order()) {
+      StageTimer timer(scale[idx]);
+      ret = state.scaler.scale(idx, src);
+    }
+    for (size_t idx : state.scaler.order()) {
+      EncodeOutput &out = state.outputs[state.scaled_outputs[idx]];
+      StageTimer timer(encode[idx]);
+      ret = encode_and_write_frame(state, out, state.scaler.output(idx), n);
+      if (ret < 0) {
+        fail_pipeline(state, ret);
+      }
+    }
+
+    MuxItem item;
+    while (state.mux_queue.try_pop(item)) {
+      for (size_t idx = 0; idx < count; ++idx) {
+        if (state.scaled_outputs[idx] == static_cast<size_t>(item.target)) {
+          StageTimer timer(mux[idx]);
+          ret = write_mux_item(state, item);
+        }
+      }
+      av_packet_free(&item.pkt);
+    }
+  }
+  for (size_t idx = 0; idx < count; ++idx) {
+    results.push_back(scale[idx]);
+    results.push_back(encode[idx]);
+    results.push_back(mux[idx]);
+  }
+
+  /** Copy HLS mux, including timestamp normalization */
+  {
+    StageResult copy;
+    copy.name = "mux_copy";
+    AVPacket *pkt = av_packet_alloc();
+    for (AVPacket *src : packets) {
+      av_packet_ref(pkt, src);
+      {
+        StageTimer timer(copy);
+        normalize_copy_timestamps(state, pkt);
+        ret = write_copy_packet(state.in_ctx, state.copy_ctx, pkt);
+      }
+      av_packet_unref(pkt);
+      if (ret < 0) {
+        fail_pipeline(state, ret);
+        break;
+      }
+    }
+    av_packet_free(&pkt);
+    results.push_back(copy);
+  }
+
+  int err = state.pipeline_error.load();
+
+  /** Close outputs first so the written size includes their tails */
+  state.mux_stage.reset();
+  close_copy_output(state.copy_ctx);
+  state.copy_ctx = nullptr;
+  close_reencode_outputs(state.outputs);
+  uintmax_t output_bytes = 0;
+  std::error_code size_ec;
+  for (const auto &entry : std::filesystem::directory_iterator(cfg.out_dir, size_ec)) {
+    if (entry.is_regular_file(size_ec)) {
+      output_bytes += entry.file_size(size_ec);
+    }
+  }
+
+  /** Report */
+  std::printf("{\n");
+  std::printf("  \"width\": %d, \"height\": %d, \"fps\": %d, \"frames\": %d, "
+              "\"codec_threads\": %d, \"segment_format\": \"%s\", "
+              "\"output_bytes\": %ju,\n",
+              cfg.width, cfg.height, cfg.fps, cfg.frames, cfg.codec_threads,
+              cfg.fmp4 ? "fmp4" : "ts", output_bytes);
+  std::printf("  \"error\": \"%s\",\n", err < 0 ? av_err2str_cpp(err).c_str() : "");
+  std::printf("  \"stages\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    print_stage(results[i], i + 1 == results.size());
+  }
+  std::printf("  ]\n}\n");
+
+  /** Cleanup */
+  for (AVFrame *frame : pictures) {
+    av_frame_free(&frame);
+  }
+  for (AVPacket *pkt : packets) {
+    av_packet_free(&pkt);
+  }
+  avcodec_free_context(&state.vdec);
+  utils::close_memory_input(&in_ctx);
+
+  if (own_dir) {
+    std::error_code ec;
+    std::filesystem::remove_all(cfg.out_dir, ec);
+  }
+  return err < 0 ? 2 : 0;
+}
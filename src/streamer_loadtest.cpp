@@ -0,0 +1,638 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pipeline.hpp"
+#include "synthetic_source.hpp"
+
+/**
+ * Camera-density load test. N virtual cameras replay a synthetic
+ * source in real time through the streamer's own ingest path
+ * (distribute_outputs and the pooled decode/encode/mux stages) into
+ * HLS outputs on disk. N is doubled until a trial loses real time and
+ * then bisected, once per rendition ladder.
+ */
+
+/**
+ * @brief Load test settings
+ */
+struct LoadConfig {
+  int width = 1920;
+  int height = 1080;
+  int fps = 30;
+  int source_seconds = 10;
+  int warmup_seconds = 5;
+  int trial_seconds = 20;
+  int max_latency_ms = 1000;
+  int start_cameras = 1;
+  int max_cameras = 256;
+  int workers = 0;
+  int codec_threads = 1;
+  std::string out_dir;
+  std::vector<std::string> ladders;
+};
+
+/**
+ * @brief Pre-demuxed source every virtual camera replays
+ */
+struct LoadSource {
+  AVFormatContext *in_ctx = nullptr;
+  std::vector<AVPacket *> packets;
+  int64_t loop_duration = 0;
+};
+
+/**
+ * @brief One camera of a trial
+ */
+struct VirtualCamera {
+  StreamState state;
+  CameraMetrics metrics{};
+  std::thread ingest;
+  std::atomic<uint64_t> late_packets{0};
+  int ingest_error = 0;
+};
+
+/**
+ * @brief Plain copy of a histogram, for deltas over the trial window
+ */
+struct HistogramSnapshot {
+  uint64_t buckets[kMetricsBuckets] = {0};
+  uint64_t count = 0;
+};
+
+/**
+ * @brief Totals of all cameras at one instant
+ */
+struct TrialSnapshot {
+  uint64_t frames_in = 0;
+  uint64_t frames_decoded = 0;
+  uint64_t dropped = 0;
+  uint64_t late = 0;
+  HistogramSnapshot latency;
+};
+
+/**
+ * @brief Outcome of one trial
+ */
+struct TrialResult {
+  int cameras = 0;
+  bool ok = false;
+  double p99_ms = 0.0;
+  uint64_t dropped = 0;
+  double decoded_ratio = 1.0;
+  double late_ratio = 0.0;
+  double rss_per_camera_mb = 0.0;
+  std::string error;
+};
+
+static std::atomic<bool> g_stop_requested(false);
+
+/**
+ * @brief Resident set size of the process
+ *
+ * @return int64_t bytes
+ */
+static int64_t read_rss_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  int64_t size = 0;
+  int64_t resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Sum the counters of every camera
+ *
+ * @param cameras
+ * @return TrialSnapshot
+ */
+static TrialSnapshot snapshot(
+    const std::vector<std::unique_ptr<VirtualCamera>> &cameras) {
+  TrialSnapshot snap;
+  for (const auto &cam : cameras) {
+    const CameraMetrics &m = cam->metrics;
+    snap.frames_in += m.video_frames_in.load(std::memory_order_relaxed);
+    snap.frames_decoded += m.frames_decoded.load(std::memory_order_relaxed);
+    snap.dropped += static_cast<uint64_t>(cam->state.dropped_packets.load());
+    snap.late += cam->late_packets.load(std::memory_order_relaxed);
+    for (size_t b = 0; b < kMetricsBuckets; ++b) {
+      snap.latency.buckets[b] +=
+          m.frame_latency.buckets[b].load(std::memory_order_relaxed);
+    }
+    snap.latency.count += m.frame_latency.count.load(std::memory_order_relaxed);
+  }
+  return snap;
+}
+
+/**
+ * @brief Estimate a quantile from histogram bucket deltas, linear
+ * within the bucket
+ *
+ * @param before
+ * @param after
+ * @param q quantile in (0, 1)
+ * @return double milliseconds, -1 without samples
+ */
+static double histogram_quantile_ms(const HistogramSnapshot &before,
+                                    const HistogramSnapshot &after, double q) {
+  uint64_t total = after.count - before.count;
+  if (total == 0) {
+    return -1.0;
+  }
+
+  double rank = q * static_cast<double>(total);
+  uint64_t seen = 0;
+  double lower_us = 0.0;
+  for (size_t b = 0; b < kMetricsBuckets; ++b) {
+    uint64_t in_bucket = after.buckets[b] - before.buckets[b];
+    double upper_us = static_cast<double>(kMetricsBucketsUs[b]);
+    if (in_bucket > 0 && static_cast<double>(seen + in_bucket) >= rank) {
+      double frac = (rank - static_cast<double>(seen)) /
+                    static_cast<double>(in_bucket);
+      return (lower_us + frac * (upper_us - lower_us)) / 1000.0;
+    }
+    seen += in_bucket;
+    lower_us = upper_us;
+  }
+
+  /** Beyond the last bucket */
+  return lower_us / 1000.0;
+}
+
+/**
+ * @brief Replay the source in real time through distribute_outputs,
+ * looping with shifted timestamps
+ *
+ * @param cam
+ * @param source
+ * @param start first packet due time
+ */
+static void run_ingest(VirtualCamera &cam, const LoadSource &source,
+                       std::chrono::steady_clock::time_point start) {
+  StreamState &state = cam.state;
+  AVRational tb = state.video_stream->time_base;
+  int64_t first_dts = source.packets.front()->dts;
+  AVPacket *pkt = av_packet_alloc();
+  if (!pkt) {
+    cam.ingest_error = AVERROR(ENOMEM);
+    return;
+  }
+
+  for (int64_t loop = 0; !g_stop_requested.load(); ++loop) {
+    int64_t offset = loop * source.loop_duration;
+    for (const AVPacket *src : source.packets) {
+      if (g_stop_requested.load() || state.pipeline_error.load() < 0) {
+        break;
+      }
+
+      int64_t due_us = av_rescale_q(src->dts - first_dts + offset, tb, {1, 1000000});
+      auto due = start + std::chrono::microseconds(due_us);
+      auto now = std::chrono::steady_clock::now();
+      if (now < due) {
+        std::this_thread::sleep_until(due);
+      } else if (now - due > std::chrono::milliseconds(100)) {
+        cam.late_packets.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      int ret = av_packet_ref(pkt, src);
+      if (ret < 0) {
+        cam.ingest_error = ret;
+        break;
+      }
+      pkt->pts += offset;
+      pkt->dts += offset;
+
+      cam.metrics.packets_in.fetch_add(1, std::memory_order_relaxed);
+      cam.metrics.video_frames_in.fetch_add(1, std::memory_order_relaxed);
+      ret = distribute_outputs(state, pkt);
+      av_packet_unref(pkt);
+      if (ret < 0) {
+        cam.ingest_error = ret;
+        break;
+      }
+    }
+  }
+
+  av_packet_free(&pkt);
+}
+
+/**
+ * @brief Open a virtual camera's decoder and outputs
+ *
+ * @param cam
+ * @param source
+ * @param ladder
+ * @param dir output directory of this camera
+ * @param pool
+ * @return int
+ */
+static int open_camera(VirtualCamera &cam, const LoadSource &source,
+                       const std::vector<Rendition> &ladder,
+                       const std::string &dir, WorkerPool &pool) {
+  StreamState &state = cam.state;
+  state.in_ctx = source.in_ctx;
+  state.video_index = 0;
+  state.video_stream = source.in_ctx->streams[0];
+  state.audio_index = -1;
+  state.metrics = &cam.metrics;
+
+  const AVCodec *decoder =
+      avcodec_find_decoder(state.video_stream->codecpar->codec_id);
+  if (!decoder) {
+    return AVERROR_DECODER_NOT_FOUND;
+  }
+  state.vdec = avcodec_alloc_context3(decoder);
+  if (!state.vdec) {
+    return AVERROR(ENOMEM);
+  }
+  int ret = avcodec_parameters_to_context(state.vdec, state.video_stream->codecpar);
+  if (ret < 0) {
+    return ret;
+  }
+  state.vdec->thread_count = g_codec_threads;
+  ret = avcodec_open2(state.vdec, decoder, nullptr);
+  if (ret < 0) {
+    return ret;
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  ret = open_outputs(state, dir + "/index.m3u8", ladder, 1, 0, 1, 4, false);
+  if (ret < 0) {
+    return ret;
+  }
+
+  state.decoded = av_frame_alloc();
+  state.audio_pkt = av_packet_alloc();
+  if (!state.decoded || !state.audio_pkt) {
+    return AVERROR(ENOMEM);
+  }
+
+  /** Every rendition is watched for the whole trial */
+  state.decoding = !ladder.empty();
+  start_pipeline(state, pool);
+  return 0;
+}
+
+/**
+ * @brief Drain and close a virtual camera
+ *
+ * @param cam
+ */
+static void close_camera(VirtualCamera &cam) {
+  StreamState &state = cam.state;
+  if (state.decode_stage) {
+    stop_pipeline(state);
+    flush_encoders(state.outputs);
+  }
+  av_packet_free(&state.audio_pkt);
+  av_frame_free(&state.decoded);
+  close_copy_output(state.copy_ctx);
+  state.copy_ctx = nullptr;
+  close_reencode_outputs(state.outputs);
+  avcodec_free_context(&state.vdec);
+}
+
+/**
+ * @brief Run N cameras for warmup + trial seconds and judge real time
+ *
+ * @param cfg
+ * @param source
+ * @param ladder
+ * @param count cameras
+ * @param pool
+ * @return TrialResult
+ */
+static TrialResult run_trial(const LoadConfig &cfg, const LoadSource &source,
+                             const std::vector<Rendition> &ladder, int count,
+                             WorkerPool &pool) {
+  TrialResult result;
+  result.cameras = count;
+  int64_t rss_before = read_rss_bytes();
+
+  std::vector<std::unique_ptr<VirtualCamera>> cameras;
+  for (int i = 0; i < count; ++i) {
+    cameras.emplace_back(new VirtualCamera());
+    std::string dir = cfg.out_dir + "/cam" + std::to_string(i);
+    int ret = open_camera(*cameras.back(), source, ladder, dir, pool);
+    if (ret < 0) {
+      result.error = "camera setup failed: " + av_err2str_cpp(ret);
+      break;
+    }
+  }
+
+  if (result.error.empty()) {
+    /** Spread cameras over one frame interval, like unsynchronized sources */
+    auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    for (int i = 0; i < count; ++i) {
+      auto offset = std::chrono::microseconds(1000000LL * i / count / cfg.fps);
+      VirtualCamera *cam = cameras[i].get();
+      cam->ingest = std::thread([cam, &source, start, offset]() {
+        run_ingest(*cam, source, start + offset);
+      });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.warmup_seconds));
+    TrialSnapshot before = snapshot(cameras);
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.trial_seconds));
+    TrialSnapshot after = snapshot(cameras);
+    int64_t rss_during = read_rss_bytes();
+
+    uint64_t frames = after.frames_in - before.frames_in;
+    result.dropped = after.dropped - before.dropped;
+    result.late_ratio = frames > 0 ? static_cast<double>(after.late - before.late) /
+                                         static_cast<double>(frames)
+                                   : 0.0;
+    if (!ladder.empty() && frames > 0) {
+      result.decoded_ratio =
+          static_cast<double>(after.frames_decoded - before.frames_decoded) /
+          static_cast<double>(frames);
+    }
+    result.p99_ms = histogram_quantile_ms(before.latency, after.latency, 0.99);
+    result.rss_per_camera_mb =
+        static_cast<double>(rss_during - rss_before) / count / (1024.0 * 1024.0);
+
+    for (const auto &cam : cameras) {
+      int err = cam->state.pipeline_error.load();
+      if (err < 0 && result.error.empty()) {
+        result.error = "pipeline error: " + av_err2str_cpp(err);
+      }
+    }
+
+    result.ok = result.error.empty() && result.dropped == 0 &&
+                result.late_ratio < 0.01 && result.decoded_ratio >= 0.98 &&
+                result.p99_ms <= cfg.max_latency_ms;
+  }
+
+  /** Stop ingest first, then drain each pipeline */
+  g_stop_requested.store(true);
+  for (auto &cam : cameras) {
+    if (cam->ingest.joinable()) {
+      cam->ingest.join();
+    }
+  }
+  g_stop_requested.store(false);
+  for (auto &cam : cameras) {
+    close_camera(*cam);
+  }
+  cameras.clear();
+
+  std::error_code ec;
+  std::filesystem::remove_all(cfg.out_dir, ec);
+  std::filesystem::create_directories(cfg.out_dir, ec);
+  return result;
+}
+
+/**
+ * @brief Resolve a comma separated ladder against the default ladder;
+ * "copy" is the remux-only ladder
+ *
+ * @param spec
+ * @param ladder
+ * @return true if every name is known
+ */
+static bool parse_ladder(const std::string &spec, std::vector<Rendition> &ladder) {
+  ladder.clear();
+  if (spec == "copy") {
+    return true;
+  }
+
+  std::vector<Rendition> known = default_renditions();
+  std::istringstream names(spec);
+  std::string name;
+  while (std::getline(names, name, ',')) {
+    auto it = std::find_if(known.begin(), known.end(),
+                           [&](const Rendition &r) { return r.name == name; });
+    if (it == known.end()) {
+      return false;
+    }
+    ladder.push_back(*it);
+  }
+  return !ladder.empty();
+}
+
+/**
+ * @brief Print one trial as a JSON object
+ *
+ * @param trial
+ * @param last
+ */
+static void print_trial(const TrialResult &trial, bool last) {
+  std::printf(
+      "        {\"cameras\": %d, \"ok\": %s, \"p99_frame_latency_ms\": %.1f, "
+      "\"dropped_packets\": %" PRIu64 ", \"decoded_ratio\": %.3f, "
+      "\"late_ratio\": %.4f, \"rss_per_camera_mb\": %.1f, \"error\": \"%s\"}%s\n",
+      trial.cameras, trial.ok ? "true" : "false", trial.p99_ms, trial.dropped,
+      trial.decoded_ratio, trial.late_ratio, trial.rss_per_camera_mb,
+      trial.error.c_str(), last ? "" : ",");
+}
+
+/**
+ * @brief Print CLI usage instructions
+ *
+ * @param argv0
+ */
+static void print_usage(const char *argv0) {
+  std::fprintf(
+      stderr,
+      "Usage: %s [--width W] [--height H] [--fps F] [--ladder copy|low,mid,high]... "
+      "[--trial-seconds S] [--warmup-seconds S] [--max-latency-ms M] "
+      "[--start N] [--max-cameras N] [--workers N] [--codec-threads N] "
+      "[--out-dir DIR]\n"
+      "Finds how many real-time cameras the box sustains per ladder and "
+      "prints JSON with cameras per core, p99 frame latency and RSS per camera.\n",
+      argv0);
+}
+
+int main(int argc, char **argv) {
+  LoadConfig cfg;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--width" && has_value) {
+      cfg.width = std::atoi(argv[++i]);
+    } else if (arg == "--height" && has_value) {
+      cfg.height = std::atoi(argv[++i]);
+    } else if (arg == "--fps" && has_value) {
+      cfg.fps = std::atoi(argv[++i]);
+    } else if (arg == "--ladder" && has_value) {
+      cfg.ladders.push_back(argv[++i]);
+    } else if (arg == "--trial-seconds" && has_value) {
+      cfg.trial_seconds = std::atoi(argv[++i]);
+    } else if (arg == "--warmup-seconds" && has_value) {
+      cfg.warmup_seconds = std::atoi(argv[++i]);
+    } else if (arg == "--max-latency-ms" && has_value) {
+      cfg.max_latency_ms = std::atoi(argv[++i]);
+    } else if (arg == "--start" && has_value) {
+      cfg.start_cameras = std::atoi(argv[++i]);
+    } else if (arg == "--max-cameras" && has_value) {
+      cfg.max_cameras = std::atoi(argv[++i]);
+    } else if (arg == "--workers" && has_value) {
+      cfg.workers = std::atoi(argv[++i]);
+    } else if (arg == "--codec-threads" && has_value) {
+      cfg.codec_threads = std::atoi(argv[++i]);
+    } else if (arg == "--out-dir" && has_value) {
+      cfg.out_dir = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (cfg.ladders.empty()) {
+    cfg.ladders = {"copy", "low,mid,high"};
+  }
+  if (cfg.width <= 0 || cfg.height <= 0 || cfg.fps <= 0 ||
+      cfg.trial_seconds <= 0 || cfg.start_cameras <= 0 ||
+      cfg.max_cameras < cfg.start_cameras) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::vector<Rendition>> ladders;
+  for (const auto &spec : cfg.ladders) {
+    std::vector<Rendition> ladder;
+    if (!parse_ladder(spec, ladder)) {
+      std::fprintf(stderr, "Unknown ladder: %s\n", spec.c_str());
+      return 1;
+    }
+    ladders.push_back(ladder);
+  }
+
+  av_log_set_level(AV_LOG_QUIET);
+  g_codec_threads = cfg.codec_threads;
+
+  bool own_dir = cfg.out_dir.empty();
+  if (own_dir) {
+    char tmpl[] = "/tmp/streamer_loadtest_XXXXXX";
+    if (!mkdtemp(tmpl)) {
+      std::fprintf(stderr, "Cannot create scratch directory\n");
+      return 1;
+    }
+    cfg.out_dir = tmpl;
+  }
+
+  /** Build the looped source once; cameras only reference it */
+  std::vector<uint8_t> ts;
+  int ret = utils::make_synthetic_source(cfg.width, cfg.height, cfg.fps,
+                                         cfg.fps * cfg.source_seconds, ts);
+  utils::MemoryInput memory;
+  memory.data = ts.data();
+  memory.size = ts.size();
+  LoadSource source;
+  if (ret >= 0) {
+    ret = utils::open_memory_input(memory, &source.in_ctx);
+  }
+  while (ret >= 0) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt) {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+    if (av_read_frame(source.in_ctx, pkt) < 0) {
+      av_packet_free(&pkt);
+      break;
+    }
+    source.packets.push_back(pkt);
+  }
+  if (ret < 0 || source.packets.empty()) {
+    std::fprintf(stderr, "Synthetic source failed: %s\n",
+                 av_err2str_cpp(ret).c_str());
+    return 1;
+  }
+  AVRational tb = source.in_ctx->streams[0]->time_base;
+  source.loop_duration = av_rescale_q(static_cast<int64_t>(source.packets.size()),
+                                      {1, cfg.fps}, tb);
+
+  WorkerPool pool(cfg.workers > 0 ? static_cast<size_t>(cfg.workers) : 0);
+
+  std::printf("{\n");
+  std::printf("  \"width\": %d, \"height\": %d, \"fps\": %d, \"workers\": %zu, "
+              "\"trial_seconds\": %d, \"max_latency_ms\": %d,\n",
+              cfg.width, cfg.height, cfg.fps, pool.size(), cfg.trial_seconds,
+              cfg.max_latency_ms);
+  std::printf("  \"ladders\": [\n");
+
+  for (size_t l = 0; l < ladders.size(); ++l) {
+    std::vector<TrialResult> trials;
+    auto trial = [&](int n) {
+      std::fprintf(stderr, "[%s] %d cameras...\n", cfg.ladders[l].c_str(), n);
+      trials.push_back(run_trial(cfg, source, ladders[l], n, pool));
+      std::fprintf(stderr, "[%s] %d cameras: %s, p99 %.1f ms\n",
+                   cfg.ladders[l].c_str(), n,
+                   trials.back().ok ? "real time" : "lost real time",
+                   trials.back().p99_ms);
+      return trials.back();
+    };
+
+    /** Double until real time is lost, then bisect */
+    int good = 0;
+    int bad = cfg.max_cameras + 1;
+    for (int n = cfg.start_cameras; n <= cfg.max_cameras; n *= 2) {
+      if (!trial(n).ok) {
+        bad = n;
+        break;
+      }
+      good = n;
+    }
+    if (good > 0 && bad <= cfg.max_cameras) {
+      while (bad - good > 1) {
+        int mid = good + (bad - good) / 2;
+        if (trial(mid).ok) {
+          good = mid;
+        } else {
+          bad = mid;
+        }
+      }
+    }
+
+    const TrialResult *best = nullptr;
+    for (const auto &t : trials) {
+      if (t.ok && t.cameras == good) {
+        best = &t;
+      }
+    }
+
+    std::printf("    {\"ladder\": \"%s\", \"max_cameras\": %d, "
+                "\"cameras_per_core\": %.2f, \"p99_frame_latency_ms\": %.1f, "
+                "\"rss_per_camera_mb\": %.1f,\n",
+                cfg.ladders[l].c_str(), good,
+                static_cast<double>(good) / static_cast<double>(pool.size()),
+                best ? best->p99_ms : 0.0, best ? best->rss_per_camera_mb : 0.0);
+    std::printf("      \"trials\": [\n");
+    for (size_t t = 0; t < trials.size(); ++t) {
+      print_trial(trials[t], t + 1 == trials.size());
+    }
+    std::printf("      ]}%s\n", l + 1 == ladders.size() ? "" : ",");
+  }
+  std::printf("  ]\n}\n");
+
+  for (AVPacket *pkt : source.packets) {
+    av_packet_free(&pkt);
+  }
+  utils::close_memory_input(&source.in_ctx);
+  if (own_dir) {
+    std::error_code ec;
+    std::filesystem::remove_all(cfg.out_dir, ec);
+  }
+  return 0;
+}
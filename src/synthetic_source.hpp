@@ -0,0 +1,253 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/opt.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+/**
+ * Synthetic camera source for the benchmark and load-test tools: a
+ * moving test pattern encoded to H.264, muxed to MPEG-TS in memory and
+ * opened through a custom AVIO context like a real input.
+ */
+
+namespace utils {
+
+/**
+ * @brief Read cursor over the in-memory MPEG-TS
+ */
+struct MemoryInput {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  size_t pos = 0;
+};
+
+/**
+ * @brief AVIO read callback over MemoryInput
+ */
+static inline int memory_read(void *opaque, uint8_t *buf, int buf_size) {
+  MemoryInput *in = static_cast<MemoryInput *>(opaque);
+  size_t left = in->size - in->pos;
+  if (left == 0) {
+    return AVERROR_EOF;
+  }
+  size_t n = std::min(left, static_cast<size_t>(buf_size));
+  std::memcpy(buf, in->data + in->pos, n);
+  in->pos += n;
+  return static_cast<int>(n);
+}
+
+/**
+ * @brief AVIO seek callback over MemoryInput
+ */
+static inline int64_t memory_seek(void *opaque, int64_t offset, int whence) {
+  MemoryInput *in = static_cast<MemoryInput *>(opaque);
+  if (whence == AVSEEK_SIZE) {
+    return static_cast<int64_t>(in->size);
+  }
+  int64_t base = whence == SEEK_CUR ? static_cast<int64_t>(in->pos)
+                 : whence == SEEK_END ? static_cast<int64_t>(in->size)
+                                      : 0;
+  int64_t pos = base + offset;
+  if (pos < 0 || pos > static_cast<int64_t>(in->size)) {
+    return AVERROR(EINVAL);
+  }
+  in->pos = static_cast<size_t>(pos);
+  return pos;
+}
+
+/**
+ * @brief Paint a moving gradient so the encoder sees real motion
+ *
+ * @param frame YUV420P frame
+ * @param index frame number
+ */
+static inline void fill_test_pattern(AVFrame *frame, int index) {
+  for (int y = 0; y < frame->height; ++y) {
+    uint8_t *row = frame->data[0] + y * frame->linesize[0];
+    for (int x = 0; x < frame->width; ++x) {
+      row[x] = static_cast<uint8_t>(x + y + index * 3);
+    }
+  }
+  for (int y = 0; y < frame->height / 2; ++y) {
+    uint8_t *u = frame->data[1] + y * frame->linesize[1];
+    uint8_t *v = frame->data[2] + y * frame->linesize[2];
+    for (int x = 0; x < frame->width / 2; ++x) {
+      u[x] = static_cast<uint8_t>(128 + y + index * 2);
+      v[x] = static_cast<uint8_t>(64 + x + index * 5);
+    }
+  }
+}
+
+/**
+ * @brief Encode a synthetic H.264 source and mux it to MPEG-TS in memory
+ *
+ * @param width
+ * @param height
+ * @param fps
+ * @param frames
+ * @param ts muxed stream
+ * @return int
+ */
+static inline int make_synthetic_source(int width, int height, int fps,
+                                        int frames, std::vector<uint8_t> &ts) {
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec) {
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+
+  AVCodecContext *enc = avcodec_alloc_context3(codec);
+  AVFormatContext *mux = nullptr;
+  AVFrame *frame = av_frame_alloc();
+  AVPacket *pkt = av_packet_alloc();
+  uint8_t *buf = nullptr;
+  int ret = enc && frame && pkt ? 0 : AVERROR(ENOMEM);
+
+  if (ret == 0) {
+    enc->width = width;
+    enc->height = height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = {1, fps};
+    enc->framerate = {fps, 1};
+    enc->gop_size = fps * 2;
+    enc->max_b_frames = 0;
+    enc->bit_rate = 4000000;
+    av_opt_set(enc->priv_data, "preset", "ultrafast", 0);
+    ret = avcodec_open2(enc, codec, nullptr);
+  }
+  if (ret == 0) {
+    ret = avformat_alloc_output_context2(&mux, nullptr, "mpegts", nullptr);
+  }
+  AVStream *stream = ret == 0 ? avformat_new_stream(mux, nullptr) : nullptr;
+  if (ret == 0 && !stream) {
+    ret = AVERROR(ENOMEM);
+  }
+  if (ret == 0) {
+    stream->time_base = enc->time_base;
+    ret = avcodec_parameters_from_context(stream->codecpar, enc);
+  }
+  if (ret == 0) {
+    ret = avio_open_dyn_buf(&mux->pb);
+  }
+  if (ret == 0) {
+    ret = avformat_write_header(mux, nullptr);
+  }
+  if (ret == 0) {
+    frame->format = enc->pix_fmt;
+    frame->width = enc->width;
+    frame->height = enc->height;
+    ret = av_frame_get_buffer(frame, 32);
+  }
+
+  for (int i = 0; ret >= 0 && i <= frames; ++i) {
+    if (i < frames) {
+      ret = av_frame_make_writable(frame);
+      if (ret < 0) {
+        break;
+      }
+      fill_test_pattern(frame, i);
+      frame->pts = i;
+    }
+    ret = avcodec_send_frame(enc, i < frames ? frame : nullptr);
+    while (ret >= 0) {
+      ret = avcodec_receive_packet(enc, pkt);
+      if (ret < 0) {
+        break;
+      }
+      pkt->stream_index = stream->index;
+      av_packet_rescale_ts(pkt, enc->time_base, stream->time_base);
+      ret = av_interleaved_write_frame(mux, pkt);
+    }
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      ret = 0;
+    }
+  }
+
+  if (ret >= 0) {
+    ret = av_write_trailer(mux);
+  }
+  if (mux && mux->pb) {
+    int size = avio_close_dyn_buf(mux->pb, &buf);
+    mux->pb = nullptr;
+    if (ret >= 0) {
+      ts.assign(buf, buf + size);
+    }
+    av_free(buf);
+  }
+
+  avformat_free_context(mux);
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&enc);
+  return ret < 0 ? ret : 0;
+}
+
+/**
+ * @brief Open an in-memory stream as an input format context
+ *
+ * @param memory stream and read cursor, must outlive the context
+ * @param in_ctx
+ * @return int
+ */
+static inline int open_memory_input(MemoryInput &memory,
+                                    AVFormatContext **in_ctx) {
+  const int io_size = 64 * 1024;
+  unsigned char *io_buf = static_cast<unsigned char *>(av_malloc(io_size));
+  *in_ctx = avformat_alloc_context();
+  if (!io_buf || !*in_ctx) {
+    av_free(io_buf);
+    avformat_free_context(*in_ctx);
+    *in_ctx = nullptr;
+    return AVERROR(ENOMEM);
+  }
+
+  (*in_ctx)->pb = avio_alloc_context(io_buf, io_size, 0, &memory, memory_read,
+                                     nullptr, memory_seek);
+  if (!(*in_ctx)->pb) {
+    av_free(io_buf);
+    avformat_free_context(*in_ctx);
+    *in_ctx = nullptr;
+    return AVERROR(ENOMEM);
+  }
+  (*in_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  AVIOContext *pb = (*in_ctx)->pb;
+  int ret = avformat_open_input(in_ctx, nullptr, av_find_input_format("mpegts"),
+                                nullptr);
+  if (ret >= 0) {
+    ret = avformat_find_stream_info(*in_ctx, nullptr);
+  }
+  if (ret < 0) {
+    avformat_close_input(in_ctx);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+  }
+  return ret;
+}
+
+/**
+ * @brief Close an input opened with open_memory_input
+ *
+ * @param in_ctx
+ */
+static inline void close_memory_input(AVFormatContext **in_ctx) {
+  if (!*in_ctx) {
+    return;
+  }
+  AVIOContext *pb = (*in_ctx)->pb;
+  avformat_close_input(in_ctx);
+  if (pb) {
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+  }
+}
+
+}  // namespace utils
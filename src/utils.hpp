@@ -1,6 +1,10 @@
 #pragma once
 
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
 #include <string>
 
 namespace utils {
@@ -21,6 +25,26 @@ static inline bool starts_with(
   ) == 0;
 }
 
+/**
+ * @brief Check if string ends with suffix
+ *
+ * @param s
+ * @param suffix
+ */
+static inline bool ends_with(
+    const std::string &s,
+    const char *suffix
+) {
+  size_t n = std::strlen(
+      suffix
+  );
+  return s.size() >= n && s.compare(
+      s.size() - n,
+      n,
+      suffix
+  ) == 0;
+}
+
 /**
  * @brief Get base name without extension from path
  * 
@@ -42,6 +66,26 @@ static inline std::string base_without_ext(
   );
 }
 
+/**
+ * @brief Get the last component of a path
+ * 
+ * @param path 
+ * @return std::string 
+ */
+static inline std::string file_name(
+    const std::string &path
+) {
+  size_t slash = path.find_last_of(
+      '/'
+  );
+  if (slash == std::string::npos) {
+    return path;
+  }
+  return path.substr(
+      slash + 1
+  );
+}
+
 /**
  * @brief Check if path is a directory
  * 
@@ -92,5 +136,76 @@ static inline std::string normalize_output_path(
   return output_path;
 }
 
+/**
+ * @brief Remove path if it is a symbolic link
+ * 
+ * @param path 
+ */
+static inline void remove_symlink(
+    const std::string &path
+) {
+  struct stat st;
+  if (lstat(
+          path.c_str(),
+          &st
+      ) == 0 && S_ISLNK(st.st_mode)) {
+    unlink(
+        path.c_str()
+    );
+  }
+}
+
+/**
+ * @brief Point a rendition playlist at the copy playlist in the same
+ * directory, replacing whatever the path held
+ * 
+ * @param copy_path copy output playlist
+ * @param alias_path rendition playlist
+ * @return true on success
+ */
+static inline bool link_playlist_alias(
+    const std::string &copy_path,
+    const std::string &alias_path
+) {
+  std::string target = file_name(
+      copy_path
+  );
+  unlink(
+      alias_path.c_str()
+  );
+  return symlink(
+      target.c_str(),
+      alias_path.c_str()
+  ) == 0;
+}
+
+/**
+ * @brief Write a file under a temporary name and rename it into
+ * place, so readers never see it half written
+ *
+ * @param path
+ * @param data
+ * @param size
+ * @return true on success
+ */
+static inline bool write_file_atomic(
+    const std::string &path,
+    const void *data,
+    size_t size
+) {
+  std::string tmp = path + ".tmp";
+  FILE *f = std::fopen(tmp.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  bool ok = std::fwrite(data, 1, size, f) == size;
+  ok = std::fclose(f) == 0 && ok;
+  if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
 }  // namespace utils
 
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed-size work-stealing pool shared by every camera in the
+ * process. Each worker keeps its own deque: tasks submitted from a
+ * worker go to its own deque and are popped newest-first, which keeps
+ * a frame's data hot in that core's cache, while idle workers steal
+ * the oldest task from their peers. Tasks from other threads enter
+ * through a shared injection queue.
+ */
+class WorkerPool {
+ public:
+  /**
+   * @brief Start the pool
+   *
+   * @param threads number of workers, 0 for the core count
+   */
+  explicit WorkerPool(
+      size_t threads
+  ) {
+    if (threads == 0) {
+      threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+      threads = 1;
+    }
+
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      workers_[i]->thread = std::thread([this, i]() { worker_loop(i); });
+    }
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  /**
+   * @brief Drain queued tasks and join all workers
+   */
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stopping_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto &worker : workers_) {
+      worker->thread.join();
+    }
+  }
+
+  /**
+   * @brief Queue a task for execution on any worker
+   *
+   * @param task
+   */
+  void submit(
+      std::function<void()> task
+  ) {
+    int self = current_worker();
+    if (self >= 0) {
+      Worker &worker = *workers_[self];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks.push_back(std::move(task));
+    } else {
+      std::lock_guard<std::mutex> lock(inject_mutex_);
+      injected_.push_back(std::move(task));
+    }
+    queued_.fetch_add(1);
+
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    sleep_cv_.notify_one();
+  }
+
+  /**
+   * @brief Number of worker threads
+   */
+  size_t size() const {
+    return workers_.size();
+  }
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    std::thread thread;
+  };
+
+  /** Worker index of the calling thread in this pool, -1 otherwise */
+  int current_worker() const {
+    const Slot &slot = current_slot();
+    return slot.pool == this ? slot.index : -1;
+  }
+
+  struct Slot {
+    const WorkerPool *pool = nullptr;
+    int index = -1;
+  };
+
+  static Slot &current_slot() {
+    static thread_local Slot slot;
+    return slot;
+  }
+
+  /** Own deque newest-first, then injected tasks, then steal oldest */
+  bool take_task(
+      int self,
+      std::function<void()> &task
+  ) {
+    if (self >= 0) {
+      Worker &worker = *workers_[self];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (!worker.tasks.empty()) {
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        queued_.fetch_sub(1);
+        return true;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(inject_mutex_);
+      if (!injected_.empty()) {
+        task = std::move(injected_.front());
+        injected_.pop_front();
+        queued_.fetch_sub(1);
+        return true;
+      }
+    }
+
+    size_t count = workers_.size();
+    size_t start = self >= 0 ? static_cast<size_t>(self) + 1 : 0;
+    for (size_t n = 0; n < count; ++n) {
+      size_t victim = (start + n) % count;
+      if (static_cast<int>(victim) == self) {
+        continue;
+      }
+      Worker &worker = *workers_[victim];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (!worker.tasks.empty()) {
+        task = std::move(worker.tasks.front());
+        worker.tasks.pop_front();
+        queued_.fetch_sub(1);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void worker_loop(
+      size_t index
+  ) {
+    Slot &slot = current_slot();
+    slot.pool = this;
+    slot.index = static_cast<int>(index);
+
+    while (true) {
+      std::function<void()> task;
+      if (take_task(slot.index, task)) {
+        task();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      sleep_cv_.wait(lock, [this]() {
+        return stopping_ || queued_.load() > 0;
+      });
+      if (stopping_ && queued_.load() == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex inject_mutex_;
+  std::deque<std::function<void()>> injected_;
+  std::atomic<size_t> queued_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  bool stopping_ = false;
+};
+
+/**
+ * @brief Fork-join helper: run() spreads tasks over the pool and
+ * wait() returns once all of them finished. Tasks sit in the group's
+ * own queue; pool workers and the waiting thread both take from it, so
+ * a join only ever runs its own tasks and never nests into another
+ * camera's stage.
+ */
+class TaskGroup {
+ public:
+  explicit TaskGroup(
+      WorkerPool &pool
+  ) : pool_(pool), shared_(std::make_shared<Shared>()) {}
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  ~TaskGroup() {
+    wait();
+  }
+
+  /**
+   * @brief Start a task in the group
+   *
+   * @param task
+   */
+  void run(
+      std::function<void()> task
+  ) {
+    {
+      std::lock_guard<std::mutex> lock(shared_->mutex);
+      shared_->tasks.push_back(std::move(task));
+      ++shared_->pending;
+    }
+
+    /** The pool slot may fire after the waiter already ran the task */
+    std::shared_ptr<Shared> shared = shared_;
+    pool_.submit([shared]() { run_one(*shared); });
+  }
+
+  /**
+   * @brief Block until every task started so far has finished, running
+   * the group's queued tasks on the calling thread meanwhile
+   */
+  void wait() {
+    while (run_one(*shared_)) {
+    }
+    std::unique_lock<std::mutex> lock(shared_->mutex);
+    shared_->done_cv.wait(lock, [this]() { return shared_->pending == 0; });
+  }
+
+ private:
+  struct Shared {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    int pending = 0;
+    std::condition_variable done_cv;
+  };
+
+  /** Run the oldest queued task of a group, false if none is queued */
+  static bool run_one(
+      Shared &shared
+  ) {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      if (shared.tasks.empty()) {
+        return false;
+      }
+      task = std::move(shared.tasks.front());
+      shared.tasks.pop_front();
+    }
+    task();
+
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (--shared.pending == 0) {
+      shared.done_cv.notify_all();
+    }
+    return true;
+  }
+
+  WorkerPool &pool_;
+  std::shared_ptr<Shared> shared_;
+};
+
+/**
+ * @brief Pipeline stage scheduled on a WorkerPool. The body drains
+ * its input queue and runs on at most one worker at a time, so a
+ * stage can own libav contexts without locking. Producers call
+ * schedule() after pushing; scheduling is lock-free and never blocks.
+ */
+class Stage {
+ public:
+  /**
+   * @brief Create an idle stage
+   *
+   * @param pool workers to run on
+   * @param body drains a bounded batch of input; it calls schedule()
+   *        itself when it leaves work behind
+   */
+  Stage(
+      WorkerPool &pool,
+      std::function<void()> body
+  ) : pool_(pool), body_(std::move(body)) {}
+
+  Stage(const Stage &) = delete;
+  Stage &operator=(const Stage &) = delete;
+
+  /**
+   * @brief Make sure the body runs at least once after this call
+   */
+  void schedule() {
+    pending_.store(true);
+    if (!scheduled_.exchange(true)) {
+      submit();
+    }
+  }
+
+  /**
+   * @brief Check that the body is neither queued nor running
+   */
+  bool idle() const {
+    return !scheduled_.load() && active_.load() == 0;
+  }
+
+ private:
+  void submit() {
+    active_.fetch_add(1);
+    pool_.submit([this]() { run(); });
+  }
+
+  void run() {
+    pending_.store(false);
+    body_();
+    scheduled_.store(false);
+
+    /** Pick up a schedule() that raced with the body */
+    if (pending_.load() && !scheduled_.exchange(true)) {
+      submit();
+    }
+    active_.fetch_sub(1);
+  }
+
+  WorkerPool &pool_;
+  std::function<void()> body_;
+  std::atomic<bool> scheduled_{false};
+  std::atomic<bool> pending_{false};
+  std::atomic<int> active_{0};
+};